@@ -0,0 +1,28 @@
+#ifndef INC_SCRUB_H
+#define INC_SCRUB_H
+
+#include "common-defines.h"
+
+typedef enum scrub_result_t {
+  ScrubResult_NoManifest = 0, // Unsigned image, nothing to check against
+  ScrubResult_Pending,        // No full pass yet
+  ScrubResult_Ok,
+  ScrubResult_Mismatch,
+} scrub_result_t;
+
+typedef struct scrub_status_t {
+  scrub_result_t result;       // Of the last full pass
+  uint32_t offset;             // How far in to the image the current pass has got
+  uint32_t length;
+  uint32_t passes;
+  uint32_t mismatches;         // Passes that didn't match the manifest, since boot
+  uint32_t expected_crc;
+  uint32_t last_crc;
+  uint32_t max_slice_cycles;   // Longest any one scrub_tick took
+} scrub_status_t;
+
+void scrub_setup(void);
+void scrub_tick(void);
+const scrub_status_t* scrub_get_status(void);
+
+#endif // INC_SCRUB_H
@@ -0,0 +1,50 @@
+#ifndef INC_TELEMETRY_H
+#define INC_TELEMETRY_H
+
+#include "common-defines.h"
+
+// Samples go out in batches, each one a large frame (see core/packet.h) whose header carries
+// PACKET_TELEMETRY_DATA0, the sample count, the number of samples dropped since the last batch
+// (16 bit) and the batch number (16 bit), so the host can tell when whole batches go missing.
+#define PACKET_TELEMETRY_DATA0    (0x23)
+#define PACKET_TELEMETRY_LENGTH   (6)
+
+// 40 samples of 12 bytes keep the framing overhead to ~4% of the line
+#define TELEMETRY_BATCH_SAMPLES   (40)
+// Must be a power of two. One is filled while the others wait for (or are on) the line.
+#define TELEMETRY_BATCH_COUNT     (4)
+// A part filled batch goes out after this many ms, so a slow channel isn't held up
+#define TELEMETRY_FLUSH_MS        (20)
+
+typedef struct telemetry_sample_t {
+  uint32_t timestamp; // DWT cycle count
+  uint16_t channel;
+  uint16_t reserved;
+  int32_t value;
+} telemetry_sample_t;
+
+// What to do with a sample when every batch is full
+typedef enum telemetry_policy_t {
+  TelemetryPolicy_DropNewest = 0, // Keep what's queued, and lose the new samples
+  TelemetryPolicy_DropOldest,     // Throw away the oldest batch that isn't on the line yet
+} telemetry_policy_t;
+
+typedef struct telemetry_stats_t {
+  uint32_t samples;          // Recorded, whether they got out or not
+  uint32_t dropped;
+  uint32_t batches_sent;
+  uint32_t max_queued;       // Most batches ever waiting for the line at once
+  uint32_t max_tick_cycles;  // Longest any one telemetry_tick took
+} telemetry_stats_t;
+
+void telemetry_setup(const telemetry_policy_t policy);
+// Safe to call from any context, including interrupts. Returns false if the sample was dropped.
+bool telemetry_record(const uint16_t channel, const int32_t value);
+// Samples that can be recorded before anything has to be dropped, for producers that would
+// rather slow down (or decimate) than lose data
+uint32_t telemetry_space(void);
+// Moves batches out to the UART as there's room, without ever waiting on it
+void telemetry_tick(void);
+const telemetry_stats_t* telemetry_get_stats(void);
+
+#endif // INC_TELEMETRY_H
@@ -1,13 +1,20 @@
+#include <stddef.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/cm3/scb.h>
+#include <libopencm3/cm3/vector.h>
 
 #include "core/system.h"
+#include "core/boot-timeline.h"
+#include "core/handoff.h"
+#include "core/kv.h"
+#include "core/memory.h"
 #include "core/uart.h"
+#include "core/trace.h"
+#include "scrub.h"
+#include "telemetry.h"
 #include "timer.h"
 
-#define BOOTLOADER_SIZE (0x8000U)
-
 #define LED_PORT      (GPIOA)
 #define LED_PIN       (GPIO5)
 
@@ -15,8 +22,21 @@
 #define RX_PIN        (GPIO3)
 #define TX_PIN        (GPIO2)
 
+#define KV_KEY_BOOT_COUNT  (0x0001)
+
+#define TELEMETRY_CHANNEL_DUTY_CYCLE   (0x0001) // PWM duty cycle, in percent
+#define TELEMETRY_CHANNEL_UART_RX      (0x0002) // Each byte received
+#define TELEMETRY_CHANNEL_LOOP_RATE    (0x0003) // Main loop iterations since the last sample
+#define TELEMETRY_CHANNEL_STACK_PEAK   (0x0004) // Most stack ever used, in bytes
+#define TELEMETRY_CHANNEL_UART_RX_PEAK (0x0005) // Most bytes the UART's rx ring has held
+#define TELEMETRY_CHANNEL_UART_TX_PEAK (0x0006) // Most bytes the UART's tx ring has held
+#define TELEMETRY_CHANNEL_TEST         (0x0100) // 'make TELEMETRY_TEST_RATE=n': a count at n samples/s
+
+// The table is wherever the app was linked to run from: flash after the bootloader, or RAM. It's
+// then copied in to RAM, so interrupts are still taken while the key-value store erases a sector.
 static void vector_setup(void) {
-  SCB_VTOR = BOOTLOADER_SIZE;
+  SCB_VTOR = (uint32_t)&vector_table;
+  system_relocate_vector_table();
 }
 
 static void gpio_setup(void) {
@@ -28,14 +48,55 @@ static void gpio_setup(void) {
   gpio_set_af(UART_PORT, GPIO_AF7, TX_PIN | RX_PIN);
 }
 
+#ifdef TELEMETRY_TEST_RATE
+// Keeps up the rate however often the loop gets round to it, so throughput can be measured
+static void telemetry_test_tick(const uint64_t start_time) {
+  static uint64_t produced = 0;
+  const uint64_t due = ((system_get_ticks() - start_time) * TELEMETRY_TEST_RATE) / 1000;
+  while (produced < due) {
+    telemetry_record(TELEMETRY_CHANNEL_TEST, (int32_t)produced);
+    produced++;
+  }
+}
+#endif
+
 int main(void) {
+  boot_timeline_mark(BootPhase_AppMain);
   vector_setup();
   system_setup();
+  memory_paint_stack();
+  boot_timeline_mark(BootPhase_AppSystemSetup);
+  trace_setup();
+
+  const handoff_t* handoff = handoff_get();
+  if (handoff != NULL) {
+    TRACE("app: version %08x, reset flags %08x", handoff->fw_version, handoff->reset_flags);
+  }
+
+  scrub_setup();
   gpio_setup();
   timer_setup();
   uart_setup();
+  telemetry_setup(TelemetryPolicy_DropNewest);
+
+  // After the peripherals, as the first write after the store's sectors held something else has to
+  // erase one first
+  if (kv_init(&kv_internal_flash)) {
+    uint32_t boot_count = 0;
+    uint8_t length = sizeof(boot_count);
+    kv_get(KV_KEY_BOOT_COUNT, &boot_count, &length);
+    boot_count++;
+    kv_set(KV_KEY_BOOT_COUNT, &boot_count, sizeof(boot_count));
+    TRACE("app: boot %u", boot_count, 0);
+  }
+  boot_timeline_mark(BootPhase_AppReady);
 
+#ifdef TELEMETRY_TEST_RATE
+  const uint64_t telemetry_start_time = system_get_ticks();
+#endif
   uint64_t start_time = system_get_ticks();
+  uint64_t memory_report_time = start_time;
+  uint32_t loop_count = 0;
   float duty_cycle = 0.0f;
 
   timer_pwm_set_duty_cycle(duty_cycle);
@@ -47,15 +108,34 @@ int main(void) {
         duty_cycle = 0.0f;
       }
       timer_pwm_set_duty_cycle(duty_cycle);
+      telemetry_record(TELEMETRY_CHANNEL_DUTY_CYCLE, (int32_t)duty_cycle);
+      telemetry_record(TELEMETRY_CHANNEL_LOOP_RATE, (int32_t)loop_count);
+      loop_count = 0;
 
       start_time = system_get_ticks();
     }
 
+    // The app has no command channel, so its high-water marks go out with the rest of the telemetry
+    if (system_get_ticks() - memory_report_time >= 1000) {
+      telemetry_record(TELEMETRY_CHANNEL_STACK_PEAK, (int32_t)memory_stack_peak());
+      telemetry_record(TELEMETRY_CHANNEL_UART_RX_PEAK, (int32_t)uart_rx_usage().peak);
+      telemetry_record(TELEMETRY_CHANNEL_UART_TX_PEAK, (int32_t)uart_tx_usage().peak);
+      memory_report_time = system_get_ticks();
+    }
+
     while (uart_data_available()) {
-      uint8_t data = uart_read_byte();
-      uart_write_byte(data + 1);
+      telemetry_record(TELEMETRY_CHANNEL_UART_RX, uart_read_byte());
     }
 
+#ifdef TELEMETRY_TEST_RATE
+    telemetry_test_tick(telemetry_start_time);
+#endif
+
+    kv_tick();
+    scrub_tick();
+    telemetry_tick();
+    loop_count++;
+
     // Do useful work
   }
 
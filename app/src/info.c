@@ -10,3 +10,9 @@ firmware_info_t firmware_info = {
 
 __attribute__ ((section (".firmware_signature")))
 uint8_t firmware_signature[16] = {0};
+
+__attribute__ ((section (".firmware_manifest")))
+firmware_manifest_t firmware_manifest = {
+  .image_crc   = MANIFEST_CRC_NONE,
+  .reserved    = { 0xffffffff, 0xffffffff, 0xffffffff },
+};
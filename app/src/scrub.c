@@ -0,0 +1,96 @@
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/cm3/vector.h>
+
+#include "scrub.h"
+#include "core/crc.h"
+#include "core/firmware-info.h"
+#include "core/trace.h"
+
+// The bootloader only checks the image at boot, and devices can run for months. This re-checks it
+// against the manifest a slice at a time from the main loop, so bit-rot shows up while it's running.
+
+// A slice stops at whichever comes first. It can overrun the cycle budget by up to one chunk.
+#define SCRUB_SLICE_BYTES   (256)
+#define SCRUB_SLICE_CYCLES  (2500) // ~30us at 84MHz
+#define SCRUB_CHUNK_SIZE    (32)
+
+#define SCRUB_SKIP_START    (SIGNATURE_OFFSET)
+#define SCRUB_SKIP_END      (MANIFEST_OFFSET + sizeof(firmware_manifest_t))
+
+static scrub_status_t status = {0};
+static uint32_t image_base = 0;
+static uint32_t crc = 0;
+
+void scrub_setup(void) {
+  // Wherever the app was linked to run from, like the vector table
+  image_base = (uint32_t)&vector_table;
+  const firmware_info_t* info = (const firmware_info_t*)(image_base + FWINFO_OFFSET);
+  const firmware_manifest_t* manifest = (const firmware_manifest_t*)(image_base + MANIFEST_OFFSET);
+  const uint32_t max_length = (image_base == MAIN_APP_START_ADDRESS) ? MAX_FW_LENGTH : RAM_APP_MAX_LENGTH;
+
+  status.result = ScrubResult_NoManifest;
+  if ((manifest->image_crc == MANIFEST_CRC_NONE) || (info->length > max_length) || (info->length < SCRUB_SKIP_END)) {
+    return;
+  }
+
+  status.result = ScrubResult_Pending;
+  status.length = info->length;
+  status.expected_crc = manifest->image_crc;
+}
+
+static void scrub_finish_pass(void) {
+  status.last_crc = crc;
+  status.passes++;
+
+  if (crc == status.expected_crc) {
+    status.result = ScrubResult_Ok;
+  } else {
+    status.result = ScrubResult_Mismatch;
+    status.mismatches++;
+    TRACE("scrub: image crc %08x, expected %08x", crc, status.expected_crc);
+  }
+
+  crc = 0;
+  status.offset = 0;
+}
+
+void scrub_tick(void) {
+  if (status.result == ScrubResult_NoManifest) {
+    return;
+  }
+
+  const uint32_t start = DWT_CYCCNT;
+  uint32_t scrubbed = 0;
+
+  while ((scrubbed < SCRUB_SLICE_BYTES) && ((DWT_CYCCNT - start) < SCRUB_SLICE_CYCLES)) {
+    if (status.offset == SCRUB_SKIP_START) {
+      status.offset = SCRUB_SKIP_END;
+      continue;
+    }
+
+    // Chunks never run in to the skipped blocks, or off the end of the image
+    const uint32_t end = (status.offset < SCRUB_SKIP_START) ? SCRUB_SKIP_START : status.length;
+    uint32_t chunk = end - status.offset;
+    if (chunk > SCRUB_CHUNK_SIZE) {
+      chunk = SCRUB_CHUNK_SIZE;
+    }
+
+    crc = crc32_update(crc, (const uint8_t*)(image_base + status.offset), chunk);
+    status.offset += chunk;
+    scrubbed += chunk;
+
+    if (status.offset >= status.length) {
+      scrub_finish_pass();
+      break;
+    }
+  }
+
+  const uint32_t cycles = DWT_CYCCNT - start;
+  if (cycles > status.max_slice_cycles) {
+    status.max_slice_cycles = cycles;
+  }
+}
+
+const scrub_status_t* scrub_get_status(void) {
+  return &status;
+}
@@ -0,0 +1,257 @@
+#include <string.h>
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/dwt.h>
+
+#include "telemetry.h"
+#include "core/crc.h"
+#include "core/packet.h"
+#include "core/system.h"
+#include "core/uart.h"
+
+// Samples are batched so the framing is paid for once per batch, and sent from the main loop a
+// bit at a time, as the UART's transmit queue has room. Nothing here ever waits on the line.
+
+#define NO_BATCH (0xff)
+
+typedef enum batch_state_t {
+  BatchState_Free = 0,
+  BatchState_Filling,
+  BatchState_Queued,
+  BatchState_Sending,
+} batch_state_t;
+
+typedef struct batch_t {
+  telemetry_sample_t samples[TELEMETRY_BATCH_SAMPLES];
+  uint32_t count;
+  batch_state_t state;
+  uint32_t order;     // When it was queued, so the oldest goes first
+  uint64_t opened_at; // ms, when the first sample went in
+} batch_t;
+
+typedef enum tx_stage_t {
+  TxStage_Header = 0,
+  TxStage_Payload,
+  TxStage_Crc,
+} tx_stage_t;
+
+static batch_t batches[TELEMETRY_BATCH_COUNT];
+static telemetry_policy_t drop_policy = TelemetryPolicy_DropNewest;
+static telemetry_stats_t stats = {0};
+static uint8_t filling = NO_BATCH;
+static uint32_t next_order = 0;
+static uint32_t dropped_since_batch = 0;
+static uint16_t batch_number = 0;
+
+// The batch on its way out, and how far it has got
+static uint8_t sending = NO_BATCH;
+static tx_stage_t tx_stage = TxStage_Header;
+static uint8_t tx_header[PACKET_LARGE_HEADER_BYTES];
+static uint32_t tx_header_length = 0;
+static uint8_t tx_crc[PACKET_LARGE_CRC_BYTES];
+static uint32_t tx_offset = 0;
+static uint32_t tx_payload_crc = 0;
+
+void telemetry_setup(const telemetry_policy_t policy) {
+  system_enable_cycle_counter();
+  memset(batches, 0, sizeof(batches));
+  drop_policy = policy;
+  filling = NO_BATCH;
+  sending = NO_BATCH;
+}
+
+static uint8_t find_batch(const batch_state_t state) {
+  uint8_t found = NO_BATCH;
+  for (uint8_t i = 0; i < TELEMETRY_BATCH_COUNT; i++) {
+    if ((batches[i].state == state) && ((found == NO_BATCH) || (batches[i].order < batches[found].order))) {
+      found = i;
+    }
+  }
+  return found;
+}
+
+// With interrupts masked. Under the drop oldest policy, the oldest batch that isn't on the line yet
+// is given up to make room.
+static bool open_batch(const bool may_drop) {
+  uint8_t index = find_batch(BatchState_Free);
+  if ((index == NO_BATCH) && may_drop && (drop_policy == TelemetryPolicy_DropOldest)) {
+    index = find_batch(BatchState_Queued);
+    if (index != NO_BATCH) {
+      stats.dropped += batches[index].count;
+      dropped_since_batch += batches[index].count;
+    }
+  }
+
+  if (index == NO_BATCH) {
+    return false;
+  }
+
+  batches[index].state = BatchState_Filling;
+  batches[index].count = 0;
+  filling = index;
+  return true;
+}
+
+// With interrupts masked
+static void close_batch(void) {
+  batches[filling].state = BatchState_Queued;
+  batches[filling].order = next_order++;
+  filling = NO_BATCH;
+
+  uint32_t queued = 0;
+  for (uint8_t i = 0; i < TELEMETRY_BATCH_COUNT; i++) {
+    queued += (batches[i].state == BatchState_Queued) ? 1 : 0;
+  }
+  if (queued > stats.max_queued) {
+    stats.max_queued = queued;
+  }
+
+  (void)open_batch(false);
+}
+
+bool telemetry_record(const uint16_t channel, const int32_t value) {
+  const uint32_t timestamp = DWT_CYCCNT;
+  const uint32_t masked = cm_mask_interrupts(1);
+  stats.samples++;
+
+  if ((filling == NO_BATCH) && !open_batch(true)) {
+    stats.dropped++;
+    dropped_since_batch++;
+    cm_mask_interrupts(masked);
+    return false;
+  }
+
+  batch_t* batch = &batches[filling];
+  if (batch->count == 0) {
+    batch->opened_at = system_get_ticks();
+  }
+  telemetry_sample_t* sample = &batch->samples[batch->count++];
+  sample->timestamp = timestamp;
+  sample->channel = channel;
+  sample->reserved = 0;
+  sample->value = value;
+
+  if (batch->count >= TELEMETRY_BATCH_SAMPLES) {
+    close_batch();
+  }
+
+  cm_mask_interrupts(masked);
+  return true;
+}
+
+uint32_t telemetry_space(void) {
+  const uint32_t masked = cm_mask_interrupts(1);
+  uint32_t space = (filling != NO_BATCH) ? (TELEMETRY_BATCH_SAMPLES - batches[filling].count) : 0;
+  for (uint8_t i = 0; i < TELEMETRY_BATCH_COUNT; i++) {
+    space += (batches[i].state == BatchState_Free) ? TELEMETRY_BATCH_SAMPLES : 0;
+  }
+  cm_mask_interrupts(masked);
+  return space;
+}
+
+// With interrupts masked. Numbered as they're sent, so a gap on the host means a batch was lost
+// on the line, rather than dropped here (which the dropped count covers).
+static void start_batch(const uint8_t index) {
+  batch_t* batch = &batches[index];
+  batch->state = BatchState_Sending;
+  sending = index;
+
+  const uint32_t dropped = (dropped_since_batch > 0xffff) ? 0xffff : dropped_since_batch;
+  dropped_since_batch = 0;
+
+  comms_packet_t header;
+  memset(&header, 0xff, sizeof(comms_packet_t));
+  header.address = COMMS_ADDR_FROM_NODE | COMMS_ADDR_ANY;
+  header.seq = 0;
+  header.length = PACKET_TELEMETRY_LENGTH;
+  header.data[0] = PACKET_TELEMETRY_DATA0;
+  header.data[1] = batch->count;
+  header.data[2] = dropped & 0xff;
+  header.data[3] = (dropped >> 8) & 0xff;
+  header.data[4] = batch_number & 0xff;
+  header.data[5] = (batch_number >> 8) & 0xff;
+  batch_number++;
+
+  tx_header_length = packet_encode_large_header(&header, batch->count * sizeof(telemetry_sample_t), tx_header);
+  tx_stage = TxStage_Header;
+  tx_offset = 0;
+  tx_payload_crc = 0;
+}
+
+// Queue as much of the batch on its way out as the UART has room for. Returns true once it's all
+// queued.
+static bool send_batch(void) {
+  const batch_t* batch = &batches[sending];
+
+  while (uart_tx_free() > 0) {
+    if (tx_stage == TxStage_Header) {
+      tx_offset += uart_write_nonblocking(&tx_header[tx_offset], tx_header_length - tx_offset);
+      if (tx_offset == tx_header_length) {
+        tx_stage = TxStage_Payload;
+        tx_offset = 0;
+      }
+    } else if (tx_stage == TxStage_Payload) {
+      const uint8_t* payload = (const uint8_t*)batch->samples;
+      const uint32_t length = batch->count * sizeof(telemetry_sample_t);
+      const uint32_t queued = uart_write_nonblocking(&payload[tx_offset], length - tx_offset);
+      tx_payload_crc = crc32_update(tx_payload_crc, &payload[tx_offset], queued);
+      tx_offset += queued;
+      if (tx_offset == length) {
+        packet_encode_large_crc(tx_payload_crc, tx_crc);
+        tx_stage = TxStage_Crc;
+        tx_offset = 0;
+      }
+    } else {
+      tx_offset += uart_write_nonblocking(&tx_crc[tx_offset], sizeof(tx_crc) - tx_offset);
+      if (tx_offset == sizeof(tx_crc)) {
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+void telemetry_tick(void) {
+  const uint32_t start = DWT_CYCCNT;
+
+  uint32_t masked = cm_mask_interrupts(1);
+  if ((filling != NO_BATCH) && (batches[filling].count > 0) &&
+      ((system_get_ticks() - batches[filling].opened_at) >= TELEMETRY_FLUSH_MS)) {
+    close_batch();
+  }
+  cm_mask_interrupts(masked);
+
+  // One batch straight after another, so the line doesn't go quiet between them
+  while (true) {
+    masked = cm_mask_interrupts(1);
+    if (sending == NO_BATCH) {
+      const uint8_t index = find_batch(BatchState_Queued);
+      if (index != NO_BATCH) {
+        start_batch(index);
+      }
+    }
+    cm_mask_interrupts(masked);
+
+    if ((sending == NO_BATCH) || !send_batch()) {
+      break;
+    }
+
+    masked = cm_mask_interrupts(1);
+    batches[sending].state = BatchState_Free;
+    sending = NO_BATCH;
+    stats.batches_sent++;
+    if (filling == NO_BATCH) {
+      (void)open_batch(false);
+    }
+    cm_mask_interrupts(masked);
+  }
+
+  const uint32_t cycles = DWT_CYCCNT - start;
+  if (cycles > stats.max_tick_cycles) {
+    stats.max_tick_cycles = cycles;
+  }
+}
+
+const telemetry_stats_t* telemetry_get_stats(void) {
+  return &stats;
+}
@@ -8,12 +8,17 @@
 #define NUM_ROUND_KEYS_128 (11)
 #define AES_BLOCK_SIZE     (16)
 
+// Signatures are only ever checked by encrypting (CBC-MAC), so decryption is left out of the build
+#ifndef AES_DECRYPT_ENABLED
+#define AES_DECRYPT_ENABLED (0)
+#endif
+
 typedef uint8_t AES_Column_t[4];
 typedef AES_Column_t AES_Block_t[4];
 typedef uint8_t AES_Key128_t[16];
 
 uint8_t GF_Mult(uint8_t a, uint8_t b);
-void GF_WordAdd(AES_Column_t a, AES_Column_t b, AES_Column_t dest);
+void GF_WordAdd(const AES_Column_t a, const AES_Column_t b, AES_Column_t dest);
 void GF_ModularProduct(AES_Column_t a, AES_Column_t b, AES_Column_t dest);
 
 void AES_KeySchedule128(const AES_Key128_t key, AES_Block_t* keysOut);
@@ -25,12 +30,15 @@ void AES_SubWord(AES_Column_t word, const uint8_t table[]);
 void AES_ShiftRows(AES_Block_t state);
 void AES_MixColumns(AES_Block_t state);
 
+#if AES_DECRYPT_ENABLED
 void AES_InvShiftRows(AES_Block_t state);
 void AES_InvMixColumns(AES_Block_t state);
-
+#endif
 
 void AES_EncryptBlock(AES_Block_t state, const AES_Block_t* keySchedule);
+#if AES_DECRYPT_ENABLED
 void AES_DecryptBlock(AES_Block_t state, const AES_Block_t* keySchedule);
+#endif
 
 #endif // AES__H
 
@@ -0,0 +1,48 @@
+#ifndef INC_BENCH_H
+#define INC_BENCH_H
+
+#include "common-defines.h"
+
+// The self-benchmark programs and erases a flash sector, and is only built in with
+// 'make DIAGNOSTICS=1'
+#ifndef BENCH_ENABLED
+#define BENCH_ENABLED (1)
+#endif
+
+// CRC and AES run over this much of the application in flash, as the signature check does
+#define BENCH_DATA_LENGTH   (4096)
+// Each computation is timed this many times, and the fastest counts
+#define BENCH_RUNS          (4)
+#define BENCH_PROGRAM_WORDS (256)
+#define BENCH_UART_LENGTH   (1024)
+#define BENCH_UART_TIMEOUT  (1000)
+#define BENCH_NO_SECTOR     (0xffffffff)
+
+// Times are in cycles of the core clock. All u32, so it goes out over the link as it is.
+typedef struct bench_results_t {
+  uint32_t cpu_hz;
+  uint32_t unique_id[3];
+  uint32_t bootloader_crc;      // CRC32 of the bootloader's code, to tell builds apart
+  uint32_t app_version;         // 0 without an application
+  uint32_t data_length;
+  uint32_t crc8_cycles;
+  uint32_t crc32_cycles;
+  uint32_t aes_block_cycles;    // One AES_EncryptBlock
+  uint32_t key_schedule_cycles;
+  uint32_t cbc_mac_cycles;      // The whole data length, after the key schedule
+  uint32_t flash_sector;        // The highest application sector that was blank, or BENCH_NO_SECTOR
+  uint32_t flash_sector_size;
+  uint32_t flash_program_words;
+  uint32_t flash_program_cycles;
+  uint32_t flash_erase_cycles;
+  uint32_t uart_baud;
+  uint32_t uart_length;
+  uint32_t uart_received;       // Came back as they were sent
+  uint32_t uart_cycles;
+} bench_results_t;
+
+// Blocks for as long as the sector erase takes, which can be a couple of seconds. The scratch
+// sector is only ever one that was already blank, and it's left that way.
+void bench_run(bench_results_t* results);
+
+#endif // INC_BENCH_H
@@ -3,7 +3,12 @@
 
 #include "common-defines.h"
 
-void bl_flash_erase_main_application(void);
+#define MAIN_APP_SECTOR_START (3) // Sectors 1 and 2 are the key-value store's
+#define MAIN_APP_SECTOR_END   (7)
+#define MAIN_APP_SECTOR_COUNT (MAIN_APP_SECTOR_END - MAIN_APP_SECTOR_START + 1)
+
+bool bl_flash_erase_main_application_sector(const uint8_t sector);
+bool bl_flash_get_sector_region(const uint8_t sector, uint32_t* address, uint32_t* size);
 void bl_flash_write(const uint32_t address, const uint8_t* data, const uint32_t length);
 
 #endif // INC_BL_FLASH_H
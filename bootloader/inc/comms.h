@@ -2,14 +2,35 @@
 #define INC_COMMS_H
 
 #include "common-defines.h"
+#include "core/memory.h"
+#include "core/packet.h"
+#include "core/transport.h"
 
-#define PACKET_DATA_LENGTH  (16)
-#define PACKET_LENGTH_BYTES (1)
-#define PACKET_CRC_BYTES    (1)
-#define PACKET_LENGTH       (PACKET_LENGTH_BYTES + PACKET_DATA_LENGTH + PACKET_CRC_BYTES)
+// Frames that may be in flight (sent but not acknowledged) in each direction
+#define COMMS_WINDOW_SIZE   (8)
+// The receiver acknowledges every COMMS_ACK_EVERY frames, or COMMS_ACK_DELAY ms after the first
+#define COMMS_ACK_EVERY     (4)
+#define COMMS_ACK_DELAY     (5)
+// Retransmission timeout bounds. It's derived from the measured round trip time (RFC 6298 style),
+// starting at COMMS_RTO_INITIAL until there's a sample, and doubling after every timeout.
+#define COMMS_RTO_INITIAL   (250)
+#define COMMS_RTO_MIN       (30)
+#define COMMS_RTO_MAX       (1000)
+// A frame is never retransmitted twice within this many ms, however many ACKs report it missing
+#define COMMS_RETX_HOLDOFF  (20)
 
-#define PACKET_RETX_DATA0   (0x19)
+// ACK frame data: type, next expected seq (all before it received), 16-bit bitmap of seq+1..seq+7
 #define PACKET_ACK_DATA0    (0x15)
+// Same as an ACK, but sent after a corrupted frame to ask for the first missing one right away
+#define PACKET_RETX_DATA0   (0x19)
+#define PACKET_ACK_LENGTH   (4)
+
+// Large link control frame carrying trace records: type, record count, dropped count (16 bit)
+#define PACKET_TRACE_DATA0  (0x1D)
+#define PACKET_TRACE_LENGTH (4)
+// When draining is on, up to COMMS_TRACE_BATCH records go out every COMMS_TRACE_INTERVAL ms
+#define COMMS_TRACE_INTERVAL (50)
+#define COMMS_TRACE_BATCH    (16)
 
 #define BL_PACKET_SYNC_OBSERVED_DATA0     (0x20)
 #define BL_PACKET_FW_UPDATE_REQ_DATA0     (0x31)
@@ -21,20 +42,107 @@
 #define BL_PACKET_READY_FOR_DATA_DATA0    (0x48)
 #define BL_PACKET_UPDATE_SUCCESSFUL_DATA0 (0x54)
 #define BL_PACKET_NACK_DATA0              (0x59)
+#define BL_PACKET_CRC_REQ_DATA0           (0x62)
+#define BL_PACKET_CRC_RES_DATA0           (0x65)
+#define BL_PACKET_READ_REQ_DATA0          (0x68)
+#define BL_PACKET_READ_RES_DATA0          (0x6B)
+#define BL_PACKET_SECTOR_REWRITE_REQ_DATA0 (0x6E)
+#define BL_PACKET_BOOT_REQ_DATA0          (0x71)
+#define BL_PACKET_BOOT_RES_DATA0          (0x74)
+
+#define BL_PACKET_BUS_JOIN_REQ_DATA0      (0x77)
+#define BL_PACKET_BUS_JOIN_RES_DATA0      (0x7A)
+#define BL_PACKET_BUS_DATA_DATA0          (0x7D)
+#define BL_PACKET_BUS_GAP_REQ_DATA0       (0x80)
+#define BL_PACKET_BUS_GAP_RES_DATA0       (0x83)
+#define BL_PACKET_DIAG_REQ_DATA0          (0x86)
+#define BL_PACKET_DIAG_RES_DATA0          (0x89)
+// Load an image of the given length in to RAM and run it from there, leaving flash alone
+#define BL_PACKET_RAM_LOAD_REQ_DATA0      (0x8C)
+// One populated range (offset, length) of a sparse image, sent after a 6 byte FW_LENGTH_RES that
+// gives the number of them. Only bytes in these ranges are sent, everything else stays erased.
+#define BL_PACKET_EXTENT_DATA0            (0x8F)
+// A CRC32 of each whole application sector, erased space and all, as a large frame: the response
+// header gives the first sector and the count, and the payload holds the CRCs
+#define BL_PACKET_SECTOR_CRC_REQ_DATA0    (0x92)
+#define BL_PACKET_SECTOR_CRC_RES_DATA0    (0x95)
+// Like FW_UPDATE_REQ, except that nothing is erased. After the length (and any extents), the
+// host rewrites just the sectors that differ with SECTOR_REWRITE_REQ, then asks to boot.
+#define BL_PACKET_DELTA_UPDATE_REQ_DATA0  (0x98)
+
+// Diagnostic requests: DIAG_REQ, diagnostic ID, arguments. The response is a large frame. Trace and
+// profile requests are built in along with tracing and profiling, the rest with 'make DIAGNOSTICS=1'.
+// Any request that isn't built in (or isn't known) is answered with UNSUPPORTED, then its ID.
+#ifndef DIAGNOSTICS_ENABLED
+#define DIAGNOSTICS_ENABLED (1)
+#endif
+
+#define BL_DIAG_TRACE                     (0x01) // Trace records since the last read
+#define BL_DIAG_TRACE_DRAIN               (0x02) // Turn background draining of the trace on/off
+#define BL_DIAG_PROFILE                   (0x03) // Statistics for one profiling scope, by index
+#define BL_DIAG_PROFILE_RESET             (0x04) // Clear every profiling scope, and the PC histogram
+#define BL_DIAG_UART_LATENCY              (0x05) // Measure RXNE to ISR latency on the next bytes
+#define BL_DIAG_BOOT_TIMELINE             (0x06) // This boot's timeline so far, or the last one
+#define BL_DIAG_LINK_STATS                (0x07) // CRC errors, FEC corrections, retransmits and RTO
+#define BL_DIAG_PC_HISTOGRAM              (0x08) // One chunk of the SysTick PC histogram, by index
+#define BL_DIAG_MEMORY                    (0x09) // RAM map, stack and buffer high-water marks
+#define BL_DIAG_BENCH                     (0x0A) // Run the self-benchmark (see bench.h)
+#define BL_DIAG_UNSUPPORTED               (0xFF)
+
+// Profiling scope payload: name (NUL padded), count, min, max, total (u64), histogram
+#define BL_DIAG_PROFILE_NAME_LENGTH       (24)
+#define BL_DIAG_PROFILE_LENGTH            (BL_DIAG_PROFILE_NAME_LENGTH + 20 + (PROFILE_HISTOGRAM_BINS * 4))
+// PC histogram response header: chunk, chunk count (0 without PC_SAMPLING=1), start (u32), shift,
+// outside (u32). The payload is that chunk of the bucket counts.
+#define BL_DIAG_PC_HISTOGRAM_LENGTH       (13)
+#define BL_DIAG_PC_HISTOGRAM_CHUNK        (BL_READ_MAX_LENGTH / sizeof(uint16_t))
+// Memory response header: buffer count. The payload is the RAM map (start, size, then the sizes of
+// .noinit, .data, .bss and the stack), the stack's high-water mark, then capacity, peak and
+// overflows for each buffer: UART rx, UART tx, USB rx, comms packets. All u32. An argument of 1
+// resets the high-water marks once they've been read.
+#define BL_DIAG_MEMORY_BUFFERS            (4)
+#define BL_DIAG_MEMORY_LENGTH             (28 + (BL_DIAG_MEMORY_BUFFERS * 12))
+// Bench response header: 1 if the benchmark ran, 0 if it was built out. The payload is a
+// bench_results_t.
+#define BL_DIAG_BENCH_LENGTH              (3)
+// How long a UART latency measurement waits for its bytes
+#define BL_DIAG_UART_LATENCY_TIMEOUT      (1000)
+
+// Largest payload that can follow a READ_RES packet as a single large frame
+#define BL_READ_MAX_LENGTH                (1024)
+
+// Bus data packets carry a 24-bit offset and a chunk of the image, and so can arrive in any order
+#define BL_BUS_CHUNK_SIZE                 (12)
+// Most missing chunk ranges reported in one gap response
+#define BL_BUS_GAP_MAX_RANGES             (64)
+
+// Most populated ranges a sparse image can be sent as
+#define BL_MAX_EXTENTS                    (32)
 
-typedef struct comms_packet_t {
-  uint8_t length;
-  uint8_t data[PACKET_DATA_LENGTH];
-  uint8_t crc;
-} comms_packet_t;
+// Counted since reset, so they cover the whole update rather than the last sync
+typedef struct comms_link_stats_t {
+  uint32_t crc_errors;      // Frames that arrived corrupted and were asked for again
+  uint32_t fec_corrections; // Frames put right by FEC instead
+  uint32_t retransmits;     // Frames this end had to send more than once
+  uint32_t rto;             // Current retransmission timeout, ms
+} comms_link_stats_t;
 
-void comms_setup(void);
+void comms_setup(const transport_t* link);
+void comms_set_node_id(const uint8_t node_id);
+uint8_t comms_get_node_id(void);
 void comms_update(void);
+void comms_flush_ack(void);
+bool comms_tx_pending(void);
+void comms_set_trace_drain(const bool enabled);
+const comms_link_stats_t* comms_get_link_stats(void);
+// Frames waiting for the application. A full buffer holds up delivery, which counts as an overflow.
+buffer_usage_t comms_packet_buffer_usage(void);
+void comms_reset_usage(void);
 
 bool comms_packets_available(void);
 void comms_write(comms_packet_t* packet);
+void comms_write_large_frame(comms_packet_t* header, const uint8_t* data, const uint32_t length);
 void comms_read(comms_packet_t* packet);
-uint8_t comms_compute_crc(comms_packet_t* packet);
 bool comms_is_single_byte_packet(const comms_packet_t* packet, uint8_t byte);
 void comms_create_single_byte_packet(comms_packet_t* packet, uint8_t byte);
 
@@ -0,0 +1,19 @@
+#ifndef INC_FEC_H
+#define INC_FEC_H
+
+#include "common-defines.h"
+
+// Parity bytes at the end of a codeword. Two put right any one wrong byte, wherever it is.
+#define FEC_PARITY_BYTES (2)
+
+typedef enum fec_result_t {
+  FecResult_Ok = 0,
+  FecResult_Corrected,
+  FecResult_Uncorrectable,
+} fec_result_t;
+
+// Check a codeword of up to 255 bytes (the parity included), and fix it in place if one byte is
+// wrong. Only the host encodes, so there's no encoder here.
+fec_result_t fec_correct(uint8_t* codeword, const uint32_t length);
+
+#endif // INC_FEC_H
@@ -1,11 +1,17 @@
 
-BOOTLOADER_SIZE = 0x8000
+import sys
+
+BOOTLOADER_SIZE = 0x4000
 BOOTLOADER_FILE = "bootloader.bin"
 
 with open(BOOTLOADER_FILE, "rb") as f:
     raw_file = f.read()
 
 bytes_to_pad = BOOTLOADER_SIZE - len(raw_file)
+if bytes_to_pad < 0:
+    sys.exit(f"bootloader.bin is {len(raw_file)} bytes, {-bytes_to_pad} over the {BOOTLOADER_SIZE} byte limit")
+print(f"bootloader.bin: {len(raw_file)}/{BOOTLOADER_SIZE} bytes ({bytes_to_pad} free)")
+
 padding = bytes([0xff for _ in range(bytes_to_pad)])
 
 with open(BOOTLOADER_FILE, "wb") as f:
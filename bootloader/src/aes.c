@@ -1,4 +1,5 @@
 #include "aes.h"
+#include "core/system.h"
 
 // For memcpy
 #include "string.h"
@@ -35,7 +36,7 @@ uint8_t GF_Mult(uint8_t a, uint8_t b) {
   return result;
 }
 
-void GF_WordAdd(AES_Column_t a, AES_Column_t b, AES_Column_t dest) {
+void GF_WordAdd(const AES_Column_t a, const AES_Column_t b, AES_Column_t dest) {
   dest[0] = a[0] ^ b[0];
   dest[1] = a[1] ^ b[1];
   dest[2] = a[2] ^ b[2];
@@ -63,6 +64,7 @@ const uint8_t sbox_encrypt[] = {
 /* f */  0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
 };
 
+#if AES_DECRYPT_ENABLED
 // Spec page 22
 const uint8_t sbox_decrypt[] = {
 /*          0     1     2     3     4     5     6     7     8     9     a     b     c     d     e     f */
@@ -83,9 +85,10 @@ const uint8_t sbox_decrypt[] = {
 /* e */  0xa0, 0xe0, 0x3b, 0x4d, 0xae, 0x2a, 0xf5, 0xb0, 0xc8, 0xeb, 0xbb, 0x3c, 0x83, 0x53, 0x99, 0x61,
 /* f */  0x17, 0x2b, 0x04, 0x7e, 0xba, 0x77, 0xd6, 0x26, 0xe1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0c, 0x7d,
 };
+#endif
 
 // Spec Appendix A1
-AES_Column_t Rcon[] = {
+const AES_Column_t Rcon[] = {
   { 0x01, 0x00, 0x00, 0x00 },
   { 0x02, 0x00, 0x00, 0x00 },
   { 0x04, 0x00, 0x00, 0x00 },
@@ -192,6 +195,7 @@ void AES_ShiftRows(AES_Block_t state) {
   state[0][3] = temp0;
 }
 
+#if AES_DECRYPT_ENABLED
 void AES_InvShiftRows(AES_Block_t state) {
   uint8_t temp0;
   uint8_t temp1;
@@ -222,6 +226,8 @@ void AES_InvShiftRows(AES_Block_t state) {
   state[3][3] = temp0;
 }
 
+#endif
+
 void AES_MixColumns(AES_Block_t state) {
   AES_Column_t temp = { 0 };
 
@@ -235,6 +241,7 @@ void AES_MixColumns(AES_Block_t state) {
   }
 }
 
+#if AES_DECRYPT_ENABLED
 void AES_InvMixColumns(AES_Block_t state) {
   AES_Column_t temp = { 0 };
 
@@ -248,6 +255,8 @@ void AES_InvMixColumns(AES_Block_t state) {
   }
 }
 
+#endif
+
 void AES_AddRoundKey(AES_Block_t state, const AES_Block_t roundKey) {
   for (size_t col = 0; col < 4; col++) {
     for  (size_t row = 0; row < 4; row++) {
@@ -257,6 +266,7 @@ void AES_AddRoundKey(AES_Block_t state, const AES_Block_t roundKey) {
 }
 
 void AES_EncryptBlock(AES_Block_t state, const AES_Block_t* keySchedule) {
+  PROFILE_BEGIN("AES_EncryptBlock");
   AES_Block_t* roundKey = (AES_Block_t*)keySchedule;
 
   // Initial round key addition
@@ -275,8 +285,11 @@ void AES_EncryptBlock(AES_Block_t state, const AES_Block_t* keySchedule) {
 
     AES_AddRoundKey(state, *roundKey++);
   }
+
+  PROFILE_END();
 }
 
+#if AES_DECRYPT_ENABLED
 void AES_DecryptBlock(AES_Block_t state, const AES_Block_t* keySchedule) {
   AES_Block_t* roundKey = (AES_Block_t*)keySchedule + NUM_ROUND_KEYS_128 - 1;
 
@@ -296,3 +309,4 @@ void AES_DecryptBlock(AES_Block_t state, const AES_Block_t* keySchedule) {
   // Last key addition
   AES_AddRoundKey(state, *roundKey);
 }
+#endif
@@ -0,0 +1,151 @@
+#include <libopencm3/stm32/memorymap.h>
+#include <libopencm3/cm3/dwt.h>
+#include <string.h>
+
+#include "aes.h"
+#include "bench.h"
+#include "bl-flash.h"
+#include "core/crc.h"
+#include "core/firmware-info.h"
+#include "core/system.h"
+#include "core/uart.h"
+
+#if BENCH_ENABLED
+
+extern uint8_t _etext;
+
+// Any key will do, the timing doesn't depend on it
+static const AES_Key128_t bench_key = {
+  0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c,
+};
+
+static const uint8_t* bench_data(void) {
+  return (const uint8_t*)MAIN_APP_START_ADDRESS;
+}
+
+static uint32_t time_crc8(void) {
+  const uint32_t start = DWT_CYCCNT;
+  (void)crc8((uint8_t*)bench_data(), BENCH_DATA_LENGTH);
+  return DWT_CYCCNT - start;
+}
+
+static uint32_t time_crc32(void) {
+  const uint32_t start = DWT_CYCCNT;
+  (void)crc32(bench_data(), BENCH_DATA_LENGTH);
+  return DWT_CYCCNT - start;
+}
+
+// The fastest of BENCH_RUNS, as the others may include a SysTick or UART interrupt
+static uint32_t fastest(uint32_t (*benchmark)(void)) {
+  uint32_t best = 0xffffffff;
+  for (uint32_t run = 0; run < BENCH_RUNS; run++) {
+    const uint32_t cycles = benchmark();
+    if (cycles < best) {
+      best = cycles;
+    }
+  }
+  return best;
+}
+
+static void bench_aes(bench_results_t* results) {
+  AES_Block_t round_keys[NUM_ROUND_KEYS_128];
+  uint32_t start = DWT_CYCCNT;
+  AES_KeySchedule128(bench_key, round_keys);
+  results->key_schedule_cycles = DWT_CYCCNT - start;
+
+  AES_Block_t state = {0};
+  results->aes_block_cycles = 0xffffffff;
+  for (uint32_t run = 0; run < BENCH_RUNS; run++) {
+    start = DWT_CYCCNT;
+    AES_EncryptBlock(state, round_keys);
+    const uint32_t cycles = DWT_CYCCNT - start;
+    if (cycles < results->aes_block_cycles) {
+      results->aes_block_cycles = cycles;
+    }
+  }
+
+  // Chained as the signature check does it, a block at a time out of flash
+  results->cbc_mac_cycles = 0xffffffff;
+  for (uint32_t run = 0; run < BENCH_RUNS; run++) {
+    AES_Block_t prev_state = {0};
+    start = DWT_CYCCNT;
+    for (uint32_t offset = 0; offset < BENCH_DATA_LENGTH; offset += AES_BLOCK_SIZE) {
+      memcpy(state, &bench_data()[offset], AES_BLOCK_SIZE);
+      for (uint8_t i = 0; i < AES_BLOCK_SIZE; i++) {
+        ((uint8_t*)state)[i] ^= ((uint8_t*)prev_state)[i];
+      }
+      AES_EncryptBlock(state, round_keys);
+      memcpy(prev_state, state, AES_BLOCK_SIZE);
+    }
+    const uint32_t cycles = DWT_CYCCNT - start;
+    if (cycles < results->cbc_mac_cycles) {
+      results->cbc_mac_cycles = cycles;
+    }
+  }
+}
+
+static bool is_erased(const uint32_t address, const uint32_t size) {
+  for (uint32_t offset = 0; offset < size; offset += 4) {
+    if (*(const uint32_t*)(address + offset) != 0xffffffff) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Only a sector that's already blank is used, so that nothing is lost even in the middle of an
+// update, and it's erased again afterwards
+static void bench_flash(bench_results_t* results) {
+  uint32_t address = 0;
+  uint32_t size = 0;
+  uint8_t sector = MAIN_APP_SECTOR_END;
+  while ((sector >= MAIN_APP_SECTOR_START) &&
+         (!bl_flash_get_sector_region(sector, &address, &size) || !is_erased(address, size))) {
+    sector--;
+  }
+
+  results->flash_program_words = BENCH_PROGRAM_WORDS;
+  if (sector < MAIN_APP_SECTOR_START) {
+    results->flash_sector = BENCH_NO_SECTOR;
+    return;
+  }
+  results->flash_sector = sector;
+  results->flash_sector_size = size;
+
+  uint8_t data[BENCH_PROGRAM_WORDS * 4];
+  for (uint32_t i = 0; i < sizeof(data); i++) {
+    data[i] = i;
+  }
+
+  uint32_t start = DWT_CYCCNT;
+  bl_flash_write(address, data, sizeof(data));
+  results->flash_program_cycles = DWT_CYCCNT - start;
+
+  start = DWT_CYCCNT;
+  (void)bl_flash_erase_main_application_sector(sector);
+  results->flash_erase_cycles = DWT_CYCCNT - start;
+}
+
+void bench_run(bench_results_t* results) {
+  memset(results, 0, sizeof(bench_results_t));
+  results->cpu_hz = CPU_FREQ;
+  memcpy(results->unique_id, (const void*)DESIG_UNIQUE_ID_BASE, sizeof(results->unique_id));
+  results->bootloader_crc = crc32((const uint8_t*)FLASH_BASE, (uint32_t)&_etext - FLASH_BASE);
+
+  const firmware_info_t* firmware_info = (const firmware_info_t*)FWINFO_ADDRESS;
+  if (firmware_info->sentinel == FWINFO_SENTINEL) {
+    results->app_version = firmware_info->version;
+  }
+
+  results->data_length = BENCH_DATA_LENGTH;
+  results->crc8_cycles = fastest(time_crc8);
+  results->crc32_cycles = fastest(time_crc32);
+  bench_aes(results);
+  bench_flash(results);
+
+  results->uart_baud = UART_BAUD_RATE;
+  results->uart_length = BENCH_UART_LENGTH;
+  results->uart_received = uart_measure_loopback(BENCH_UART_LENGTH, BENCH_UART_TIMEOUT, &results->uart_cycles);
+}
+
+#endif // BENCH_ENABLED
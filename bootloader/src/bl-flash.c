@@ -1,19 +1,104 @@
 #include <libopencm3/stm32/flash.h>
+#include "core/ramfunc.h"
+#include "core/system.h"
 #include "bl-flash.h"
 
-#define MAIN_APP_SECTOR_START (2)
-#define MAIN_APP_SECTOR_END   (7)
+#define NUM_SECTORS           (8)
 
-void bl_flash_erase_main_application(void) {
-  flash_unlock();
-  for (uint8_t sector = MAIN_APP_SECTOR_START; sector <= MAIN_APP_SECTOR_END; sector++) {
-    flash_erase_sector(sector, FLASH_CR_PROGRAM_X32);
+static const uint32_t sector_sizes[NUM_SECTORS] = {
+  0x4000, 0x4000, 0x4000, 0x4000, 0x10000, 0x20000, 0x20000, 0x20000,
+};
+
+// The CPU stalls on any flash fetch while an erase or program is in progress, so everything that
+// runs during one (these helpers, and the interrupts that can preempt them) has to live in RAM.
+// libopencm3's own flash routines are in flash, so the registers are driven directly here.
+
+static RAMFUNC void bl_flash_wait_for_last_operation(void) {
+  while ((FLASH_SR & FLASH_SR_BSY) == FLASH_SR_BSY) {
+    // Spin
+  }
+}
+
+static RAMFUNC void bl_flash_set_program_size(uint32_t program_size) {
+  FLASH_CR &= ~(FLASH_CR_PROGRAM_MASK << FLASH_CR_PROGRAM_SHIFT);
+  FLASH_CR |= program_size << FLASH_CR_PROGRAM_SHIFT;
+}
+
+static RAMFUNC void bl_flash_erase_sector(uint8_t sector) {
+  bl_flash_wait_for_last_operation();
+  bl_flash_set_program_size(FLASH_CR_PROGRAM_X32);
+
+  FLASH_CR &= ~(FLASH_CR_SNB_MASK << FLASH_CR_SNB_SHIFT);
+  FLASH_CR |= (sector & FLASH_CR_SNB_MASK) << FLASH_CR_SNB_SHIFT;
+  FLASH_CR |= FLASH_CR_SER;
+  FLASH_CR |= FLASH_CR_STRT;
+
+  bl_flash_wait_for_last_operation();
+  FLASH_CR &= ~FLASH_CR_SER;
+  FLASH_CR &= ~(FLASH_CR_SNB_MASK << FLASH_CR_SNB_SHIFT);
+}
+
+static RAMFUNC void bl_flash_program(uint32_t address, const uint8_t* data, uint32_t length) {
+  uint32_t i = 0;
+
+  bl_flash_wait_for_last_operation();
+
+  // Word-sized programming for the aligned bulk of the data, which is 4x fewer operations
+  if ((address & 3) == 0) {
+    bl_flash_set_program_size(FLASH_CR_PROGRAM_X32);
+    FLASH_CR |= FLASH_CR_PG;
+    for (; (i + 4) <= length; i += 4) {
+      const uint32_t word = (
+        (data[i])             |
+        (data[i + 1] << 8)    |
+        (data[i + 2] << 16)   |
+        ((uint32_t)data[i + 3] << 24)
+      );
+      MMIO32(address + i) = word;
+      bl_flash_wait_for_last_operation();
+    }
+    FLASH_CR &= ~FLASH_CR_PG;
   }
+
+  bl_flash_set_program_size(FLASH_CR_PROGRAM_X8);
+  FLASH_CR |= FLASH_CR_PG;
+  for (; i < length; i++) {
+    MMIO8(address + i) = data[i];
+    bl_flash_wait_for_last_operation();
+  }
+  FLASH_CR &= ~FLASH_CR_PG;
+}
+
+bool bl_flash_erase_main_application_sector(const uint8_t sector) {
+  if (sector < MAIN_APP_SECTOR_START || sector > MAIN_APP_SECTOR_END) {
+    return false;
+  }
+
+  flash_unlock();
+  bl_flash_erase_sector(sector);
   flash_lock();
+  return true;
+}
+
+bool bl_flash_get_sector_region(const uint8_t sector, uint32_t* address, uint32_t* size) {
+  if (sector >= NUM_SECTORS) {
+    return false;
+  }
+
+  uint32_t sector_address = FLASH_BASE;
+  for (uint8_t i = 0; i < sector; i++) {
+    sector_address += sector_sizes[i];
+  }
+
+  *address = sector_address;
+  *size = sector_sizes[sector];
+  return true;
 }
 
 void bl_flash_write(const uint32_t address, const uint8_t* data, const uint32_t length) {
+  PROFILE_BEGIN("bl_flash_write");
   flash_unlock();
-  flash_program(address, data, length);
+  bl_flash_program(address, data, length);
   flash_lock();
+  PROFILE_END();
 }
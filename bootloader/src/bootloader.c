@@ -7,11 +7,17 @@
 #include <string.h>
 
 #include "aes.h"
+#include "bench.h"
 #include "core/firmware-info.h"
+#include "core/boot-timeline.h"
+#include "core/handoff.h"
+#include "core/memory.h"
 #include "core/uart.h"
+#include "core/usb-cdc.h"
 #include "core/system.h"
 #include "core/crc.h"
 #include "core/simple-timer.h"
+#include "core/trace.h"
 #include "comms.h"
 #include "bl-flash.h"
 
@@ -19,12 +25,32 @@
 #define RX_PIN        (GPIO3)
 #define TX_PIN        (GPIO2)
 
+#define USB_PORT      (GPIOA)
+#define USB_DM_PIN    (GPIO11)
+#define USB_DP_PIN    (GPIO12)
+
 #define SYNC_SEQ_0 (0xc4)
 #define SYNC_SEQ_1 (0x55)
 #define SYNC_SEQ_2 (0x7e)
 #define SYNC_SEQ_3 (0x10)
+// Last byte of the sync sequence for a bus update, after which nodes stay quiet until addressed
+#define SYNC_SEQ_3_BUS (0x11)
 
 #define DEFAULT_TIMEOUT (5000)
+// Nodes on a bus spend a long time waiting while the host deals with the others
+#define BUS_TIMEOUT     (30000)
+// How long the last responses (e.g. the boot response) are resent for, waiting for the host's ACK
+#define LINGER_TIMEOUT  (2000)
+
+// A node ID assigned at production time lives in the first byte of OTP block 0
+#define NODE_ID_OTP_ADDRESS (0x1FFF7800U)
+#define UNIQUE_ID_LENGTH    (12)
+
+#define BUS_MAX_CHUNKS  ((MAX_FW_LENGTH + BL_BUS_CHUNK_SIZE - 1) / BL_BUS_CHUNK_SIZE)
+
+// The UART receives in to the RAM image load area unless a RAM load is under way. 32K is ~2.8s of
+// line time at 115200, which covers the longest sector erase (128K, 2s at most).
+#define UART_ERASE_RX_BUFFER_SIZE (0x8000)
 
 typedef enum bl_state_t {
   BL_State_Sync,
@@ -33,15 +59,44 @@ typedef enum bl_state_t {
   BL_State_DeviceIDRes,
   BL_State_FWLengthReq,
   BL_State_FWLengthRes,
+  BL_State_ReceiveExtents,
   BL_State_EraseApplication,
   BL_State_ReceiveFirmware,
+  BL_State_BusReceive,
+  BL_State_Verify,
   BL_State_Done,
 } bl_state_t;
 
+typedef struct extent_t {
+  uint32_t offset;
+  uint32_t length;
+} extent_t;
+
 static bl_state_t state = BL_State_Sync;
 static uint32_t fw_length = 0;
 static uint32_t bytes_written = 0;
-static uint8_t sync_seq[4] = {0};
+static uint32_t write_limit = 0;
+// Ranges of the image that are sent. A dense image is one extent covering the whole thing.
+static extent_t extents[BL_MAX_EXTENTS];
+static uint8_t extent_count = 0;
+static uint8_t extents_received = 0;
+static uint8_t extent_index = 0;
+static bool image_validated = false;
+static bool ram_load = false;
+// The installed image stays put, and only the sectors the host asks for are erased and rewritten
+static bool delta_update = false;
+// The next sector to erase. It's one per pass of the main loop, so the UART is drained in between.
+static uint8_t erase_sector = MAIN_APP_SECTOR_START;
+static uint32_t handoff_flags = 0;
+static bool bus_mode = false;
+static uint32_t bus_chunk_count = 0;
+static uint32_t bus_chunks_received = 0;
+static uint8_t bus_received[(BUS_MAX_CHUNKS + 7) / 8];
+// Every link is watched for the sync sequence, and the first one to see it is used from then on
+static const transport_t* const transports[] = { &uart_transport, &usb_cdc_transport };
+#define NUM_TRANSPORTS (sizeof(transports) / sizeof(transports[0]))
+static const transport_t* synced_transport = &uart_transport;
+static uint8_t sync_seq[NUM_TRANSPORTS][4] = {{0}};
 static simple_timer_t timer;
 static comms_packet_t temp_packet;
 
@@ -56,16 +111,20 @@ static void gpio_setup(void) {
   rcc_periph_clock_enable(RCC_GPIOA);
   gpio_mode_setup(UART_PORT, GPIO_MODE_AF, GPIO_PUPD_NONE, TX_PIN | RX_PIN);
   gpio_set_af(UART_PORT, GPIO_AF7, TX_PIN | RX_PIN);
+
+  gpio_mode_setup(USB_PORT, GPIO_MODE_AF, GPIO_PUPD_NONE, USB_DM_PIN | USB_DP_PIN);
+  gpio_set_af(USB_PORT, GPIO_AF10, USB_DM_PIN | USB_DP_PIN);
 }
 
 static void gpio_teardown(void) {
   gpio_mode_setup(UART_PORT, GPIO_MODE_ANALOG, GPIO_PUPD_NONE, TX_PIN | RX_PIN);
+  gpio_mode_setup(USB_PORT, GPIO_MODE_ANALOG, GPIO_PUPD_NONE, USB_DM_PIN | USB_DP_PIN);
   rcc_periph_clock_disable(RCC_GPIOA);
 }
 
-static void jump_to_main(void) {
-  vector_table_t* main_vector_table = (vector_table_t*)MAIN_APP_START_ADDRESS;
-  main_vector_table->reset();
+static void jump_to_app(const uint32_t app_address) {
+  vector_table_t* app_vector_table = (vector_table_t*)app_address;
+  app_vector_table->reset();
 }
 
 static void aes_cbc_mac_step(AES_Block_t aes_state, AES_Block_t prev_state, const AES_Block_t *key_schedule) {
@@ -78,20 +137,22 @@ static void aes_cbc_mac_step(AES_Block_t aes_state, AES_Block_t prev_state, cons
   memcpy(prev_state, aes_state, AES_BLOCK_SIZE);
 }
 
-static bool validate_firmware_image(void) {
-  firmware_info_t* firmware_info = (firmware_info_t*)FWINFO_ADDRESS;
-  const uint8_t* signature = (const uint8_t*)SIGNATURE_ADDRESS;
-
-  if (firmware_info->sentinel != FWINFO_SENTINEL) {
-    return false;
-  }
+// Check the signature of the image at app_address, in flash or RAM
+static bool validate_firmware_image(const uint32_t app_address, const uint32_t max_length) {
+  PROFILE_BEGIN("validate_firmware_image");
+  firmware_info_t* firmware_info = (firmware_info_t*)(app_address + FWINFO_OFFSET);
+  const uint8_t* signature = (const uint8_t*)(app_address + FWINFO_OFFSET + sizeof(firmware_info_t));
 
-  if (firmware_info->device_id != DEVICE_ID) {
+  // Turned away before the signature check, which still counts as a run of the profiling scope
+  if ((firmware_info->sentinel != FWINFO_SENTINEL) ||
+      (firmware_info->device_id != DEVICE_ID) || (firmware_info->length > max_length)) {
+    PROFILE_END();
     return false;
   }
 
   AES_Block_t round_keys[NUM_ROUND_KEYS_128];
   AES_KeySchedule128(secret_key, round_keys);
+  boot_timeline_mark(BootPhase_BootloaderKeySchedule);
 
   AES_Block_t aes_state = {0};
   AES_Block_t prev_state = {0};
@@ -107,26 +168,26 @@ static bool validate_firmware_image(void) {
   uint32_t offset = 0;
   while (offset < firmware_info->length) {
     // Are we are the point where we need to skip the info and signature sections?
-    if (offset == (FWINFO_ADDRESS - MAIN_APP_START_ADDRESS)) {
+    if (offset == FWINFO_OFFSET) {
       offset += AES_BLOCK_SIZE * 2;
       continue;
     }
 
     if (firmware_info->length - offset > AES_BLOCK_SIZE) {
       // The regular case
-      memcpy(aes_state, (void*)(MAIN_APP_START_ADDRESS + offset), AES_BLOCK_SIZE);
+      memcpy(aes_state, (void*)(app_address + offset), AES_BLOCK_SIZE);
       aes_cbc_mac_step(aes_state, prev_state, round_keys);
     } else {
       // The case of padding
       if (bytes_to_pad == 16) {
         // Add a whole extra block of padding
-        memcpy(aes_state, (void*)(MAIN_APP_START_ADDRESS + offset), AES_BLOCK_SIZE);
+        memcpy(aes_state, (void*)(app_address + offset), AES_BLOCK_SIZE);
         aes_cbc_mac_step(aes_state, prev_state, round_keys);
 
         memset(aes_state, AES_BLOCK_SIZE, AES_BLOCK_SIZE);
         aes_cbc_mac_step(aes_state, prev_state, round_keys);
       } else {
-        memcpy(aes_state, (void*)(MAIN_APP_START_ADDRESS + offset), AES_BLOCK_SIZE - bytes_to_pad);
+        memcpy(aes_state, (void*)(app_address + offset), AES_BLOCK_SIZE - bytes_to_pad);
         memset((void*)(aes_state) + (AES_BLOCK_SIZE - bytes_to_pad), bytes_to_pad, bytes_to_pad);
         aes_cbc_mac_step(aes_state, prev_state, round_keys);
       }
@@ -135,12 +196,31 @@ static bool validate_firmware_image(void) {
     offset += AES_BLOCK_SIZE;
   }
 
-  return memcmp(signature, aes_state, AES_BLOCK_SIZE) == 0;
+  const bool valid = memcmp(signature, aes_state, AES_BLOCK_SIZE) == 0;
+  boot_timeline_set_version(valid ? firmware_info->version : 0);
+  boot_timeline_mark(BootPhase_BootloaderValidate);
+  PROFILE_END();
+  return valid;
+}
+
+// Boards on a shared bus need distinct IDs. One programmed in OTP wins, otherwise it's derived
+// from the chip's unique ID (the point-to-point updater shows it after syncing).
+static uint8_t get_node_id(void) {
+  const uint8_t assigned = *(const uint8_t*)NODE_ID_OTP_ADDRESS;
+  if ((assigned >= COMMS_NODE_ID_MIN) && (assigned <= COMMS_NODE_ID_MAX)) {
+    return assigned;
+  }
+
+  const uint8_t hash = crc8((uint8_t*)DESIG_UNIQUE_ID_BASE, UNIQUE_ID_LENGTH);
+  return COMMS_NODE_ID_MIN + (hash % (COMMS_NODE_ID_MAX - COMMS_NODE_ID_MIN + 1));
 }
 
 static void bootloading_fail(void) {
-  comms_create_single_byte_packet(&temp_packet, BL_PACKET_NACK_DATA0);
-  comms_write(&temp_packet);
+  // On a bus, nodes only ever speak when spoken to
+  if (!bus_mode) {
+    comms_create_single_byte_packet(&temp_packet, BL_PACKET_NACK_DATA0);
+    comms_write(&temp_packet);
+  }
   state = BL_State_Done;
 }
 
@@ -168,8 +248,523 @@ static bool is_device_id_packet(const comms_packet_t* packet) {
   return true;
 }
 
+static uint32_t read_u32(const uint8_t* bytes) {
+  return (
+    (bytes[0])       |
+    (bytes[1] << 8)  |
+    (bytes[2] << 16) |
+    (bytes[3] << 24)
+  );
+}
+
+static void write_u32(uint8_t* bytes, const uint32_t value) {
+  bytes[0] = value & 0xff;
+  bytes[1] = (value >> 8) & 0xff;
+  bytes[2] = (value >> 16) & 0xff;
+  bytes[3] = (value >> 24) & 0xff;
+}
+
+static void set_dense_extent(const uint32_t length) {
+  extents[0].offset = 0;
+  extents[0].length = length;
+  extent_count = 1;
+}
+
+// Move the write position forward to the next byte that will actually be sent, past any erased
+// gap, or to the end of the image once there's nothing left
+static void skip_to_extent(void) {
+  while ((extent_index < extent_count) && (bytes_written >= (extents[extent_index].offset + extents[extent_index].length))) {
+    extent_index++;
+  }
+
+  if (extent_index == extent_count) {
+    bytes_written = fw_length;
+  } else if (bytes_written < extents[extent_index].offset) {
+    bytes_written = extents[extent_index].offset;
+  }
+}
+
+static void seek(const uint32_t offset) {
+  bytes_written = offset;
+  extent_index = 0;
+  skip_to_extent();
+}
+
+static bool is_packet_of_type(const comms_packet_t* packet, uint8_t type, uint8_t length) {
+  if (packet->length != length) {
+    return false;
+  }
+
+  if (packet->data[0] != type) {
+    return false;
+  }
+
+  for (uint8_t i = length; i < PACKET_DATA_LENGTH; i++) {
+    if (packet->data[i] != 0xff) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Range requests carry an offset and length in to the main application region
+static bool is_range_request(const comms_packet_t* packet, uint8_t type, uint32_t* offset, uint32_t* length) {
+  if (!is_packet_of_type(packet, type, 9)) {
+    return false;
+  }
+
+  *offset = read_u32(&packet->data[1]);
+  *length = read_u32(&packet->data[5]);
+
+  return (*offset <= MAX_FW_LENGTH) && (*length <= (MAX_FW_LENGTH - *offset));
+}
+
+// Requests that inspect the installed image, without changing it. These are accepted both before
+// an update (to audit a device in the field) and after one (to verify what was written).
+static bool handle_inspection_request(const comms_packet_t* packet) {
+  comms_packet_t response;
+  uint32_t offset = 0;
+  uint32_t length = 0;
+
+  if (is_range_request(packet, BL_PACKET_CRC_REQ_DATA0, &offset, &length)) {
+    const uint32_t crc = crc32((const uint8_t*)(MAIN_APP_START_ADDRESS + offset), length);
+
+    memset(&response, 0xff, sizeof(comms_packet_t));
+    response.length = 5;
+    response.data[0] = BL_PACKET_CRC_RES_DATA0;
+    write_u32(&response.data[1], crc);
+    comms_write(&response);
+    return true;
+  }
+
+  if (is_range_request(packet, BL_PACKET_READ_REQ_DATA0, &offset, &length) && (length <= BL_READ_MAX_LENGTH)) {
+    memset(&response, 0xff, sizeof(comms_packet_t));
+    response.length = 9;
+    response.data[0] = BL_PACKET_READ_RES_DATA0;
+    write_u32(&response.data[1], offset);
+    write_u32(&response.data[5], length);
+    comms_write_large_frame(&response, (const uint8_t*)(MAIN_APP_START_ADDRESS + offset), length);
+    return true;
+  }
+
+  // Whole sectors, so that a sector whose new contents end early (or that no longer holds any of
+  // the image) still only matches if what's left over is erased
+  if (comms_is_single_byte_packet(packet, BL_PACKET_SECTOR_CRC_REQ_DATA0)) {
+    uint8_t crcs[MAIN_APP_SECTOR_COUNT * 4];
+    for (uint8_t i = 0; i < MAIN_APP_SECTOR_COUNT; i++) {
+      uint32_t sector_address = 0;
+      uint32_t sector_size = 0;
+      bl_flash_get_sector_region(MAIN_APP_SECTOR_START + i, &sector_address, &sector_size);
+      write_u32(&crcs[i * 4], crc32((const uint8_t*)sector_address, sector_size));
+    }
+
+    memset(&response, 0xff, sizeof(comms_packet_t));
+    response.length = 3;
+    response.data[0] = BL_PACKET_SECTOR_CRC_RES_DATA0;
+    response.data[1] = MAIN_APP_SECTOR_START;
+    response.data[2] = MAIN_APP_SECTOR_COUNT;
+    comms_write_large_frame(&response, crcs, sizeof(crcs));
+    return true;
+  }
+
+  return false;
+}
+
+// Erase one sector of the image just written, and receive its contents again. A sector past the
+// end of the image is only erased, which is how a delta update clears what a longer one left.
+static bool handle_sector_rewrite_request(const comms_packet_t* packet) {
+  if (!is_packet_of_type(packet, BL_PACKET_SECTOR_REWRITE_REQ_DATA0, 2)) {
+    return false;
+  }
+
+  uint32_t sector_address = 0;
+  uint32_t sector_size = 0;
+  if (!bl_flash_get_sector_region(packet->data[1], &sector_address, &sector_size)) {
+    return false;
+  }
+
+  if (ram_load || (sector_address < MAIN_APP_START_ADDRESS)) {
+    return false;
+  }
+
+  comms_flush_ack();
+  if (!bl_flash_erase_main_application_sector(packet->data[1])) {
+    return false;
+  }
+
+  seek(sector_address - MAIN_APP_START_ADDRESS);
+  write_limit = sector_address - MAIN_APP_START_ADDRESS + sector_size;
+  if (write_limit > fw_length) {
+    write_limit = fw_length;
+  }
+
+  comms_create_single_byte_packet(&temp_packet, BL_PACKET_READY_FOR_DATA_DATA0);
+  comms_write(&temp_packet);
+
+  // Nothing in a sparse image's erased gap is sent, so a sector entirely inside one is done already
+  if (bytes_written >= write_limit) {
+    comms_create_single_byte_packet(&temp_packet, BL_PACKET_UPDATE_SUCCESSFUL_DATA0);
+    comms_write(&temp_packet);
+  } else {
+    state = BL_State_ReceiveFirmware;
+  }
+  return true;
+}
+
+// Receive an image in to RAM, to be run from there without touching the application in flash
+static bool handle_ram_load_request(const comms_packet_t* packet) {
+  if (!is_packet_of_type(packet, BL_PACKET_RAM_LOAD_REQ_DATA0, 5)) {
+    return false;
+  }
+
+  const uint32_t length = read_u32(&packet->data[1]);
+  if (length > RAM_APP_MAX_LENGTH) {
+    return false;
+  }
+
+  TRACE("bl: ram load of %u bytes", length, 0);
+  // The image goes where the UART has been receiving, so it has to go back to its own ring. Frames
+  // still in flight may not fit there yet, so comms takes them first (or, with the host on USB,
+  // they're of no use to anyone).
+  while (!uart_use_rx_buffer(NULL, 0)) {
+    if (synced_transport == &uart_transport) {
+      comms_update();
+    } else {
+      uint8_t discard[16];
+      (void)uart_read(discard, sizeof(discard));
+    }
+  }
+  ram_load = true;
+  image_validated = false;
+  fw_length = length;
+  write_limit = length;
+  set_dense_extent(length);
+  seek(0);
+
+  comms_create_single_byte_packet(&temp_packet, BL_PACKET_READY_FOR_DATA_DATA0);
+  comms_write(&temp_packet);
+  state = BL_State_ReceiveFirmware;
+  return true;
+}
+
+// Boot only if the image is valid. Otherwise report it, and stay put so the host can repair it.
+static bool handle_boot_request(const comms_packet_t* packet) {
+  if (!comms_is_single_byte_packet(packet, BL_PACKET_BOOT_REQ_DATA0)) {
+    return false;
+  }
+
+  if (ram_load) {
+    image_validated = validate_firmware_image(RAM_APP_START_ADDRESS, RAM_APP_MAX_LENGTH);
+  } else {
+    image_validated = validate_firmware_image(MAIN_APP_START_ADDRESS, MAX_FW_LENGTH);
+  }
+
+  comms_packet_t response;
+  memset(&response, 0xff, sizeof(comms_packet_t));
+  response.length = 2;
+  response.data[0] = BL_PACKET_BOOT_RES_DATA0;
+  response.data[1] = image_validated ? 1 : 0;
+  comms_write(&response);
+
+  if (image_validated) {
+    state = BL_State_Done;
+  }
+  return true;
+}
+
+static bool is_bus_chunk_received(const uint32_t chunk) {
+  return (bus_received[chunk / 8] & (1 << (chunk % 8))) != 0;
+}
+
+// Join a bus update: check the image is meant for this device, answer, and erase ready for the
+// broadcast data. Nothing else can be answered until the erase is done.
+static bool handle_bus_join_request(const comms_packet_t* packet) {
+  if (!is_packet_of_type(packet, BL_PACKET_BUS_JOIN_REQ_DATA0, 6)) {
+    return false;
+  }
+
+  const uint32_t length = read_u32(&packet->data[2]);
+  const bool accepted = (packet->data[1] == DEVICE_ID) && (length > 0) && (length <= MAX_FW_LENGTH);
+
+  comms_packet_t response;
+  memset(&response, 0xff, sizeof(comms_packet_t));
+  response.length = 2;
+  response.data[0] = BL_PACKET_BUS_JOIN_RES_DATA0;
+  response.data[1] = accepted ? 1 : 0;
+  comms_write(&response);
+
+  if (!accepted) {
+    state = BL_State_Done;
+    return true;
+  }
+
+  fw_length = length;
+  write_limit = length;
+  bus_chunk_count = (length + BL_BUS_CHUNK_SIZE - 1) / BL_BUS_CHUNK_SIZE;
+  bus_chunks_received = 0;
+  memset(bus_received, 0, sizeof(bus_received));
+
+  erase_sector = MAIN_APP_SECTOR_START;
+  state = BL_State_EraseApplication;
+  return true;
+}
+
+// Bus data is a 24-bit offset followed by one chunk of the image. Chunks come in any order, and
+// repairs are broadcast to every node, so each one is only written the first time it is seen.
+// Returns whether the packet was bus data at all, valid or not.
+static bool handle_bus_data(const comms_packet_t* packet) {
+  if ((packet->length < 5) || (packet->data[0] != BL_PACKET_BUS_DATA_DATA0)) {
+    return false;
+  }
+
+  const uint32_t offset = packet->data[1] | (packet->data[2] << 8) | (packet->data[3] << 16);
+  const uint32_t chunk = offset / BL_BUS_CHUNK_SIZE;
+  const uint8_t length = packet->length - 4;
+
+  if ((state != BL_State_BusReceive) || ((offset % BL_BUS_CHUNK_SIZE) != 0) || (chunk >= bus_chunk_count)) {
+    return true;
+  }
+
+  const uint32_t expected_length = (fw_length - offset) < BL_BUS_CHUNK_SIZE ? (fw_length - offset) : BL_BUS_CHUNK_SIZE;
+  if ((length != expected_length) || is_bus_chunk_received(chunk)) {
+    return true;
+  }
+
+  bl_flash_write(MAIN_APP_START_ADDRESS + offset, &packet->data[4], length);
+  bus_received[chunk / 8] |= 1 << (chunk % 8);
+  bus_chunks_received++;
+  return true;
+}
+
+// Report the chunks still missing, as (first chunk, count) ranges from the requested chunk on.
+// A response with BL_BUS_GAP_MAX_RANGES ranges may have more after it.
+static bool handle_bus_gap_request(const comms_packet_t* packet) {
+  if (!is_packet_of_type(packet, BL_PACKET_BUS_GAP_REQ_DATA0, 3)) {
+    return false;
+  }
+
+  uint8_t ranges[BL_BUS_GAP_MAX_RANGES * 4];
+  uint8_t range_count = 0;
+  uint32_t chunk = packet->data[1] | (packet->data[2] << 8);
+
+  while ((chunk < bus_chunk_count) && (range_count < BL_BUS_GAP_MAX_RANGES)) {
+    if (is_bus_chunk_received(chunk)) {
+      chunk++;
+      continue;
+    }
+
+    const uint32_t first = chunk;
+    while ((chunk < bus_chunk_count) && !is_bus_chunk_received(chunk) && ((chunk - first) < 0xffff)) {
+      chunk++;
+    }
+
+    uint8_t* range = &ranges[range_count * 4];
+    range[0] = first & 0xff;
+    range[1] = (first >> 8) & 0xff;
+    range[2] = (chunk - first) & 0xff;
+    range[3] = ((chunk - first) >> 8) & 0xff;
+    range_count++;
+  }
+
+  const uint32_t missing = bus_chunk_count - bus_chunks_received;
+
+  comms_packet_t response;
+  memset(&response, 0xff, sizeof(comms_packet_t));
+  response.length = 4;
+  response.data[0] = BL_PACKET_BUS_GAP_RES_DATA0;
+  response.data[1] = missing & 0xff;
+  response.data[2] = (missing >> 8) & 0xff;
+  response.data[3] = range_count;
+  comms_write_large_frame(&response, ranges, range_count * 4);
+  return true;
+}
+
+// Diagnostics are answered in any state after sync, and never change anything that matters to
+// the update itself
+static bool handle_diagnostic_request(const comms_packet_t* packet) {
+  if ((packet->length < 2) || (packet->data[0] != BL_PACKET_DIAG_REQ_DATA0)) {
+    return false;
+  }
+
+  comms_packet_t response;
+  memset(&response, 0xff, sizeof(comms_packet_t));
+  response.data[0] = BL_PACKET_DIAG_RES_DATA0;
+  response.data[1] = packet->data[1];
+
+  // Each group of requests is only built in along with what it reads out
+  switch (packet->data[1]) {
+#if TRACE_ENABLED
+    case BL_DIAG_TRACE: {
+      trace_record_t records[BL_READ_MAX_LENGTH / sizeof(trace_record_t)];
+      uint32_t dropped = 0;
+      const uint32_t count = trace_read(records, BL_READ_MAX_LENGTH / sizeof(trace_record_t), &dropped);
+
+      response.length = 7;
+      write_u32(&response.data[2], dropped);
+      response.data[6] = count;
+      comms_write_large_frame(&response, (const uint8_t*)records, count * sizeof(trace_record_t));
+    } break;
+
+    case BL_DIAG_TRACE_DRAIN: {
+      comms_set_trace_drain(packet->data[2] == 1);
+      response.length = 2;
+      comms_write_large_frame(&response, NULL, 0);
+    } break;
+#endif
+
+#if PROFILE_ENABLED
+    case BL_DIAG_PROFILE: {
+      const uint8_t index = packet->data[2];
+      const profile_scope_t* scope = system_profile_get_scope(index);
+      uint8_t payload[BL_DIAG_PROFILE_LENGTH] = {0};
+
+      if (scope != NULL) {
+        strncpy((char*)payload, scope->name, BL_DIAG_PROFILE_NAME_LENGTH - 1);
+        uint8_t* stats = &payload[BL_DIAG_PROFILE_NAME_LENGTH];
+        write_u32(&stats[0], scope->count);
+        write_u32(&stats[4], scope->min);
+        write_u32(&stats[8], scope->max);
+        write_u32(&stats[12], (uint32_t)scope->total);
+        write_u32(&stats[16], (uint32_t)(scope->total >> 32));
+        for (uint32_t i = 0; i < PROFILE_HISTOGRAM_BINS; i++) {
+          write_u32(&stats[20 + (i * 4)], scope->histogram[i]);
+        }
+      }
+
+      response.length = 4;
+      response.data[2] = index;
+      response.data[3] = system_profile_scope_count();
+      comms_write_large_frame(&response, payload, (scope != NULL) ? sizeof(payload) : 0);
+    } break;
+
+    case BL_DIAG_PROFILE_RESET: {
+      system_profile_reset();
+      response.length = 2;
+      comms_write_large_frame(&response, NULL, 0);
+    } break;
+
+    case BL_DIAG_UART_LATENCY: {
+      // The host starts sending filler bytes once this request is acknowledged
+      comms_flush_ack();
+      const uint32_t taken = uart_measure_rx_latency(packet->data[2], BL_DIAG_UART_LATENCY_TIMEOUT);
+
+      response.length = 3;
+      response.data[2] = taken;
+      comms_write_large_frame(&response, NULL, 0);
+    } break;
+#endif
+
+#if DIAGNOSTICS_ENABLED
+    case BL_DIAG_BOOT_TIMELINE: {
+      const boot_timeline_t* timeline = boot_timeline_get(packet->data[2] == 1);
+      const uint32_t count = (timeline->magic == BOOT_TIMELINE_MAGIC) ? timeline->count : 0;
+
+      response.length = 8;
+      response.data[2] = packet->data[2];
+      response.data[3] = count;
+      write_u32(&response.data[4], timeline->version);
+      comms_write_large_frame(&response, (const uint8_t*)timeline->events, count * sizeof(boot_event_t));
+    } break;
+
+    case BL_DIAG_LINK_STATS: {
+      const comms_link_stats_t* stats = comms_get_link_stats();
+      uint8_t payload[sizeof(comms_link_stats_t)];
+
+      write_u32(&payload[0], stats->crc_errors);
+      write_u32(&payload[4], stats->fec_corrections);
+      write_u32(&payload[8], stats->retransmits);
+      write_u32(&payload[12], stats->rto);
+
+      response.length = 2;
+      comms_write_large_frame(&response, payload, sizeof(payload));
+    } break;
+
+    case BL_DIAG_PC_HISTOGRAM: {
+      const pc_histogram_t* histogram = system_pc_histogram_get();
+      const uint8_t chunk = packet->data[2];
+      const uint8_t chunks = (histogram != NULL) ? (PC_HISTOGRAM_BUCKETS / BL_DIAG_PC_HISTOGRAM_CHUNK) : 0;
+
+      response.length = BL_DIAG_PC_HISTOGRAM_LENGTH;
+      response.data[2] = chunk;
+      response.data[3] = chunks;
+      if (chunk >= chunks) {
+        comms_write_large_frame(&response, NULL, 0);
+        break;
+      }
+
+      write_u32(&response.data[4], histogram->start);
+      response.data[8] = histogram->shift;
+      write_u32(&response.data[9], histogram->outside);
+      comms_write_large_frame(&response, (const uint8_t*)&histogram->counts[chunk * BL_DIAG_PC_HISTOGRAM_CHUNK],
+                              BL_DIAG_PC_HISTOGRAM_CHUNK * sizeof(uint16_t));
+    } break;
+
+    case BL_DIAG_MEMORY: {
+      memory_map_t map;
+      memory_get_map(&map);
+      const buffer_usage_t buffers[BL_DIAG_MEMORY_BUFFERS] = {
+        uart_rx_usage(), uart_tx_usage(), usb_cdc_rx_usage(), comms_packet_buffer_usage(),
+      };
+      uint8_t payload[BL_DIAG_MEMORY_LENGTH];
+
+      write_u32(&payload[0], map.ram_start);
+      write_u32(&payload[4], map.ram_size);
+      write_u32(&payload[8], map.noinit_size);
+      write_u32(&payload[12], map.data_size);
+      write_u32(&payload[16], map.bss_size);
+      write_u32(&payload[20], map.stack_size);
+      write_u32(&payload[24], memory_stack_peak());
+      for (uint32_t i = 0; i < BL_DIAG_MEMORY_BUFFERS; i++) {
+        write_u32(&payload[28 + (i * 12)], buffers[i].capacity);
+        write_u32(&payload[32 + (i * 12)], buffers[i].peak);
+        write_u32(&payload[36 + (i * 12)], buffers[i].overflows);
+      }
+
+      response.length = 3;
+      response.data[2] = BL_DIAG_MEMORY_BUFFERS;
+      comms_write_large_frame(&response, payload, sizeof(payload));
+
+      // What's in use right now (this call included) stays marked, so the new mark starts from here
+      if (packet->data[2] == 1) {
+        uart_reset_usage();
+        usb_cdc_reset_usage();
+        comms_reset_usage();
+        memory_paint_stack();
+      }
+    } break;
+#endif
+
+    case BL_DIAG_BENCH: {
+      response.length = BL_DIAG_BENCH_LENGTH;
+#if BENCH_ENABLED
+      // The erase keeps the main loop busy for a while
+      comms_flush_ack();
+      bench_results_t results;
+      bench_run(&results);
+
+      response.data[2] = 1;
+      comms_write_large_frame(&response, (const uint8_t*)&results, sizeof(results));
+#else
+      response.data[2] = 0;
+      comms_write_large_frame(&response, NULL, 0);
+#endif
+    } break;
+
+    default: {
+      response.length = 3;
+      response.data[1] = BL_DIAG_UNSUPPORTED;
+      response.data[2] = packet->data[1];
+      comms_write_large_frame(&response, NULL, 0);
+    }
+  }
+
+  return true;
+}
+
+// Either just the length, or the length and the number of extents that follow for a sparse image
 static bool is_fw_length_packet(const comms_packet_t* packet) {
-  if (packet->length != 5) {
+  if ((packet->length != 5) && (packet->length != 6)) {
     return false;
   }
 
@@ -177,7 +772,7 @@ static bool is_fw_length_packet(const comms_packet_t* packet) {
     return false;
   }
 
-  for (uint8_t i = 5; i < PACKET_DATA_LENGTH; i++) {
+  for (uint8_t i = packet->length; i < PACKET_DATA_LENGTH; i++) {
     if (packet->data[i] != 0xff) {
       return false;
     }
@@ -187,35 +782,73 @@ static bool is_fw_length_packet(const comms_packet_t* packet) {
 }
 
 int main(void) {
+  boot_timeline_begin();
+  handoff_begin();
+
+  // Interrupts must not fetch their vectors from flash while it is being erased
+  system_relocate_vector_table();
   system_setup();
+  memory_paint_stack();
+  boot_timeline_mark(BootPhase_BootloaderSystemSetup);
+  trace_setup();
   gpio_setup();
+  // First, as it can move the clocks on to the HSE
+  usb_cdc_setup();
   uart_setup();
-  comms_setup();
+  (void)uart_use_rx_buffer((uint8_t*)RAM_APP_START_ADDRESS, UART_ERASE_RX_BUFFER_SIZE);
+  comms_setup(&uart_transport);
+  comms_set_node_id(get_node_id());
+  boot_timeline_mark(BootPhase_BootloaderPeripheralSetup);
 
   simple_timer_setup(&timer, DEFAULT_TIMEOUT, false);
 
+  bl_state_t last_state = state;
   while (state != BL_State_Done) {
+    if (state != last_state) {
+      TRACE("bl: state %u -> %u", last_state, state);
+      last_state = state;
+    }
+
     if (state == BL_State_Sync) {
-      if (uart_data_available()) {
-        sync_seq[0] = sync_seq[1];
-        sync_seq[1] = sync_seq[2];
-        sync_seq[2] = sync_seq[3];
-        sync_seq[3] = uart_read_byte();
-
-        bool is_match = sync_seq[0] == SYNC_SEQ_0;
-        is_match = is_match && (sync_seq[1] == SYNC_SEQ_1);
-        is_match = is_match && (sync_seq[2] == SYNC_SEQ_2);
-        is_match = is_match && (sync_seq[3] == SYNC_SEQ_3);
-
-        if (is_match) {
+      for (uint8_t i = 0; (i < NUM_TRANSPORTS) && (state == BL_State_Sync); i++) {
+        uint8_t* window = sync_seq[i];
+        uint8_t byte = 0;
+        if (transports[i]->read(&byte, 1) == 0) {
+          continue;
+        }
+
+        window[0] = window[1];
+        window[1] = window[2];
+        window[2] = window[3];
+        window[3] = byte;
+
+        bool is_match = window[0] == SYNC_SEQ_0;
+        is_match = is_match && (window[1] == SYNC_SEQ_1);
+        is_match = is_match && (window[2] == SYNC_SEQ_2);
+
+        if (is_match && (window[3] == SYNC_SEQ_3)) {
+          TRACE("bl: sync on transport %u", i, 0);
+          boot_timeline_mark(BootPhase_BootloaderSynced);
+          handoff_flags |= HANDOFF_FLAG_SYNCED;
+          synced_transport = transports[i];
+          comms_setup(transports[i]);
           comms_create_single_byte_packet(&temp_packet, BL_PACKET_SYNC_OBSERVED_DATA0);
           comms_write(&temp_packet);
           simple_timer_reset(&timer);
           state = BL_State_WaitForUpdateReq;
-        } else {
-          check_for_timeout();
+        } else if (is_match && (window[3] == SYNC_SEQ_3_BUS)) {
+          TRACE("bl: bus sync on transport %u", i, 0);
+          boot_timeline_mark(BootPhase_BootloaderSynced);
+          handoff_flags |= HANDOFF_FLAG_SYNCED;
+          synced_transport = transports[i];
+          comms_setup(transports[i]);
+          bus_mode = true;
+          simple_timer_setup(&timer, BUS_TIMEOUT, false);
+          state = BL_State_WaitForUpdateReq;
         }
-      } else {
+      }
+
+      if (state == BL_State_Sync) {
         check_for_timeout();
       }
 
@@ -229,11 +862,17 @@ int main(void) {
         if (comms_packets_available()) {
           comms_read(&temp_packet);
 
-          if (comms_is_single_byte_packet(&temp_packet, BL_PACKET_FW_UPDATE_REQ_DATA0)) {
+          const bool is_delta = comms_is_single_byte_packet(&temp_packet, BL_PACKET_DELTA_UPDATE_REQ_DATA0);
+          if (is_delta || comms_is_single_byte_packet(&temp_packet, BL_PACKET_FW_UPDATE_REQ_DATA0)) {
             simple_timer_reset(&timer);
+            delta_update = is_delta;
             comms_create_single_byte_packet(&temp_packet, BL_PACKET_FW_UPDATE_RES_DATA0);
             comms_write(&temp_packet);
             state = BL_State_DeviceIDReq;
+          } else if (handle_bus_join_request(&temp_packet) || handle_ram_load_request(&temp_packet)) {
+            simple_timer_reset(&timer);
+          } else if (handle_inspection_request(&temp_packet) || handle_diagnostic_request(&temp_packet) || handle_boot_request(&temp_packet)) {
+            simple_timer_reset(&timer);
           } else {
             bootloading_fail();
           }
@@ -283,7 +922,47 @@ int main(void) {
           );
 
           if (is_fw_length_packet(&temp_packet) && (fw_length <= MAX_FW_LENGTH)) {
-            state = BL_State_EraseApplication;
+            write_limit = fw_length;
+            erase_sector = MAIN_APP_SECTOR_START;
+            if (temp_packet.length == 5) {
+              set_dense_extent(fw_length);
+              state = BL_State_EraseApplication;
+            } else if ((temp_packet.data[5] > 0) && (temp_packet.data[5] <= BL_MAX_EXTENTS)) {
+              extent_count = temp_packet.data[5];
+              extents_received = 0;
+              simple_timer_reset(&timer);
+              state = BL_State_ReceiveExtents;
+            } else {
+              bootloading_fail();
+            }
+          } else {
+            bootloading_fail();
+          }
+        } else {
+          check_for_timeout();
+        }
+      } break;
+
+      case BL_State_ReceiveExtents: {
+        if (comms_packets_available()) {
+          comms_read(&temp_packet);
+
+          // Extents have to be in order and can't overlap, which is what lets the write position
+          // only ever move forwards through them
+          const uint32_t previous_end = (extents_received == 0) ? 0 : (extents[extents_received - 1].offset + extents[extents_received - 1].length);
+          const uint32_t offset = read_u32(&temp_packet.data[1]);
+          const uint32_t length = read_u32(&temp_packet.data[5]);
+          const bool valid = is_packet_of_type(&temp_packet, BL_PACKET_EXTENT_DATA0, 9) &&
+            (length > 0) && (offset >= previous_end) && (offset <= fw_length) && (length <= (fw_length - offset));
+
+          if (valid) {
+            extents[extents_received].offset = offset;
+            extents[extents_received].length = length;
+            extents_received++;
+            simple_timer_reset(&timer);
+            if (extents_received == extent_count) {
+              state = BL_State_EraseApplication;
+            }
           } else {
             bootloading_fail();
           }
@@ -293,10 +972,32 @@ int main(void) {
       } break;
 
       case BL_State_EraseApplication: {
-        bl_flash_erase_main_application();
+        // Nothing to do until the first sector rewrite comes in
+        if (delta_update) {
+          TRACE("bl: delta update of %u bytes", fw_length, 0);
+          simple_timer_reset(&timer);
+          state = BL_State_Verify;
+          break;
+        }
+
+        // Whatever the host streams meanwhile waits in the UART ring, and then the packet buffer
+        if (erase_sector <= MAIN_APP_SECTOR_END) {
+          comms_flush_ack();
+          bl_flash_erase_main_application_sector(erase_sector);
+          erase_sector++;
+          simple_timer_reset(&timer);
+          break;
+        }
+
+        simple_timer_reset(&timer);
+        if (bus_mode) {
+          state = BL_State_BusReceive;
+          break;
+        }
+
+        seek(0);
         comms_create_single_byte_packet(&temp_packet, BL_PACKET_READY_FOR_DATA_DATA0);
         comms_write(&temp_packet);
-        simple_timer_reset(&timer);
         state = BL_State_ReceiveFirmware;
       } break;
 
@@ -304,18 +1005,74 @@ int main(void) {
         if (comms_packets_available()) {
           comms_read(&temp_packet);
 
-          const uint8_t packet_length = (temp_packet.length & 0x0f) + 1;
-          bl_flash_write(MAIN_APP_START_ADDRESS + bytes_written, temp_packet.data, packet_length);
-          bytes_written += packet_length;
+          // The link layer delivers each data packet exactly once and in order, so the host can
+          // stream them back to back without waiting for a ready-for-data each time. A packet
+          // carries the next bytes of the extents, and so can span the gap between two of them.
+          const uint8_t packet_length = temp_packet.length;
+          uint8_t consumed = 0;
+          while ((consumed < packet_length) && (bytes_written < write_limit)) {
+            uint32_t run_end = extents[extent_index].offset + extents[extent_index].length;
+            if (run_end > write_limit) {
+              run_end = write_limit;
+            }
+            uint32_t run = packet_length - consumed;
+            if (run > (run_end - bytes_written)) {
+              run = run_end - bytes_written;
+            }
+
+            if (ram_load) {
+              memcpy((void*)(RAM_APP_START_ADDRESS + bytes_written), &temp_packet.data[consumed], run);
+            } else {
+              bl_flash_write(MAIN_APP_START_ADDRESS + bytes_written, &temp_packet.data[consumed], run);
+            }
+            consumed += run;
+            bytes_written += run;
+            skip_to_extent();
+          }
           simple_timer_reset(&timer);
 
-          if (bytes_written >= fw_length) {
+          if (bytes_written >= write_limit) {
             comms_create_single_byte_packet(&temp_packet, BL_PACKET_UPDATE_SUCCESSFUL_DATA0);
             comms_write(&temp_packet);
-            state = BL_State_Done;
+            state = BL_State_Verify;
+          }
+        } else {
+          check_for_timeout();
+        }
+      } break;
+
+      case BL_State_BusReceive: {
+        if (comms_packets_available()) {
+          comms_read(&temp_packet);
+
+          if (handle_bus_data(&temp_packet)) {
+            simple_timer_reset(&timer);
+            if (bus_chunks_received == bus_chunk_count) {
+              state = BL_State_Verify;
+            }
+          } else if (handle_bus_gap_request(&temp_packet) || handle_inspection_request(&temp_packet) || handle_diagnostic_request(&temp_packet)) {
+            simple_timer_reset(&timer);
           } else {
-            comms_create_single_byte_packet(&temp_packet, BL_PACKET_READY_FOR_DATA_DATA0);
-            comms_write(&temp_packet);
+            bootloading_fail();
+          }
+        } else {
+          check_for_timeout();
+        }
+      } break;
+
+      case BL_State_Verify: {
+        if (comms_packets_available()) {
+          comms_read(&temp_packet);
+
+          if (handle_inspection_request(&temp_packet) || handle_diagnostic_request(&temp_packet) || handle_boot_request(&temp_packet)) {
+            simple_timer_reset(&timer);
+          } else if (handle_bus_data(&temp_packet) || handle_bus_gap_request(&temp_packet)) {
+            // Repairs for other nodes on the bus, or a last gap poll
+            simple_timer_reset(&timer);
+          } else if (handle_sector_rewrite_request(&temp_packet)) {
+            simple_timer_reset(&timer);
+          } else {
+            bootloading_fail();
           }
         } else {
           check_for_timeout();
@@ -329,13 +1086,41 @@ int main(void) {
 
   }
 
+  boot_timeline_mark(BootPhase_BootloaderLoopDone);
+
+  // A lost response is only sent again while comms runs, so keep it going until the host has
+  // acknowledged everything, or given up
+  simple_timer_setup(&timer, LINGER_TIMEOUT, false);
+  while (comms_tx_pending() && !simple_timer_has_elapsed(&timer)) {
+    comms_update();
+  }
+
   system_delay(150);
   uart_teardown();
+  usb_cdc_teardown();
   gpio_teardown();
   system_teardown();
+  boot_timeline_mark(BootPhase_BootloaderTeardown);
+
+  // A RAM image that was loaded and validated runs instead of the application in flash. Anything
+  // else falls back to the application, if that's valid.
+  uint32_t app_address = MAIN_APP_START_ADDRESS;
+  if (image_validated && ram_load) {
+    app_address = RAM_APP_START_ADDRESS;
+    handoff_flags |= HANDOFF_FLAG_RAM_IMAGE;
+  } else if (!image_validated) {
+    image_validated = validate_firmware_image(MAIN_APP_START_ADDRESS, MAX_FW_LENGTH);
+  }
 
-  if (validate_firmware_image()) {
-    jump_to_main();
+  if (image_validated) {
+    // The clocks are left as they are, for the app to pick up where the bootloader left off
+    if (!ram_load && ((bytes_written > 0) || (bus_chunks_received > 0))) {
+      handoff_flags |= HANDOFF_FLAG_UPDATED;
+    }
+    const firmware_info_t* firmware_info = (const firmware_info_t*)(app_address + FWINFO_OFFSET);
+    handoff_publish(system_get_clock_config(), firmware_info->version, handoff_flags);
+    boot_timeline_mark(BootPhase_BootloaderJump);
+    jump_to_app(app_address);
   } else {
     scb_reset_core();
   }
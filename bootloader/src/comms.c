@@ -1,28 +1,68 @@
 #include <string.h>
 #include "comms.h"
-#include "core/uart.h"
+#include "fec.h"
 #include "core/crc.h"
+#include "core/system.h"
+#include "core/trace.h"
 
 #define PACKET_BUFFER_LENGTH (8)
+#define WINDOW_MASK          (COMMS_WINDOW_SIZE - 1)
+#define ACK_BITMAP_BITS      (16)
 
 typedef enum comms_state_t {
+  CommsState_SOF,
+  CommsState_Address,
+  CommsState_Seq,
   CommsState_Length,
   CommsState_Data,
   CommsState_CRC,
+  CommsState_Parity,
 } comms_state_t;
 
-static comms_state_t state = CommsState_Length;
+// A sent frame kept until it is acknowledged, so it can be selectively retransmitted
+typedef struct tx_slot_t {
+  comms_packet_t packet;
+  uint64_t sent_at;
+  bool acked;
+  bool retransmitted;
+} tx_slot_t;
+
+static comms_state_t state = CommsState_SOF;
 static uint8_t data_byte_count = 0;
+static uint8_t parity[FEC_PARITY_BYTES];
+static uint8_t parity_byte_count = 0;
+
+static comms_packet_t temporary_packet = { .address = 0, .seq = 0, .length = 0, .data = {0}, .crc = 0 };
+static uint8_t node_id = COMMS_ADDR_ANY;
+static const transport_t* transport = NULL;
+static bool trace_drain_enabled = false;
+static comms_link_stats_t link_stats = {0};
+static uint64_t next_trace_drain_time = 0;
+
+// Transmit side: frames tx_base_seq..tx_next_seq-1 are in flight
+static tx_slot_t tx_window[COMMS_WINDOW_SIZE];
+static uint8_t tx_base_seq = 0;
+static uint8_t tx_next_seq = 0;
 
-static comms_packet_t temporary_packet = { .length = 0, .data = {0}, .crc = 0 };
-static comms_packet_t retx_packet = { .length = 0, .data = {0}, .crc = 0 };
-static comms_packet_t ack_packet = { .length = 0, .data = {0}, .crc = 0 };
-static comms_packet_t last_transmitted_packet = { .length = 0, .data = {0}, .crc = 0 };
+// Smoothed RTT and its variance, in ms, kept x8 and x4 so that the filter gains are shifts
+static bool rtt_sampled = false;
+static int32_t srtt_x8 = 0;
+static int32_t rttvar_x4 = 0;
+static uint32_t rto = COMMS_RTO_INITIAL;
+
+// Receive side: rx_next_seq is the oldest frame not yet delivered. Frames after it that arrived
+// early are held in rx_window until the gap is filled.
+static comms_packet_t rx_window[COMMS_WINDOW_SIZE];
+static bool rx_window_valid[COMMS_WINDOW_SIZE];
+static uint8_t rx_next_seq = 0;
+static uint8_t frames_since_ack = 0;
+static uint64_t ack_due_time = 0;
 
 static comms_packet_t packet_buffer[PACKET_BUFFER_LENGTH];
 static uint32_t packet_read_index = 0;
 static uint32_t packet_write_index = 0;
 static uint32_t packet_buffer_mask = PACKET_BUFFER_LENGTH - 1;
+static buffer_usage_t packet_buffer_usage = { .capacity = PACKET_BUFFER_LENGTH - 1 };
 
 bool comms_is_single_byte_packet(const comms_packet_t* packet, uint8_t byte) {
   if (packet->length != 1) {
@@ -46,66 +86,465 @@ void comms_create_single_byte_packet(comms_packet_t* packet, uint8_t byte) {
   memset(packet, 0xff, sizeof(comms_packet_t));
   packet->length = 1;
   packet->data[0] = byte;
-  packet->crc = comms_compute_crc(packet);
 }
 
-void comms_setup(void) {
-  comms_create_single_byte_packet(&retx_packet, PACKET_RETX_DATA0);
-  comms_create_single_byte_packet(&ack_packet, PACKET_ACK_DATA0);
+// The whole frame goes to the transport in one write, so that a packet based link (like USB)
+// sends it as one packet rather than three
+static void write_frame(comms_packet_t* packet) {
+  uint8_t frame[PACKET_MAX_BYTES];
+  transport->write(frame, packet_encode(packet, frame));
+}
+
+// A large frame is an unsequenced header packet, followed directly by the raw payload length,
+// the payload bytes and their CRC32. Bulk transfers then pay the per-packet overhead once rather
+// than every 16 bytes. They aren't retransmitted by the link, the requester just asks again.
+static void write_large_frame(comms_packet_t* header, const uint8_t flags, const uint8_t* data, const uint32_t length) {
+  uint8_t frame[PACKET_LARGE_HEADER_BYTES];
+  header->address = COMMS_ADDR_FROM_NODE | node_id;
+  header->seq = 0;
+  header->length |= flags;
+  transport->write(frame, packet_encode_large_header(header, length, frame));
+  transport->write((uint8_t*)data, length);
+
+  uint8_t crc_bytes[PACKET_LARGE_CRC_BYTES];
+  packet_encode_large_crc(crc32(data, length), crc_bytes);
+  transport->write(crc_bytes, sizeof(crc_bytes));
+}
+
+static void send_ack(uint8_t type) {
+  comms_packet_t ack;
+  uint16_t bitmap = 0;
+
+  for (uint8_t i = 1; i < COMMS_WINDOW_SIZE; i++) {
+    if (rx_window_valid[(rx_next_seq + i) & WINDOW_MASK]) {
+      bitmap |= 1 << (i - 1);
+    }
+  }
+
+  memset(&ack, 0xff, sizeof(comms_packet_t));
+  ack.address = COMMS_ADDR_FROM_NODE | node_id;
+  ack.seq = 0;
+  ack.length = PACKET_FLAG_ACK | PACKET_ACK_LENGTH;
+  ack.data[0] = type;
+  ack.data[1] = rx_next_seq;
+  ack.data[2] = bitmap & 0xff;
+  ack.data[3] = (bitmap >> 8) & 0xff;
+  ack.crc = packet_compute_crc(&ack);
+  write_frame(&ack);
+  TRACE("comms: tx ack %02x, next seq %u", type, rx_next_seq);
+
+  frames_since_ack = 0;
+}
+
+static void transmit_slot(tx_slot_t* slot, uint64_t now) {
+  write_frame(&slot->packet);
+  slot->sent_at = now;
+}
+
+static void retransmit_slot(tx_slot_t* slot, uint64_t now) {
+  transmit_slot(slot, now);
+  slot->retransmitted = true;
+  link_stats.retransmits++;
+}
+
+// Only frames sent once are sampled, as there's no telling which copy of a resent one was ACKed.
+// An ACK can be held back for up to COMMS_ACK_DELAY, so the variance term never goes below that.
+static void rtt_sample(const uint32_t rtt) {
+  if (!rtt_sampled) {
+    srtt_x8 = (int32_t)rtt << 3;
+    rttvar_x4 = (int32_t)rtt << 1;
+    rtt_sampled = true;
+  } else {
+    int32_t error = (int32_t)rtt - (srtt_x8 >> 3);
+    srtt_x8 += error;
+    if (error < 0) {
+      error = -error;
+    }
+    rttvar_x4 += error - (rttvar_x4 >> 2);
+  }
+
+  rto = (uint32_t)((srtt_x8 >> 3) + ((rttvar_x4 > COMMS_ACK_DELAY) ? rttvar_x4 : COMMS_ACK_DELAY));
+  if (rto < COMMS_RTO_MIN) {
+    rto = COMMS_RTO_MIN;
+  } else if (rto > COMMS_RTO_MAX) {
+    rto = COMMS_RTO_MAX;
+  }
+}
+
+// Number of frames between two sequence numbers, in sequence space
+static uint8_t seq_distance(uint8_t from, uint8_t to) {
+  return (uint8_t)(to - from);
+}
+
+static void handle_ack(const comms_packet_t* ack) {
+  const uint8_t cumulative_seq = ack->data[1];
+  const uint16_t bitmap = ack->data[2] | (ack->data[3] << 8);
+  const uint8_t in_flight = seq_distance(tx_base_seq, tx_next_seq);
+  const uint64_t now = system_get_ticks();
+
+  TRACE("comms: rx ack, next seq %u, bitmap %04x", cumulative_seq, bitmap);
+
+  // Ignore anything that doesn't refer to the current window (e.g. a stale, delayed ACK)
+  if (seq_distance(tx_base_seq, cumulative_seq) > in_flight) {
+    return;
+  }
+
+  // Everything before the cumulative seq has been delivered. The newest of those that this is the
+  // first ACK for gives the RTT sample.
+  if (cumulative_seq != tx_base_seq) {
+    const tx_slot_t* newest = &tx_window[(uint8_t)(cumulative_seq - 1) & WINDOW_MASK];
+    if (!newest->acked && !newest->retransmitted) {
+      rtt_sample((uint32_t)(now - newest->sent_at));
+    }
+  }
+  tx_base_seq = cumulative_seq;
+
+  // Mark selectively acknowledged frames, and find the newest one the receiver holds
+  uint8_t highest_acked = 0;
+  for (uint8_t i = 0; i < ACK_BITMAP_BITS; i++) {
+    const uint8_t offset = i + 1;
+    if ((bitmap & (1 << i)) && (offset < seq_distance(tx_base_seq, tx_next_seq))) {
+      tx_window[(uint8_t)(tx_base_seq + offset) & WINDOW_MASK].acked = true;
+      highest_acked = offset;
+    }
+  }
+
+  // Frames before the newest acknowledged one were lost, as was the first one if asked for
+  uint8_t resend_up_to = highest_acked;
+  if ((ack->data[0] == PACKET_RETX_DATA0) && (resend_up_to == 0) && (tx_base_seq != tx_next_seq)) {
+    resend_up_to = 1;
+  }
+
+  for (uint8_t offset = 0; offset < resend_up_to; offset++) {
+    tx_slot_t* slot = &tx_window[(uint8_t)(tx_base_seq + offset) & WINDOW_MASK];
+    if (!slot->acked && ((now - slot->sent_at) >= COMMS_RETX_HOLDOFF)) {
+      TRACE("comms: resend seq %u (reported missing)", slot->packet.seq, 0);
+      retransmit_slot(slot, now);
+    }
+  }
+}
+
+// Frames that go unacknowledged for a whole RTO are sent again. The RTO then backs off until the
+// next sample, in case it's the round trip that got longer rather than a frame that was lost.
+static void check_retransmit_timeouts(void) {
+  const uint64_t now = system_get_ticks();
+  bool timed_out = false;
+
+  for (uint8_t seq = tx_base_seq; seq != tx_next_seq; seq++) {
+    tx_slot_t* slot = &tx_window[seq & WINDOW_MASK];
+    if (!slot->acked && ((now - slot->sent_at) >= rto)) {
+      TRACE("comms: resend seq %u (timed out, rto %u)", slot->packet.seq, rto);
+      retransmit_slot(slot, now);
+      timed_out = true;
+    }
+  }
+
+  if (timed_out) {
+    rto = (rto * 2 > COMMS_RTO_MAX) ? COMMS_RTO_MAX : rto * 2;
+  }
+}
+
+static void note_packet_buffer_peak(void) {
+  const uint32_t used = (packet_write_index - packet_read_index) & packet_buffer_mask;
+  if (used > packet_buffer_usage.peak) {
+    packet_buffer_usage.peak = used;
+  }
+}
+
+// Move in-order frames up to the application, as long as it has room for them
+static void deliver_received_frames(void) {
+  while (rx_window_valid[rx_next_seq & WINDOW_MASK]) {
+    uint32_t next_write_index = (packet_write_index + 1) & packet_buffer_mask;
+    if (next_write_index == packet_read_index) {
+      // Not acknowledged until it's delivered, so the sender will hold off
+      packet_buffer_usage.overflows++;
+      return;
+    }
+
+    memcpy(&packet_buffer[packet_write_index], &rx_window[rx_next_seq & WINDOW_MASK], sizeof(comms_packet_t));
+    packet_write_index = next_write_index;
+    note_packet_buffer_peak();
+    rx_window_valid[rx_next_seq & WINDOW_MASK] = false;
+    rx_next_seq++;
+
+    if (frames_since_ack++ == 0) {
+      ack_due_time = system_get_ticks() + COMMS_ACK_DELAY;
+    }
+  }
+}
+
+static void handle_frame(const comms_packet_t* packet) {
+  if (packet->length & PACKET_FLAG_ACK) {
+    handle_ack(packet);
+    return;
+  }
+
+  const uint8_t offset = seq_distance(rx_next_seq, packet->seq);
+  TRACE("comms: rx seq %u, length %u", packet->seq, packet->length);
+
+  if (offset >= COMMS_WINDOW_SIZE) {
+    // Already delivered, so our ACK must have been lost. Don't deliver it twice, just re-ACK.
+    send_ack(PACKET_ACK_DATA0);
+    return;
+  }
+
+  memcpy(&rx_window[packet->seq & WINDOW_MASK], packet, sizeof(comms_packet_t));
+  rx_window_valid[packet->seq & WINDOW_MASK] = true;
+
+  // Out of order: tell the sender about the gap straight away. Frames that are only waiting on
+  // earlier ones from the same read (or on room in the packet buffer) aren't a gap.
+  for (uint8_t i = 0; i < offset; i++) {
+    if (!rx_window_valid[(uint8_t)(rx_next_seq + i) & WINDOW_MASK]) {
+      send_ack(PACKET_ACK_DATA0);
+      return;
+    }
+  }
+}
+
+// Broadcasts go straight to the application. Nothing is sent back (every node would answer at
+// once), so one that doesn't fit is lost, and it's up to the application to find the gap.
+static void handle_broadcast_frame(const comms_packet_t* packet) {
+  if (packet->length & (PACKET_FLAG_ACK | PACKET_FLAG_LARGE)) {
+    return;
+  }
+
+  uint32_t next_write_index = (packet_write_index + 1) & packet_buffer_mask;
+  if (next_write_index == packet_read_index) {
+    packet_buffer_usage.overflows++;
+    return;
+  }
+
+  memcpy(&packet_buffer[packet_write_index], packet, sizeof(comms_packet_t));
+  packet_write_index = next_write_index;
+  note_packet_buffer_peak();
+}
+
+static bool is_addressed_to_us(const uint8_t address) {
+  return (address == node_id) || (address == COMMS_ADDR_ANY);
+}
+
+// A corrupted frame can't be used, and the address can't be trusted either. Only a frame that
+// looks like it was meant for us gets a retransmit request, or we'd talk over other nodes.
+static void reject_frame(const comms_packet_t* packet) {
+  TRACE("comms: crc error, address %02x, seq %u", packet->address, packet->seq);
+  link_stats.crc_errors++;
+  if (is_addressed_to_us(packet->address)) {
+    send_ack(PACKET_RETX_DATA0);
+  }
+}
+
+static void receive_frame(comms_packet_t* packet) {
+  if (packet->crc != packet_compute_crc(packet)) {
+    reject_frame(packet);
+    return;
+  }
+
+  // Past the link layer, a frame is the same however it was sent
+  packet->length &= ~PACKET_FLAG_FEC;
+
+  if (packet->address == COMMS_ADDR_BROADCAST) {
+    handle_broadcast_frame(packet);
+  } else if (is_addressed_to_us(packet->address)) {
+    handle_frame(packet);
+  }
+}
+
+// Put right a frame with one wrong byte, using the parity that follows it. The CRC is still
+// checked afterwards, which catches the rare frame with more errors that looks like it has one. A
+// wrong length byte can't be corrected, as the frame was already read with it.
+static bool correct_frame(comms_packet_t* packet) {
+  uint8_t codeword[3 + PACKET_DATA_LENGTH + PACKET_CRC_BYTES + FEC_PARITY_BYTES];
+  const uint8_t data_length = packet->length & PACKET_LENGTH_MASK;
+  const uint8_t length = 3 + data_length + PACKET_CRC_BYTES + FEC_PARITY_BYTES;
+
+  codeword[0] = packet->address;
+  codeword[1] = packet->seq;
+  codeword[2] = packet->length;
+  memcpy(&codeword[3], packet->data, data_length);
+  codeword[3 + data_length] = packet->crc;
+  memcpy(&codeword[3 + data_length + PACKET_CRC_BYTES], parity, FEC_PARITY_BYTES);
+
+  const fec_result_t result = fec_correct(codeword, length);
+  if (result == FecResult_Uncorrectable) {
+    return false;
+  }
+
+  if (result == FecResult_Corrected) {
+    if (codeword[2] != packet->length) {
+      return false;
+    }
+    packet->address = codeword[0];
+    packet->seq = codeword[1];
+    memcpy(packet->data, &codeword[3], data_length);
+    packet->crc = codeword[3 + data_length];
+    link_stats.fec_corrections++;
+    TRACE("comms: fec corrected seq %u", packet->seq, 0);
+  }
+
+  return true;
+}
+
+void comms_set_node_id(const uint8_t id) {
+  node_id = id;
+}
+
+uint8_t comms_get_node_id(void) {
+  return node_id;
+}
+
+// Trace records go out as large link control frames, which the host strips out of the stream.
+// Nothing here is traced, or draining would keep itself busy.
+static void drain_trace(void) {
+  if (!trace_drain_enabled || (system_get_ticks() < next_trace_drain_time) || (trace_pending() == 0)) {
+    return;
+  }
+  next_trace_drain_time = system_get_ticks() + COMMS_TRACE_INTERVAL;
+
+  trace_record_t records[COMMS_TRACE_BATCH];
+  uint32_t dropped = 0;
+  const uint32_t count = trace_read(records, COMMS_TRACE_BATCH, &dropped);
+
+  comms_packet_t header;
+  memset(&header, 0xff, sizeof(comms_packet_t));
+  header.length = PACKET_TRACE_LENGTH;
+  header.data[0] = PACKET_TRACE_DATA0;
+  header.data[1] = count;
+  header.data[2] = dropped > 0xffff ? 0xff : (dropped & 0xff);
+  header.data[3] = dropped > 0xffff ? 0xff : ((dropped >> 8) & 0xff);
+  write_large_frame(&header, PACKET_FLAG_ACK | PACKET_FLAG_LARGE, (const uint8_t*)records, count * sizeof(trace_record_t));
+}
+
+const comms_link_stats_t* comms_get_link_stats(void) {
+  link_stats.rto = rto;
+  return &link_stats;
+}
+
+void comms_set_trace_drain(const bool enabled) {
+  trace_drain_enabled = enabled;
+}
+
+void comms_setup(const transport_t* link) {
+  transport = link;
+  state = CommsState_SOF;
+  tx_base_seq = 0;
+  tx_next_seq = 0;
+  rx_next_seq = 0;
+  frames_since_ack = 0;
+  memset(rx_window_valid, 0, sizeof(rx_window_valid));
+  rtt_sampled = false;
+  rto = COMMS_RTO_INITIAL;
 }
 
 void comms_update(void) {
-  while (uart_data_available()) {
+  PROFILE_BEGIN("comms_update");
+  uint8_t byte = 0;
+  while (transport->read(&byte, 1) == 1) {
+
     switch (state) {
-      case CommsState_Length: {
-        temporary_packet.length = uart_read_byte();
-        state = CommsState_Data;
+      case CommsState_SOF: {
+        if (byte == PACKET_SOF) {
+          state = CommsState_Address;
+        }
       } break;
 
-      case CommsState_Data: {
-        temporary_packet.data[data_byte_count++] = uart_read_byte();
-        if (data_byte_count >= PACKET_DATA_LENGTH) {
-          data_byte_count = 0;
-          state = CommsState_CRC;
-        }
+      case CommsState_Address: {
+        temporary_packet.address = byte;
+        state = CommsState_Seq;
       } break;
 
-      case CommsState_CRC: {
-        temporary_packet.crc = uart_read_byte();
+      case CommsState_Seq: {
+        temporary_packet.seq = byte;
+        state = CommsState_Length;
+      } break;
 
-        if (temporary_packet.crc != comms_compute_crc(&temporary_packet)) {
-          comms_write(&retx_packet);
-          state = CommsState_Length;
+      case CommsState_Length: {
+        // Large frames only ever travel from the device to the host
+        if (((byte & PACKET_LENGTH_MASK) > PACKET_DATA_LENGTH) || (byte & PACKET_FLAG_LARGE)) {
+          state = CommsState_SOF;
           break;
         }
 
-        if (comms_is_single_byte_packet(&temporary_packet, PACKET_RETX_DATA0)) {
-          comms_write(&last_transmitted_packet);
-          state = CommsState_Length;
-          break;
-        }
+        temporary_packet.length = byte;
+        memset(temporary_packet.data, 0xff, PACKET_DATA_LENGTH);
+        data_byte_count = 0;
+        state = (byte & PACKET_LENGTH_MASK) ? CommsState_Data : CommsState_CRC;
+      } break;
 
-        if (comms_is_single_byte_packet(&temporary_packet, PACKET_ACK_DATA0)) {
-          state = CommsState_Length;
-          break;
+      case CommsState_Data: {
+        temporary_packet.data[data_byte_count++] = byte;
+        if (data_byte_count >= (temporary_packet.length & PACKET_LENGTH_MASK)) {
+          state = CommsState_CRC;
         }
+      } break;
 
-        uint32_t next_write_index = (packet_write_index + 1) & packet_buffer_mask;
-        if (next_write_index == packet_read_index) {
-          __asm__("BKPT #0");
+      case CommsState_CRC: {
+        temporary_packet.crc = byte;
+        if (temporary_packet.length & PACKET_FLAG_FEC) {
+          parity_byte_count = 0;
+          state = CommsState_Parity;
+        } else {
+          state = CommsState_SOF;
+          receive_frame(&temporary_packet);
         }
+      } break;
 
-        memcpy(&packet_buffer[packet_write_index], &temporary_packet, sizeof(comms_packet_t));
-        packet_write_index = next_write_index;
-        comms_write(&ack_packet);
-        state = CommsState_Length;
+      case CommsState_Parity: {
+        parity[parity_byte_count++] = byte;
+        if (parity_byte_count >= FEC_PARITY_BYTES) {
+          state = CommsState_SOF;
+          if (correct_frame(&temporary_packet)) {
+            receive_frame(&temporary_packet);
+          } else {
+            reject_frame(&temporary_packet);
+          }
+        }
       } break;
 
       default: {
-        state = CommsState_Length;
+        state = CommsState_SOF;
       }
     }
   }
+
+  deliver_received_frames();
+
+  if (frames_since_ack >= COMMS_ACK_EVERY) {
+    send_ack(PACKET_ACK_DATA0);
+  } else if ((frames_since_ack > 0) && (system_get_ticks() >= ack_due_time)) {
+    send_ack(PACKET_ACK_DATA0);
+  }
+
+  check_retransmit_timeouts();
+  drain_trace();
+  PROFILE_END();
+}
+
+// Acknowledge everything delivered so far right away. Called before anything that keeps the main
+// loop busy for a long time (like a flash erase), so that the sender doesn't retransmit meanwhile.
+void comms_flush_ack(void) {
+  deliver_received_frames();
+  if (frames_since_ack > 0) {
+    send_ack(PACKET_ACK_DATA0);
+  }
+}
+
+// Whether any frame sent is still waiting to be acknowledged
+bool comms_tx_pending(void) {
+  for (uint8_t seq = tx_base_seq; seq != tx_next_seq; seq++) {
+    if (!tx_window[seq & WINDOW_MASK].acked) {
+      return true;
+    }
+  }
+  return false;
+}
+
+buffer_usage_t comms_packet_buffer_usage(void) {
+  return packet_buffer_usage;
+}
+
+void comms_reset_usage(void) {
+  packet_buffer_usage.peak = 0;
+  packet_buffer_usage.overflows = 0;
 }
 
 bool comms_packets_available(void) {
@@ -113,15 +552,29 @@ bool comms_packets_available(void) {
 }
 
 void comms_write(comms_packet_t* packet) {
-  uart_write((uint8_t*)packet, PACKET_LENGTH);
-  memcpy(&last_transmitted_packet, packet, sizeof(comms_packet_t));
+  // If the window is full, the oldest frame is given up on. Responses are one per request, so
+  // this only happens if the host has stopped acknowledging altogether.
+  if (seq_distance(tx_base_seq, tx_next_seq) >= COMMS_WINDOW_SIZE) {
+    tx_base_seq++;
+  }
+
+  packet->address = COMMS_ADDR_FROM_NODE | node_id;
+  packet->seq = tx_next_seq++;
+  packet->crc = packet_compute_crc(packet);
+  TRACE("comms: tx seq %u, length %u", packet->seq, packet->length);
+
+  tx_slot_t* slot = &tx_window[packet->seq & WINDOW_MASK];
+  memcpy(&slot->packet, packet, sizeof(comms_packet_t));
+  slot->acked = false;
+  slot->retransmitted = false;
+  transmit_slot(slot, system_get_ticks());
+}
+
+void comms_write_large_frame(comms_packet_t* header, const uint8_t* data, const uint32_t length) {
+  write_large_frame(header, PACKET_FLAG_LARGE, data, length);
 }
 
 void comms_read(comms_packet_t* packet) {
   memcpy(packet, &packet_buffer[packet_read_index], sizeof(comms_packet_t));
   packet_read_index = (packet_read_index + 1) & packet_buffer_mask;
 }
-
-uint8_t comms_compute_crc(comms_packet_t* packet) {
-  return crc8((uint8_t*)packet, PACKET_LENGTH - PACKET_CRC_BYTES);
-}
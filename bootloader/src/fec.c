@@ -0,0 +1,40 @@
+#include "fec.h"
+
+// A shortened Reed-Solomon code over GF(2^8) (polynomial 0x11d), whose generator has the roots 1
+// and alpha (2). The two syndromes of a codeword with one wrong byte are the error itself, and the
+// error times alpha to the power of its distance from the end. With only one error to find, a walk
+// through the powers of alpha locates it, so no log or antilog tables are needed.
+
+static uint8_t gf_mul2(const uint8_t value) {
+  return (uint8_t)((value << 1) ^ ((value & 0x80) ? 0x1d : 0x00));
+}
+
+fec_result_t fec_correct(uint8_t* codeword, const uint32_t length) {
+  uint8_t s0 = 0;
+  uint8_t s1 = 0;
+
+  for (uint32_t i = 0; i < length; i++) {
+    s0 ^= codeword[i];
+    s1 = gf_mul2(s1) ^ codeword[i];
+  }
+
+  if ((s0 == 0) && (s1 == 0)) {
+    return FecResult_Ok;
+  }
+
+  // More than one byte is wrong
+  if ((s0 == 0) || (s1 == 0)) {
+    return FecResult_Uncorrectable;
+  }
+
+  uint8_t error_at_power = s0;
+  for (uint32_t power = 0; power < length; power++) {
+    if (error_at_power == s1) {
+      codeword[length - 1 - power] ^= s0;
+      return FecResult_Corrected;
+    }
+    error_at_power = gf_mul2(error_at_power);
+  }
+
+  return FecResult_Uncorrectable;
+}
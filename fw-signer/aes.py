@@ -0,0 +1,100 @@
+import struct
+
+# AES-128 encryption only (the signer never decrypts), using the usual 32-bit T-table
+# formulation so that a block costs a few dozen table lookups rather than byte-wise GF maths.
+
+def _xtime(a):
+    a <<= 1
+    return (a ^ 0x11b) if a & 0x100 else a
+
+def _build_sbox():
+    sbox = [0] * 256
+    p = q = 1
+    while True:
+        # p walks the multiplicative group by 3, q by its inverse (1/3)
+        p = p ^ _xtime(p)
+        q ^= q << 1
+        q ^= q << 2
+        q ^= q << 4
+        q &= 0xff
+        if q & 0x80:
+            q ^= 0x09
+        rot = lambda x, n: ((x << n) | (x >> (8 - n))) & 0xff
+        sbox[p] = q ^ rot(q, 1) ^ rot(q, 2) ^ rot(q, 3) ^ rot(q, 4) ^ 0x63
+        if p == 1:
+            break
+    sbox[0] = 0x63
+    return sbox
+
+SBOX = _build_sbox()
+
+def _build_tables():
+    te0 = []
+    for x in SBOX:
+        s2 = _xtime(x)
+        s3 = s2 ^ x
+        te0.append((s2 << 24) | (x << 16) | (x << 8) | s3)
+    ror = lambda w, n: ((w >> n) | (w << (32 - n))) & 0xffffffff
+    return te0, [ror(w, 8) for w in te0], [ror(w, 16) for w in te0], [ror(w, 24) for w in te0]
+
+TE0, TE1, TE2, TE3 = _build_tables()
+
+def expand_key_128(key):
+    if len(key) != 16:
+        raise ValueError("AES-128 key must be 16 bytes")
+
+    w = list(struct.unpack(">4I", key))
+    rcon = 1
+    for i in range(4, 44):
+        t = w[i - 1]
+        if i % 4 == 0:
+            t = ((SBOX[(t >> 16) & 0xff] << 24) | (SBOX[(t >> 8) & 0xff] << 16) |
+                 (SBOX[t & 0xff] << 8) | SBOX[t >> 24]) ^ (rcon << 24)
+            rcon = _xtime(rcon)
+        w.append(w[i - 4] ^ t)
+    return w
+
+def encrypt_words(rk, s0, s1, s2, s3):
+    te0, te1, te2, te3, sbox = TE0, TE1, TE2, TE3, SBOX
+
+    s0 ^= rk[0]; s1 ^= rk[1]; s2 ^= rk[2]; s3 ^= rk[3]
+    for r in range(4, 40, 4):
+        t0 = te0[s0 >> 24] ^ te1[(s1 >> 16) & 0xff] ^ te2[(s2 >> 8) & 0xff] ^ te3[s3 & 0xff] ^ rk[r]
+        t1 = te0[s1 >> 24] ^ te1[(s2 >> 16) & 0xff] ^ te2[(s3 >> 8) & 0xff] ^ te3[s0 & 0xff] ^ rk[r + 1]
+        t2 = te0[s2 >> 24] ^ te1[(s3 >> 16) & 0xff] ^ te2[(s0 >> 8) & 0xff] ^ te3[s1 & 0xff] ^ rk[r + 2]
+        t3 = te0[s3 >> 24] ^ te1[(s0 >> 16) & 0xff] ^ te2[(s1 >> 8) & 0xff] ^ te3[s2 & 0xff] ^ rk[r + 3]
+        s0, s1, s2, s3 = t0, t1, t2, t3
+
+    return (
+        ((sbox[s0 >> 24] << 24) | (sbox[(s1 >> 16) & 0xff] << 16) | (sbox[(s2 >> 8) & 0xff] << 8) | sbox[s3 & 0xff]) ^ rk[40],
+        ((sbox[s1 >> 24] << 24) | (sbox[(s2 >> 16) & 0xff] << 16) | (sbox[(s3 >> 8) & 0xff] << 8) | sbox[s0 & 0xff]) ^ rk[41],
+        ((sbox[s2 >> 24] << 24) | (sbox[(s3 >> 16) & 0xff] << 16) | (sbox[(s0 >> 8) & 0xff] << 8) | sbox[s1 & 0xff]) ^ rk[42],
+        ((sbox[s3 >> 24] << 24) | (sbox[(s0 >> 16) & 0xff] << 16) | (sbox[(s1 >> 8) & 0xff] << 8) | sbox[s2 & 0xff]) ^ rk[43],
+    )
+
+class CbcMac:
+    """
+    Streaming AES-128 CBC-MAC with a zero IV and PKCS#7 padding, i.e. the last ciphertext
+    block of `openssl enc -aes-128-cbc -iv 0`, without ever holding the ciphertext.
+    """
+
+    def __init__(self, key):
+        self._rk = expand_key_128(key)
+        self._state = (0, 0, 0, 0)
+        self._pending = b""
+
+    def update(self, data):
+        data = self._pending + bytes(data)
+        whole = len(data) - (len(data) % 16)
+        self._pending = data[whole:]
+
+        rk = self._rk
+        s0, s1, s2, s3 = self._state
+        for w0, w1, w2, w3 in struct.iter_unpack(">4I", memoryview(data)[:whole]):
+            s0, s1, s2, s3 = encrypt_words(rk, s0 ^ w0, s1 ^ w1, s2 ^ w2, s3 ^ w3)
+        self._state = (s0, s1, s2, s3)
+
+    def digest(self):
+        bytes_to_pad = 16 - len(self._pending)
+        self.update(bytes([bytes_to_pad] * bytes_to_pad))
+        return struct.pack(">4I", *self._state)
@@ -0,0 +1,71 @@
+# Loads an application image from a flat binary, an Intel HEX file or an ELF file. HEX and ELF files
+# say where each piece goes, so they're laid out from the image's start address with any gaps
+# filled with 0xff, the erased state of flash, just as they'll read back from the device.
+
+import struct
+
+ELF_MAGIC = b"\x7fELF"
+PT_LOAD = 1
+
+def _flatten(segments, base_address, filename):
+    segments = [(address, data) for address, data in segments if data]
+    segments = [(max(address, base_address), data[max(0, base_address - address):])
+                for address, data in segments if address + len(data) > base_address]
+    if not segments:
+        raise ValueError(f"{filename} has nothing at or after 0x{base_address:08x}")
+
+    end = max(address + len(data) for address, data in segments)
+    image = bytearray(b"\xff" * (end - base_address))
+    for address, data in segments:
+        image[address - base_address:address - base_address + len(data)] = data
+    return image
+
+def _elf_segments(data, filename):
+    if data[4] != 1 or data[5] != 1:
+        raise ValueError(f"{filename} is not a little endian ELF32 file")
+
+    (phoff,) = struct.unpack_from("<I", data, 0x1c)
+    phentsize, phnum = struct.unpack_from("<HH", data, 0x2a)
+
+    segments = []
+    for i in range(phnum):
+        type, offset, _, paddr, filesz = struct.unpack_from("<IIIII", data, phoff + i * phentsize)
+        # Load addresses, so initialised data comes from where it's stored in flash, not where it runs
+        if type == PT_LOAD and filesz > 0:
+            segments.append((paddr, data[offset:offset + filesz]))
+    return segments
+
+def _hex_segments(text, filename):
+    segments = []
+    upper = 0
+    for number, line in enumerate(text.splitlines(), 1):
+        line = line.strip()
+        if not line:
+            continue
+        if not line.startswith(":"):
+            raise ValueError(f"{filename}:{number}: not an Intel HEX record")
+
+        record = bytes.fromhex(line[1:])
+        if len(record) < 5 or len(record) != record[0] + 5 or sum(record) & 0xff:
+            raise ValueError(f"{filename}:{number}: bad record length or checksum")
+
+        count, address, type, payload = record[0], (record[1] << 8) | record[2], record[3], record[4:-1]
+        if type == 0x00:
+            segments.append((upper + address, payload))
+        elif type == 0x01:
+            break
+        elif type == 0x02:
+            upper = int.from_bytes(payload, "big") << 4
+        elif type == 0x04:
+            upper = int.from_bytes(payload, "big") << 16
+    return segments
+
+def load_image(filename, base_address):
+    with open(filename, "rb") as f:
+        data = f.read()
+
+    if data.startswith(ELF_MAGIC):
+        return _flatten(_elf_segments(data, filename), base_address, filename)
+    if filename.lower().endswith((".hex", ".ihex")):
+        return _flatten(_hex_segments(data.decode("ascii"), filename), base_address, filename)
+    return bytearray(data)
@@ -1,68 +1,150 @@
 #!/usr/bin/env python3
 
-import sys
+import argparse
+import json
 import os
-import subprocess
 import struct
+import sys
+import tempfile
+import zlib
+from concurrent.futures import ProcessPoolExecutor
+
+from aes import CbcMac
+from image import load_image
 
 AES_BLOCK_SIZE = 16
-BOOTLOADER_SIZE = 0x8000
+FLASH_BASE = 0x08000000
+BOOTLOADER_SIZE = 0x4000
+# Two 16K sectors for the key-value store, between the bootloader and the app
+KV_FLASH_SIZE = 2 * 0x4000
+MAIN_APP_START_ADDRESS = FLASH_BASE + BOOTLOADER_SIZE + KV_FLASH_SIZE
+RAM_APP_START_ADDRESS = 0x20004000
 FWINFO_OFFSET = 0x01B0
 SIGNATURE_OFFSET = FWINFO_OFFSET + AES_BLOCK_SIZE
+MANIFEST_OFFSET = SIGNATURE_OFFSET + AES_BLOCK_SIZE
 
 FWINFO_VERSION_OFFSET = 8
 FWINFO_LENGTH_OFFSET = 12
 
-signing_key = "000102030405060708090a0b0c0d0e0f"
-zeroed_iv = "00000000000000000000000000000000"
-
-signing_image_filename = "image_to_be_signed.bin"
-encrypted_filename = "encryped_image.bin"
-signed_filename = "signed.bin"
-
-if len(sys.argv) < 3:
-    print("usage: fw-signer.py <input file> <version number hex>")
-    exit(1)
-
-with open(sys.argv[1], "rb") as f:
-    f.seek(BOOTLOADER_SIZE)
-    fw_image = bytearray(f.read())
-    f.close()
-
-version_hex = sys.argv[2]
-version_value = int(version_hex, base=16)
-struct.pack_into("<I", fw_image, FWINFO_OFFSET + FWINFO_LENGTH_OFFSET, len(fw_image))
-struct.pack_into("<I", fw_image, FWINFO_OFFSET + FWINFO_VERSION_OFFSET, version_value)
+# The MAC is fed in chunks of this size, so only one chunk is ever copied at a time
+MAC_CHUNK_SIZE = 16 * 1024
 
-signing_image = fw_image[FWINFO_OFFSET:FWINFO_OFFSET + AES_BLOCK_SIZE]
-signing_image += fw_image[:FWINFO_OFFSET]
-signing_image += fw_image[FWINFO_OFFSET + AES_BLOCK_SIZE * 2:]
+signing_key = bytes.fromhex("000102030405060708090a0b0c0d0e0f")
 
-with open(signing_image_filename, "wb") as f:
-    f.write(signing_image)
-    f.close()
-
-openssl_command = f"openssl enc -aes-128-cbc -nosalt -K {signing_key} -iv {zeroed_iv} -in {signing_image_filename} -out {encrypted_filename}"
-subprocess.call(openssl_command.split(" "))
-
-with open(encrypted_filename, "rb") as f:
-    f.seek(-AES_BLOCK_SIZE, os.SEEK_END)
-    signature = f.read()
-    f.close()
-
-signature_text = ""
-for byte in signature:
-    signature_text += f"{byte:02x}"
-
-print(f"Signed firmeware version {version_hex}")
-print(f"key       = {signing_key}")
-print(f"signature = {signature_text}")
-
-os.remove(signing_image_filename)
-os.remove(encrypted_filename)
-
-fw_image[SIGNATURE_OFFSET:SIGNATURE_OFFSET + AES_BLOCK_SIZE] = signature
+signed_filename = "signed.bin"
 
-with open(signed_filename, "wb") as f:
-    f.write(fw_image)
-    f.close()
+def compute_signature(fw_image):
+    mac = CbcMac(signing_key)
+    view = memoryview(fw_image)
+
+    # The info block goes first, and the info + signature blocks are skipped in the body
+    mac.update(view[FWINFO_OFFSET:FWINFO_OFFSET + AES_BLOCK_SIZE])
+    mac.update(view[:FWINFO_OFFSET])
+    for offset in range(FWINFO_OFFSET + AES_BLOCK_SIZE * 2, len(view), MAC_CHUNK_SIZE):
+        mac.update(view[offset:offset + MAC_CHUNK_SIZE])
+
+    return mac.digest()
+
+# What the app's background scrub checks its image against. The signature isn't known yet, so it's
+# skipped along with the manifest itself, which the signature then covers.
+def compute_image_crc(fw_image):
+    view = memoryview(fw_image)
+    crc = zlib.crc32(view[:SIGNATURE_OFFSET])
+    return zlib.crc32(view[MANIFEST_OFFSET + AES_BLOCK_SIZE:], crc)
+
+def write_file_atomic(filename, data):
+    directory = os.path.dirname(os.path.abspath(filename))
+    with tempfile.NamedTemporaryFile(dir=directory, delete=False) as f:
+        f.write(data)
+        temp_filename = f.name
+    os.replace(temp_filename, filename)
+
+def sign_image(job):
+    input_filename, version_value, output_filename, ram = job
+
+    # A flat binary is just the app, so only ELF and HEX files need cutting at its start
+    start_address = RAM_APP_START_ADDRESS if ram else MAIN_APP_START_ADDRESS
+    fw_image = load_image(input_filename, start_address)
+
+    struct.pack_into("<I", fw_image, FWINFO_OFFSET + FWINFO_LENGTH_OFFSET, len(fw_image))
+    struct.pack_into("<I", fw_image, FWINFO_OFFSET + FWINFO_VERSION_OFFSET, version_value)
+    image_crc = compute_image_crc(fw_image)
+    struct.pack_into("<I", fw_image, MANIFEST_OFFSET, image_crc)
+
+    signature = compute_signature(fw_image)
+    fw_image[SIGNATURE_OFFSET:SIGNATURE_OFFSET + AES_BLOCK_SIZE] = signature
+
+    write_file_atomic(output_filename, fw_image)
+
+    return {
+        "input": input_filename,
+        "output": output_filename,
+        "version": f"{version_value:08x}",
+        "length": len(fw_image),
+        "signature": signature.hex(),
+        "image_crc": f"{image_crc:08x}",
+        "crc32": f"{zlib.crc32(fw_image):08x}",
+    }
+
+def parse_job(spec):
+    input_filename, sep, version_hex = spec.rpartition(":")
+    if not sep or not input_filename:
+        raise argparse.ArgumentTypeError(f"expected <input file>:<version hex>, got '{spec}'")
+    return (input_filename, int(version_hex, base=16))
+
+def main():
+    parser = argparse.ArgumentParser(
+        prog="fw-signer.py",
+        description="Sign one or more firmware images with the bootloader's AES-CBC-MAC.",
+    )
+    parser.add_argument("input", nargs="?",
+                        help="firmware image: a flat binary of the application, or an ELF or Intel HEX file")
+    parser.add_argument("versions", nargs="*", help="version number(s) in hex to sign the input as")
+    parser.add_argument("--job", action="append", type=parse_job, default=[], metavar="INPUT:VERSION",
+                        help="sign another input/version pair, may be repeated")
+    parser.add_argument("--out-dir", help="directory for signed images (default: signed.bin for a single image)")
+    parser.add_argument("--manifest", help="write a JSON manifest of the signed images ('-' for stdout)")
+    parser.add_argument("--ram", action="store_true",
+                        help="the inputs are RAM images ('make ram'), with no bootloader in front")
+    parser.add_argument("--jobs", type=int, default=os.cpu_count(), help="number of images signed in parallel")
+    args = parser.parse_args()
+
+    jobs = [(args.input, int(v, base=16)) for v in args.versions] + args.job
+    if args.input and not args.versions:
+        parser.error("a version number is required for the positional input")
+    if not jobs:
+        parser.print_usage()
+        exit(1)
+
+    if len(jobs) == 1 and not args.out_dir:
+        outputs = [signed_filename]
+    else:
+        out_dir = args.out_dir or "."
+        os.makedirs(out_dir, exist_ok=True)
+        outputs = []
+        for input_filename, version_value in jobs:
+            stem = os.path.splitext(os.path.basename(input_filename))[0]
+            outputs.append(os.path.join(out_dir, f"{stem}-{version_value:08x}.signed.bin"))
+        if len(set(outputs)) != len(outputs):
+            parser.error("the same input and version was given more than once")
+
+    work = [(i, v, o, args.ram) for (i, v), o in zip(jobs, outputs)]
+    if len(work) == 1 or args.jobs <= 1:
+        results = [sign_image(job) for job in work]
+    else:
+        with ProcessPoolExecutor(max_workers=args.jobs) as pool:
+            results = list(pool.map(sign_image, work))
+
+    for result in results:
+        print(f"Signed firmware version {result['version']} -> {result['output']}", file=sys.stderr)
+        print(f"signature = {result['signature']}", file=sys.stderr)
+
+    if args.manifest:
+        manifest = json.dumps({"images": results}, indent=2)
+        if args.manifest == "-":
+            print(manifest)
+        else:
+            write_file_atomic(args.manifest, (manifest + "\n").encode())
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+
+import argparse
+import json
+import statistics
+import sys
+
+def phase_durations(record):
+    # Each phase is marked when it ends, so its duration is the gap to the mark before it
+    durations = {}
+    last = 0
+    for event in record["events"]:
+        durations[event["phase"]] = durations.get(event["phase"], 0) + event["timeUs"] - last
+        last = event["timeUs"]
+    durations["total"] = last
+    return durations
+
+def main():
+    parser = argparse.ArgumentParser(
+        prog="boot-timeline.py",
+        description="Compare boot phase timings across firmware versions, from fw-updater --boot-timeline logs.",
+    )
+    parser.add_argument("log", help="JSON lines file written by fw-updater --boot-timeline")
+    parser.add_argument("--threshold", type=float, default=10.0,
+                        help="percentage a phase may grow by between versions before it's flagged (default 10)")
+    parser.add_argument("--min-us", type=int, default=100,
+                        help="ignore growth smaller than this many us (default 100)")
+    args = parser.parse_args()
+
+    by_version = {}
+    with open(args.log) as f:
+        for line in f:
+            if line.strip():
+                record = json.loads(line)
+                by_version.setdefault(record["version"], []).append(phase_durations(record))
+
+    if not by_version:
+        sys.exit("no boot timelines in the log")
+
+    # Median of every run of a version, so one slow boot doesn't look like a regression
+    versions = sorted(by_version)
+    medians = {}
+    for version in versions:
+        runs = by_version[version]
+        phases = list(dict.fromkeys(phase for run in runs for phase in run))
+        medians[version] = {phase: statistics.median(run.get(phase, 0) for run in runs) for phase in phases}
+
+    phases = []
+    for version in versions:
+        phases += [phase for phase in medians[version] if phase not in phases and phase != "total"]
+    phases.append("total")
+
+    header = "".join(f"{v:>14x}" for v in versions)
+    print(f"{'phase (median us)':<30}{header}")
+    regressions = []
+    for phase in phases:
+        row = ""
+        for i, version in enumerate(versions):
+            value = medians[version].get(phase)
+            flag = " "
+            if value is not None and i > 0:
+                before = medians[versions[i - 1]].get(phase)
+                if before is not None and value - before >= args.min_us and value > before * (1 + args.threshold / 100):
+                    flag = "!"
+                    regressions.append((phase, versions[i - 1], version, before, value))
+            row += f"{'-' if value is None else f'{value:.0f}':>13}{flag}"
+        print(f"{phase:<30}{row}")
+
+    print(f"\n{sum(len(r) for r in by_version.values())} boot(s) over {len(versions)} version(s)")
+    for phase, old, new, before, after in regressions:
+        print(f"regression: {phase} went from {before:.0f}us in {old:x} to {after:.0f}us in {new:x}")
+
+    if regressions:
+        sys.exit(1)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,73 @@
+# Just enough of an ELF32 (little endian) reader for the firmware tools: section headers, section
+# contents and the symbol table.
+
+import struct
+
+SHT_SYMTAB = 2
+SHT_NOBITS = 8
+
+class Section:
+    def __init__(self, name, type, addr, offset, size, link, entsize):
+        self.name = name
+        self.type = type
+        self.addr = addr
+        self.offset = offset
+        self.size = size
+        self.link = link
+        self.entsize = entsize
+
+class Symbol:
+    def __init__(self, name, value, size, info, section_index):
+        self.name = name
+        self.value = value
+        self.size = size
+        self.type = info & 0xf
+        self.section_index = section_index
+
+class ElfFile:
+    def __init__(self, filename):
+        with open(filename, "rb") as f:
+            self.data = f.read()
+
+        if self.data[:4] != b"\x7fELF" or self.data[4] != 1 or self.data[5] != 1:
+            raise ValueError(f"{filename} is not a little endian ELF32 file")
+
+        (shoff,) = struct.unpack_from("<I", self.data, 0x20)
+        shentsize, shnum, shstrndx = struct.unpack_from("<HHH", self.data, 0x2e)
+
+        raw = []
+        for i in range(shnum):
+            fields = struct.unpack_from("<IIIIIIIIII", self.data, shoff + i * shentsize)
+            raw.append(fields)
+
+        names = raw[shstrndx]
+        self.sections = []
+        for name, type, _, addr, offset, size, link, _, _, entsize in raw:
+            self.sections.append(Section(self._string(names[4], name), type, addr, offset, size, link, entsize))
+
+    def _string(self, table_offset, index):
+        start = table_offset + index
+        return self.data[start:self.data.index(b"\0", start)].decode()
+
+    def section(self, name):
+        for section in self.sections:
+            if section.name == name:
+                return section
+        return None
+
+    def contents(self, section):
+        if section.type == SHT_NOBITS:
+            return bytes(section.size)
+        return self.data[section.offset:section.offset + section.size]
+
+    def symbols(self):
+        symtab = next((s for s in self.sections if s.type == SHT_SYMTAB), None)
+        if symtab is None:
+            return []
+
+        strtab = self.sections[symtab.link]
+        symbols = []
+        for offset in range(symtab.offset, symtab.offset + symtab.size, symtab.entsize):
+            name, value, size, info, _, shndx = struct.unpack_from("<IIIBBH", self.data, offset)
+            symbols.append(Symbol(self._string(strtab.offset, name), value, size, info, shndx))
+        return symbols
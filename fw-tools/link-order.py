@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+
+import argparse
+import os
+import struct
+import sys
+
+from elf import ElfFile
+
+STT_FUNC = 2
+
+PC_HISTOGRAM_MAGIC = 0x43505448
+PC_HISTOGRAM_HEADER = struct.Struct("<IIII")
+
+# The F4's ART accelerator caches 64 lines of 128 bits of instructions
+ART_CACHE_BYTES = 1024
+
+# Below this share of the samples, a function's count is as likely to be spill-over from a
+# neighbour in the same histogram bucket as its own
+HOT_MIN_SHARE = 0.005
+
+class Function:
+    def __init__(self, name, start, size):
+        self.name = name
+        self.start = start
+        self.size = size
+        self.samples = 0.0
+        # In the profile at all, even if it never took long enough to be sampled
+        self.seen = False
+
+# Everything the linker placed in .text (so not RAM functions, which the link order can't move)
+def load_functions(elf_filename):
+    elf = ElfFile(elf_filename)
+    text = elf.section(".text")
+    if text is None:
+        sys.exit(f"{elf_filename} has no .text section")
+    text_index = elf.sections.index(text)
+
+    functions = {}
+    for symbol in elf.symbols():
+        if symbol.type == STT_FUNC and symbol.size > 0 and symbol.section_index == text_index:
+            # Thumb function addresses have bit 0 set
+            functions[symbol.name] = Function(symbol.name, symbol.value & ~1, symbol.size)
+    return list(functions.values())
+
+# A pc_histogram_t, from fw-updater --pc-histogram or a debugger dump of the app's. Each bucket's
+# samples are shared between the functions in it, by how many of its bytes each one covers.
+def apply_histogram(functions, data):
+    magic, start, shift, outside = PC_HISTOGRAM_HEADER.unpack_from(data, 0)
+    if magic != PC_HISTOGRAM_MAGIC:
+        return False
+
+    counts = struct.unpack_from(f"<{(len(data) - PC_HISTOGRAM_HEADER.size) // 2}H", data, PC_HISTOGRAM_HEADER.size)
+    bucket_bytes = 1 << shift
+    for bucket, count in enumerate(counts):
+        if count == 0:
+            continue
+
+        low = start + bucket * bucket_bytes
+        high = low + bucket_bytes
+        overlaps = [(f, min(high, f.start + f.size) - max(low, f.start)) for f in functions]
+        overlaps = [(f, n) for f, n in overlaps if n > 0]
+        covered = sum(n for _, n in overlaps)
+        for function, n in overlaps:
+            function.samples += count * n / covered
+            function.seen = True
+
+    if outside:
+        print(f"{outside} sample(s) outside the image's code (RAM functions?) are left out", file=sys.stderr)
+    return True
+
+# One "<count> <function>" per line, e.g. from a debugger's sampling profiler. They should come from
+# the board: a host build's profile weighs each function by code for a different CPU.
+# A function listed with a count of 0 ran, just not for long, so it isn't cold.
+def apply_counts(functions, text):
+    by_name = {}
+    for function in functions:
+        by_name.setdefault(base_name(function.name), []).append(function)
+
+    unknown = 0
+    for line in text.splitlines():
+        fields = line.split()
+        if len(fields) < 2 or line.lstrip().startswith("#"):
+            continue
+        matches = by_name.get(base_name(fields[1]), [])
+        for function in matches:
+            function.samples += float(fields[0]) / len(matches)
+            function.seen = True
+        unknown += 0 if matches else 1
+
+    if unknown:
+        print(f"{unknown} function(s) in the profile aren't in the ELF file, and are left out", file=sys.stderr)
+
+# Without any suffix GCC gave a clone of it (e.g. crc8.constprop.0), which can differ between
+# builds and compilers
+def base_name(name):
+    return name.split(".")[0]
+
+# With -ffunction-sections, GCC puts each function in .text.<name> (clones in .text.<name>.<suffix>),
+# except for main, which goes in .text.startup.main
+def input_sections(function):
+    name = base_name(function.name)
+    sections = f".text.{name} .text.{name}.*"
+    if name == "main":
+        sections += f" .text.startup.{name}"
+    return sections
+
+def write_order(filename, comment, functions):
+    written = set()
+    with open(filename, "w") as f:
+        f.write(f"/* Generated by fw-tools/link-order.py, don't edit. {comment} */\n")
+        for function in functions:
+            sections = input_sections(function)
+            if sections not in written:
+                f.write(f"*({sections})\n")
+                written.add(sections)
+
+def main():
+    parser = argparse.ArgumentParser(
+        prog="link-order.py",
+        description="Write the hot and cold function lists the linker scripts include, from a profile.",
+    )
+    parser.add_argument("elf", help="bootloader.elf or firmware.elf, as built when the profile was taken")
+    parser.add_argument("profile", help="PC histogram (fw-updater --pc-histogram, or a raw dump), or '<count> <function>' lines")
+    parser.add_argument("--out-dir", default=".", help="where link-order-hot.ld and link-order-cold.ld go (default: .)")
+    parser.add_argument("--hot-bytes", type=int, default=ART_CACHE_BYTES,
+                        help=f"most code to put in the hot region (default {ART_CACHE_BYTES}, the size of the ART's cache)")
+    parser.add_argument("--hot-only", action="store_true",
+                        help="leave link-order-cold.ld alone, for profiles that only cover part of what the device runs")
+    args = parser.parse_args()
+
+    functions = load_functions(args.elf)
+    with open(args.profile, "rb") as f:
+        data = f.read()
+    if not apply_histogram(functions, data):
+        apply_counts(functions, data.decode(errors="replace"))
+
+    total = sum(f.samples for f in functions)
+    if total == 0:
+        sys.exit("no samples landed in any function")
+
+    # Most samples per byte first, for as long as they fit, so that the code the cache holds is the
+    # code that's running. Sizes are as the ELF has them, so profile the build being reordered.
+    hot = []
+    hot_bytes = 0
+    for function in sorted(functions, key=lambda f: f.samples / f.size, reverse=True):
+        if function.samples >= total * HOT_MIN_SHARE and hot_bytes + function.size <= args.hot_bytes:
+            hot.append(function)
+            hot_bytes += function.size
+    taken = sum(f.samples for f in hot)
+
+    cold = sorted((f for f in functions if not f.seen), key=lambda f: f.name)
+
+    cold_bytes = sum(f.size for f in cold)
+    write_order(os.path.join(args.out_dir, "link-order-hot.ld"),
+                f"{len(hot)} functions, {hot_bytes} bytes, {taken * 100 / total:.0f}% of the samples.", hot)
+    if not args.hot_only:
+        write_order(os.path.join(args.out_dir, "link-order-cold.ld"),
+                    f"{len(cold)} functions, {cold_bytes} bytes, never sampled.", cold)
+
+    print(f"{'function':<32} {'samples':>9} {'share':>7} {'bytes':>6}")
+    for function in hot:
+        print(f"{function.name:<32} {function.samples:>9.1f} {function.samples * 100 / total:>6.1f}% {function.size:>6}")
+    print(f"hot: {len(hot)} functions, {hot_bytes} bytes ({taken * 100 / total:.0f}% of the samples)")
+    if not args.hot_only:
+        print(f"cold: {len(cold)} functions, {cold_bytes} bytes")
+
+if __name__ == "__main__":
+    main()
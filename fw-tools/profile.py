@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+
+import argparse
+import json
+
+DEFAULT_CPU_HZ = 84000000
+BAR_WIDTH = 40
+
+def bin_label(bin):
+    # Bin n holds samples that took [2^(n-1), 2^n) cycles
+    if bin == 0:
+        return "0"
+    return f"{1 << (bin - 1)}-{(1 << bin) - 1}"
+
+def print_scope(scope, cpu_hz, show_histogram):
+    us = lambda cycles: cycles * 1e6 / cpu_hz
+    print(f"{scope['name']:<24} {scope['count']:>9} "
+          f"{scope['min']:>10} {scope['mean']:>12.1f} {scope['max']:>10}   "
+          f"{us(scope['min']):>9.2f} {us(scope['mean']):>9.2f} {us(scope['max']):>9.2f}")
+
+    if not show_histogram or scope["count"] == 0:
+        return
+
+    histogram = scope["histogram"]
+    used = [i for i, n in enumerate(histogram) if n]
+    peak = max(histogram)
+    for bin in range(used[0], used[-1] + 1):
+        bar = "#" * round(histogram[bin] * BAR_WIDTH / peak)
+        print(f"    {bin_label(bin):>21} cycles {histogram[bin]:>9}  {bar}")
+    print()
+
+# Mean cycles against the same scope in another profile, e.g. one taken before a link order change
+def print_comparison(scopes, baseline, cpu_hz):
+    before = {scope["name"]: scope for scope in baseline}
+    print(f"{'scope':<24} {'before':>12} {'after':>12} {'change':>8}   {'before us':>9} {'after us':>9}")
+    for scope in scopes:
+        old = before.get(scope["name"])
+        if old is None or old["count"] == 0 or scope["count"] == 0:
+            continue
+        change = (scope["mean"] - old["mean"]) * 100 / old["mean"]
+        print(f"{scope['name']:<24} {old['mean']:>12.1f} {scope['mean']:>12.1f} {change:>+7.1f}%   "
+              f"{old['mean'] * 1e6 / cpu_hz:>9.2f} {scope['mean'] * 1e6 / cpu_hz:>9.2f}")
+
+# RAM map and high-water marks, in profiles saved since the memory diagnostic was added
+def print_memory(memory):
+    print(f"RAM 0x{memory['ramStart']:08x}, {memory['ramBytes']} bytes")
+    for name, key in [("noinit", "noinitBytes"), ("data", "dataBytes"), ("bss", "bssBytes"), ("stack", "stackBytes")]:
+        print(f"  {name:<14} {memory[key]:>7} bytes {memory[key] * 100 / memory['ramBytes']:>5.1f}%")
+    print(f"{'buffer':<16} {'peak':>7} {'capacity':>9} {'used':>6} {'overflows':>10}")
+    buffers = [{"name": "stack", "peak": memory["stackPeakBytes"], "capacity": memory["stackBytes"], "overflows": 0}]
+    for buffer in buffers + memory["buffers"]:
+        used = buffer["peak"] * 100 / buffer["capacity"] if buffer["capacity"] else 0
+        print(f"{buffer['name']:<16} {buffer['peak']:>7} {buffer['capacity']:>9} {used:>5.0f}% {buffer['overflows']:>10}")
+    print()
+
+def main():
+    parser = argparse.ArgumentParser(
+        prog="profile.py",
+        description="Print the profiling scopes saved by fw-updater --profile.",
+    )
+    parser.add_argument("profile", help="JSON file written by fw-updater --profile")
+    parser.add_argument("--cpu-hz", type=int, default=DEFAULT_CPU_HZ, help="core clock the cycle counter runs at")
+    parser.add_argument("--no-histogram", action="store_true", help="only print the summary line for each scope")
+    parser.add_argument("--sort", choices=["name", "count", "mean", "max", "total"], default="total",
+                        help="order of the scopes (default: most total time first)")
+    parser.add_argument("--baseline", help="another fw-updater --profile file, to compare mean cycles against")
+    args = parser.parse_args()
+
+    with open(args.profile) as f:
+        profile = json.load(f)
+    scopes = profile["scopes"]
+
+    if args.sort == "name":
+        scopes.sort(key=lambda s: s["name"])
+    elif args.sort == "total":
+        scopes.sort(key=lambda s: s["mean"] * s["count"], reverse=True)
+    else:
+        scopes.sort(key=lambda s: s[args.sort], reverse=True)
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            print_comparison(scopes, json.load(f)["scopes"], args.cpu_hz)
+        return
+
+    if "memory" in profile:
+        print_memory(profile["memory"])
+
+    print(f"{'scope':<24} {'count':>9} {'min':>10} {'mean':>12} {'max':>10}   "
+          f"{'min us':>9} {'mean us':>9} {'max us':>9}")
+    for scope in scopes:
+        print_scope(scope, args.cpu_hz, not args.no_histogram)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+
+# Checks for profile.py, against profiles shaped like the ones fw-updater --profile writes.
+# Run with: python3 -m unittest discover fw-tools
+
+import contextlib
+import io
+import json
+import os
+import sys
+import tempfile
+import unittest
+
+import profile
+
+BINS = 32
+
+def scope(name, count, min, max, mean, bins):
+    histogram = [0] * BINS
+    for bin, samples in bins.items():
+        histogram[bin] = samples
+    return {"name": name, "count": count, "min": min, "max": max, "mean": mean, "histogram": histogram}
+
+COMMS = scope("comms_update", 4, 84, 840, 252.0, {7: 2, 10: 2})
+FLASH = scope("flash_write", 1, 8400, 8400, 8400.0, {14: 1})
+IDLE = scope("never_ran", 0, 0, 0, 0, {})
+
+MEMORY = {
+    "ramStart": 0x20000000, "ramBytes": 1000,
+    "noinitBytes": 100, "dataBytes": 200, "bssBytes": 300, "stackBytes": 400, "stackPeakBytes": 100,
+    "buffers": [{"name": "uart rx", "capacity": 128, "peak": 32, "overflows": 2}],
+}
+
+def output_of(function, *args):
+    output = io.StringIO()
+    with contextlib.redirect_stdout(output):
+        function(*args)
+    return output.getvalue().splitlines()
+
+class BinLabelTest(unittest.TestCase):
+    def test_labels(self):
+        self.assertEqual(profile.bin_label(0), "0")
+        self.assertEqual(profile.bin_label(1), "1-1")
+        self.assertEqual(profile.bin_label(8), "128-255")
+        self.assertEqual(profile.bin_label(32), "2147483648-4294967295")
+
+class PrintScopeTest(unittest.TestCase):
+    # 84 cycles is 1us at 84MHz
+    def test_summary(self):
+        fields = output_of(profile.print_scope, COMMS, 84000000, False)[0].split()
+        self.assertEqual(fields, ["comms_update", "4", "84", "252.0", "840", "1.00", "3.00", "10.00"])
+
+    # Every bin from the first used to the last is shown, empty ones too, with the bars to scale
+    def test_histogram(self):
+        lines = output_of(profile.print_scope, COMMS, 84000000, True)
+        rows = [line.split() for line in lines[1:] if line.strip()]
+        self.assertEqual([row[0] for row in rows], ["64-127", "128-255", "256-511", "512-1023"])
+        self.assertEqual([int(row[2]) for row in rows], [2, 0, 0, 2])
+        self.assertEqual(len(rows[0][3]), profile.BAR_WIDTH)
+        self.assertEqual(len(rows[1]), 3)
+
+    def test_no_histogram_without_samples(self):
+        self.assertEqual(len(output_of(profile.print_scope, IDLE, 84000000, True)), 1)
+
+class ComparisonTest(unittest.TestCase):
+    def test_change(self):
+        before = [dict(COMMS, mean=200.0), IDLE]
+        lines = output_of(profile.print_comparison, [COMMS, FLASH, IDLE], before, 84000000)
+
+        # The header, then only the scopes there's something to compare with
+        self.assertEqual(len(lines), 2)
+        self.assertEqual(lines[1].split()[:4], ["comms_update", "200.0", "252.0", "+26.0%"])
+
+class MemoryTest(unittest.TestCase):
+    def test_memory(self):
+        lines = output_of(profile.print_memory, MEMORY)
+        self.assertIn("RAM 0x20000000, 1000 bytes", lines[0])
+        self.assertEqual(lines[2].split(), ["data", "200", "bytes", "20.0%"])
+        self.assertEqual(lines[6].split(), ["stack", "100", "400", "25%", "0"])
+        self.assertEqual(lines[7].split(), ["uart", "rx", "32", "128", "25%", "2"])
+
+class MainTest(unittest.TestCase):
+    def setUp(self):
+        self.directory = tempfile.TemporaryDirectory()
+        self.addCleanup(self.directory.cleanup)
+
+    def write(self, name, contents):
+        path = os.path.join(self.directory.name, name)
+        with open(path, "w") as f:
+            json.dump(contents, f)
+        return path
+
+    def run_main(self, *args):
+        argv = sys.argv
+        sys.argv = ["profile.py", *args]
+        try:
+            return output_of(profile.main)
+        finally:
+            sys.argv = argv
+
+    def summary_names(self, lines):
+        return [line.split()[0] for line in lines if line.split() and line.split()[0] in ("comms_update", "flash_write", "never_ran")]
+
+    # Most total time first by default: flash_write has 8400 cycles in all, comms_update 1008
+    def test_sorted_by_total(self):
+        path = self.write("profile.json", {"scopes": [COMMS, IDLE, FLASH]})
+        self.assertEqual(self.summary_names(self.run_main(path, "--no-histogram")), ["flash_write", "comms_update", "never_ran"])
+
+    def test_sorted_by_name(self):
+        path = self.write("profile.json", {"scopes": [IDLE, FLASH, COMMS]})
+        self.assertEqual(self.summary_names(self.run_main(path, "--no-histogram", "--sort", "name")), ["comms_update", "flash_write", "never_ran"])
+
+    # Older profiles have no memory section
+    def test_memory_only_when_saved(self):
+        with_memory = self.write("with.json", {"scopes": [COMMS], "memory": MEMORY})
+        without = self.write("without.json", {"scopes": [COMMS]})
+        self.assertTrue(self.run_main(with_memory, "--no-histogram")[0].startswith("RAM"))
+        self.assertTrue(self.run_main(without, "--no-histogram")[0].startswith("scope"))
+
+    def test_baseline(self):
+        path = self.write("after.json", {"scopes": [COMMS]})
+        baseline = self.write("before.json", {"scopes": [dict(COMMS, mean=504.0)]})
+        lines = self.run_main(path, "--baseline", baseline)
+        self.assertEqual(lines[1].split()[3], "-50.0%")
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+
+# Checks for trace.py, against an ELF file and records built here rather than a real build.
+# Run with: python3 -m unittest discover fw-tools
+
+import contextlib
+import io
+import os
+import struct
+import sys
+import tempfile
+import unittest
+
+import trace
+
+SHT_PROGBITS = 1
+SHT_STRTAB = 3
+
+# A little endian ELF32 with just a section header table, section names and the given sections
+def build_elf(sections):
+    names = b"\0"
+    name_offsets = []
+    for name, _ in sections + [(".shstrtab", None)]:
+        name_offsets.append(len(names))
+        names += name.encode() + b"\0"
+
+    contents = [data for _, data in sections] + [names]
+    body = b""
+    offsets = []
+    for data in contents:
+        offsets.append(52 + len(body))
+        body += data
+    shoff = 52 + len(body)
+
+    header = b"\x7fELF" + bytes([1, 1, 1]) + bytes(9)
+    header += struct.pack("<HHIIIIIHHHHHH", 2, 40, 1, 0, 0, shoff, 0, 52, 0, 0, 40, len(contents) + 1, len(contents))
+
+    table = bytes(40)
+    for i, data in enumerate(contents):
+        type = SHT_STRTAB if i == len(contents) - 1 else SHT_PROGBITS
+        table += struct.pack("<IIIIIIIIII", name_offsets[i], type, 0, 0, offsets[i], len(data), 0, 0, 1, 0)
+    return header + body + table
+
+FORMATS = b"comms: rx seq %u, length %u\0bl: offset %d, sector %02x\0uart: %lu bytes, 100%%\0"
+RX_SEQ = 0
+OFFSET = FORMATS.index(b"bl:")
+UART = FORMATS.index(b"uart:")
+
+def record(timestamp, event, arg0=0, arg1=0):
+    return trace.RECORD.pack(timestamp, event, arg0, arg1)
+
+class FormatEventTest(unittest.TestCase):
+    def test_unsigned(self):
+        self.assertEqual(trace.format_event(FORMATS, RX_SEQ, 7, 16), "comms: rx seq 7, length 16")
+
+    def test_signed_and_hex(self):
+        self.assertEqual(trace.format_event(FORMATS, OFFSET, 0xfffffffe, 0x0a), "bl: offset -2, sector 0a")
+
+    def test_length_modifier_and_percent(self):
+        self.assertEqual(trace.format_event(FORMATS, UART, 1024, 0), "uart: 1024 bytes, 100%")
+
+    def test_unknown_event(self):
+        self.assertEqual(trace.format_event(FORMATS, 0x1000, 1, 2), "<unknown event 0x00001000> 00000001 00000002")
+
+class RecordsTest(unittest.TestCase):
+    def test_stream_ignores_a_partial_record(self):
+        data = record(1, RX_SEQ, 2, 3) + record(4, UART, 5, 6) + b"\x01\x02"
+        self.assertEqual(trace.records_from_stream(data), [(1, RX_SEQ, 2, 3), (4, UART, 5, 6)])
+
+    def test_dump_before_wrapping(self):
+        ring = record(10, RX_SEQ) + record(20, UART) + bytes(2 * trace.RECORD.size)
+        dump = struct.pack("<III", trace.TRACE_MAGIC, 4, 2) + ring
+        self.assertEqual([r[0] for r in trace.records_from_dump(dump)], [10, 20])
+
+    # Head has gone round the ring one and a half times, so the oldest record is at head % capacity
+    def test_dump_after_wrapping(self):
+        ring = record(50, RX_SEQ) + record(60, RX_SEQ) + record(30, RX_SEQ) + record(40, RX_SEQ)
+        dump = struct.pack("<III", trace.TRACE_MAGIC, 4, 6) + ring
+        self.assertEqual([r[0] for r in trace.records_from_dump(dump)], [30, 40, 50, 60])
+
+    def test_dump_bad_magic(self):
+        with self.assertRaises(SystemExit):
+            trace.records_from_dump(struct.pack("<III", 0, 4, 0) + bytes(4 * trace.RECORD.size))
+
+class DecodeTest(unittest.TestCase):
+    def setUp(self):
+        self.directory = tempfile.TemporaryDirectory()
+        self.addCleanup(self.directory.cleanup)
+
+    def write(self, name, data):
+        path = os.path.join(self.directory.name, name)
+        with open(path, "wb") as f:
+            f.write(data)
+        return path
+
+    def run_main(self, *args):
+        output = io.StringIO()
+        argv = sys.argv
+        sys.argv = ["trace.py", *args]
+        try:
+            with contextlib.redirect_stdout(output):
+                trace.main()
+        finally:
+            sys.argv = argv
+        return output.getvalue().splitlines()
+
+    def test_load_formats(self):
+        elf = self.write("bootloader.elf", build_elf([(".text", bytes(8)), (".trace_fmt", FORMATS)]))
+        self.assertEqual(trace.load_formats(elf), FORMATS)
+
+    def test_load_formats_without_section(self):
+        elf = self.write("bootloader.elf", build_elf([(".text", bytes(8))]))
+        with self.assertRaises(SystemExit):
+            trace.load_formats(elf)
+
+    # The cycle counter wraps between the second and third records, and the timeline mustn't
+    def test_timeline_across_wrap(self):
+        elf = self.write("bootloader.elf", build_elf([(".trace_fmt", FORMATS)]))
+        records = self.write("trace.bin", record(0xfffe0000, RX_SEQ, 0, 4) +
+                                          record(0xffff0000, RX_SEQ, 1, 4) +
+                                          record(0x00010000, OFFSET, 0xffffffff, 3))
+        lines = self.run_main(elf, records, "--cpu-hz", "65536000")
+
+        self.assertEqual(len(lines), 3)
+        self.assertEqual(lines[0].split()[0], "0.000")
+        self.assertEqual(lines[1].split()[0], "1.000")
+        self.assertEqual(lines[2].split()[0], "3.000")
+        self.assertTrue(lines[1].endswith("comms: rx seq 1, length 4"))
+        self.assertTrue(lines[2].endswith("bl: offset -1, sector 03"))
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+
+import argparse
+import re
+import struct
+import sys
+
+from elf import ElfFile
+
+TRACE_MAGIC = 0x43525454
+RECORD = struct.Struct("<IIII")
+
+DEFAULT_CPU_HZ = 84000000
+
+# printf conversions that take an argument (%% doesn't)
+CONVERSION = re.compile(r"%[-+ #0]*\d*(?:\.\d+)?[hlz]*([diouxXcs%])")
+
+def load_formats(elf_filename):
+    elf = ElfFile(elf_filename)
+    section = elf.section(".trace_fmt")
+    if section is None:
+        sys.exit(f"{elf_filename} has no .trace_fmt section (built with TRACE_ENABLED=0?)")
+    return elf.contents(section)
+
+def format_event(formats, event, arg0, arg1):
+    if event >= len(formats):
+        return f"<unknown event 0x{event:08x}> {arg0:08x} {arg1:08x}"
+
+    fmt = formats[event:formats.index(b"\0", event)].decode(errors="replace")
+
+    # Python's % formatting matches C's for everything traced here, once the length modifiers go
+    fmt = CONVERSION.sub(lambda m: re.sub(r"[hlz]+", "", m.group(0)), fmt)
+    conversions = [c for c in CONVERSION.findall(fmt) if c != "%"]
+    args = [struct.unpack("<i", struct.pack("<I", arg))[0] if c in "di" else arg
+            for arg, c in zip((arg0, arg1), conversions)]
+    try:
+        return fmt % tuple(args)
+    except (TypeError, ValueError):
+        return f"{fmt} [{arg0:08x} {arg1:08x}]"
+
+def records_from_stream(data):
+    usable = len(data) - len(data) % RECORD.size
+    return [RECORD.unpack_from(data, offset) for offset in range(0, usable, RECORD.size)]
+
+# A raw dump of trace_buffer_t: magic, capacity, head, then the ring itself
+def records_from_dump(data):
+    magic, capacity, head = struct.unpack_from("<III", data, 0)
+    if magic != TRACE_MAGIC:
+        sys.exit("not a trace buffer dump (bad magic)")
+
+    ring = records_from_stream(data[12:12 + capacity * RECORD.size])
+    count = min(head, capacity)
+    return [ring[i % capacity] for i in range(head - count, head)]
+
+def main():
+    parser = argparse.ArgumentParser(
+        prog="trace.py",
+        description="Decode binary trace records against the ELF file they were recorded by.",
+    )
+    parser.add_argument("elf", help="bootloader.elf or firmware.elf, as flashed")
+    parser.add_argument("trace", help="records written by fw-updater --trace, or a raw dump with --raw")
+    parser.add_argument("--raw", action="store_true", help="the trace file is a memory dump of trace_buffer")
+    parser.add_argument("--cpu-hz", type=int, default=DEFAULT_CPU_HZ, help="core clock the cycle counter runs at")
+    args = parser.parse_args()
+
+    formats = load_formats(args.elf)
+    with open(args.trace, "rb") as f:
+        data = f.read()
+
+    records = records_from_dump(data) if args.raw else records_from_stream(data)
+    if not records:
+        print("no trace records", file=sys.stderr)
+        return
+
+    # The cycle counter wraps every ~51s at 84MHz, so the timeline is unwrapped as it goes
+    cycles = 0
+    previous = records[0][0]
+    last_ms = 0.0
+    for timestamp, event, arg0, arg1 in records:
+        cycles += (timestamp - previous) & 0xffffffff
+        previous = timestamp
+
+        ms = cycles * 1000.0 / args.cpu_hz
+        print(f"{ms:12.3f} ms  (+{ms - last_ms:9.3f})  {format_event(formats, event, arg0, arg1)}")
+        last_ms = ms
+
+if __name__ == "__main__":
+    main()
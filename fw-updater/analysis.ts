@@ -0,0 +1,390 @@
+import {
+  COMMS_ADDR_BROADCAST,
+  COMMS_WINDOW_SIZE,
+  PACKET_RETX_DATA0,
+  BL_PACKET_SYNC_OBSERVED_DATA0,
+  BL_PACKET_FW_LENGTH_RES_DATA0,
+  BL_PACKET_EXTENT_DATA0,
+  BL_PACKET_DELTA_UPDATE_REQ_DATA0,
+  BL_PACKET_READY_FOR_DATA_DATA0,
+  BL_PACKET_UPDATE_SUCCESSFUL_DATA0,
+  BL_PACKET_BOOT_REQ_DATA0,
+  BL_PACKET_BOOT_RES_DATA0,
+  SYNC_SEQ,
+  SYNC_SEQ_BUS,
+  Extent,
+  FrameParser,
+  Packet,
+} from './protocol';
+import {Capture, CaptureDirection} from './capture';
+
+// Gaps in traffic (both directions) longer than this are reported as idle time
+const DEFAULT_IDLE_GAP_MS = 20;
+const REPORTED_GAPS = 5;
+
+type TimedFrame = {
+  direction: CaptureDirection;
+  timeUs: number;
+  packet: Packet;
+  crcOk: boolean;
+};
+
+// Sequenced frames sent in one direction, matched up with the ACKs coming back the other way
+type DirectionStats = {
+  frames: number;
+  retransmits: number;
+  retxRequests: number;
+  crcErrors: number;
+  bytes: number;
+  rttMs: number[];
+};
+
+export type Phase = { name: string, startUs: number, endUs: number };
+export type IdleGap = { startUs: number, durationUs: number, phase: string };
+
+export type CaptureReport = {
+  durationMs: number;
+  baudRate: number;
+  syncAttempts: number;
+  phases: Phase[];
+  idleGapMs: number;
+  host: DirectionStats;
+  device: DirectionStats;
+  idleGaps: IdleGap[];
+  idleTotalMs: number;
+  imageBytes: number;
+  transferGoodput: number;
+  overallGoodput: number;
+};
+
+const newDirectionStats = (): DirectionStats => ({
+  frames: 0, retransmits: 0, retxRequests: 0, crcErrors: 0, bytes: 0, rttMs: [],
+});
+
+const parseFrames = (capture: Capture) => {
+  const parsers = [new FrameParser(), new FrameParser()];
+  const frames: TimedFrame[] = [];
+  for (const record of capture.records) {
+    for (const frame of parsers[record.direction].push(record.data)) {
+      frames.push({ direction: record.direction, timeUs: record.timeUs, packet: frame.packet, crcOk: frame.crcOk });
+    }
+  }
+  return frames;
+};
+
+// Track the frames sent one way against the cumulative + selective ACKs coming back. RTT samples
+// are only taken from frames sent once (Karn's algorithm), and include the receiver's ACK delay.
+const matchAcks = (frames: TimedFrame[], direction: CaptureDirection, stats: DirectionStats) => {
+  const outstanding = new Map<number, { sentUs: number, retransmitted: boolean }>();
+
+  const acknowledge = (seq: number, timeUs: number) => {
+    const sent = outstanding.get(seq);
+    if (sent) {
+      if (!sent.retransmitted) {
+        stats.rttMs.push((timeUs - sent.sentUs) / 1000);
+      }
+      outstanding.delete(seq);
+    }
+  };
+
+  for (const frame of frames) {
+    const packet = frame.packet;
+    if (!frame.crcOk) {
+      if (frame.direction === direction) {
+        stats.crcErrors++;
+      }
+      continue;
+    }
+
+    if (frame.direction === direction) {
+      if (packet.isAck() || packet.isLarge() || packet.address === COMMS_ADDR_BROADCAST) {
+        continue;
+      }
+      stats.frames++;
+      stats.bytes += packet.length;
+
+      const previous = outstanding.get(packet.seq);
+      if (previous) {
+        stats.retransmits++;
+        previous.retransmitted = true;
+      } else {
+        outstanding.set(packet.seq, { sentUs: frame.timeUs, retransmitted: false });
+      }
+    } else if (packet.isAck() && !packet.isLarge()) {
+      if (packet.data[0] === PACKET_RETX_DATA0) {
+        stats.retxRequests++;
+      }
+
+      // Everything before the next expected seq, plus whatever the bitmap says arrived after it
+      const nextSeq = packet.data[1];
+      const bitmap = packet.data.readUInt16LE(2);
+      for (const seq of [...outstanding.keys()]) {
+        const offset = (nextSeq - seq) & 0xff;
+        if (offset > 0 && offset <= 128) {
+          acknowledge(seq, frame.timeUs);
+        }
+      }
+      for (let i = 0; i < 16; i++) {
+        if (bitmap & (1 << i)) {
+          acknowledge((nextSeq + i + 1) & 0xff, frame.timeUs);
+        }
+      }
+    }
+  }
+};
+
+const firstTime = (frames: TimedFrame[], direction: CaptureDirection, type: number) =>
+  frames.find(f => f.crcOk && f.direction === direction && !f.packet.isAck() && f.packet.data[0] === type)?.timeUs;
+
+// Phases of an update, between the first sightings of the packets that start and end them
+const findPhases = (frames: TimedFrame[], startUs: number, endUs: number) => {
+  const marks: [string, number | undefined][] = [
+    ['start', startUs],
+    ['sync', firstTime(frames, CaptureDirection.DeviceToHost, BL_PACKET_SYNC_OBSERVED_DATA0)],
+    ['handshake', firstTime(frames, CaptureDirection.HostToDevice, BL_PACKET_FW_LENGTH_RES_DATA0)],
+    ['erase', firstTime(frames, CaptureDirection.DeviceToHost, BL_PACKET_READY_FOR_DATA_DATA0)],
+    ['transfer', firstTime(frames, CaptureDirection.DeviceToHost, BL_PACKET_UPDATE_SUCCESSFUL_DATA0)],
+    ['verify', firstTime(frames, CaptureDirection.HostToDevice, BL_PACKET_BOOT_REQ_DATA0)],
+    ['boot', firstTime(frames, CaptureDirection.DeviceToHost, BL_PACKET_BOOT_RES_DATA0)],
+    ['end', endUs],
+  ];
+
+  // Each phase runs from the previous mark that was seen (an audit has no handshake, erase or
+  // transfer), and whatever follows the last one is the tail
+  const seen = marks.filter(([, time]) => time !== undefined) as [string, number][];
+  const phases: Phase[] = [];
+  for (let i = 1; i < seen.length; i++) {
+    const [name, endTime] = seen[i];
+    const startTime = seen[i - 1][1];
+    if (name !== 'end' || endTime > startTime) {
+      phases.push({ name: name === 'end' ? 'tail' : name, startUs: startTime, endUs: endTime });
+    }
+  }
+  return phases;
+};
+
+const phaseAt = (phases: Phase[], timeUs: number) =>
+  phases.find(p => timeUs >= p.startUs && timeUs < p.endUs)?.name ?? '-';
+
+export const analyzeCapture = (capture: Capture, idleGapMs = DEFAULT_IDLE_GAP_MS): CaptureReport => {
+  const records = capture.records;
+  const startUs = records.length ? records[0].timeUs : 0;
+  const endUs = records.length ? records[records.length - 1].timeUs : 0;
+
+  const frames = parseFrames(capture);
+  const phases = findPhases(frames, startUs, endUs);
+
+  const host = newDirectionStats();
+  const device = newDirectionStats();
+  matchAcks(frames, CaptureDirection.HostToDevice, host);
+  matchAcks(frames, CaptureDirection.DeviceToHost, device);
+
+  const syncAttempts = records.filter(r =>
+    r.direction === CaptureDirection.HostToDevice && (r.data.equals(SYNC_SEQ) || r.data.equals(SYNC_SEQ_BUS))).length;
+
+  const idleGaps: IdleGap[] = [];
+  for (let i = 1; i < records.length; i++) {
+    const gap = records[i].timeUs - records[i - 1].timeUs;
+    if (gap >= idleGapMs * 1000) {
+      idleGaps.push({ startUs: records[i - 1].timeUs, durationUs: gap, phase: phaseAt(phases, records[i - 1].timeUs) });
+    }
+  }
+
+  // Image bytes are the data frames sent (once each) while transferring
+  const transfer = phases.find(p => p.name === 'transfer');
+  let imageBytes = 0;
+  if (transfer) {
+    const seen = new Set<number>();
+    for (const frame of frames) {
+      if (frame.direction !== CaptureDirection.HostToDevice || !frame.crcOk || frame.packet.isAck()) continue;
+      if (frame.timeUs < transfer.startUs || frame.timeUs > transfer.endUs) continue;
+      if (!seen.has(frame.packet.seq)) {
+        imageBytes += frame.packet.length;
+      }
+      // Seqs repeat every 256 frames, so only remember the last window's worth
+      seen.add(frame.packet.seq);
+      seen.delete((frame.packet.seq - 64) & 0xff);
+    }
+  }
+
+  const durationMs = (endUs - startUs) / 1000;
+  return {
+    durationMs,
+    baudRate: capture.baudRate,
+    syncAttempts,
+    phases,
+    idleGapMs,
+    host,
+    device,
+    idleGaps,
+    idleTotalMs: idleGaps.reduce((total, gap) => total + gap.durationUs, 0) / 1000,
+    imageBytes,
+    transferGoodput: transfer ? imageBytes / ((transfer.endUs - transfer.startUs) / 1e6) : 0,
+    overallGoodput: durationMs > 0 ? imageBytes / (durationMs / 1000) : 0,
+  };
+};
+
+// The image the host sent, put back together the way the device would have: data frames follow
+// the firmware length response (and the extents of a sparse image), and are delivered in sequence
+// order however often they were sent. Whatever a sparse image skipped is left erased. A delta
+// update only sends the sectors that changed, so there's no whole image to put back together.
+export const extractImage = (capture: Capture) => {
+  const parser = new FrameParser();
+  let lengthRes: Packet | null = null;
+  let extentCount = 0;
+  const extents: Extent[] = [];
+  let nextSeq = 0;
+  const window = new Map<number, Buffer>();
+  const chunks: Buffer[] = [];
+  let received = 0;
+  let expected = 0;
+
+  for (const record of capture.records) {
+    if (record.direction !== CaptureDirection.HostToDevice) continue;
+
+    for (const { packet, crcOk } of parser.push(record.data)) {
+      if (!crcOk || packet.isAck() || packet.isLarge()) continue;
+
+      if (!lengthRes) {
+        if (packet.isSingleBytePacket(BL_PACKET_DELTA_UPDATE_REQ_DATA0)) {
+          throw new Error('Capture is of a delta update, which only has the sectors that changed (capture with --full to replay)');
+        }
+        if ((packet.length === 5 || packet.length === 6) && packet.data[0] === BL_PACKET_FW_LENGTH_RES_DATA0) {
+          lengthRes = packet;
+          extentCount = packet.length === 6 ? packet.data[5] : 0;
+          expected = extentCount === 0 ? packet.data.readUInt32LE(1) : 0;
+          nextSeq = (packet.seq + 1) & 0xff;
+        }
+        continue;
+      }
+
+      if (((packet.seq - nextSeq) & 0xff) >= COMMS_WINDOW_SIZE) continue;
+      window.set(packet.seq, packet.data.slice(0, packet.length));
+
+      while (window.has(nextSeq)) {
+        const data = window.get(nextSeq)!;
+        window.delete(nextSeq);
+        nextSeq = (nextSeq + 1) & 0xff;
+
+        if (extents.length < extentCount) {
+          if (data.length === 9 && data[0] === BL_PACKET_EXTENT_DATA0) {
+            extents.push({ offset: data.readUInt32LE(1), length: data.readUInt32LE(5) });
+            expected += data.readUInt32LE(5);
+          }
+          continue;
+        }
+        chunks.push(data);
+        received += data.length;
+      }
+
+      if (extents.length === extentCount && received >= expected) {
+        const length = lengthRes.data.readUInt32LE(1);
+        const data = Buffer.concat(chunks).slice(0, expected);
+        if (extentCount === 0) {
+          return data;
+        }
+
+        const image = Buffer.alloc(length, 0xff);
+        let position = 0;
+        for (const extent of extents) {
+          data.copy(image, extent.offset, position, position + extent.length);
+          position += extent.length;
+        }
+        return image;
+      }
+    }
+  }
+
+  throw new Error(lengthRes ? 'Capture ends before the whole image was sent' : 'No firmware update in the capture');
+};
+
+const percentile = (sorted: number[], p: number) =>
+  sorted.length ? sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))] : 0;
+
+const formatRtt = (rttMs: number[]) => {
+  const lines: string[] = [];
+  if (rttMs.length === 0) {
+    return ['    no RTT samples'];
+  }
+
+  const sorted = [...rttMs].sort((a, b) => a - b);
+  lines.push(`    RTT ms: min ${sorted[0].toFixed(2)}  p50 ${percentile(sorted, 0.5).toFixed(2)}  ` +
+    `p90 ${percentile(sorted, 0.9).toFixed(2)}  p99 ${percentile(sorted, 0.99).toFixed(2)}  ` +
+    `max ${sorted[sorted.length - 1].toFixed(2)}  (${sorted.length} samples)`);
+
+  // Log2 buckets of 1ms and up
+  const buckets = new Map<number, number>();
+  for (const rtt of sorted) {
+    const bucket = rtt < 1 ? 0 : Math.floor(Math.log2(rtt)) + 1;
+    buckets.set(bucket, (buckets.get(bucket) ?? 0) + 1);
+  }
+  const peak = Math.max(...buckets.values());
+  for (const [bucket, count] of [...buckets.entries()].sort((a, b) => a[0] - b[0])) {
+    const label = bucket === 0 ? '<1' : `${2 ** (bucket - 1)}-${2 ** bucket}`;
+    lines.push(`    ${label.padStart(10)} ms ${String(count).padStart(7)}  ${'#'.repeat(Math.round(count * 40 / peak))}`);
+  }
+  return lines;
+};
+
+const formatDirection = (name: string, stats: DirectionStats) => [
+  `  ${name}: ${stats.frames} sequenced frames (${stats.bytes} data bytes), ${stats.retransmits} retransmits, ` +
+    `${stats.retxRequests} RETX requests received, ${stats.crcErrors} CRC errors`,
+  ...formatRtt(stats.rttMs),
+];
+
+export const formatReport = (report: CaptureReport) => {
+  const ms = (us: number) => (us / 1000).toFixed(1);
+  const lines = [
+    `Session: ${(report.durationMs / 1000).toFixed(3)} s at ${report.baudRate} baud, ${report.syncAttempts} sync attempt(s)`,
+    '',
+    'Phases:',
+    ...report.phases.map(p => `  ${p.name.padEnd(12)} ${ms(p.endUs - p.startUs).padStart(10)} ms`),
+    '',
+    'Link:',
+    ...formatDirection('host -> device', report.host),
+    ...formatDirection('device -> host', report.device),
+    '',
+    `Idle gaps >= ${report.idleGapMs} ms: ${report.idleGaps.length}, ${report.idleTotalMs.toFixed(1)} ms in total`,
+    ...[...report.idleGaps].sort((a, b) => b.durationUs - a.durationUs).slice(0, REPORTED_GAPS)
+      .map(gap => `  ${ms(gap.durationUs).padStart(10)} ms at ${ms(gap.startUs)} ms (${gap.phase})`),
+    '',
+    `Goodput: ${report.imageBytes} image bytes, ${(report.transferGoodput / 1024).toFixed(2)} KiB/s while transferring, ` +
+      `${(report.overallGoodput / 1024).toFixed(2)} KiB/s overall`,
+  ];
+
+  // At 8N1 each byte takes 10 bit times
+  const transfer = report.phases.find(p => p.name === 'transfer');
+  if (transfer && report.baudRate > 0) {
+    lines.push(`Wire utilisation while transferring: ${(100 * report.transferGoodput / (report.baudRate / 10)).toFixed(1)}%`);
+  }
+
+  return lines.join('\n');
+};
+
+// Two runs of the same update (e.g. a capture and its replay) next to each other
+export const formatComparison = (names: [string, string], reports: [CaptureReport, CaptureReport]) => {
+  const [a, b] = reports;
+  const p50 = (rttMs: number[]) => percentile([...rttMs].sort((x, y) => x - y), 0.5);
+  const row = (label: string, values: [number, number], digits = 1) =>
+    `  ${label.padEnd(26)} ${values[0].toFixed(digits).padStart(12)} ${values[1].toFixed(digits).padStart(12)}`;
+
+  const phaseNames = [...new Set([...a.phases, ...b.phases].map(p => p.name))];
+  const phaseMs = (report: CaptureReport, name: string) => {
+    const phase = report.phases.find(p => p.name === name);
+    return phase ? (phase.endUs - phase.startUs) / 1000 : 0;
+  };
+
+  return [
+    `  ${''.padEnd(26)} ${names[0].padStart(12)} ${names[1].padStart(12)}`,
+    row('duration (ms)', [a.durationMs, b.durationMs]),
+    ...phaseNames.map(name => row(`  ${name} (ms)`, [phaseMs(a, name), phaseMs(b, name)])),
+    row('host frames', [a.host.frames, b.host.frames], 0),
+    row('host retransmits', [a.host.retransmits, b.host.retransmits], 0),
+    row('device retransmits', [a.device.retransmits, b.device.retransmits], 0),
+    row('RETX requests', [a.host.retxRequests + a.device.retxRequests, b.host.retxRequests + b.device.retxRequests], 0),
+    row('host RTT p50 (ms)', [p50(a.host.rttMs), p50(b.host.rttMs)], 2),
+    row('idle time (ms)', [a.idleTotalMs, b.idleTotalMs]),
+    row('transfer goodput (KiB/s)', [a.transferGoodput / 1024, b.transferGoodput / 1024], 2),
+    row('overall goodput (KiB/s)', [a.overallGoodput / 1024, b.overallGoodput / 1024], 2),
+  ].join('\n');
+};
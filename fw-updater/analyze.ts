@@ -0,0 +1,31 @@
+import {Logger} from './protocol';
+import {readCapture} from './capture';
+import {analyzeCapture, formatReport} from './analysis';
+
+const usage = () => {
+  console.log("usage: analyze <capture> [options]");
+  console.log("  --idle-gap <ms>       report gaps in traffic at least this long (default 20)");
+  process.exit(1);
+};
+
+async function main() {
+  const argv = process.argv.slice(2);
+  let captureFilename = '';
+  let idleGapMs: number | undefined;
+
+  for (let i = 0; i < argv.length; i++) {
+    if (argv[i] === '--idle-gap' && i + 1 < argv.length) idleGapMs = parseFloat(argv[++i]);
+    else if (!argv[i].startsWith('--') && !captureFilename) captureFilename = argv[i];
+    else usage();
+  }
+  if (!captureFilename || (idleGapMs !== undefined && isNaN(idleGapMs))) usage();
+
+  const capture = await readCapture(captureFilename);
+  console.log(formatReport(analyzeCapture(capture, idleGapMs)));
+}
+
+main()
+  .catch((e: Error) => {
+    Logger.error(e.message);
+    process.exit(1);
+  });
@@ -0,0 +1,90 @@
+import {FWINFO_DEVICE_ID_OFFSET, Logger} from './protocol';
+import {Port} from './link';
+import {DEFAULT_BAUD_RATE, DeviceSession} from './session';
+import {SimulatedDevice} from './sim-device';
+
+const usage = () => {
+  console.log("usage: benchmark [options]");
+  console.log("  --ber <p,p,...>       bit error rates to sweep (default 0,1e-4,3e-4,1e-3,2e-3,3e-3)");
+  console.log("  --length <bytes>      size of the (random) image sent each time (default 32768)");
+  console.log("  --baud <rate>         simulated baud rate (default 115200)");
+  console.log("  --seed <n>            seed for the simulated wire's errors (default 1)");
+  process.exit(1);
+};
+
+type Run = { ok: boolean, ms: number, fecCorrections: number };
+
+// Progress from every session would drown the table
+class QuietLogger extends Logger {
+  info() {}
+  success() {}
+  error() {}
+}
+
+// A full update of the image to a simulated device, over a wire that flips bits independently.
+// The device corrupts whole bytes, so a bit error rate is turned in to the chance of a byte having
+// at least one bit wrong.
+const runUpdate = async (image: Buffer, baudRate: number, ber: number, seed: number, fec: boolean): Promise<Run> => {
+  const device = new SimulatedDevice({
+    baudRate,
+    deviceId: image[FWINFO_DEVICE_ID_OFFSET],
+    byteErrorRate: 1 - Math.pow(1 - ber, 8),
+    seed,
+  });
+  const port = await Port.openOn('sim', device);
+  const session = DeviceSession.onPort(port, { logger: new QuietLogger(), baudRate, full: true, fec });
+
+  const start = Date.now();
+  let ok = true;
+  try {
+    await session.updateFirmware(image);
+  } catch (e) {
+    ok = false;
+  } finally {
+    await session.close();
+  }
+  return { ok, ms: Date.now() - start, fecCorrections: device.fecCorrections };
+};
+
+async function main() {
+  const argv = process.argv.slice(2);
+  const args = { bers: [0, 1e-4, 3e-4, 1e-3, 2e-3, 3e-3], length: 32768, baudRate: DEFAULT_BAUD_RATE, seed: 1 };
+
+  for (let i = 0; i < argv.length; i++) {
+    const arg = argv[i];
+    const value = () => {
+      if (i + 1 >= argv.length) usage();
+      return argv[++i];
+    };
+
+    if (arg === '--ber') args.bers = value().split(',').map(parseFloat);
+    else if (arg === '--length') args.length = parseInt(value(), 10);
+    else if (arg === '--baud') args.baudRate = parseInt(value(), 10);
+    else if (arg === '--seed') args.seed = parseInt(value(), 10);
+    else usage();
+  }
+  if (args.bers.some(isNaN) || isNaN(args.length) || isNaN(args.baudRate) || isNaN(args.seed)) usage();
+
+  // Random, so that none of it is skipped as erased, and the same every time
+  const image = Buffer.alloc(args.length);
+  let state = args.seed;
+  for (let i = 0; i < image.length; i++) {
+    state = (state * 1103515245 + 12345) >>> 0;
+    image[i] = state >>> 24;
+  }
+
+  const goodput = (run: Run) => run.ok ? `${(args.length / 1024 / (run.ms / 1000)).toFixed(2)} KiB/s` : 'failed';
+  console.log(`${args.length} byte image at ${args.baudRate} baud`);
+  console.log(`  ${'BER'.padEnd(10)} ${'ARQ only'.padStart(14)} ${'ARQ + FEC'.padStart(14)} ${'corrected'.padStart(10)}`);
+  for (const ber of args.bers) {
+    const arq = await runUpdate(image, args.baudRate, ber, args.seed, false);
+    const fec = await runUpdate(image, args.baudRate, ber, args.seed, true);
+    console.log(`  ${ber.toExponential(1).padEnd(10)} ${goodput(arq).padStart(14)} ${goodput(fec).padStart(14)} ${String(fec.fecCorrections).padStart(10)}`);
+  }
+}
+
+main()
+  .catch((e: Error) => {
+    Logger.error(e.message);
+    process.exit(1);
+  });
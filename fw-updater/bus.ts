@@ -0,0 +1,199 @@
+import {
+  BL_BUS_CHUNK_SIZE,
+  SYNC_SEQ_BUS,
+  delay,
+  Logger,
+  Packet,
+} from './protocol';
+import {Port} from './link';
+import {ChunkRange, DeviceSession, DEFAULT_BAUD_RATE} from './session';
+import {FleetResult} from './fleet';
+
+export type BusOptions = {
+  baudRate?: number;
+  // How long to keep sending the bus sync sequence, while the boards are being reset
+  syncTime?: number;
+  // Rounds of gap polling and re-broadcasting before giving up on the nodes still missing data
+  repairRounds?: number;
+  verbose?: boolean;
+  // Where everything is logged, instead of the console with a prefix per node
+  logger?: Logger;
+};
+
+const SYNC_INTERVAL = 100;
+const DEFAULT_SYNC_TIME = 2000;
+const DEFAULT_REPAIR_ROUNDS = 5;
+
+// Nodes erase their whole application after joining, before they can answer the first gap poll
+const ERASE_TIMEOUT = 15000;
+
+// Broadcast frames are written in batches, waiting for each one to leave the port, so that the
+// serial driver doesn't end up holding the whole image
+const BROADCAST_BATCH = 64;
+
+type BusNode = {
+  id: number;
+  log: Logger;
+  session: DeviceSession;
+  complete: boolean;
+  error: string;
+};
+
+const nodeName = (id: number) => `0x${id.toString(16).padStart(2, '0')}`;
+
+// Merge everyone's gaps in to the fewest ranges that cover them all
+const mergeRanges = (ranges: ChunkRange[]) => {
+  const merged: ChunkRange[] = [];
+  for (const range of [...ranges].sort((a, b) => a.first - b.first)) {
+    const last = merged[merged.length - 1];
+    if (last && range.first <= last.first + last.count) {
+      last.count = Math.max(last.count, range.first + range.count - last.first);
+    } else {
+      merged.push({ ...range });
+    }
+  }
+  return merged;
+};
+
+// Send the given chunks of the image to every node at once. Returns the number of chunks sent.
+const broadcastChunks = async (port: Port, fwImage: Buffer, ranges: ChunkRange[]) => {
+  let sent = 0;
+  for (const range of ranges) {
+    for (let chunk = range.first; chunk < range.first + range.count; chunk++) {
+      const offset = chunk * BL_BUS_CHUNK_SIZE;
+      port.broadcast(Packet.createBusDataPacket(offset, fwImage.slice(offset, offset + BL_BUS_CHUNK_SIZE)));
+      if (++sent % BROADCAST_BATCH === 0) {
+        await port.drain();
+      }
+    }
+  }
+  await port.drain();
+  return sent;
+};
+
+// Update every listed node on a multi-drop bus with the same image. Each node is set up in turn,
+// then the image is broadcast once to all of them without any acknowledgements. Afterwards each
+// node is polled for the chunks it missed, and only those are broadcast again, until none are
+// missing. Finally every node verifies its own copy and boots.
+export const runBusUpdate = async (path: string, nodeIds: number[], fwImage: Buffer, options: BusOptions = {}) => {
+  const port = await Port.open(path, options.baudRate ?? DEFAULT_BAUD_RATE);
+  return runBusUpdateOn(port, nodeIds, fwImage, options);
+};
+
+// The same, over a port that's already open (e.g. to a simulated bus), which is closed afterwards
+export const runBusUpdateOn = async (port: Port, nodeIds: number[], fwImage: Buffer, options: BusOptions = {}) => {
+  const path = port.path;
+  const busLog = options.logger ?? Logger.default;
+  const start = Date.now();
+  let repairRoundsUsed = 0;
+
+  const nodes: BusNode[] = nodeIds.map(id => {
+    const log = options.logger ?? new Logger(`[${path}#${nodeName(id)}]`);
+    const session = DeviceSession.onBus(port, id, { logger: log, verbose: options.verbose });
+    return { id, log, session, complete: false, error: '' };
+  });
+
+  const fail = (node: BusNode, error: string) => {
+    node.error = error;
+    node.log.error(error);
+  };
+  const active = () => nodes.filter(node => !node.error);
+
+  try {
+    busLog.info(`Putting the nodes on ${path} in to their bootloaders`);
+    for (let timeWaited = 0; timeWaited < (options.syncTime ?? DEFAULT_SYNC_TIME); timeWaited += SYNC_INTERVAL) {
+      port.writeRaw(SYNC_SEQ_BUS);
+      await delay(SYNC_INTERVAL);
+    }
+
+    // Each node starts erasing as soon as it has joined, so the erases all overlap
+    for (const node of nodes) {
+      try {
+        if (await node.session.joinBusUpdate(fwImage)) {
+          node.log.success('Joined the update');
+        } else {
+          fail(node, 'Node rejected the image');
+        }
+      } catch (e) {
+        fail(node, `Failed to join: ${(e as Error).message}`);
+      }
+    }
+
+    for (const node of active()) {
+      try {
+        await node.session.readBusGaps(ERASE_TIMEOUT);
+      } catch (e) {
+        fail(node, `No answer after erasing: ${(e as Error).message}`);
+      }
+    }
+
+    if (active().length === 0) {
+      throw new Error('No nodes joined the update');
+    }
+
+    const chunkCount = Math.ceil(fwImage.length / BL_BUS_CHUNK_SIZE);
+    busLog.info(`Broadcasting ${fwImage.length} bytes to ${active().length} node(s)`);
+    await broadcastChunks(port, fwImage, [{ first: 0, count: chunkCount }]);
+
+    const repairRounds = options.repairRounds ?? DEFAULT_REPAIR_ROUNDS;
+    for (let round = 1; ; round++) {
+      const gaps: ChunkRange[] = [];
+      for (const node of active().filter(n => !n.complete)) {
+        try {
+          const report = await node.session.readBusGaps();
+          if (report.missing === 0) {
+            node.complete = true;
+            node.log.success('Received the whole image');
+          } else {
+            node.log.info(`Missing ${report.missing} chunk(s) in ${report.gaps.length} range(s)`);
+            gaps.push(...report.gaps);
+          }
+        } catch (e) {
+          fail(node, `Gap poll failed: ${(e as Error).message}`);
+        }
+      }
+
+      if (gaps.length === 0) {
+        break;
+      }
+
+      if (round > repairRounds) {
+        active().filter(n => !n.complete).forEach(n => fail(n, `Still missing data after ${repairRounds} repair rounds`));
+        break;
+      }
+
+      const ranges = mergeRanges(gaps);
+      const sent = await broadcastChunks(port, fwImage, ranges);
+      repairRoundsUsed = round;
+      busLog.info(`Repair round ${round}: re-sent ${sent} chunk(s) in ${ranges.length} range(s)`);
+    }
+
+    for (const node of active()) {
+      try {
+        await node.session.verifyImage(fwImage, true);
+        if (!await node.session.boot()) {
+          throw new Error('Node rejected the image signature');
+        }
+        node.log.success('Firmware update complete!');
+      } catch (e) {
+        fail(node, (e as Error).message);
+      }
+    }
+  } finally {
+    for (const node of nodes) {
+      await node.session.close();
+    }
+    await port.close();
+  }
+
+  const wallTimeMs = Date.now() - start;
+  const results: FleetResult[] = nodes.map(node => ({
+    path: `${path}#${nodeName(node.id)}`,
+    ok: !node.error,
+    attempts: 1,
+    durationMs: wallTimeMs,
+    error: node.error || undefined,
+  }));
+
+  return { results, wallTimeMs, repairRounds: repairRoundsUsed };
+};
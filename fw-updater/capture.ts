@@ -0,0 +1,100 @@
+import * as fs from 'fs';
+import * as fsp from 'fs/promises';
+
+// Capture files start with a header (magic, baud rate, wall clock start time in ms), followed by
+// one record per chunk of bytes written or received: direction, time in us since the start of the
+// capture, length, then the bytes themselves.
+const CAPTURE_MAGIC = Buffer.from('FWCAP1');
+const CAPTURE_HEADER_BYTES = CAPTURE_MAGIC.length + 4 + 8;
+const RECORD_HEADER_BYTES = 1 + 4 + 2;
+const MAX_RECORD_BYTES = 0xffff;
+
+export enum CaptureDirection {
+  HostToDevice = 0,
+  DeviceToHost = 1,
+}
+
+export type CaptureRecord = {
+  direction: CaptureDirection;
+  timeUs: number;
+  data: Buffer;
+};
+
+export type Capture = {
+  baudRate: number;
+  startTime: Date;
+  records: CaptureRecord[];
+};
+
+export class CaptureWriter {
+  private stream: fs.WriteStream;
+  private start = process.hrtime.bigint();
+
+  private constructor(filename: string, baudRate: number) {
+    this.stream = fs.createWriteStream(filename);
+
+    const header = Buffer.alloc(CAPTURE_HEADER_BYTES);
+    CAPTURE_MAGIC.copy(header);
+    header.writeUInt32LE(baudRate, CAPTURE_MAGIC.length);
+    header.writeBigUInt64LE(BigInt(Date.now()), CAPTURE_MAGIC.length + 4);
+    this.stream.write(header);
+  }
+
+  static create(filename: string, baudRate: number) {
+    return new CaptureWriter(filename, baudRate);
+  }
+
+  record(direction: CaptureDirection, data: Buffer) {
+    const timeUs = Number((process.hrtime.bigint() - this.start) / 1000n);
+
+    for (let offset = 0; offset < data.length; offset += MAX_RECORD_BYTES) {
+      const chunk = data.slice(offset, offset + MAX_RECORD_BYTES);
+      const header = Buffer.alloc(RECORD_HEADER_BYTES);
+      header[0] = direction;
+      header.writeUInt32LE(timeUs >>> 0, 1);
+      header.writeUInt16LE(chunk.length, 5);
+      this.stream.write(Buffer.concat([header, chunk]));
+    }
+  }
+
+  close() {
+    return new Promise<void>(resolve => this.stream.end(() => resolve()));
+  }
+}
+
+export const readCapture = async (filename: string): Promise<Capture> => {
+  const file = await fsp.readFile(filename);
+  if (file.length < CAPTURE_HEADER_BYTES || !file.slice(0, CAPTURE_MAGIC.length).equals(CAPTURE_MAGIC)) {
+    throw new Error(`${filename} is not a capture file`);
+  }
+
+  const baudRate = file.readUInt32LE(CAPTURE_MAGIC.length);
+  const startTime = new Date(Number(file.readBigUInt64LE(CAPTURE_MAGIC.length + 4)));
+
+  // Times are stored in 32 bits, so unwrap them for captures over ~71 minutes
+  const records: CaptureRecord[] = [];
+  let wraps = 0;
+  let lastTime = 0;
+  let offset = CAPTURE_HEADER_BYTES;
+  while (offset + RECORD_HEADER_BYTES <= file.length) {
+    const time = file.readUInt32LE(offset + 1);
+    const length = file.readUInt16LE(offset + 5);
+    if (offset + RECORD_HEADER_BYTES + length > file.length) {
+      break; // Truncated by a crash, keep what's there
+    }
+
+    if (time < lastTime) {
+      wraps++;
+    }
+    lastTime = time;
+
+    records.push({
+      direction: file[offset] as CaptureDirection,
+      timeUs: wraps * 0x100000000 + time,
+      data: file.slice(offset + RECORD_HEADER_BYTES, offset + RECORD_HEADER_BYTES + length),
+    });
+    offset += RECORD_HEADER_BYTES + length;
+  }
+
+  return { baudRate, startTime, records };
+};
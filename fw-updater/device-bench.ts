@@ -0,0 +1,146 @@
+import * as fs from 'fs/promises';
+import {BENCH_NO_SECTOR, Logger} from './protocol';
+import {BenchResults, DeviceSession, DEFAULT_BAUD_RATE} from './session';
+
+const defaultResultsFilename = 'bench-results.jsonl';
+// A change for the worse of at least this much since the last run is flagged with a '!'
+const REGRESSION_PERCENT = 5;
+
+const usage = () => {
+  console.log("usage: fw-updater bench [options]");
+  console.log("  --port <path>         serial port the device is on (default /dev/ttyUSB0)");
+  console.log("  --baud <rate>         serial baud rate (default 115200)");
+  console.log(`  --results <file>      append the results to <file>, and compare with the device's last run in it (default ${defaultResultsFilename})`);
+  process.exit(1);
+};
+
+type Metric = {
+  name: string;
+  value: number;
+  unit: string;
+  higherIsBetter: boolean;
+};
+
+// One line of the results file
+type BenchRecord = {
+  date: string;
+  port: string;
+  results: BenchResults;
+  metrics: Metric[];
+};
+
+const metrics = (r: BenchResults): Metric[] => {
+  const seconds = (cycles: number) => cycles / r.cpuHz;
+  const kibPerS = (bytes: number, cycles: number) => bytes / 1024 / seconds(cycles);
+
+  const list: Metric[] = [
+    { name: 'crc8', value: kibPerS(r.dataLength, r.crc8Cycles), unit: 'KiB/s', higherIsBetter: true },
+    { name: 'crc32', value: kibPerS(r.dataLength, r.crc32Cycles), unit: 'KiB/s', higherIsBetter: true },
+    { name: 'AES_EncryptBlock', value: r.aesBlockCycles, unit: 'cycles', higherIsBetter: false },
+    { name: 'AES key schedule', value: r.keyScheduleCycles, unit: 'cycles', higherIsBetter: false },
+    { name: 'CBC-MAC', value: kibPerS(r.dataLength, r.cbcMacCycles), unit: 'KiB/s', higherIsBetter: true },
+  ];
+
+  if (r.flashSector !== BENCH_NO_SECTOR) {
+    list.push(
+      { name: 'flash program', value: seconds(r.flashProgramCycles) * 1e6 / r.flashProgramWords, unit: 'us/word', higherIsBetter: false },
+      { name: `sector ${r.flashSector} erase (${r.flashSectorSize / 1024}K)`, value: seconds(r.flashEraseCycles) * 1000, unit: 'ms', higherIsBetter: false },
+    );
+  }
+
+  list.push({ name: 'UART loopback', value: r.uartReceived / seconds(r.uartCycles), unit: 'bytes/s', higherIsBetter: true });
+  return list;
+};
+
+// The last run on the same chip, from a results file that may not exist yet
+const previousRun = async (filename: string, uniqueId: string) => {
+  let text = '';
+  try {
+    text = await fs.readFile(filename, 'utf8');
+  } catch (e) {
+    return null;
+  }
+
+  const records = text.split('\n').filter(line => line.trim()).map(line => JSON.parse(line) as BenchRecord);
+  return records.reverse().find(record => record.results.uniqueId === uniqueId) ?? null;
+};
+
+const printMetrics = (current: Metric[], previous: BenchRecord | null) => {
+  const before = new Map((previous?.metrics ?? []).map(metric => [metric.name, metric.value]));
+  console.log(`  ${'benchmark'.padEnd(28)} ${'result'.padStart(12)} ${''.padEnd(8)} ${'last run'.padStart(12)} ${'change'.padStart(8)}`);
+
+  for (const metric of current) {
+    const old = before.get(metric.name);
+    let change = '';
+    if (old !== undefined && old !== 0) {
+      const percent = (metric.value - old) * 100 / old;
+      const worse = metric.higherIsBetter ? percent < 0 : percent > 0;
+      change = `${percent >= 0 ? '+' : ''}${percent.toFixed(1)}%${worse && Math.abs(percent) >= REGRESSION_PERCENT ? ' !' : ''}`;
+    }
+    console.log(`  ${metric.name.padEnd(28)} ${metric.value.toFixed(2).padStart(12)} ${metric.unit.padEnd(8)} ` +
+      `${(old !== undefined ? old.toFixed(2) : '-').padStart(12)} ${change.padStart(8)}`);
+  }
+};
+
+// Sync with the bootloader, run its self-benchmark, then boot the application as usual
+export const runBench = async (argv: string[]) => {
+  const args = { port: '/dev/ttyUSB0', baudRate: DEFAULT_BAUD_RATE, resultsFilename: defaultResultsFilename };
+
+  for (let i = 0; i < argv.length; i++) {
+    const arg = argv[i];
+    const value = () => {
+      if (i + 1 >= argv.length) usage();
+      return argv[++i];
+    };
+
+    if (arg === '--port') args.port = value();
+    else if (arg === '--baud') args.baudRate = parseInt(value(), 10);
+    else if (arg === '--results') args.resultsFilename = value();
+    else usage();
+  }
+  if (isNaN(args.baudRate)) usage();
+
+  const session = await DeviceSession.open(args.port, { baudRate: args.baudRate });
+  let results: BenchResults | null = null;
+  try {
+    Logger.info('Attempting to sync with the bootloader');
+    await session.syncWithBootloader();
+    Logger.success('Synced!');
+
+    Logger.info('Running the self-benchmark (this erases a blank flash sector, so takes a few seconds)');
+    results = await session.readBench();
+
+    if (!await session.boot()) {
+      Logger.error('Device rejected the installed application');
+    }
+  } finally {
+    await session.close();
+  }
+
+  if (results === null) {
+    Logger.error("The bootloader was built without the self-benchmark, build it with 'make DIAGNOSTICS=1'");
+    process.exitCode = 1;
+    return;
+  }
+
+  const previous = await previousRun(args.resultsFilename, results.uniqueId);
+  const current = metrics(results);
+  Logger.success(`Device ${results.uniqueId}, bootloader ${results.bootloaderCrc.toString(16).padStart(8, '0')}, ` +
+    `application version ${results.appVersion}, ${results.cpuHz / 1e6} MHz`);
+  printMetrics(current, previous);
+  if (previous) {
+    Logger.info(`Compared with ${previous.date} (bootloader ${previous.results.bootloaderCrc.toString(16).padStart(8, '0')}, ` +
+      `application version ${previous.results.appVersion})`);
+  }
+
+  if (results.flashSector === BENCH_NO_SECTOR) {
+    Logger.error('No application sector was blank, so flash programming and erasing were left out');
+  }
+  if (results.uartReceived !== results.uartLength) {
+    Logger.error(`Only ${results.uartReceived}/${results.uartLength} UART loopback bytes came back intact`);
+  }
+
+  const record: BenchRecord = { date: new Date().toISOString(), port: args.port, results, metrics: current };
+  await fs.appendFile(args.resultsFilename, JSON.stringify(record) + '\n');
+  Logger.success(`Saved the results to ${args.resultsFilename}`);
+};
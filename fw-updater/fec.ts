@@ -0,0 +1,51 @@
+// The same shortened Reed-Solomon code as the bootloader's fec.c: GF(2^8) with polynomial 0x11d,
+// and a generator with the roots 1 and alpha (2), i.e. x^2 + 3x + 2. Two parity bytes put right
+// any one wrong byte in up to 255.
+export const FEC_PARITY_BYTES = 2;
+
+const gfMul2 = (value: number) => ((value << 1) ^ ((value & 0x80) ? 0x1d : 0x00)) & 0xff;
+
+// The remainder of the data (shifted up by the parity) divided by the generator, as an LFSR
+export const fecParity = (data: Buffer | Array<number>) => {
+  let p0 = 0;
+  let p1 = 0;
+  for (const byte of data) {
+    const feedback = byte ^ p0;
+    p0 = p1 ^ gfMul2(feedback) ^ feedback;
+    p1 = gfMul2(feedback);
+  }
+  return Buffer.from([p0, p1]);
+};
+
+export enum FecResult {
+  Ok,
+  Corrected,
+  Uncorrectable,
+}
+
+// Check a codeword (data then parity), fixing it in place if one byte is wrong
+export const fecCorrect = (codeword: Buffer) => {
+  let s0 = 0;
+  let s1 = 0;
+  for (const byte of codeword) {
+    s0 ^= byte;
+    s1 = gfMul2(s1) ^ byte;
+  }
+
+  if (s0 === 0 && s1 === 0) {
+    return FecResult.Ok;
+  }
+  if (s0 === 0 || s1 === 0) {
+    return FecResult.Uncorrectable;
+  }
+
+  let errorAtPower = s0;
+  for (let power = 0; power < codeword.length; power++) {
+    if (errorAtPower === s1) {
+      codeword[codeword.length - 1 - power] ^= s0;
+      return FecResult.Corrected;
+    }
+    errorAtPower = gfMul2(errorAtPower);
+  }
+  return FecResult.Uncorrectable;
+};
@@ -0,0 +1,161 @@
+import * as fs from 'fs/promises';
+import * as path from 'path';
+import {delay, Logger} from './protocol';
+import {DeviceSession, SessionOptions} from './session';
+
+export type FleetOptions = {
+  baudRate?: number;
+  // Maximum number of ports being flashed at any one time
+  concurrency?: number;
+  // Number of extra attempts a port gets after its first failure
+  retries?: number;
+  // Pause between attempts on the same port. A retry can only sync if the board is still in its
+  // bootloader: one whose update failed part way has no valid app, and resets back into it, but
+  // one that booted its app (e.g. after a failed audit, or a device ID mismatch) has to be reset
+  // by hand before its next attempt.
+  retryDelay?: number;
+  // Compare the installed application with the image instead of flashing it
+  audit?: boolean;
+  // Send erased runs too, rather than only the populated extents
+  dense?: boolean;
+  // Write every sector, even ones that already match the image
+  full?: boolean;
+  // Send frames with FEC parity
+  fec?: boolean;
+  verbose?: boolean;
+  // Where each port's progress goes, by default the console with the port as a prefix
+  logger?: (port: string) => Logger;
+  // Opens the session for each attempt, DeviceSession.open unless something else (e.g. a simulated
+  // device) stands in for the port
+  openSession?: (port: string, options: SessionOptions) => Promise<DeviceSession>;
+};
+
+export type FleetResult = {
+  path: string;
+  ok: boolean;
+  attempts: number;
+  durationMs: number;
+  error?: string;
+};
+
+const globToRegExp = (pattern: string) => {
+  let source = '';
+  for (const c of pattern) {
+    if (c === '*') source += '[^/]*';
+    else if (c === '?') source += '[^/]';
+    else source += c.replace(/[.+^${}()|[\]\\]/g, '\\$&');
+  }
+  return new RegExp(`^${source}$`);
+};
+
+// Expand any globs in the list of ports (only the final path component may contain wildcards,
+// which covers the /dev/ttyUSB* and /dev/pts/* cases). Duplicates are dropped, order is kept.
+export const expandPorts = async (patterns: string[]) => {
+  const ports: string[] = [];
+
+  for (const pattern of patterns) {
+    if (!/[*?]/.test(pattern)) {
+      ports.push(pattern);
+      continue;
+    }
+
+    const dir = path.dirname(pattern);
+    const matcher = globToRegExp(path.basename(pattern));
+    const entries = await fs.readdir(dir).catch(() => [] as string[]);
+    entries
+      .filter(entry => matcher.test(entry))
+      .sort()
+      .forEach(entry => ports.push(path.join(dir, entry)));
+  }
+
+  return [...new Set(ports)];
+};
+
+const flashPort = async (port: string, fwImage: Buffer, options: FleetOptions): Promise<FleetResult> => {
+  const log = options.logger ? options.logger(port) : new Logger(`[${port}]`);
+  const maxAttempts = 1 + (options.retries ?? 0);
+  const openSession = options.openSession ?? DeviceSession.open;
+  const start = Date.now();
+  let error = '';
+
+  for (let attempt = 1; attempt <= maxAttempts; attempt++) {
+    let session: DeviceSession | null = null;
+    try {
+      session = await openSession(port, { baudRate: options.baudRate, logger: log, verbose: options.verbose, dense: options.dense, full: options.full, fec: options.fec });
+      if (options.audit) {
+        const mismatches = await session.auditImage(fwImage);
+        if (mismatches.length > 0) {
+          throw new Error(`${mismatches.length} sector(s) differ from the image`);
+        }
+      } else {
+        await session.updateFirmware(fwImage);
+      }
+      return { path: port, ok: true, attempts: attempt, durationMs: Date.now() - start };
+    } catch (e) {
+      error = (e as Error).message;
+      log.error(`Attempt ${attempt}/${maxAttempts} failed: ${error}`);
+    } finally {
+      if (session) {
+        await session.close();
+      }
+    }
+
+    if (attempt < maxAttempts) {
+      await delay(options.retryDelay ?? 1000);
+    }
+  }
+
+  return { path: port, ok: false, attempts: maxAttempts, durationMs: Date.now() - start, error };
+};
+
+// Flash every port with the same image, keeping at most `concurrency` sessions in flight
+export const runFleet = async (ports: string[], fwImage: Buffer, options: FleetOptions = {}) => {
+  const concurrency = Math.max(1, options.concurrency ?? ports.length);
+  const results: FleetResult[] = new Array(ports.length);
+  let nextPort = 0;
+
+  const worker = async () => {
+    while (nextPort < ports.length) {
+      const index = nextPort++;
+      results[index] = await flashPort(ports[index], fwImage, options);
+    }
+  };
+
+  const start = Date.now();
+  await Promise.all(Array.from({ length: Math.min(concurrency, ports.length) }, worker));
+  return { results, wallTimeMs: Date.now() - start };
+};
+
+export const summarizeFleet = (results: FleetResult[], wallTimeMs: number, imageLength: number) => {
+  const succeeded = results.filter(r => r.ok).length;
+  const wallSeconds = wallTimeMs / 1000;
+  return {
+    succeeded,
+    failed: results.length - succeeded,
+    retried: results.filter(r => r.attempts > 1).length,
+    wallSeconds,
+    serialSeconds: results.reduce((sum, r) => sum + r.durationMs, 0) / 1000,
+    bytesPerSecond: succeeded * imageLength / wallSeconds,
+    boardsPerHour: succeeded * 3600 / wallSeconds,
+  };
+};
+
+export const printFleetReport = (results: FleetResult[], wallTimeMs: number, imageLength: number) => {
+  console.log('');
+  Logger.info('Fleet report');
+  for (const r of results) {
+    const seconds = (r.durationMs / 1000).toFixed(1);
+    const attempts = `${r.attempts} attempt${r.attempts === 1 ? '' : 's'}`;
+    if (r.ok) {
+      Logger.success(`${r.path}: ok in ${seconds}s (${attempts})`);
+    } else {
+      Logger.error(`${r.path}: FAILED after ${seconds}s (${attempts}): ${r.error}`);
+    }
+  }
+
+  const summary = summarizeFleet(results, wallTimeMs, imageLength);
+  console.log('');
+  Logger.info(`Boards:     ${summary.succeeded}/${results.length} succeeded, ${summary.failed} failed, ${summary.retried} needed retries`);
+  Logger.info(`Wall time:  ${summary.wallSeconds.toFixed(1)}s (${summary.serialSeconds.toFixed(1)}s if flashed one at a time)`);
+  Logger.info(`Throughput: ${summary.bytesPerSecond.toFixed(0)} B/s aggregate, ${summary.boardsPerHour.toFixed(0)} boards/hour`);
+};
@@ -0,0 +1,48 @@
+import * as fs from 'fs/promises';
+
+// A signed image, either as the signer wrote it (a flat binary), or as Intel HEX. A HEX file is laid
+// out from its lowest address, which is where the vector table starts, with any gaps left as 0xff.
+const parseHex = (text: string, filename: string) => {
+  const segments: { address: number, data: Buffer }[] = [];
+  let upper = 0;
+
+  const lines = text.split(/\r?\n/);
+  for (let i = 0; i < lines.length; i++) {
+    const line = lines[i].trim();
+    if (!line) continue;
+
+    const record = Buffer.from(line.slice(1), 'hex');
+    const checksum = record.reduce((a, b) => a + b, 0) & 0xff;
+    if (!line.startsWith(':') || record.length < 5 || record.length !== record[0] + 5 || checksum !== 0) {
+      throw new Error(`${filename}:${i + 1}: bad Intel HEX record`);
+    }
+
+    const address = record.readUInt16BE(1);
+    const type = record[3];
+    const payload = record.slice(4, record.length - 1);
+    if (type === 0x00) segments.push({ address: upper + address, data: payload });
+    else if (type === 0x01) break;
+    else if (type === 0x02) upper = payload.readUInt16BE(0) << 4;
+    else if (type === 0x04) upper = payload.readUInt16BE(0) * 0x10000;
+  }
+
+  if (segments.length === 0) {
+    throw new Error(`${filename} has no data records`);
+  }
+
+  const base = Math.min(...segments.map(s => s.address));
+  const end = Math.max(...segments.map(s => s.address + s.data.length));
+  const image = Buffer.alloc(end - base, 0xff);
+  for (const { address, data } of segments) {
+    data.copy(image, address - base);
+  }
+  return image;
+};
+
+export const loadImage = async (filename: string) => {
+  const data = await fs.readFile(filename);
+  if (/\.i?hex$/i.test(filename)) {
+    return parseHex(data.toString('ascii'), filename);
+  }
+  return data;
+};
@@ -1,327 +1,251 @@
 import * as fs from 'fs/promises';
+import {createWriteStream} from 'fs';
 import * as path from 'path';
-import {SerialPort} from 'serialport';
-
-// Constants for the packet protocol
-const PACKET_LENGTH_BYTES   = 1;
-const PACKET_DATA_BYTES     = 16;
-const PACKET_CRC_BYTES      = 1;
-const PACKET_CRC_INDEX      = PACKET_LENGTH_BYTES + PACKET_DATA_BYTES;
-const PACKET_LENGTH         = PACKET_LENGTH_BYTES + PACKET_DATA_BYTES + PACKET_CRC_BYTES;
-
-const PACKET_ACK_DATA0      = 0x15;
-const PACKET_RETX_DATA0     = 0x19;
-
-const BL_PACKET_SYNC_OBSERVED_DATA0     = (0x20);
-const BL_PACKET_FW_UPDATE_REQ_DATA0     = (0x31);
-const BL_PACKET_FW_UPDATE_RES_DATA0     = (0x37);
-const BL_PACKET_DEVICE_ID_REQ_DATA0     = (0x3C);
-const BL_PACKET_DEVICE_ID_RES_DATA0     = (0x3F);
-const BL_PACKET_FW_LENGTH_REQ_DATA0     = (0x42);
-const BL_PACKET_FW_LENGTH_RES_DATA0     = (0x45);
-const BL_PACKET_READY_FOR_DATA_DATA0    = (0x48);
-const BL_PACKET_UPDATE_SUCCESSFUL_DATA0 = (0x54);
-const BL_PACKET_NACK_DATA0              = (0x59);
-
-const VECTOR_TABLE_SIZE                 = (0x01B0);
-
-const FWINFO_DEVICE_ID_OFFSET           = (VECTOR_TABLE_SIZE + (1 * 4));
-const FWINFO_LENGTH_OFFSET              = (VECTOR_TABLE_SIZE + (3 * 4));
-
-const SYNC_SEQ  = Buffer.from([0xc4, 0x55, 0x7e, 0x10]);
-const DEFAULT_TIMEOUT  = (5000);
+import {Logger} from './protocol';
+import {DeviceSession, DEFAULT_BAUD_RATE} from './session';
+import {expandPorts, runFleet, printFleetReport} from './fleet';
+import {runBusUpdate} from './bus';
+import {CaptureWriter} from './capture';
+import {loadImage} from './image';
+import {runBench} from './device-bench';
 
 // Details about the serial port connection
-const serialPath            = "/dev/ttyUSB0";
-const baudRate              = 115200;
-
-// CRC8 implementation
-const crc8 = (data: Buffer | Array<number>) => {
-  let crc = 0;
-
-  for (const byte of data) {
-    crc = (crc ^ byte) & 0xff;
-    for (let i = 0; i < 8; i++) {
-      if (crc & 0x80) {
-        crc = ((crc << 1) ^ 0x07) & 0xff;
-      } else {
-        crc = (crc << 1) & 0xff;
-      }
-    }
-  }
-
-  return crc;
+const defaultSerialPath     = "/dev/ttyUSB0";
+
+const usage = () => {
+  console.log("usage: fw-updater <signed firmware (.bin or .hex)> [options]");
+  console.log("       fw-updater bench [options]    run the bootloader's self-benchmark (see fw-updater bench --help)");
+  console.log("  --port <path|glob>    serial port to flash, may be given more than once (default /dev/ttyUSB0)");
+  console.log("                        (a USB port such as /dev/ttyACM0 talks to the bootloader over USB instead)");
+  console.log("  --concurrency <n>     maximum number of ports flashed at once (default: all)");
+  console.log("  --retries <n>         extra attempts per port after a failure (default 0)");
+  console.log("  --baud <rate>         serial baud rate (default 115200)");
+  console.log("  --audit               compare the installed application with the image, without flashing");
+  console.log("  --ram                 load an image built with 'make ram' in to RAM and run it, leaving flash alone");
+  console.log("  --dense               send the whole image, including erased (0xff) runs that are skipped by default");
+  console.log("  --full                erase and write the whole application, not just the sectors that differ");
+  console.log("  --fec                 add parity to every frame sent, so the bootloader can fix a wrong byte itself");
+  console.log("  --node <id>           update node <id> on the multi-drop bus at --port, may be given more than once");
+  console.log("  --trace <file>        append the bootloader's trace records to <file> (single port only)");
+  console.log("  --profile <file>      save the bootloader's profiling scopes, link stats and memory use to <file> as JSON before booting");
+  console.log("  --latency <n>         with --profile, first time UART interrupt entry on <n> bytes (max 255)");
+  console.log("  --pc-histogram <file> save the PC histogram of a 'make PC_SAMPLING=1' bootloader to <file>, for fw-tools/link-order.py");
+  console.log("  --boot-timeline <file> append the last boot's timeline to <file> (one JSON line per run)");
+  console.log("  --capture <file>      record every byte on the wire to <file>, for analyze and replay (single port only)");
+  console.log("  --verbose             log every data packet");
+  process.exit(1);
 };
 
-const crc32 = (data: Buffer, length: number) => {
-  let byte;
-  let crc = 0xffffffff;
-  let mask;
-
-  for (let i = 0; i < length; i++) {
-     byte = data[i];
-     crc = (crc ^ byte) >>> 0;
-
-     for (let j = 0; j < 8; j++) {
-        mask = (-(crc & 1)) >>> 0;
-        crc = ((crc >>> 1) ^ (0xedb88320 & mask)) >>> 0;
-     }
+const parseArgs = (argv: string[]) => {
+  const args = {
+    firmwareFilename: '',
+    ports: [] as string[],
+    concurrency: 0,
+    retries: 0,
+    baudRate: DEFAULT_BAUD_RATE,
+    audit: false,
+    ram: false,
+    dense: false,
+    full: false,
+    fec: false,
+    verbose: false,
+    nodes: [] as number[],
+    traceFilename: '',
+    profileFilename: '',
+    latencySamples: 0,
+    pcHistogramFilename: '',
+    bootTimelineFilename: '',
+    captureFilename: '',
+  };
+
+  for (let i = 0; i < argv.length; i++) {
+    const arg = argv[i];
+    const value = () => {
+      if (i + 1 >= argv.length) usage();
+      return argv[++i];
+    };
+
+    if (arg === '--port') args.ports.push(value());
+    else if (arg === '--concurrency') args.concurrency = parseInt(value(), 10);
+    else if (arg === '--retries') args.retries = parseInt(value(), 10);
+    else if (arg === '--baud') args.baudRate = parseInt(value(), 10);
+    else if (arg === '--audit') args.audit = true;
+    else if (arg === '--ram') args.ram = true;
+    else if (arg === '--dense') args.dense = true;
+    else if (arg === '--full') args.full = true;
+    else if (arg === '--fec') args.fec = true;
+    else if (arg === '--node') args.nodes.push(parseInt(value()));
+    else if (arg === '--trace') args.traceFilename = value();
+    else if (arg === '--profile') args.profileFilename = value();
+    else if (arg === '--capture') args.captureFilename = value();
+    else if (arg === '--latency') args.latencySamples = parseInt(value(), 10);
+    else if (arg === '--pc-histogram') args.pcHistogramFilename = value();
+    else if (arg === '--boot-timeline') args.bootTimelineFilename = value();
+    else if (arg === '--verbose') args.verbose = true;
+    else if (arg.startsWith('--')) usage();
+    else if (!args.firmwareFilename) args.firmwareFilename = arg;
+    else usage();
   }
 
-  return (~crc) >>> 0;
-}
-
-// Async delay function, which gives the event loop time to process outside input
-const delay = (ms: number) => new Promise(r => setTimeout(r, ms));
-
-class Logger {
-  static info(message: string) { console.log(`[.] ${message}`); }
-  static success(message: string) { console.log(`[$] ${message}`); }
-  static error(message: string) { console.log(`[!] ${message}`); }
-}
-
-// Class for serialising and deserialising packets
-class Packet {
-  length: number;
-  data: Buffer;
-  crc: number;
-
-  static retx = new Packet(1, Buffer.from([PACKET_RETX_DATA0]));
-  static ack = new Packet(1, Buffer.from([PACKET_ACK_DATA0]));
-
-  constructor(length: number, data: Buffer, crc?: number) {
-    this.length = length;
-    this.data = data;
+  if (!args.firmwareFilename) usage();
+  if (args.ports.length === 0) args.ports.push(defaultSerialPath);
 
-    const bytesToPad = PACKET_DATA_BYTES - this.data.length;
-    const padding = Buffer.alloc(bytesToPad).fill(0xff);
-    this.data = Buffer.concat([this.data, padding]);
-
-    if (typeof crc === 'undefined') {
-      this.crc = this.computeCrc();
-    } else {
-      this.crc = crc;
-    }
-  }
-
-  computeCrc() {
-    const allData = [this.length, ...this.data];
-    return crc8(allData);
-  }
+  return args;
+};
 
-  toBuffer() {
-    return Buffer.concat([ Buffer.from([this.length]), this.data, Buffer.from([this.crc]) ]);
+// Do everything in an async function so we can have loops, awaits etc
+const main = async () => {
+  if (process.argv[2] === 'bench') {
+    await runBench(process.argv.slice(3));
+    return;
   }
 
-  isSingleBytePacket(byte: number) {
-    if (this.length !== 1) return false;
-    if (this.data[0] !== byte) return false;
-    for (let i = 1; i < PACKET_DATA_BYTES; i++) {
-      if (this.data[i] !== 0xff) return false;
-    }
-    return true;
-  }
+  const args = parseArgs(process.argv.slice(2));
 
-  isAck() {
-    return this.isSingleBytePacket(PACKET_ACK_DATA0);
-  }
-
-  isRetx() {
-    return this.isSingleBytePacket(PACKET_RETX_DATA0);
-  }
+  Logger.info('Reading the firmware image...');
+  const fwImage = await loadImage(path.join(process.cwd(), args.firmwareFilename));
+  const fwLength = fwImage.length;
+  Logger.success(`Read firmware image (${fwLength} bytes)`);
 
-  static createSingleBytePacket(byte: number) {
-    return new Packet(1, Buffer.from([byte]));
+  const ports = await expandPorts(args.ports);
+  if (ports.length === 0) {
+    Logger.error(`No serial ports matched ${args.ports.join(', ')}`);
+    process.exit(1);
   }
-}
-
-// Serial port instance
-const uart = new SerialPort({ path: serialPath, baudRate });
-
-// Packet buffer
-let packets: Packet[] = [];
-
-let lastPacket: Packet = new Packet(1, Buffer.from([0xff]));
-const writePacket = (packet: Packet) => {
-  uart.write(packet.toBuffer());
-  lastPacket = packet;
-};
-
-// Serial data buffer, with a splice-like function for consuming data
-let rxBuffer = Buffer.from([]);
-const consumeFromBuffer = (n: number) => {
-  const consumed = rxBuffer.slice(0, n);
-  rxBuffer = rxBuffer.slice(n);
-  return consumed;
-}
-
-// This function fires whenever data is received over the serial port. The whole
-// packet state machine runs here.
-uart.on('data', data => {
-  // Add the data to the packet
-  rxBuffer = Buffer.concat([rxBuffer, data]);
-
-  // Can we build a packet?
-  while (rxBuffer.length >= PACKET_LENGTH) {
-    const raw = consumeFromBuffer(PACKET_LENGTH);
-    // console.log(raw);
-    const packet = new Packet(raw[0], raw.slice(1, 1+PACKET_DATA_BYTES), raw[PACKET_CRC_INDEX]);
-    const computedCrc = packet.computeCrc();
-
-    // Need retransmission?
-    if (packet.crc !== computedCrc) {
-      // console.log(`CRC failed, computed 0x${computedCrc.toString(16)}, got 0x${packet.crc.toString(16)}`);
-      writePacket(Packet.retx);
-      continue;
-    }
-
-    // Are we being asked to retransmit?
-    if (packet.isRetx()) {
-      // console.log(`Retransmitting last packet`);
-      // console.log(`Last packet:`, lastPacket);
-      writePacket(lastPacket);
-      continue;
-    }
-
-    // If this is an ack, move on
-    if (packet.isAck()) {
-      continue;
-    }
 
-    // If this is an nack, exit the program
-    if (packet.isSingleBytePacket(BL_PACKET_NACK_DATA0)) {
-      Logger.error('Received NACK. Exiting...');
-      // console.log('packets', packets);
-      // console.log('uart buffer', rxBuffer);
-      process.exit(1);
-    }
-
-    // Otherwise write the packet in to the buffer, and send an ack
-    packets.push(packet);
-    writePacket(Packet.ack);
-  }
-});
+  // Nodes sharing a bus are all updated at once, by broadcast
+  if (args.nodes.length > 0) {
+    if (ports.length !== 1 || args.audit || args.ram || args.fec || args.nodes.some(isNaN)) usage();
 
-// Function to allow us to await a packet
-const waitForPacket = async (timeout = DEFAULT_TIMEOUT) => {
-  let timeWaited = 0;
-  while (packets.length < 1) {
-    await delay(1);
-    timeWaited += 1;
+    Logger.info(`Updating ${args.nodes.length} node(s) on ${ports[0]}`);
+    const { results, wallTimeMs } = await runBusUpdate(ports[0], args.nodes, fwImage, {
+      baudRate: args.baudRate,
+      verbose: args.verbose,
+    });
+    printFleetReport(results, wallTimeMs, fwLength);
 
-    if (timeWaited >= timeout) {
-      throw Error('Timed out waiting for packet');
+    if (results.some(r => !r.ok)) {
+      process.exitCode = 1;
     }
+    return;
   }
-  return packets.splice(0, 1)[0];
-}
 
-const waitForSingleBytePacket = (byte: number, timeout = DEFAULT_TIMEOUT) => (
-  waitForPacket(timeout)
-    .then(packet => {
-      if (packet.length !== 1 || packet.data[0] !== byte) {
-        const formattedPacket = [...packet.toBuffer()].map(x => x.toString(16)).join(' ');
-        throw new Error(`Unexpected packet received. Expected single byte 0x${byte.toString(16)}), got packet ${formattedPacket}`);
+  const diagnostics = args.traceFilename || args.profileFilename || args.pcHistogramFilename || args.bootTimelineFilename || args.captureFilename;
+  if (diagnostics && (ports.length !== 1 || args.retries !== 0)) usage();
+  if (args.latencySamples && (!args.profileFilename || isNaN(args.latencySamples))) usage();
+  if (args.ram && (ports.length !== 1 || args.retries !== 0 || args.audit)) usage();
+
+  // A single port with no retries behaves exactly like the original one-board updater
+  if (ports.length === 1 && args.retries === 0) {
+    const trace = !!args.traceFilename;
+
+    // Collected while the bootloader is still running, just before it's asked to boot
+    const beforeBoot = async (session: DeviceSession) => {
+      if (args.profileFilename) {
+        if (args.latencySamples > 0) {
+          const taken = await session.measureUartLatency(args.latencySamples);
+          Logger.info(`Measured UART interrupt latency on ${taken}/${args.latencySamples} byte(s)`);
+        }
+        const scopes = await session.readProfile();
+        const link = await session.readLinkStats();
+        const memory = await session.readMemoryUsage();
+        await fs.writeFile(args.profileFilename, JSON.stringify({ scopes, link, memory }, null, 2) + '\n');
+        Logger.success(`Saved ${scopes.length} profiling scope(s) to ${args.profileFilename}`);
+        if (scopes.length === 0) {
+          Logger.info(`The bootloader only has profiling scopes when it's built with 'make DIAGNOSTICS=1'`);
+        }
+        Logger.info(`RAM at 0x${memory.ramStart.toString(16)}, ${memory.ramBytes} bytes: ${memory.noinitBytes} noinit, ` +
+          `${memory.dataBytes} data, ${memory.bssBytes} bss, stack ${memory.stackPeakBytes}/${memory.stackBytes} used at most`);
+        for (const buffer of memory.buffers) {
+          const log = buffer.overflows > 0 ? Logger.error : Logger.info;
+          log(`  ${buffer.name}: ${buffer.peak}/${buffer.capacity} at most, ${buffer.overflows} overflow(s)`);
+        }
       }
-    })
-    .catch((e: Error) => {
-      Logger.error(e.message);
-      console.log(rxBuffer);
-      console.log(packets);
-      process.exit(1);
-    })
-);
-
-const syncWithBootloader = async (syncDelay = 500, timeout = DEFAULT_TIMEOUT) => {
-  let timeWaited = 0;
-
-  while (true) {
-    uart.write(SYNC_SEQ);
-    await delay(syncDelay);
-    timeWaited += syncDelay;
-
-    if (packets.length > 0) {
-      const packet = packets.splice(0, 1)[0];
-      if (packet.isSingleBytePacket(BL_PACKET_SYNC_OBSERVED_DATA0)) {
-        return;
+      if (args.pcHistogramFilename) {
+        const histogram = await session.readPcHistogram();
+        if (histogram === null) {
+          Logger.error('The bootloader has no PC histogram (build it with PC_SAMPLING=1)');
+        } else {
+          await fs.writeFile(args.pcHistogramFilename, histogram);
+          Logger.success(`Saved the PC histogram to ${args.pcHistogramFilename}`);
+        }
+      }
+      if (args.bootTimelineFilename) {
+        // The boot before this one ran all the way through to the app
+        const timeline = await session.readBootTimeline(true);
+        if (timeline.events.length === 0) {
+          Logger.error('No boot timeline from the last boot (first boot after power on?)');
+        } else {
+          let last = 0;
+          for (const event of timeline.events) {
+            Logger.info(`${(event.timeUs / 1000).toFixed(3).padStart(10)} ms (+${((event.timeUs - last) / 1000).toFixed(3)}) ${event.phase}`);
+            last = event.timeUs;
+          }
+          const record = { date: new Date().toISOString(), port: session.path, ...timeline };
+          await fs.appendFile(args.bootTimelineFilename, JSON.stringify(record) + '\n');
+        }
+      }
+      if (trace) {
+        const { records } = await session.readTrace();
+        session.port.traceSink?.(records, 0);
       }
-      Logger.error('Wrong packet observed during sync sequence');
-      process.exit(1);
+    };
+
+    const session = await DeviceSession.open(ports[0], { baudRate: args.baudRate, verbose: true, trace, dense: args.dense, full: args.full, fec: args.fec, beforeBoot });
+    const capture = args.captureFilename ? CaptureWriter.create(args.captureFilename, args.baudRate) : null;
+    session.port.capture = capture;
+
+    // Records are kept raw, and decoded against the bootloader's ELF with fw-tools/trace.py
+    const traceFile = trace ? createWriteStream(args.traceFilename, { flags: 'a' }) : null;
+    if (traceFile) {
+      session.port.traceSink = (records, dropped) => {
+        traceFile.write(records);
+        if (dropped > 0) {
+          Logger.error(`${dropped} trace record(s) were overwritten before they could be sent`);
+        }
+      };
     }
 
-    if (timeWaited >= timeout) {
-      Logger.error('Timed out waiting for sync sequence observed');
-      process.exit(1);
+    try {
+      if (args.audit) {
+        const mismatches = await session.auditImage(fwImage);
+        process.exitCode = mismatches.length > 0 ? 1 : 0;
+      } else if (args.ram) {
+        await session.runFromRam(fwImage);
+      } else {
+        await session.updateFirmware(fwImage);
+      }
+    } catch (e) {
+      Logger.error((e as Error).message);
+      process.exitCode = 1;
+    } finally {
+      await session.close();
+      traceFile?.end();
+      await capture?.close();
     }
+    return;
   }
-}
 
-// Do everything in an async function so we can have loops, awaits etc
-const main = async () => {
-  if (process.argv.length < 3) {
-    console.log("usage: fw-updater <signed firmware>");
-    process.exit(1);
+  Logger.info(`Flashing ${ports.length} port(s): ${ports.join(', ')}`);
+  const { results, wallTimeMs } = await runFleet(ports, fwImage, {
+    baudRate: args.baudRate,
+    concurrency: args.concurrency || ports.length,
+    retries: args.retries,
+    audit: args.audit,
+    dense: args.dense,
+    full: args.full,
+    fec: args.fec,
+    verbose: args.verbose,
+  });
+  printFleetReport(results, wallTimeMs, fwLength);
+
+  if (results.some(r => !r.ok)) {
+    process.exitCode = 1;
   }
-  const firmwareFilename = process.argv[2];
-
-  Logger.info('Reading the firmware image...');
-  const fwImage = await fs.readFile(path.join(process.cwd(), firmwareFilename));
-  const fwLength = fwImage.length;
-  Logger.success(`Read firmware image (${fwLength} bytes)`);
-
-  Logger.info('Attempting to sync with the bootloader');
-  await syncWithBootloader();
-  Logger.success('Synced!');
-
-  Logger.info('Requesting firmware update');
-  const fwUpdatePacket = Packet.createSingleBytePacket(BL_PACKET_FW_UPDATE_REQ_DATA0);
-  writePacket(fwUpdatePacket);
-  await waitForSingleBytePacket(BL_PACKET_FW_UPDATE_RES_DATA0);
-  Logger.success('Firmware update request accepted');
-
-  Logger.info('Waiting for device ID request');
-  await waitForSingleBytePacket(BL_PACKET_DEVICE_ID_REQ_DATA0);
-  Logger.success('Device ID request recieved');
-
-  const deviceId = fwImage[FWINFO_DEVICE_ID_OFFSET];
-  const deviceIDPacket = new Packet(2, Buffer.from([BL_PACKET_DEVICE_ID_RES_DATA0, deviceId]));
-  writePacket(deviceIDPacket);
-  Logger.info(`Responding with device ID 0x${deviceId.toString(16)}`);
-
-  Logger.info('Waiting for firmware length request');
-  await waitForSingleBytePacket(BL_PACKET_FW_LENGTH_REQ_DATA0);
-  Logger.success('Firmware length request recieved');
-
-  const fwLengthPacketBuffer = Buffer.alloc(5);
-  fwLengthPacketBuffer[0] = BL_PACKET_FW_LENGTH_RES_DATA0;
-  fwLengthPacketBuffer.writeUInt32LE(fwLength, 1);
-  const fwLengthPacket = new Packet(5, fwLengthPacketBuffer);
-  writePacket(fwLengthPacket);
-  Logger.info('Responding with firmware length');
-
-  Logger.info('Waiting for a few seconds for main application to be erased...');
-  await delay(1000);
-  Logger.info('Waiting for a few seconds for main application to be erased...');
-  await delay(1000);
-  Logger.info('Waiting for a few seconds for main application to be erased...');
-  await delay(1000);
-
-  let bytesWritten = 0;
-  while (bytesWritten < fwLength) {
-    await waitForSingleBytePacket(BL_PACKET_READY_FOR_DATA_DATA0);
-
-    const dataBytes = fwImage.slice(bytesWritten, bytesWritten + PACKET_DATA_BYTES);
-    const dataLength = dataBytes.length;
-    const dataPacket = new Packet(dataLength - 1, dataBytes);
-    writePacket(dataPacket);
-    bytesWritten += dataLength;
-
-    Logger.info(`Wrote ${dataLength} bytes (${bytesWritten}/${fwLength})`);
-  }
-
-  await waitForSingleBytePacket(BL_PACKET_UPDATE_SUCCESSFUL_DATA0);
-  Logger.success("Firmware update complete!");
 }
 
 main()
-  .finally(() => uart.close());
+  .catch((e: Error) => {
+    Logger.error(e.message);
+    process.exit(1);
+  });
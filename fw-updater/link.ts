@@ -0,0 +1,489 @@
+import {SerialPort} from 'serialport';
+import {
+  PACKET_ACK_DATA0,
+  PACKET_RETX_DATA0,
+  PACKET_TRACE_DATA0,
+  COMMS_ADDR_FROM_NODE,
+  COMMS_ADDR_ANY,
+  COMMS_ADDR_BROADCAST,
+  COMMS_WINDOW_SIZE,
+  COMMS_ACK_EVERY,
+  COMMS_ACK_DELAY,
+  COMMS_RTO_MIN,
+  COMMS_RETX_HOLDOFF,
+  PACKET_HEADER_BYTES,
+  PACKET_CRC_BYTES,
+  PACKET_DATA_BYTES,
+  PACKET_MIN_DATA_BYTES,
+  PACKET_FLAG_FEC,
+  BL_PACKET_NACK_DATA0,
+  DEFAULT_TIMEOUT,
+  delay,
+  FrameParser,
+  Packet,
+  RttEstimator,
+} from './protocol';
+import {CaptureDirection, CaptureWriter} from './capture';
+import {FEC_PARITY_BYTES} from './fec';
+
+type TxSlot = {
+  packet: Packet;
+  sentAt: number;
+  acked: boolean;
+  retransmitted: boolean;
+};
+
+// How quickly the loss rate follows what's happening on the line, as the weight of each frame
+const LOSS_RATE_GAIN = 1 / 32;
+
+// The sequenced, acknowledged link to one node. Packets written here are delivered to the node in
+// order and exactly once, and packets from the node come out of waitForPacket the same way.
+export class Link {
+  readonly address: number;
+  private write: (data: Buffer) => void;
+
+  // Packets delivered by the link layer, in order and exactly once
+  packets: Packet[] = [];
+
+  // Receive side: frames that arrived ahead of a gap wait here, keyed by seq
+  private rxNextSeq = 0;
+  private rxWindow = new Map<number, Packet>();
+  private framesSinceAck = 0;
+  private ackTimer: ReturnType<typeof setTimeout> | null = null;
+
+  // Transmit side: at most COMMS_WINDOW_SIZE frames in flight, the rest queued
+  private txQueue: Packet[] = [];
+  private txWindow = new Map<number, TxSlot>();
+  private txBaseSeq = 0;
+  private txNextSeq = 0;
+  private retransmitTimer: ReturnType<typeof setInterval>;
+
+  // Total frames (and the data bytes in them) the node has acknowledged, for progress reporting
+  framesAcked = 0;
+  bytesAcked = 0;
+
+  readonly rtt = new RttEstimator();
+  // Share of recent frames that had to be sent more than once
+  lossRate = 0;
+
+  // Send sequenced frames and ACKs with FEC parity, so the node can fix a wrong byte itself
+  // rather than wait for the frame to come round again. The node's frames never have it.
+  fec = false;
+
+  // Called whenever an ACK makes room in the window, for a sender that makes packets as it goes
+  onAck: (() => void) | null = null;
+
+  // Set when the node NACKs or the port fails, and surfaced by the next wait
+  failure: Error | null = null;
+
+  constructor(address: number, write: (data: Buffer) => void) {
+    this.address = address;
+    this.write = write;
+    this.retransmitTimer = setInterval(() => this.checkRetransmitTimeouts(), COMMS_RTO_MIN / 4);
+  }
+
+  close() {
+    clearInterval(this.retransmitTimer);
+    if (this.ackTimer) {
+      clearTimeout(this.ackTimer);
+      this.ackTimer = null;
+    }
+  }
+
+  // Queue a packet for reliable delivery. It gets the next seq once there's room in the window.
+  writePacket(packet: Packet) {
+    this.txQueue.push(packet);
+    this.fillTxWindow();
+  }
+
+  get framesInFlight() {
+    return (this.txNextSeq - this.txBaseSeq) & 0xff;
+  }
+
+  get framesQueued() {
+    return this.txQueue.length;
+  }
+
+  get idle() {
+    return this.txQueue.length === 0 && this.framesInFlight === 0;
+  }
+
+  // The data packet size that gets the most data through at the current loss rate. Errors are
+  // taken to hit bytes independently, so a frame of n bytes gets through with probability (1-p)^n,
+  // or with FEC, when no more than one of them is wrong. On a clean line that's always the largest
+  // packet, and it only shrinks once loss gets heavy.
+  get dataPacketSize() {
+    const overhead = PACKET_HEADER_BYTES + PACKET_CRC_BYTES + (this.fec ? FEC_PARITY_BYTES : 0);
+    const frameSuccess = (byteSuccess: number, n: number) => {
+      const clean = Math.pow(byteSuccess, n);
+      return this.fec ? clean + n * (1 - byteSuccess) * Math.pow(byteSuccess, n - 1) : clean;
+    };
+
+    // The per-byte success rate that would lose full size frames as often as they are being lost
+    const frameLoss = Math.min(this.lossRate, 0.99);
+    let low = 0;
+    let high = 1;
+    for (let i = 0; i < 32; i++) {
+      const mid = (low + high) / 2;
+      if (1 - frameSuccess(mid, PACKET_DATA_BYTES + overhead) > frameLoss) {
+        low = mid;
+      } else {
+        high = mid;
+      }
+    }
+    const byteSuccess = high;
+
+    let best = PACKET_DATA_BYTES;
+    let bestGoodput = 0;
+    for (let size = PACKET_MIN_DATA_BYTES; size <= PACKET_DATA_BYTES; size += 4) {
+      const goodput = (size / (size + overhead)) * frameSuccess(byteSuccess, size + overhead);
+      if (goodput > bestGoodput) {
+        best = size;
+        bestGoodput = goodput;
+      }
+    }
+    return best;
+  }
+
+  private fillTxWindow() {
+    while (this.txQueue.length > 0 && this.framesInFlight < COMMS_WINDOW_SIZE) {
+      const packet = this.txQueue.shift()!;
+      packet.address = this.address;
+      packet.seq = this.txNextSeq;
+      if (this.fec) {
+        packet.flags |= PACKET_FLAG_FEC;
+      }
+      packet.crc = packet.computeCrc();
+      this.txNextSeq = (this.txNextSeq + 1) & 0xff;
+
+      this.txWindow.set(packet.seq, { packet, sentAt: Date.now(), acked: false, retransmitted: false });
+      this.write(packet.toBuffer());
+    }
+  }
+
+  private retransmitSlot(slot: TxSlot, now: number) {
+    this.write(slot.packet.toBuffer());
+    slot.sentAt = now;
+    slot.retransmitted = true;
+  }
+
+  sendAck(type: number) {
+    let bitmap = 0;
+    for (let i = 1; i < COMMS_WINDOW_SIZE; i++) {
+      if (this.rxWindow.has((this.rxNextSeq + i) & 0xff)) {
+        bitmap |= 1 << (i - 1);
+      }
+    }
+
+    const ack = Packet.createAck(type, this.rxNextSeq, bitmap);
+    ack.address = this.address;
+    if (this.fec) {
+      ack.flags |= PACKET_FLAG_FEC;
+    }
+    ack.crc = ack.computeCrc();
+    this.write(ack.toBuffer());
+
+    this.framesSinceAck = 0;
+    if (this.ackTimer) {
+      clearTimeout(this.ackTimer);
+      this.ackTimer = null;
+    }
+  }
+
+  // Acknowledge everything delivered so far right away, e.g. before moving on to another node
+  flushAck() {
+    if (this.framesSinceAck > 0) {
+      this.sendAck(PACKET_ACK_DATA0);
+    }
+  }
+
+  // Cumulative ACK up to the next expected seq, selective ACK for the bitmap. Frames before the
+  // newest selectively acknowledged one are known to be lost and are sent again straight away.
+  private handleAck(ack: Packet) {
+    const cumulativeSeq = ack.data[1];
+    const bitmap = ack.data.readUInt16LE(2);
+    const now = Date.now();
+
+    // Ignore anything that doesn't refer to the current window (e.g. a stale, delayed ACK)
+    if (((cumulativeSeq - this.txBaseSeq) & 0xff) > this.framesInFlight) {
+      return;
+    }
+
+    // The newest frame this is the first ACK for gives the RTT sample
+    let newest: TxSlot | null = null;
+    while (this.txBaseSeq !== cumulativeSeq) {
+      const slot = this.txWindow.get(this.txBaseSeq)!;
+      if (!slot.acked) {
+        newest = slot;
+      }
+      this.lossRate += ((slot.retransmitted ? 1 : 0) - this.lossRate) * LOSS_RATE_GAIN;
+      this.txWindow.delete(this.txBaseSeq);
+      this.txBaseSeq = (this.txBaseSeq + 1) & 0xff;
+      this.framesAcked++;
+      this.bytesAcked += slot.packet.length;
+    }
+
+    let highestAcked = 0;
+    for (let i = 0; i < COMMS_WINDOW_SIZE - 1; i++) {
+      const offset = i + 1;
+      const slot = this.txWindow.get((this.txBaseSeq + offset) & 0xff);
+      if ((bitmap & (1 << i)) && slot) {
+        if (!slot.acked) {
+          newest = slot;
+        }
+        slot.acked = true;
+        highestAcked = offset;
+      }
+    }
+
+    if (newest && !newest.retransmitted) {
+      this.rtt.sample(now - newest.sentAt);
+    }
+
+    let resendUpTo = highestAcked;
+    if (ack.data[0] === PACKET_RETX_DATA0 && resendUpTo === 0 && this.framesInFlight > 0) {
+      resendUpTo = 1;
+    }
+
+    for (let offset = 0; offset < resendUpTo; offset++) {
+      const slot = this.txWindow.get((this.txBaseSeq + offset) & 0xff);
+      if (slot && !slot.acked && now - slot.sentAt >= COMMS_RETX_HOLDOFF) {
+        this.retransmitSlot(slot, now);
+      }
+    }
+
+    this.fillTxWindow();
+    this.onAck?.();
+  }
+
+  // Frames that go unacknowledged for a whole RTO are sent again, and the RTO backs off until the
+  // next sample, in case it's the round trip that has got longer rather than a frame that was lost
+  private checkRetransmitTimeouts() {
+    const now = Date.now();
+    let timedOut = false;
+    for (const slot of this.txWindow.values()) {
+      if (!slot.acked && now - slot.sentAt >= this.rtt.rto) {
+        this.retransmitSlot(slot, now);
+        timedOut = true;
+      }
+    }
+
+    if (timedOut) {
+      this.rtt.backOff();
+    }
+  }
+
+  handleFrame(packet: Packet) {
+    if (packet.isAck()) {
+      this.handleAck(packet);
+      return;
+    }
+
+    // Large frames are unsequenced, and delivered as they come
+    if (packet.isLarge()) {
+      this.packets.push(packet);
+      return;
+    }
+
+    const offset = (packet.seq - this.rxNextSeq) & 0xff;
+    if (offset >= COMMS_WINDOW_SIZE) {
+      // Already delivered, so our ACK must have been lost. Don't deliver it twice, just re-ACK.
+      this.sendAck(PACKET_ACK_DATA0);
+      return;
+    }
+
+    this.rxWindow.set(packet.seq, packet);
+
+    // Anything out of order means a gap, which the sender should hear about right away
+    if (offset !== 0) {
+      this.sendAck(PACKET_ACK_DATA0);
+      return;
+    }
+
+    while (this.rxWindow.has(this.rxNextSeq)) {
+      this.deliver(this.rxWindow.get(this.rxNextSeq)!);
+      this.rxWindow.delete(this.rxNextSeq);
+      this.rxNextSeq = (this.rxNextSeq + 1) & 0xff;
+      this.framesSinceAck++;
+    }
+
+    if (this.framesSinceAck >= COMMS_ACK_EVERY) {
+      this.sendAck(PACKET_ACK_DATA0);
+    } else if (this.framesSinceAck > 0 && !this.ackTimer) {
+      this.ackTimer = setTimeout(() => {
+        this.ackTimer = null;
+        this.flushAck();
+      }, COMMS_ACK_DELAY);
+    }
+  }
+
+  private deliver(packet: Packet) {
+    // If this is an nack, fail the session
+    if (packet.isSingleBytePacket(BL_PACKET_NACK_DATA0)) {
+      this.failure = new Error('Received NACK');
+      return;
+    }
+    this.packets.push(packet);
+  }
+
+  checkFailure() {
+    if (this.failure) {
+      const failure = this.failure;
+      this.failure = null;
+      throw failure;
+    }
+  }
+
+  // Function to allow us to await a packet
+  async waitForPacket(timeout = DEFAULT_TIMEOUT) {
+    let timeWaited = 0;
+    while (this.packets.length < 1) {
+      this.checkFailure();
+      await delay(1);
+      timeWaited += 1;
+
+      if (timeWaited >= timeout) {
+        throw Error('Timed out waiting for packet');
+      }
+    }
+    return this.packets.splice(0, 1)[0];
+  }
+}
+
+// What a Port needs from the thing underneath it: a real serial port, or a simulated device
+export interface SerialLike {
+  isOpen: boolean;
+  open(callback: (e: Error | null) => void): void;
+  close(callback: () => void): void;
+  write(data: Buffer): unknown;
+  drain(callback: () => void): void;
+  on(event: 'data', listener: (data: Buffer) => void): unknown;
+  on(event: 'error', listener: (e: Error) => void): unknown;
+}
+
+// A serial port, and the links to every node reachable through it: just the one (addressed as
+// COMMS_ADDR_ANY) for a point-to-point connection, or one per node ID on a multi-drop bus.
+export class Port {
+  readonly path: string;
+  private uart: SerialLike;
+  private links = new Map<number, Link>();
+  private parser = new FrameParser();
+
+  // Every byte in both directions, when capturing
+  capture: CaptureWriter | null = null;
+
+  // ID of the node that most recently sent a valid frame
+  lastNodeId: number | null = null;
+
+  // Receives trace records the node drains in the background, as raw 16-byte records
+  traceSink: ((records: Buffer, dropped: number) => void) | null = null;
+
+  private constructor(path: string, uart: SerialLike) {
+    this.path = path;
+    this.uart = uart;
+    this.uart.on('data', (data: Buffer) => this.onData(data));
+    this.uart.on('error', (e: Error) => {
+      for (const link of this.links.values()) {
+        link.failure = e;
+      }
+    });
+  }
+
+  static open(path: string, baudRate: number) {
+    return Port.openOn(path, new SerialPort({ path, baudRate, autoOpen: false }));
+  }
+
+  static openOn(path: string, uart: SerialLike) {
+    const port = new Port(path, uart);
+    return new Promise<Port>((resolve, reject) => {
+      port.uart.open(e => e ? reject(e) : resolve(port));
+    });
+  }
+
+  close() {
+    for (const link of this.links.values()) {
+      link.close();
+    }
+    this.links.clear();
+
+    if (!this.uart.isOpen) {
+      return Promise.resolve();
+    }
+    return new Promise<void>(resolve => this.uart.close(() => resolve()));
+  }
+
+  link(address: number) {
+    let link = this.links.get(address);
+    if (!link) {
+      link = new Link(address, data => this.write(data));
+      this.links.set(address, link);
+    }
+    return link;
+  }
+
+  private write(data: Buffer) {
+    this.capture?.record(CaptureDirection.HostToDevice, data);
+    this.uart.write(data);
+  }
+
+  writeRaw(data: Buffer) {
+    this.write(data);
+  }
+
+  // Wait for everything written so far to actually leave the port
+  drain() {
+    return new Promise<void>(resolve => this.uart.drain(() => resolve()));
+  }
+
+  // Send an unsequenced frame to every node. Nothing comes back, so nothing is retransmitted.
+  broadcast(packet: Packet) {
+    packet.address = COMMS_ADDR_BROADCAST;
+    packet.seq = 0;
+    packet.crc = packet.computeCrc();
+    this.write(packet.toBuffer());
+  }
+
+  // The link a frame from `nodeId` belongs to. A point-to-point link takes frames from anyone.
+  private linkForNode(nodeId: number) {
+    return this.links.get(nodeId) ?? this.links.get(COMMS_ADDR_ANY);
+  }
+
+  // This function fires whenever data is received over the serial port
+  private onData(data: Buffer) {
+    this.capture?.record(CaptureDirection.DeviceToHost, data);
+
+    for (const frame of this.parser.push(data)) {
+      const packet = frame.packet;
+      const address = packet.address;
+
+      // Need retransmission?
+      if (!frame.crcOk) {
+        const link = this.linkForNode(address & ~COMMS_ADDR_FROM_NODE);
+        if (link && (address & COMMS_ADDR_FROM_NODE)) {
+          link.sendAck(PACKET_RETX_DATA0);
+        }
+        continue;
+      }
+
+      // Our own frames, echoed back by a half-duplex bus
+      if (!(address & COMMS_ADDR_FROM_NODE)) {
+        continue;
+      }
+
+      // A large frame that failed its CRC32 is dropped, and the requester asks again
+      if (packet.isLarge() && !packet.payload) {
+        continue;
+      }
+
+      // Drained trace records share the link control flag, but aren't ACKs
+      if (packet.isAck() && packet.isLarge() && packet.data[0] === PACKET_TRACE_DATA0) {
+        this.traceSink?.(packet.payload!, packet.data.readUInt16LE(2));
+        continue;
+      }
+
+      const nodeId = address & ~COMMS_ADDR_FROM_NODE;
+      this.lastNodeId = nodeId;
+      this.linkForNode(nodeId)?.handleFrame(packet);
+    }
+  }
+}
@@ -0,0 +1,521 @@
+import {FEC_PARITY_BYTES, FecResult, fecCorrect, fecParity} from './fec';
+
+// Constants for the packet protocol. Frames on the wire are: SOF, address, seq, length (+ flags),
+// `length` data bytes, CRC8 over address..data
+export const PACKET_DATA_BYTES     = 16;
+export const PACKET_SOF            = 0xA5;
+export const PACKET_HEADER_BYTES   = 4;
+export const PACKET_CRC_BYTES      = 1;
+
+export const PACKET_LENGTH_MASK    = 0x1F;
+// Followed by FEC parity over address..CRC, which lets the receiver fix one wrong byte
+export const PACKET_FLAG_FEC       = 0x20;
+// Unsequenced header, followed by a 16-bit payload length, the payload and its CRC32
+export const PACKET_FLAG_LARGE     = 0x40;
+// Link control frame, never delivered to the application
+export const PACKET_FLAG_ACK       = 0x80;
+
+// Frames to a node carry its ID, frames from a node carry its ID with COMMS_ADDR_FROM_NODE set
+export const COMMS_ADDR_FROM_NODE  = 0x80;
+export const COMMS_NODE_ID_MIN     = 0x01;
+export const COMMS_NODE_ID_MAX     = 0x7D;
+export const COMMS_ADDR_ANY        = 0x7E;
+export const COMMS_ADDR_BROADCAST  = 0x7F;
+
+// Link layer parameters, matching the bootloader
+export const COMMS_WINDOW_SIZE     = 8;
+export const COMMS_ACK_EVERY       = 4;
+export const COMMS_ACK_DELAY       = 5;
+// Retransmission timeout bounds: it starts at the initial value until there's an RTT sample
+export const COMMS_RTO_INITIAL     = 250;
+export const COMMS_RTO_MIN         = 30;
+export const COMMS_RTO_MAX         = 1000;
+export const COMMS_RETX_HOLDOFF    = 20;
+// Smallest data packet the host will shrink to on a noisy line. Sizes are kept to whole words.
+export const PACKET_MIN_DATA_BYTES = 4;
+
+// ACK frame data: type, next expected seq, bitmap of the frames received after it
+export const PACKET_ACK_DATA0      = 0x15;
+export const PACKET_RETX_DATA0     = 0x19;
+export const PACKET_ACK_LENGTH     = 4;
+
+// Large link control frame carrying drained trace records: type, count, dropped (16 bit)
+export const PACKET_TRACE_DATA0    = 0x1D;
+
+// Large frame of telemetry samples from the app: type, sample count, dropped (16 bit), batch
+// number (16 bit). Each sample is a cycle count timestamp (u32), channel (u16), unused (u16) and
+// value (i32).
+export const PACKET_TELEMETRY_DATA0   = 0x23;
+export const PACKET_TELEMETRY_LENGTH  = 6;
+export const TELEMETRY_SAMPLE_BYTES   = 12;
+export const CPU_FREQ                 = 84000000;
+
+export const BL_PACKET_SYNC_OBSERVED_DATA0     = (0x20);
+export const BL_PACKET_FW_UPDATE_REQ_DATA0     = (0x31);
+export const BL_PACKET_FW_UPDATE_RES_DATA0     = (0x37);
+export const BL_PACKET_DEVICE_ID_REQ_DATA0     = (0x3C);
+export const BL_PACKET_DEVICE_ID_RES_DATA0     = (0x3F);
+export const BL_PACKET_FW_LENGTH_REQ_DATA0     = (0x42);
+export const BL_PACKET_FW_LENGTH_RES_DATA0     = (0x45);
+export const BL_PACKET_READY_FOR_DATA_DATA0    = (0x48);
+export const BL_PACKET_UPDATE_SUCCESSFUL_DATA0 = (0x54);
+export const BL_PACKET_NACK_DATA0              = (0x59);
+export const BL_PACKET_CRC_REQ_DATA0           = (0x62);
+export const BL_PACKET_CRC_RES_DATA0           = (0x65);
+export const BL_PACKET_READ_REQ_DATA0          = (0x68);
+export const BL_PACKET_READ_RES_DATA0          = (0x6B);
+export const BL_PACKET_SECTOR_REWRITE_REQ_DATA0 = (0x6E);
+export const BL_PACKET_BOOT_REQ_DATA0          = (0x71);
+export const BL_PACKET_BOOT_RES_DATA0          = (0x74);
+export const BL_PACKET_BUS_JOIN_REQ_DATA0      = (0x77);
+export const BL_PACKET_BUS_JOIN_RES_DATA0      = (0x7A);
+export const BL_PACKET_BUS_DATA_DATA0          = (0x7D);
+export const BL_PACKET_BUS_GAP_REQ_DATA0       = (0x80);
+export const BL_PACKET_BUS_GAP_RES_DATA0       = (0x83);
+export const BL_PACKET_DIAG_REQ_DATA0          = (0x86);
+export const BL_PACKET_DIAG_RES_DATA0          = (0x89);
+export const BL_PACKET_RAM_LOAD_REQ_DATA0      = (0x8C);
+// One populated range of a sparse image, after a FW_LENGTH_RES that also gives the number of them
+export const BL_PACKET_EXTENT_DATA0            = (0x8F);
+// CRC32s of every whole application sector, as a large frame
+export const BL_PACKET_SECTOR_CRC_REQ_DATA0    = (0x92);
+export const BL_PACKET_SECTOR_CRC_RES_DATA0    = (0x95);
+// An update that erases nothing up front, leaving the host to rewrite only the sectors that differ
+export const BL_PACKET_DELTA_UPDATE_REQ_DATA0  = (0x98);
+
+// Diagnostic IDs carried by DIAG_REQ/DIAG_RES
+export const BL_DIAG_TRACE                     = (0x01);
+export const BL_DIAG_TRACE_DRAIN               = (0x02);
+export const BL_DIAG_PROFILE                   = (0x03);
+export const BL_DIAG_PROFILE_RESET             = (0x04);
+export const BL_DIAG_UART_LATENCY              = (0x05);
+export const BL_DIAG_BOOT_TIMELINE             = (0x06);
+export const BL_DIAG_LINK_STATS                = (0x07);
+export const BL_DIAG_PC_HISTOGRAM              = (0x08);
+export const BL_DIAG_MEMORY                    = (0x09);
+export const BL_DIAG_BENCH                     = (0x0A);
+// The answer to a diagnostic request that the bootloader was built without, or doesn't know
+export const BL_DIAG_UNSUPPORTED               = (0xFF);
+
+// bench_results_t's flash sector when no application sector was blank to benchmark on
+export const BENCH_NO_SECTOR                   = (0xffffffff);
+
+// Buffers in a memory response, in the order the bootloader sends them
+export const MEMORY_BUFFER_NAMES = ['uart rx', 'uart tx', 'usb rx', 'comms packets'];
+
+// Profiling scope payload: name (NUL padded), count, min, max, total (u64), log2 histogram
+export const BL_DIAG_PROFILE_NAME_LENGTH       = (24);
+export const PROFILE_HISTOGRAM_BINS            = (32);
+
+// pc_histogram_t, as built with 'make PC_SAMPLING=1': magic, start, shift, outside, u16 counts
+export const PC_HISTOGRAM_MAGIC                = (0x43505448);
+export const PC_HISTOGRAM_BUCKETS              = (1024);
+
+// Boot timeline phases, in the order of boot_phase_t. Each is marked when it ends.
+export const BOOT_PHASE_NAMES = [
+  'bootloader main',
+  'bootloader system setup',
+  'bootloader peripheral setup',
+  'bootloader synced',
+  'bootloader loop done',
+  'bootloader teardown',
+  'bootloader key schedule',
+  'bootloader validate',
+  'bootloader jump',
+  'app main',
+  'app system setup',
+  'app ready',
+];
+
+// Each trace record is a cycle count timestamp, the event ID and two arguments (all u32)
+export const TRACE_RECORD_BYTES                = (16);
+
+// Largest payload the bootloader sends after a READ_RES packet, followed by a CRC32
+export const BL_READ_MAX_LENGTH                = (1024);
+
+// Bus data packets carry a 24-bit offset and this much of the image
+export const BL_BUS_CHUNK_SIZE                 = (12);
+export const BL_BUS_GAP_MAX_RANGES             = (64);
+
+// Most populated ranges a sparse image can be sent as
+export const BL_MAX_EXTENTS                    = (32);
+
+export const BOOTLOADER_SIZE                   = (0x4000);
+// Largest image the bootloader will load in to RAM and run from there
+export const RAM_APP_MAX_LENGTH                = (48 * 1024);
+export const FLASH_SECTOR_SIZES                = [0x4000, 0x4000, 0x4000, 0x4000, 0x10000, 0x20000, 0x20000, 0x20000];
+// The key-value store's two 16K sectors sit between the bootloader and the application
+export const KV_FLASH_OFFSET                   = (BOOTLOADER_SIZE);
+export const KV_FLASH_SIZE                     = (2 * 0x4000);
+export const APP_START_OFFSET                  = (KV_FLASH_OFFSET + KV_FLASH_SIZE);
+export const MAX_FW_LENGTH                     = (FLASH_SECTOR_SIZES.reduce((a, b) => a + b, 0) - APP_START_OFFSET);
+
+export const VECTOR_TABLE_SIZE                 = (0x01B0);
+
+export const FWINFO_DEVICE_ID_OFFSET           = (VECTOR_TABLE_SIZE + (1 * 4));
+export const FWINFO_VERSION_OFFSET             = (VECTOR_TABLE_SIZE + (2 * 4));
+export const FWINFO_LENGTH_OFFSET              = (VECTOR_TABLE_SIZE + (3 * 4));
+export const SIGNATURE_OFFSET                  = (VECTOR_TABLE_SIZE + (4 * 4));
+export const SIGNATURE_LENGTH                  = (16);
+
+export const SYNC_SEQ  = Buffer.from([0xc4, 0x55, 0x7e, 0x10]);
+// Puts every node on a bus in to its bootloader without any of them answering
+export const SYNC_SEQ_BUS  = Buffer.from([0xc4, 0x55, 0x7e, 0x11]);
+export const DEFAULT_TIMEOUT  = (5000);
+
+export type FlashSector = { index: number, offset: number, size: number };
+
+// The flash sectors that hold the first `length` bytes of the main application, with offsets
+// relative to the start of the application
+export const applicationSectors = (length: number) => {
+  const sectors: FlashSector[] = [];
+  let address = 0;
+
+  FLASH_SECTOR_SIZES.forEach((size, index) => {
+    const offset = address - APP_START_OFFSET;
+    if (offset >= 0 && offset < length) {
+      sectors.push({ index, offset, size: Math.min(size, length - offset) });
+    }
+    address += size;
+  });
+
+  return sectors;
+};
+
+export type Extent = { offset: number, length: number };
+
+// An erased run shorter than this isn't worth skipping: it costs an extent packet, which takes
+// about as long to send as the data it saves
+const EXTENT_MIN_GAP = 64;
+
+// The parts of an image that aren't erased flash (0xff), which are all that need to be sent.
+// Extents are whole words, so the bootloader still programs them a word at a time, and the
+// closest ones are merged until there are no more than maxExtents.
+export const findExtents = (image: Buffer, maxExtents = BL_MAX_EXTENTS, minGap = EXTENT_MIN_GAP) => {
+  const extents: Extent[] = [];
+
+  for (let word = 0; word < image.length; word += 4) {
+    const end = Math.min(word + 4, image.length);
+    if (image.slice(word, end).every(byte => byte === 0xff)) {
+      continue;
+    }
+
+    const last = extents[extents.length - 1];
+    if (last && word - (last.offset + last.length) < minGap) {
+      last.length = end - last.offset;
+    } else {
+      extents.push({ offset: word, length: end - word });
+    }
+  }
+
+  while (extents.length > maxExtents) {
+    let closest = 1;
+    for (let i = 2; i < extents.length; i++) {
+      const gap = extents[i].offset - (extents[i - 1].offset + extents[i - 1].length);
+      if (gap < extents[closest].offset - (extents[closest - 1].offset + extents[closest - 1].length)) {
+        closest = i;
+      }
+    }
+    const [next] = extents.splice(closest, 1);
+    extents[closest - 1].length = next.offset + next.length - extents[closest - 1].offset;
+  }
+
+  return extents;
+};
+
+// The bytes of image[start, end) that fall inside the extents, in the order they're sent
+export const extentData = (image: Buffer, extents: Extent[], start: number, end: number) => {
+  const pieces: Buffer[] = [];
+  for (const extent of extents) {
+    const from = Math.max(extent.offset, start);
+    const to = Math.min(extent.offset + extent.length, end);
+    if (from < to) {
+      pieces.push(image.slice(from, to));
+    }
+  }
+  return Buffer.concat(pieces);
+};
+
+// CRC8 implementation
+export const crc8 = (data: Buffer | Array<number>) => {
+  let crc = 0;
+
+  for (const byte of data) {
+    crc = (crc ^ byte) & 0xff;
+    for (let i = 0; i < 8; i++) {
+      if (crc & 0x80) {
+        crc = ((crc << 1) ^ 0x07) & 0xff;
+      } else {
+        crc = (crc << 1) & 0xff;
+      }
+    }
+  }
+
+  return crc;
+};
+
+export const crc32 = (data: Buffer, length: number) => {
+  let byte;
+  let crc = 0xffffffff;
+  let mask;
+
+  for (let i = 0; i < length; i++) {
+     byte = data[i];
+     crc = (crc ^ byte) >>> 0;
+
+     for (let j = 0; j < 8; j++) {
+        mask = (-(crc & 1)) >>> 0;
+        crc = ((crc >>> 1) ^ (0xedb88320 & mask)) >>> 0;
+     }
+  }
+
+  return (~crc) >>> 0;
+}
+
+// Async delay function, which gives the event loop time to process outside input
+// Retransmission timeout from smoothed round trip times (RFC 6298), as comms.c does it. An ACK can
+// be held back for up to COMMS_ACK_DELAY, so the variance term never goes below that.
+export class RttEstimator {
+  srtt = 0;
+  rttvar = 0;
+  rto = COMMS_RTO_INITIAL;
+  private sampled = false;
+
+  // Only for frames that were sent once, as there's no telling which copy of a resent one was ACKed
+  sample(rtt: number) {
+    if (!this.sampled) {
+      this.srtt = rtt;
+      this.rttvar = rtt / 2;
+      this.sampled = true;
+    } else {
+      this.rttvar = 0.75 * this.rttvar + 0.25 * Math.abs(this.srtt - rtt);
+      this.srtt = 0.875 * this.srtt + 0.125 * rtt;
+    }
+    this.rto = Math.min(COMMS_RTO_MAX, Math.max(COMMS_RTO_MIN, this.srtt + Math.max(COMMS_ACK_DELAY, 4 * this.rttvar)));
+  }
+
+  // After a timeout, until the next sample
+  backOff() {
+    this.rto = Math.min(COMMS_RTO_MAX, this.rto * 2);
+  }
+}
+
+export const delay = (ms: number) => new Promise(r => setTimeout(r, ms));
+
+export class Logger {
+  prefix: string;
+
+  constructor(prefix = '') {
+    this.prefix = prefix ? `${prefix} ` : '';
+  }
+
+  info(message: string) { console.log(`[.] ${this.prefix}${message}`); }
+  success(message: string) { console.log(`[$] ${this.prefix}${message}`); }
+  error(message: string) { console.log(`[!] ${this.prefix}${message}`); }
+
+  static default = new Logger();
+  static info(message: string) { Logger.default.info(message); }
+  static success(message: string) { Logger.default.success(message); }
+  static error(message: string) { Logger.default.error(message); }
+}
+
+// Class for serialising and deserialising packets
+export class Packet {
+  address = COMMS_ADDR_ANY;
+  seq: number;
+  length: number;
+  flags: number;
+  data: Buffer;
+  crc: number;
+
+  // Raw payload of a large frame, once its CRC32 has been checked
+  payload: Buffer | null = null;
+
+  constructor(length: number, data: Buffer, flags = 0, seq = 0, crc?: number) {
+    this.seq = seq;
+    this.length = length;
+    this.flags = flags;
+    this.data = data;
+
+    const bytesToPad = PACKET_DATA_BYTES - this.data.length;
+    const padding = Buffer.alloc(bytesToPad).fill(0xff);
+    this.data = Buffer.concat([this.data, padding]);
+
+    if (typeof crc === 'undefined') {
+      this.crc = this.computeCrc();
+    } else {
+      this.crc = crc;
+    }
+  }
+
+  computeCrc() {
+    const allData = [this.address, this.seq, this.length | this.flags, ...this.data.slice(0, this.length)];
+    return crc8(allData);
+  }
+
+  toBuffer() {
+    const frame = Buffer.concat([
+      Buffer.from([PACKET_SOF, this.address, this.seq, this.length | this.flags]),
+      this.data.slice(0, this.length),
+      Buffer.from([this.crc]),
+    ]);
+    if (!this.hasFec()) {
+      return frame;
+    }
+    return Buffer.concat([frame, fecParity(frame.slice(1))]);
+  }
+
+  toString() {
+    return [...this.toBuffer()].map(x => x.toString(16)).join(' ');
+  }
+
+  isSingleBytePacket(byte: number) {
+    if (this.length !== 1) return false;
+    if (this.data[0] !== byte) return false;
+    for (let i = 1; i < PACKET_DATA_BYTES; i++) {
+      if (this.data[i] !== 0xff) return false;
+    }
+    return true;
+  }
+
+  isAck() {
+    return (this.flags & PACKET_FLAG_ACK) !== 0;
+  }
+
+  isLarge() {
+    return (this.flags & PACKET_FLAG_LARGE) !== 0;
+  }
+
+  hasFec() {
+    return (this.flags & PACKET_FLAG_FEC) !== 0;
+  }
+
+  static createAck(type: number, nextSeq: number, bitmap: number) {
+    const data = Buffer.from([type, nextSeq, bitmap & 0xff, (bitmap >> 8) & 0xff]);
+    return new Packet(PACKET_ACK_LENGTH, data, PACKET_FLAG_ACK);
+  }
+
+  // Bus data: a chunk of the image at a 24-bit offset
+  static createBusDataPacket(offset: number, chunk: Buffer) {
+    const data = Buffer.alloc(4 + chunk.length);
+    data[0] = BL_PACKET_BUS_DATA_DATA0;
+    data.writeUIntLE(offset, 1, 3);
+    chunk.copy(data, 4);
+    return new Packet(data.length, data);
+  }
+
+  static createSingleBytePacket(byte: number) {
+    return new Packet(1, Buffer.from([byte]));
+  }
+
+  // Request for an offset + length range of the main application
+  static createRangePacket(byte: number, offset: number, length: number) {
+    const data = Buffer.alloc(9);
+    data[0] = byte;
+    data.writeUInt32LE(offset, 1);
+    data.writeUInt32LE(length, 5);
+    return new Packet(9, data);
+  }
+}
+
+// A frame found on the wire. Frames that fail their CRC8 come out too (with crcOk false), so the
+// receiver can ask for a retransmission. A large frame that fails its CRC32 has no payload. A
+// frame with FEC that had a byte put right is `corrected`, and `raw` is still what was received.
+export type ParsedFrame = {
+  packet: Packet;
+  raw: Buffer;
+  crcOk: boolean;
+  corrected: boolean;
+};
+
+// Turns a byte stream in to frames. Frames are found by hunting for the SOF byte, so a corrupted or
+// truncated frame only costs the bytes up to the next one.
+export class FrameParser {
+  private buffer = Buffer.from([]);
+
+  private consume(n: number) {
+    const consumed = this.buffer.slice(0, n);
+    this.buffer = this.buffer.slice(n);
+    return consumed;
+  }
+
+  push(data: Buffer) {
+    const frames: ParsedFrame[] = [];
+    this.buffer = Buffer.concat([this.buffer, data]);
+
+    while (true) {
+      const sof = this.buffer.indexOf(PACKET_SOF);
+      if (sof < 0) {
+        this.buffer = Buffer.from([]);
+        break;
+      }
+      this.consume(sof);
+
+      // Can we build a packet?
+      if (this.buffer.length < PACKET_HEADER_BYTES) break;
+
+      const control = this.buffer[3];
+      const length = control & PACKET_LENGTH_MASK;
+      if (length > PACKET_DATA_BYTES) {
+        this.consume(1);
+        continue;
+      }
+
+      const fec = (control & PACKET_FLAG_FEC) !== 0;
+      const frameLength = PACKET_HEADER_BYTES + length + PACKET_CRC_BYTES + (fec ? FEC_PARITY_BYTES : 0);
+      if (this.buffer.length < frameLength) break;
+
+      // Corrected in a copy, so the raw frame is left as it was. Like the bootloader, a frame whose
+      // length byte was the wrong one isn't used, as it was already read with the wrong length.
+      let frame = this.buffer.slice(0, frameLength);
+      let corrected = false;
+      if (fec) {
+        const codeword = Buffer.from(frame.slice(1));
+        const result = fecCorrect(codeword);
+        if (result === FecResult.Corrected && codeword[2] === control) {
+          frame = Buffer.concat([frame.slice(0, 1), codeword]);
+          corrected = true;
+        }
+      }
+
+      const packet = new Packet(
+        length,
+        frame.slice(PACKET_HEADER_BYTES, PACKET_HEADER_BYTES + length),
+        control & (PACKET_FLAG_LARGE | PACKET_FLAG_ACK | PACKET_FLAG_FEC),
+        frame[2],
+        frame[PACKET_HEADER_BYTES + length],
+      );
+      packet.address = frame[1];
+
+      // Only the SOF is dropped, in case a real frame starts inside this one
+      if (packet.crc !== packet.computeCrc()) {
+        frames.push({ packet, raw: this.buffer.slice(0, frameLength), crcOk: false, corrected: false });
+        this.consume(1);
+        continue;
+      }
+
+      let totalLength = frameLength;
+      if (packet.isLarge()) {
+        // Large frames carry their own length and CRC32 after the header
+        if (this.buffer.length < frameLength + 2) break;
+        const payloadLength = this.buffer.readUInt16LE(frameLength);
+        if (payloadLength > BL_READ_MAX_LENGTH) {
+          this.consume(1);
+          continue;
+        }
+
+        totalLength = frameLength + 2 + payloadLength + 4;
+        if (this.buffer.length < totalLength) break;
+
+        const payload = this.buffer.slice(frameLength + 2, frameLength + 2 + payloadLength);
+        if (crc32(payload, payloadLength) === this.buffer.readUInt32LE(frameLength + 2 + payloadLength)) {
+          packet.payload = payload;
+        }
+      }
+
+      frames.push({ packet, raw: this.consume(totalLength), crcOk: true, corrected });
+    }
+
+    return frames;
+  }
+}
@@ -0,0 +1,75 @@
+import {FWINFO_DEVICE_ID_OFFSET, Logger} from './protocol';
+import {Port} from './link';
+import {DeviceSession} from './session';
+import {CaptureWriter, readCapture} from './capture';
+import {analyzeCapture, extractImage, formatComparison} from './analysis';
+import {SimulatedDevice} from './sim-device';
+
+const usage = () => {
+  console.log("usage: replay <capture> [options]");
+  console.log("  --baud <rate>         simulated baud rate (default: the capture's)");
+  console.log("  --error-rate <p>      chance of each byte being corrupted on the simulated wire (default 0)");
+  console.log("  --seed <n>            seed for the simulated wire's errors (default 1)");
+  console.log("  --out <file>          where to save the replay's own capture (default <capture>.replay)");
+  process.exit(1);
+};
+
+async function main() {
+  const argv = process.argv.slice(2);
+  const args = { captureFilename: '', baudRate: 0, errorRate: 0, seed: 1, outFilename: '' };
+
+  for (let i = 0; i < argv.length; i++) {
+    const arg = argv[i];
+    const value = () => {
+      if (i + 1 >= argv.length) usage();
+      return argv[++i];
+    };
+
+    if (arg === '--baud') args.baudRate = parseInt(value(), 10);
+    else if (arg === '--error-rate') args.errorRate = parseFloat(value());
+    else if (arg === '--seed') args.seed = parseInt(value(), 10);
+    else if (arg === '--out') args.outFilename = value();
+    else if (!arg.startsWith('--') && !args.captureFilename) args.captureFilename = arg;
+    else usage();
+  }
+  if (!args.captureFilename || isNaN(args.baudRate) || isNaN(args.errorRate) || isNaN(args.seed)) usage();
+
+  const original = await readCapture(args.captureFilename);
+  const fwImage = extractImage(original);
+  const baudRate = args.baudRate || original.baudRate;
+  const outFilename = args.outFilename || `${args.captureFilename}.replay`;
+  Logger.info(`Replaying a ${fwImage.length} byte update at ${baudRate} baud`);
+
+  const device = new SimulatedDevice({
+    baudRate,
+    deviceId: fwImage[FWINFO_DEVICE_ID_OFFSET],
+    byteErrorRate: args.errorRate,
+    seed: args.seed,
+  });
+  const port = await Port.openOn('sim', device);
+  const capture = CaptureWriter.create(outFilename, baudRate);
+  port.capture = capture;
+  const session = DeviceSession.onPort(port, { logger: new Logger('[sim] '), baudRate, full: true });
+
+  try {
+    await session.updateFirmware(fwImage);
+  } catch (e) {
+    Logger.error((e as Error).message);
+    process.exitCode = 1;
+  } finally {
+    await session.close();
+    await capture.close();
+  }
+
+  const replay = await readCapture(outFilename);
+  console.log(formatComparison(['captured', 'replayed'], [analyzeCapture(original), analyzeCapture(replay)]));
+  if (device.overrunBytes > 0) {
+    Logger.error(`${device.overrunBytes} byte(s) overran the simulated device's receive buffer`);
+  }
+}
+
+main()
+  .catch((e: Error) => {
+    Logger.error(e.message);
+    process.exit(1);
+  });
@@ -0,0 +1,928 @@
+import {
+  COMMS_ADDR_ANY,
+  COMMS_WINDOW_SIZE,
+  BL_PACKET_SYNC_OBSERVED_DATA0,
+  BL_PACKET_FW_UPDATE_REQ_DATA0,
+  BL_PACKET_FW_UPDATE_RES_DATA0,
+  BL_PACKET_DEVICE_ID_REQ_DATA0,
+  BL_PACKET_DEVICE_ID_RES_DATA0,
+  BL_PACKET_FW_LENGTH_REQ_DATA0,
+  BL_PACKET_FW_LENGTH_RES_DATA0,
+  BL_PACKET_READY_FOR_DATA_DATA0,
+  BL_PACKET_UPDATE_SUCCESSFUL_DATA0,
+  BL_PACKET_CRC_REQ_DATA0,
+  BL_PACKET_CRC_RES_DATA0,
+  BL_PACKET_READ_REQ_DATA0,
+  BL_PACKET_READ_RES_DATA0,
+  BL_PACKET_SECTOR_REWRITE_REQ_DATA0,
+  BL_PACKET_BOOT_REQ_DATA0,
+  BL_PACKET_BOOT_RES_DATA0,
+  BL_PACKET_BUS_JOIN_REQ_DATA0,
+  BL_PACKET_BUS_JOIN_RES_DATA0,
+  BL_PACKET_BUS_GAP_REQ_DATA0,
+  BL_PACKET_BUS_GAP_RES_DATA0,
+  BL_PACKET_DIAG_REQ_DATA0,
+  BL_PACKET_DIAG_RES_DATA0,
+  BL_PACKET_RAM_LOAD_REQ_DATA0,
+  BL_PACKET_EXTENT_DATA0,
+  BL_PACKET_SECTOR_CRC_REQ_DATA0,
+  BL_PACKET_SECTOR_CRC_RES_DATA0,
+  BL_PACKET_DELTA_UPDATE_REQ_DATA0,
+  BL_DIAG_TRACE,
+  BL_DIAG_TRACE_DRAIN,
+  BL_DIAG_PROFILE,
+  BL_DIAG_PROFILE_RESET,
+  BL_DIAG_UART_LATENCY,
+  BL_DIAG_BOOT_TIMELINE,
+  BL_DIAG_LINK_STATS,
+  BL_DIAG_PC_HISTOGRAM,
+  BL_DIAG_MEMORY,
+  BL_DIAG_BENCH,
+  BL_DIAG_UNSUPPORTED,
+  MEMORY_BUFFER_NAMES,
+  PC_HISTOGRAM_MAGIC,
+  PC_HISTOGRAM_BUCKETS,
+  BOOT_PHASE_NAMES,
+  BL_DIAG_PROFILE_NAME_LENGTH,
+  PROFILE_HISTOGRAM_BINS,
+  BL_BUS_GAP_MAX_RANGES,
+  BL_READ_MAX_LENGTH,
+  RAM_APP_MAX_LENGTH,
+  TRACE_RECORD_BYTES,
+  FWINFO_DEVICE_ID_OFFSET,
+  FWINFO_VERSION_OFFSET,
+  SIGNATURE_OFFSET,
+  SIGNATURE_LENGTH,
+  MAX_FW_LENGTH,
+  SYNC_SEQ,
+  DEFAULT_TIMEOUT,
+  applicationSectors,
+  crc32,
+  delay,
+  extentData,
+  findExtents,
+  Extent,
+  FlashSector,
+  Logger,
+  Packet,
+} from './protocol';
+import {Link, Port} from './link';
+
+export const DEFAULT_BAUD_RATE = 115200;
+
+// How many times a sector that fails read-back verification is erased and rewritten
+const MAX_SECTOR_REWRITES = 3;
+
+// The device says when it's ready for data, which for a full update is once the whole application
+// is erased. That takes a couple of seconds typically, and this is comfortably past the worst case.
+const ERASE_TIMEOUT = 10000;
+
+// The sync sequence goes out this often at first, to catch a device just out of reset as soon as
+// its bootloader is listening, then backs off to the sync delay
+const SYNC_PROBE_INTERVAL = 20;
+
+// Data packets are only made as the link has room for them, so that each one is sized for the
+// loss rate at the time. This many are kept queued ahead of the window.
+const DATA_PACKETS_AHEAD = COMMS_WINDOW_SIZE * 2;
+
+// A bulk read is asked for again if its large frame is lost or corrupted
+const MAX_READ_ATTEMPTS = 3;
+const READ_TIMEOUT = 1000;
+// A large frame only gets through if every one of its bytes does, so a bulk read that fails is
+// asked for again at half the size, down to this. Each success doubles the size again.
+const READ_MIN_LENGTH = 64;
+
+// A range of chunks a node on a bus is still missing
+export type ChunkRange = { first: number, count: number };
+
+// Phases of a boot, each with the time it ended at (us since the bootloader's main)
+export type BootTimeline = {
+  version: number;
+  events: { phase: string, timeUs: number }[];
+};
+
+// The device's end of the link, counted since it was reset
+export type LinkStats = {
+  crcErrors: number;
+  fecCorrections: number;
+  retransmits: number;
+  rtoMs: number;
+};
+
+// Where the bootloader's RAM went, and the most of it that's been used since the marks were reset
+export type MemoryUsage = {
+  ramStart: number;
+  ramBytes: number;
+  noinitBytes: number;
+  dataBytes: number;
+  bssBytes: number;
+  stackBytes: number;
+  stackPeakBytes: number;
+  buffers: { name: string, capacity: number, peak: number, overflows: number }[];
+};
+
+// bench_results_t: times are in cycles of the core clock
+export type BenchResults = {
+  cpuHz: number;
+  uniqueId: string;
+  bootloaderCrc: number;
+  appVersion: number;
+  dataLength: number;
+  crc8Cycles: number;
+  crc32Cycles: number;
+  aesBlockCycles: number;
+  keyScheduleCycles: number;
+  cbcMacCycles: number;
+  flashSector: number;
+  flashSectorSize: number;
+  flashProgramWords: number;
+  flashProgramCycles: number;
+  flashEraseCycles: number;
+  uartBaud: number;
+  uartLength: number;
+  uartReceived: number;
+  uartCycles: number;
+};
+
+// Cycle counts for one of the device's profiling scopes
+export type ProfileScope = {
+  name: string;
+  count: number;
+  min: number;
+  max: number;
+  mean: number;
+  histogram: number[];
+};
+
+// Read-back results for one sector. Offsets are relative to the start of the image.
+export type SectorMismatch = {
+  sector: FlashSector;
+  offsets: number[];
+};
+
+export type SessionOptions = {
+  baudRate?: number;
+  logger?: Logger;
+  // Log progress on every acknowledgement, rather than every 10% of the image
+  verbose?: boolean;
+  // Have the device drain its trace buffer to the port's trace sink once synced
+  trace?: boolean;
+  // Send every byte of the image, including erased (0xff) runs that would otherwise be skipped
+  dense?: boolean;
+  // Erase and write the whole application, rather than only the sectors that differ from the
+  // installed one (and even when it's the very same image)
+  full?: boolean;
+  // Send frames with FEC parity, for a noisy line
+  fec?: boolean;
+  // Runs once the device has the image and is about to be told to boot, while the bootloader is
+  // still there to answer diagnostic requests
+  beforeBoot?: (session: DeviceSession) => Promise<void>;
+};
+
+// All of the state needed to talk to one bootloader. A session either owns its serial port
+// (point-to-point), or is one of several sharing the link to a multi-drop bus. Nothing else is
+// shared between sessions, so any number of them can run side by side in the same process.
+export class DeviceSession {
+  readonly path: string;
+  readonly log: Logger;
+  readonly port: Port;
+  private link: Link;
+  private ownsPort: boolean;
+  private baudRate: number;
+  private readLength = BL_READ_MAX_LENGTH;
+  private verbose: boolean;
+  private trace: boolean;
+  private dense: boolean;
+  private full: boolean;
+  // What of the image was sent in the last update, and so what a sector rewrite sends again
+  private extents: Extent[] | null = null;
+  private beforeBoot: ((session: DeviceSession) => Promise<void>) | null;
+
+  private constructor(port: Port, link: Link, ownsPort: boolean, options: SessionOptions) {
+    this.path = port.path;
+    this.log = options.logger ?? new Logger();
+    this.verbose = options.verbose ?? false;
+    this.baudRate = options.baudRate ?? DEFAULT_BAUD_RATE;
+    this.trace = options.trace ?? false;
+    this.dense = options.dense ?? false;
+    this.full = options.full ?? false;
+    this.beforeBoot = options.beforeBoot ?? null;
+    this.port = port;
+    this.link = link;
+    this.link.fec = options.fec ?? false;
+    this.ownsPort = ownsPort;
+  }
+
+  static async open(path: string, options: SessionOptions = {}) {
+    const port = await Port.open(path, options.baudRate ?? DEFAULT_BAUD_RATE);
+    return DeviceSession.onPort(port, options);
+  }
+
+  // A point-to-point session over an already open port (e.g. one on a simulated device), which
+  // the session then owns
+  static onPort(port: Port, options: SessionOptions = {}) {
+    return new DeviceSession(port, port.link(COMMS_ADDR_ANY), true, options);
+  }
+
+  // A session with one node on a bus, over a port opened (and closed) by the caller
+  static onBus(port: Port, nodeId: number, options: SessionOptions = {}) {
+    return new DeviceSession(port, port.link(nodeId), false, options);
+  }
+
+  close() {
+    this.link.close();
+    if (!this.ownsPort) {
+      return Promise.resolve();
+    }
+    return this.port.close();
+  }
+
+  writePacket(packet: Packet) {
+    this.link.writePacket(packet);
+  }
+
+  private checkFailure() {
+    this.link.checkFailure();
+  }
+
+  waitForPacket(timeout = DEFAULT_TIMEOUT) {
+    return this.link.waitForPacket(timeout);
+  }
+
+  async waitForPacketOfType(byte: number, timeout = DEFAULT_TIMEOUT) {
+    const packet = await this.waitForPacket(timeout);
+    if (packet.data[0] !== byte) {
+      throw new Error(`Unexpected packet received. Expected type 0x${byte.toString(16)}, got packet ${packet}`);
+    }
+    return packet;
+  }
+
+  async waitForSingleBytePacket(byte: number, timeout = DEFAULT_TIMEOUT) {
+    const packet = await this.waitForPacket(timeout);
+    if (packet.length !== 1 || packet.data[0] !== byte) {
+      throw new Error(`Unexpected packet received. Expected single byte 0x${byte.toString(16)}), got packet ${packet}`);
+    }
+  }
+
+  async syncWithBootloader(syncDelay = 500, timeout = DEFAULT_TIMEOUT) {
+    let timeWaited = 0;
+    let probeInterval = Math.min(SYNC_PROBE_INTERVAL, syncDelay);
+
+    while (true) {
+      this.checkFailure();
+      this.port.writeRaw(SYNC_SEQ);
+
+      // Answered as soon as the bootloader sees it, so there's no need to sit out the whole delay
+      for (let waited = 0; waited < probeInterval && this.link.packets.length === 0; waited += 5) {
+        await delay(5);
+      }
+      timeWaited += probeInterval;
+      probeInterval = Math.min(probeInterval * 2, syncDelay);
+
+      if (this.link.packets.length > 0) {
+        const packet = this.link.packets.splice(0, 1)[0];
+        if (packet.isSingleBytePacket(BL_PACKET_SYNC_OBSERVED_DATA0)) {
+          if (this.port.lastNodeId !== null) {
+            this.log.info(`Node ID 0x${this.port.lastNodeId.toString(16)}`);
+          }
+          if (this.trace) {
+            await this.setTraceDrain(true);
+          }
+          return;
+        }
+        throw new Error('Wrong packet observed during sync sequence');
+      }
+
+      if (timeWaited >= timeout) {
+        throw new Error('Timed out waiting for sync sequence observed');
+      }
+    }
+  }
+
+  // CRC32 of a range of the installed application, computed on the device
+  async readCrc(offset: number, length: number) {
+    this.writePacket(Packet.createRangePacket(BL_PACKET_CRC_REQ_DATA0, offset, length));
+    const response = await this.waitForPacketOfType(BL_PACKET_CRC_RES_DATA0);
+    return response.data.readUInt32LE(1);
+  }
+
+  // CRC32 of every whole application sector, by sector index. Like a bulk read, the large frame it
+  // comes back in is asked for again if it's lost.
+  async readSectorCrcs() {
+    for (let attempt = 1; ; attempt++) {
+      this.link.packets = this.link.packets.filter(p => p.data[0] !== BL_PACKET_SECTOR_CRC_RES_DATA0);
+      this.writePacket(Packet.createSingleBytePacket(BL_PACKET_SECTOR_CRC_REQ_DATA0));
+
+      try {
+        const response = await this.waitForPacketOfType(BL_PACKET_SECTOR_CRC_RES_DATA0, READ_TIMEOUT);
+        if (response.payload) {
+          const crcs = new Map<number, number>();
+          for (let i = 0; i < response.data[2]; i++) {
+            crcs.set(response.data[1] + i, response.payload.readUInt32LE(i * 4));
+          }
+          return crcs;
+        }
+      } catch (e) {
+        if (attempt >= MAX_READ_ATTEMPTS) {
+          throw e;
+        }
+      }
+    }
+  }
+
+  // Whether the installed application has the same version and signature as the image
+  async isInstalled(fwImage: Buffer) {
+    const installed = await this.readMemory(FWINFO_VERSION_OFFSET, SIGNATURE_OFFSET + SIGNATURE_LENGTH - FWINFO_VERSION_OFFSET);
+    const expected = fwImage.slice(FWINFO_VERSION_OFFSET, SIGNATURE_OFFSET + SIGNATURE_LENGTH);
+    this.log.info(`Installed version ${installed.readUInt32LE(0)}, image version ${expected.readUInt32LE(0)}`);
+    return installed.equals(expected);
+  }
+
+  // The application sectors whose contents would change if the image were written: those where
+  // the image, followed by erased flash, doesn't match what's there now
+  async changedSectors(fwImage: Buffer) {
+    const crcs = await this.readSectorCrcs();
+    const padded = Buffer.alloc(MAX_FW_LENGTH, 0xff);
+    fwImage.copy(padded);
+
+    return applicationSectors(MAX_FW_LENGTH).filter(sector => {
+      const expected = padded.slice(sector.offset, sector.offset + sector.size);
+      return crcs.get(sector.index) !== (crc32(expected, expected.length) >>> 0);
+    });
+  }
+
+  // Bulk read of a range of the installed application, as a series of large frames. The link
+  // doesn't retransmit those, so a chunk that is lost or fails its CRC32 is simply asked for again.
+  async readMemory(offset: number, length: number) {
+    const chunks: Buffer[] = [];
+
+    for (let position = offset; position < offset + length; ) {
+      const chunk = await this.readChunk(position, offset + length - position);
+      chunks.push(chunk);
+      position += chunk.length;
+    }
+
+    return Buffer.concat(chunks);
+  }
+
+  // Long enough for the request to get there and a large frame of `length` bytes to come back:
+  // a retransmission timeout, plus twice the time the frame takes on the wire (8N1)
+  private largeFrameTimeout(length: number) {
+    return this.link.rtt.rto + (2 * (length + 16) * 10000) / this.baudRate;
+  }
+
+  // Read up to `remaining` bytes from `position`, as many as the current read size allows
+  private async readChunk(position: number, remaining: number) {
+    for (let attempt = 1; ; ) {
+      const chunkLength = Math.min(this.readLength, remaining);
+      const range = `0x${position.toString(16)}-0x${(position + chunkLength).toString(16)}`;
+      this.writePacket(Packet.createRangePacket(BL_PACKET_READ_REQ_DATA0, position, chunkLength));
+
+      try {
+        // A late answer to an earlier attempt may still be on its way. One from the same position
+        // is as good as any, otherwise it's stale.
+        while (true) {
+          const response = await this.waitForPacketOfType(BL_PACKET_READ_RES_DATA0, this.largeFrameTimeout(chunkLength));
+          if (response.payload && response.data.readUInt32LE(1) === position && response.payload.length <= remaining) {
+            this.readLength = Math.min(BL_READ_MAX_LENGTH, this.readLength * 2);
+            return response.payload;
+          }
+        }
+      } catch (e) {
+        this.log.error(`Read of ${range} failed (attempt ${attempt}/${MAX_READ_ATTEMPTS}): ${(e as Error).message}`);
+      }
+
+      // Only attempts at the smallest size count towards giving up
+      if (this.readLength > READ_MIN_LENGTH) {
+        this.readLength = Math.max(READ_MIN_LENGTH, this.readLength / 2);
+      } else if (attempt++ >= MAX_READ_ATTEMPTS) {
+        throw new Error(`Could not read ${range}`);
+      }
+    }
+  }
+
+  // Compare a sector with the image: one CRC for the whole sector, then per read-sized block CRCs
+  // to narrow down a mismatch, and bulk reads of only the blocks that differ to find exact offsets
+  async compareSector(fwImage: Buffer, sector: FlashSector): Promise<SectorMismatch | null> {
+    const expected = fwImage.slice(sector.offset, sector.offset + sector.size);
+    if (await this.readCrc(sector.offset, sector.size) === crc32(expected, expected.length)) {
+      return null;
+    }
+
+    const offsets: number[] = [];
+    for (let position = 0; position < expected.length; position += BL_READ_MAX_LENGTH) {
+      const local = expected.slice(position, position + BL_READ_MAX_LENGTH);
+      if (await this.readCrc(sector.offset + position, local.length) === crc32(local, local.length)) {
+        continue;
+      }
+
+      const remote = await this.readMemory(sector.offset + position, local.length);
+      for (let i = 0; i < local.length; i++) {
+        if (local[i] !== remote[i]) {
+          offsets.push(sector.offset + position + i);
+        }
+      }
+    }
+
+    return { sector, offsets };
+  }
+
+  // Check every sector of the image against the device. With `repair` set, any sector that
+  // doesn't match is erased and sent again, and only an unrepairable sector throws.
+  async verifyImage(fwImage: Buffer, repair: boolean) {
+    const mismatches: SectorMismatch[] = [];
+
+    for (const sector of applicationSectors(fwImage.length)) {
+      for (let rewrites = 0; ; rewrites++) {
+        const mismatch = await this.compareSector(fwImage, sector);
+        if (!mismatch) {
+          break;
+        }
+
+        const shown = mismatch.offsets.slice(0, 8).map(x => `0x${x.toString(16)}`).join(', ');
+        const more = mismatch.offsets.length > 8 ? ', ...' : '';
+        this.log.error(`Sector ${sector.index} differs at ${mismatch.offsets.length} byte(s): ${shown}${more}`);
+
+        if (!repair) {
+          mismatches.push(mismatch);
+          break;
+        }
+
+        if (rewrites >= MAX_SECTOR_REWRITES) {
+          throw new Error(`Sector ${sector.index} still differs after ${rewrites} rewrites`);
+        }
+
+        this.log.info(`Rewriting sector ${sector.index}`);
+        await this.rewriteSector(fwImage, sector);
+      }
+    }
+
+    return mismatches;
+  }
+
+  async rewriteSector(fwImage: Buffer, sector: FlashSector) {
+    this.writePacket(new Packet(2, Buffer.from([BL_PACKET_SECTOR_REWRITE_REQ_DATA0, sector.index])));
+    await this.sendImageData(fwImage, sector.offset, sector.offset + sector.size, this.extents, ERASE_TIMEOUT);
+  }
+
+  // Ask the device to check the signature and boot. Returns false if it rejected the image.
+  async boot() {
+    if (this.beforeBoot) {
+      await this.beforeBoot(this);
+    }
+
+    this.writePacket(Packet.createSingleBytePacket(BL_PACKET_BOOT_REQ_DATA0));
+    const response = await this.waitForPacketOfType(BL_PACKET_BOOT_RES_DATA0);
+    // The device keeps resending it until it's acknowledged, so don't leave that to the ACK timer
+    this.link.flushAck();
+    return response.data[1] === 1;
+  }
+
+  // Send image[start, end) as data packets, leaving out anything outside the extents the device
+  // was given. The device asks for data once, after which the link layer's window does the
+  // pacing. Only a lack of progress (no frames acknowledged) times out.
+  private async sendImageData(fwImage: Buffer, start: number, end: number, extents: Extent[] | null = null, readyTimeout = DEFAULT_TIMEOUT) {
+    await this.waitForSingleBytePacket(BL_PACKET_READY_FOR_DATA_DATA0, readyTimeout);
+
+    const data = extents ? extentData(fwImage, extents, start, end) : fwImage.slice(start, end);
+    const firstByte = this.link.bytesAcked;
+    let position = 0;
+    const queueData = () => {
+      while (position < data.length && this.link.framesQueued < DATA_PACKETS_AHEAD) {
+        const dataBytes = data.slice(position, position + this.link.dataPacketSize);
+        this.writePacket(new Packet(dataBytes.length, dataBytes));
+        position += dataBytes.length;
+      }
+    };
+    this.link.onAck = queueData;
+    try {
+      queueData();
+
+      let lastAcked = this.link.framesAcked;
+      let timeWaited = 0;
+      let nextProgressReport = 0;
+      while (this.link.packets.length < 1) {
+        this.checkFailure();
+        await delay(10);
+
+        if (this.link.framesAcked === lastAcked) {
+          timeWaited += 10;
+          if (timeWaited >= DEFAULT_TIMEOUT) {
+            throw new Error('Timed out waiting for the device to accept firmware data');
+          }
+          continue;
+        }
+
+        lastAcked = this.link.framesAcked;
+        timeWaited = 0;
+
+        const bytesWritten = Math.min(data.length, this.link.bytesAcked - firstByte);
+        if (this.verbose) {
+          this.log.info(`Wrote ${bytesWritten}/${data.length} bytes`);
+        } else if (bytesWritten >= nextProgressReport) {
+          this.log.info(`Wrote ${bytesWritten}/${data.length} bytes`);
+          nextProgressReport += data.length / 10;
+        }
+      }
+    } finally {
+      this.link.onAck = null;
+    }
+
+    await this.waitForSingleBytePacket(BL_PACKET_UPDATE_SUCCESSFUL_DATA0);
+  }
+
+  // Join a bus update: the node checks the image is meant for it, answers, then erases its
+  // application ready for the broadcast. Returns false if the node turned the image down.
+  async joinBusUpdate(fwImage: Buffer) {
+    const data = Buffer.alloc(6);
+    data[0] = BL_PACKET_BUS_JOIN_REQ_DATA0;
+    data[1] = fwImage[FWINFO_DEVICE_ID_OFFSET];
+    data.writeUInt32LE(fwImage.length, 2);
+    this.writePacket(new Packet(6, data));
+
+    const response = await this.waitForPacketOfType(BL_PACKET_BUS_JOIN_RES_DATA0);
+
+    // Nothing from this node may still be waiting on us once the host moves on to the next one
+    this.link.flushAck();
+    return response.data[1] === 1;
+  }
+
+  // Every chunk range the node hasn't received yet, along with the total count. The first poll
+  // after joining also tells us the node has finished erasing, so it may take a while.
+  async readBusGaps(timeout = READ_TIMEOUT) {
+    const gaps: ChunkRange[] = [];
+    let missing = 0;
+    let nextChunk = 0;
+
+    for (let attempt = 1; ; ) {
+      // An answer to an earlier attempt that timed out would be out of date by now
+      this.link.packets = this.link.packets.filter(p => p.data[0] !== BL_PACKET_BUS_GAP_RES_DATA0);
+
+      const request = Buffer.from([BL_PACKET_BUS_GAP_REQ_DATA0, nextChunk & 0xff, (nextChunk >> 8) & 0xff]);
+      this.writePacket(new Packet(3, request));
+
+      let response: Packet;
+      try {
+        response = await this.waitForPacketOfType(BL_PACKET_BUS_GAP_RES_DATA0, timeout);
+      } catch (e) {
+        if (attempt++ >= MAX_READ_ATTEMPTS) {
+          throw e;
+        }
+        continue;
+      }
+
+      missing = response.data.readUInt16LE(1);
+      const rangeCount = response.data[3];
+      for (let i = 0; i < rangeCount; i++) {
+        gaps.push({ first: response.payload!.readUInt16LE(i * 4), count: response.payload!.readUInt16LE(i * 4 + 2) });
+      }
+
+      if (rangeCount < BL_BUS_GAP_MAX_RANGES) {
+        break;
+      }
+      const last = gaps[gaps.length - 1];
+      nextChunk = last.first + last.count;
+    }
+
+    this.link.flushAck();
+    return { missing, gaps };
+  }
+
+  // Send a diagnostic request and wait for its large frame response
+  private async diagnostic(id: number, args: number[] = [], timeout = READ_TIMEOUT) {
+    this.link.packets = this.link.packets.filter(p => p.data[0] !== BL_PACKET_DIAG_RES_DATA0);
+    this.writePacket(new Packet(2 + args.length, Buffer.from([BL_PACKET_DIAG_REQ_DATA0, id, ...args])));
+
+    while (true) {
+      const response = await this.waitForPacketOfType(BL_PACKET_DIAG_RES_DATA0, timeout);
+      if (response.data[1] === BL_DIAG_UNSUPPORTED && response.data[2] === id) {
+        throw new Error(`The bootloader was built without diagnostic 0x${id.toString(16)}, build it with 'make DIAGNOSTICS=1'`);
+      }
+      if (response.data[1] === id && response.payload) {
+        return response;
+      }
+    }
+  }
+
+  // Every trace record the device hasn't handed over yet, as raw 16-byte records. Records that
+  // were overwritten before they could be read are only counted.
+  async readTrace() {
+    const pages: Buffer[] = [];
+    let dropped = 0;
+
+    while (true) {
+      const response = await this.diagnostic(BL_DIAG_TRACE);
+      const count = response.data[6];
+      dropped += response.data.readUInt32LE(2);
+      pages.push(response.payload!.slice(0, count * TRACE_RECORD_BYTES));
+
+      if (count < BL_READ_MAX_LENGTH / TRACE_RECORD_BYTES) {
+        break;
+      }
+    }
+
+    return { records: Buffer.concat(pages), dropped };
+  }
+
+  // Have the device send its trace records in the background as they're recorded
+  async setTraceDrain(enabled: boolean) {
+    await this.diagnostic(BL_DIAG_TRACE_DRAIN, [enabled ? 1 : 0]);
+  }
+
+  // Statistics for every profiling scope that has recorded anything so far
+  async readProfile() {
+    const scopes: ProfileScope[] = [];
+
+    for (let index = 0; ; index++) {
+      const response = await this.diagnostic(BL_DIAG_PROFILE, [index]);
+      const payload = response.payload!;
+      if (index >= response.data[3] || payload.length === 0) {
+        break;
+      }
+
+      const name = payload.slice(0, BL_DIAG_PROFILE_NAME_LENGTH).toString('latin1').replace(/\0.*$/, '');
+      const stats = payload.slice(BL_DIAG_PROFILE_NAME_LENGTH);
+      const count = stats.readUInt32LE(0);
+      const total = Number(stats.readBigUInt64LE(12));
+      const histogram: number[] = [];
+      for (let bin = 0; bin < PROFILE_HISTOGRAM_BINS; bin++) {
+        histogram.push(stats.readUInt32LE(20 + bin * 4));
+      }
+
+      scopes.push({
+        name,
+        count,
+        min: count ? stats.readUInt32LE(4) : 0,
+        max: stats.readUInt32LE(8),
+        mean: count ? total / count : 0,
+        histogram,
+      });
+    }
+
+    return scopes;
+  }
+
+  // The timeline of the boot in progress (bootloader phases up to now), or with `previous`, of the
+  // last complete boot, including the app's own startup
+  async readBootTimeline(previous: boolean): Promise<BootTimeline> {
+    const response = await this.diagnostic(BL_DIAG_BOOT_TIMELINE, [previous ? 1 : 0]);
+    const payload = response.payload!;
+    const events = [];
+    for (let i = 0; i < response.data[3]; i++) {
+      const phase = payload.readUInt32LE(i * 8 + 4);
+      events.push({ phase: BOOT_PHASE_NAMES[phase] ?? `phase ${phase}`, timeUs: payload.readUInt32LE(i * 8) });
+    }
+    return { version: response.data.readUInt32LE(4), events };
+  }
+
+  async readLinkStats(): Promise<LinkStats> {
+    const payload = (await this.diagnostic(BL_DIAG_LINK_STATS)).payload!;
+    return {
+      crcErrors: payload.readUInt32LE(0),
+      fecCorrections: payload.readUInt32LE(4),
+      retransmits: payload.readUInt32LE(8),
+      rtoMs: payload.readUInt32LE(12),
+    };
+  }
+
+  // With `reset`, the high-water marks start again from what's in use once they've been read
+  async readMemoryUsage(reset = false): Promise<MemoryUsage> {
+    const response = await this.diagnostic(BL_DIAG_MEMORY, [reset ? 1 : 0]);
+    const payload = response.payload!;
+    const buffers = [];
+    for (let i = 0; i < response.data[2]; i++) {
+      buffers.push({
+        name: MEMORY_BUFFER_NAMES[i] ?? `buffer ${i}`,
+        capacity: payload.readUInt32LE(28 + i * 12),
+        peak: payload.readUInt32LE(32 + i * 12),
+        overflows: payload.readUInt32LE(36 + i * 12),
+      });
+    }
+
+    return {
+      ramStart: payload.readUInt32LE(0),
+      ramBytes: payload.readUInt32LE(4),
+      noinitBytes: payload.readUInt32LE(8),
+      dataBytes: payload.readUInt32LE(12),
+      bssBytes: payload.readUInt32LE(16),
+      stackBytes: payload.readUInt32LE(20),
+      stackPeakBytes: payload.readUInt32LE(24),
+      buffers,
+    };
+  }
+
+  // Run the bootloader's self-benchmark, which takes as long as a sector erase. Null if the
+  // bootloader was built without it (it needs 'make DIAGNOSTICS=1').
+  async readBench(): Promise<BenchResults | null> {
+    const response = await this.diagnostic(BL_DIAG_BENCH, [], ERASE_TIMEOUT);
+    if (response.data[2] === 0) {
+      return null;
+    }
+
+    const payload = response.payload!;
+    const u32 = (field: number) => payload.readUInt32LE(field * 4);
+    return {
+      cpuHz: u32(0),
+      uniqueId: payload.slice(4, 16).toString('hex'),
+      bootloaderCrc: u32(4),
+      appVersion: u32(5),
+      dataLength: u32(6),
+      crc8Cycles: u32(7),
+      crc32Cycles: u32(8),
+      aesBlockCycles: u32(9),
+      keyScheduleCycles: u32(10),
+      cbcMacCycles: u32(11),
+      flashSector: u32(12),
+      flashSectorSize: u32(13),
+      flashProgramWords: u32(14),
+      flashProgramCycles: u32(15),
+      flashEraseCycles: u32(16),
+      uartBaud: u32(17),
+      uartLength: u32(18),
+      uartReceived: u32(19),
+      uartCycles: u32(20),
+    };
+  }
+
+  // The SysTick PC histogram, laid out as pc_histogram_t so that it reads the same as a debugger
+  // dump of the app's. Null unless the bootloader was built with 'make PC_SAMPLING=1'.
+  async readPcHistogram() {
+    const histogram = Buffer.alloc(16 + PC_HISTOGRAM_BUCKETS * 2);
+    histogram.writeUInt32LE(PC_HISTOGRAM_MAGIC, 0);
+
+    for (let chunk = 0, offset = 16; ; chunk++) {
+      const response = await this.diagnostic(BL_DIAG_PC_HISTOGRAM, [chunk]);
+      if (chunk >= response.data[3]) {
+        return (chunk > 0) ? histogram : null;
+      }
+
+      histogram.writeUInt32LE(response.data.readUInt32LE(4), 4);
+      histogram.writeUInt32LE(response.data[8], 8);
+      histogram.writeUInt32LE(response.data.readUInt32LE(9), 12);
+      offset += response.payload!.copy(histogram, offset);
+    }
+  }
+
+  async resetProfile() {
+    await this.diagnostic(BL_DIAG_PROFILE_RESET);
+  }
+
+  // Have the device time its UART interrupt entry on `samples` filler bytes. The results land in
+  // the "usart2 rxne->isr" profiling scope. Only meaningful when talking to the device over UART.
+  async measureUartLatency(samples: number) {
+    const request = Buffer.from([BL_PACKET_DIAG_REQ_DATA0, BL_DIAG_UART_LATENCY, Math.min(samples, 0xff)]);
+    this.link.packets = this.link.packets.filter(p => p.data[0] !== BL_PACKET_DIAG_RES_DATA0);
+    this.writePacket(new Packet(3, request));
+
+    // The device starts measuring once it has acknowledged the request
+    while (!this.link.idle) {
+      this.checkFailure();
+      await delay(1);
+    }
+
+    // Spaced out, so that every byte is measured on its own (anything but a SOF will do)
+    for (let i = 0; i < samples; i++) {
+      this.port.writeRaw(Buffer.from([0x00]));
+      await delay(2);
+    }
+
+    const response = await this.waitForPacketOfType(BL_PACKET_DIAG_RES_DATA0, READ_TIMEOUT * 2);
+    return response.data[2];
+  }
+
+  // Compare the installed application with an image without changing anything, then boot it
+  async auditImage(fwImage: Buffer) {
+    this.log.info('Attempting to sync with the bootloader');
+    await this.syncWithBootloader();
+    this.log.success('Synced!');
+
+    this.log.info('Comparing the installed application with the image');
+    const mismatches = await this.verifyImage(fwImage, false);
+    if (mismatches.length === 0) {
+      this.log.success('Installed application matches the image');
+    }
+
+    if (!await this.boot()) {
+      this.log.error('Device rejected the installed application');
+    }
+
+    return mismatches;
+  }
+
+  // For development: load the image (linked with 'make ram' and signed with --ram) in to RAM and
+  // run it from there. Nothing is erased or written, so the application in flash is still there
+  // after the next reset.
+  async runFromRam(fwImage: Buffer) {
+    if (fwImage.length > RAM_APP_MAX_LENGTH) {
+      throw new Error(`Image is ${fwImage.length} bytes, the most that can be loaded in to RAM is ${RAM_APP_MAX_LENGTH}`);
+    }
+
+    this.log.info('Attempting to sync with the bootloader');
+    await this.syncWithBootloader();
+    this.log.success('Synced!');
+
+    const data = Buffer.alloc(5);
+    data[0] = BL_PACKET_RAM_LOAD_REQ_DATA0;
+    data.writeUInt32LE(fwImage.length, 1);
+    this.writePacket(new Packet(5, data));
+    this.log.info('Loading the image in to RAM');
+
+    await this.sendImageData(fwImage, 0, fwImage.length);
+    this.log.success('Image loaded');
+
+    if (!await this.boot()) {
+      throw new Error('Device rejected the image signature');
+    }
+    this.log.success('Running from RAM');
+  }
+
+  // Run the whole update sequence against the device. Throws on any protocol failure, leaving
+  // the caller to decide whether to retry.
+  async updateFirmware(fwImage: Buffer) {
+    const fwLength = fwImage.length;
+
+    this.log.info('Attempting to sync with the bootloader');
+    await this.syncWithBootloader();
+    this.log.success('Synced!');
+
+    // Unless asked for a full update, only the sectors that differ are erased and written. A
+    // device that already has this very image isn't touched at all.
+    let changed: FlashSector[] | null = null;
+    if (!this.full) {
+      if (await this.isInstalled(fwImage)) {
+        if (await this.boot()) {
+          this.log.success('Device already has this image');
+          return;
+        }
+        this.log.error('Device rejected the installed application, updating it');
+      }
+
+      changed = await this.changedSectors(fwImage);
+      const bytes = changed.reduce((total, sector) => total + sector.size, 0);
+      this.log.info(`${changed.length} sector(s) differ (${bytes / 1024} KiB): ${changed.map(sector => sector.index).join(', ')}`);
+    }
+
+    this.log.info('Requesting firmware update');
+    const fwUpdatePacket = Packet.createSingleBytePacket(changed ? BL_PACKET_DELTA_UPDATE_REQ_DATA0 : BL_PACKET_FW_UPDATE_REQ_DATA0);
+    this.writePacket(fwUpdatePacket);
+    await this.waitForSingleBytePacket(BL_PACKET_FW_UPDATE_RES_DATA0);
+    this.log.success('Firmware update request accepted');
+
+    this.log.info('Waiting for device ID request');
+    await this.waitForSingleBytePacket(BL_PACKET_DEVICE_ID_REQ_DATA0);
+    this.log.success('Device ID request recieved');
+
+    const deviceId = fwImage[FWINFO_DEVICE_ID_OFFSET];
+    const deviceIDPacket = new Packet(2, Buffer.from([BL_PACKET_DEVICE_ID_RES_DATA0, deviceId]));
+    this.writePacket(deviceIDPacket);
+    this.log.info(`Responding with device ID 0x${deviceId.toString(16)}`);
+
+    this.log.info('Waiting for firmware length request');
+    await this.waitForSingleBytePacket(BL_PACKET_FW_LENGTH_REQ_DATA0);
+    this.log.success('Firmware length request recieved');
+
+    // A sparse image also says how many extents follow. Only the data in them is sent, and the
+    // erased runs in between are left as the erase leaves them.
+    const extents = this.dense ? null : findExtents(fwImage);
+    const sparse = extents !== null && !(extents.length === 1 && extents[0].offset === 0 && extents[0].length === fwLength);
+    this.extents = sparse ? extents : null;
+
+    const fwLengthPacketBuffer = Buffer.alloc(this.extents ? 6 : 5);
+    fwLengthPacketBuffer[0] = BL_PACKET_FW_LENGTH_RES_DATA0;
+    fwLengthPacketBuffer.writeUInt32LE(fwLength, 1);
+    if (this.extents) {
+      fwLengthPacketBuffer[5] = this.extents.length;
+    }
+    const fwLengthPacket = new Packet(fwLengthPacketBuffer.length, fwLengthPacketBuffer);
+    this.writePacket(fwLengthPacket);
+    this.log.info('Responding with firmware length');
+
+    if (this.extents) {
+      for (const extent of this.extents) {
+        this.writePacket(Packet.createRangePacket(BL_PACKET_EXTENT_DATA0, extent.offset, extent.length));
+      }
+      const sent = this.extents.reduce((total, extent) => total + extent.length, 0);
+      this.log.info(`Sending ${sent}/${fwLength} bytes in ${this.extents.length} extent(s), skipping ${fwLength - sent} erased`);
+    }
+
+    if (changed) {
+      for (const sector of changed) {
+        this.log.info(`Writing sector ${sector.index}`);
+        await this.rewriteSector(fwImage, sector);
+      }
+    } else {
+      this.log.info('Waiting for the main application to be erased...');
+      await this.sendImageData(fwImage, 0, fwLength, this.extents, ERASE_TIMEOUT);
+    }
+    this.log.success('Firmware written');
+
+    this.log.info('Verifying the written image');
+    await this.verifyImage(fwImage, true);
+    this.log.success('Read-back verification passed');
+
+    if (!await this.boot()) {
+      throw new Error('Device rejected the image signature');
+    }
+    this.log.success("Firmware update complete!");
+  }
+}
@@ -0,0 +1,394 @@
+import * as fs from 'fs/promises';
+import * as os from 'os';
+import * as path from 'path';
+import {
+  BL_PACKET_BOOT_RES_DATA0,
+  BL_PACKET_DEVICE_ID_REQ_DATA0,
+  BL_PACKET_DEVICE_ID_RES_DATA0,
+  BL_PACKET_FW_LENGTH_REQ_DATA0,
+  BL_PACKET_FW_LENGTH_RES_DATA0,
+  BL_PACKET_FW_UPDATE_REQ_DATA0,
+  BL_PACKET_FW_UPDATE_RES_DATA0,
+  BL_PACKET_READY_FOR_DATA_DATA0,
+  BL_PACKET_UPDATE_SUCCESSFUL_DATA0,
+  FWINFO_DEVICE_ID_OFFSET,
+  Logger,
+  PACKET_DATA_BYTES,
+  PROFILE_HISTOGRAM_BINS,
+  Packet,
+} from './protocol';
+import {Port} from './link';
+import {DEFAULT_BAUD_RATE, DeviceSession, SessionOptions} from './session';
+import {SimulatedBus, SimulatedDevice, SimulatedProfileScope} from './sim-device';
+import {runBusUpdateOn} from './bus';
+import {expandPorts, runFleet, summarizeFleet} from './fleet';
+import {CaptureDirection, CaptureWriter, readCapture} from './capture';
+import {analyzeCapture, extractImage} from './analysis';
+
+const usage = () => {
+  console.log("usage: sim-check [options]");
+  console.log(`  --check <name>        run only <name>, may be given more than once (${checks.map(check => check.name).join(', ')})`);
+  console.log("  --seed <n>            seed for images and the simulated wire's errors (default 1)");
+  process.exit(1);
+};
+
+// Progress from the sessions would drown the results
+class QuietLogger extends Logger {
+  info() {}
+  success() {}
+  error() {}
+}
+
+// Keeps the errors, e.g. a read-back mismatch that the session then repaired
+class RecordingLogger extends QuietLogger {
+  errors: string[] = [];
+  error(message: string) { this.errors.push(message); }
+}
+
+type Check = {
+  name: string;
+  description: string;
+  // Throws if the check fails
+  run: (seed: number) => Promise<void>;
+};
+
+const expect = (condition: boolean, message: string) => {
+  if (!condition) {
+    throw new Error(message);
+  }
+};
+
+// Random, so that none of it is skipped as erased, with the device ID in the right place
+const makeImage = (length: number, seed: number) => {
+  const image = Buffer.alloc(length);
+  let state = seed;
+  for (let i = 0; i < image.length; i++) {
+    state = (state * 1103515245 + 12345) >>> 0;
+    image[i] = state >>> 24;
+  }
+  image[FWINFO_DEVICE_ID_OFFSET] = 0x42;
+  return image;
+};
+
+const openSimulated = async (image: Buffer, seed: number, byteErrorRate = 0, logger: Logger = new QuietLogger(), captureFilename = '') => {
+  const device = new SimulatedDevice({ baudRate: DEFAULT_BAUD_RATE, deviceId: image[FWINFO_DEVICE_ID_OFFSET], byteErrorRate, seed });
+  const port = await Port.openOn('sim', device);
+  const capture = captureFilename ? CaptureWriter.create(captureFilename, DEFAULT_BAUD_RATE) : null;
+  port.capture = capture;
+  const session = DeviceSession.onPort(port, { logger, full: true });
+  return { device, session, capture };
+};
+
+// A full update, captured to `filename`
+const captureUpdate = async (image: Buffer, seed: number, byteErrorRate: number, filename: string) => {
+  const { device, session, capture } = await openSimulated(image, seed, byteErrorRate, new QuietLogger(), filename);
+  try {
+    await session.updateFirmware(image);
+  } finally {
+    await session.close();
+    await capture!.close();
+  }
+  return device;
+};
+
+// Start an update, then stream the whole image straight after the length without waiting to be
+// told the erase is done. Everything sent lands while the flash is busy, and must all get through
+// the UART ring with nothing dropped.
+const checkEraseStream = async (seed: number) => {
+  const image = makeImage(16 * 1024, seed);
+  const { device, session } = await openSimulated(image, seed);
+  try {
+    await session.syncWithBootloader();
+    session.writePacket(Packet.createSingleBytePacket(BL_PACKET_FW_UPDATE_REQ_DATA0));
+    await session.waitForSingleBytePacket(BL_PACKET_FW_UPDATE_RES_DATA0);
+    await session.waitForSingleBytePacket(BL_PACKET_DEVICE_ID_REQ_DATA0);
+    session.writePacket(new Packet(2, Buffer.from([BL_PACKET_DEVICE_ID_RES_DATA0, image[FWINFO_DEVICE_ID_OFFSET]])));
+    await session.waitForSingleBytePacket(BL_PACKET_FW_LENGTH_REQ_DATA0);
+
+    const length = Buffer.alloc(5);
+    length[0] = BL_PACKET_FW_LENGTH_RES_DATA0;
+    length.writeUInt32LE(image.length, 1);
+    session.writePacket(new Packet(5, length));
+    for (let position = 0; position < image.length; position += PACKET_DATA_BYTES) {
+      const data = image.slice(position, position + PACKET_DATA_BYTES);
+      session.writePacket(new Packet(data.length, data));
+    }
+
+    await session.waitForSingleBytePacket(BL_PACKET_READY_FOR_DATA_DATA0, 20000);
+    await session.waitForSingleBytePacket(BL_PACKET_UPDATE_SUCCESSFUL_DATA0, 20000);
+    expect(device.overrunBytes === 0, `${device.overrunBytes} bytes dropped by the UART ring during the erase`);
+    expect(await session.isInstalled(image), 'the image read back differs from the one sent');
+  } finally {
+    await session.close();
+  }
+};
+
+// A full update over a wire that corrupts bytes in both directions, so data frames and ACKs are
+// lost. Only the missing frames should be sent again, and a frame that arrives twice must not be
+// written twice, which would shift everything after it.
+const checkLossRecovery = async (seed: number) => {
+  let duplicates = 0;
+  for (const byteErrorRate of [1e-3, 5e-3]) {
+    const image = makeImage(32 * 1024, seed);
+    const logger = new RecordingLogger();
+    const { device, session } = await openSimulated(image, seed, byteErrorRate, logger);
+    try {
+      await session.updateFirmware(image);
+    } finally {
+      await session.close();
+    }
+
+    expect(device.corruptFrames > 0, `no frames were corrupted at a byte error rate of ${byteErrorRate}`);
+    expect(logger.errors.length === 0, `at a byte error rate of ${byteErrorRate}: ${logger.errors[0]}`);
+    duplicates += device.duplicateFrames;
+  }
+  expect(duplicates > 0, 'no frame arrived twice, so duplicate detection went untested');
+};
+
+// The boot response is lost on its way to the host. The device has to send it again before it
+// hands over to the app, or the host is left waiting for it.
+const checkBootResponseLoss = async (seed: number) => {
+  const image = makeImage(4 * 1024, seed);
+  const device = new SimulatedDevice({ baudRate: DEFAULT_BAUD_RATE, deviceId: image[FWINFO_DEVICE_ID_OFFSET], seed, dropFirst: [BL_PACKET_BOOT_RES_DATA0] });
+  const session = DeviceSession.onPort(await Port.openOn('sim', device), { logger: new QuietLogger(), full: true });
+  try {
+    await session.updateFirmware(image);
+  } finally {
+    await session.close();
+  }
+  expect(device.droppedFrames === 1, `${device.droppedFrames} frames dropped instead of the boot response`);
+};
+
+// Three nodes on one bus, each missing different broadcast chunks to its own line noise. After the
+// broadcast, the gaps the nodes report have to be filled in by repair rounds, and every node ends
+// up with an image that reads back intact and boots.
+const checkBusGapFill = async (seed: number) => {
+  const image = makeImage(8 * 1024, seed);
+  const nodeIds = [0x01, 0x02, 0x03];
+  const bus = new SimulatedBus(nodeIds.map(nodeId => new SimulatedDevice({
+    baudRate: DEFAULT_BAUD_RATE,
+    deviceId: image[FWINFO_DEVICE_ID_OFFSET],
+    nodeId,
+    byteErrorRate: 2e-3,
+    seed: seed * 256 + nodeId,
+  })));
+
+  const logger = new RecordingLogger();
+  const port = await Port.openOn('sim-bus', bus);
+  const { results, repairRounds } = await runBusUpdateOn(port, nodeIds, image, { logger, syncTime: 500 });
+
+  for (const result of results) {
+    expect(result.ok, `${result.path}: ${result.error}`);
+  }
+  expect(logger.errors.length === 0, logger.errors[0]);
+  expect(repairRounds > 0, 'no chunks were lost, so gap filling went untested');
+};
+
+// Scopes with known statistics, one with a total too big for 32 bits and one that never ran, are
+// read back through the diagnostic and must decode to the same numbers
+const checkProfileDecode = async (seed: number) => {
+  const histogram = (bins: Record<number, number>) =>
+    Array.from({ length: PROFILE_HISTOGRAM_BINS }, (_, bin) => bins[bin] ?? 0);
+  const scopes: SimulatedProfileScope[] = [
+    { name: 'comms_update', count: 3, min: 90, max: 300, total: 600n, histogram: histogram({ 7: 1, 8: 1, 9: 1 }) },
+    { name: 'a_scope_name_too_long_to_fit', count: 2, min: 0x80000000, max: 0xffffffff, total: 0x17fffffffn, histogram: histogram({ 30: 1, 31: 1 }) },
+    { name: 'never_ran', count: 0, min: 0xffffffff, max: 0, total: 0n, histogram: histogram({}) },
+  ];
+
+  const image = makeImage(1024, seed);
+  const device = new SimulatedDevice({ baudRate: DEFAULT_BAUD_RATE, deviceId: image[FWINFO_DEVICE_ID_OFFSET], profileScopes: scopes });
+  const port = await Port.openOn('sim', device);
+  const session = DeviceSession.onPort(port, { logger: new QuietLogger() });
+  try {
+    await session.syncWithBootloader();
+    const decoded = await session.readProfile();
+
+    expect(decoded.length === scopes.length, `${decoded.length} scopes decoded instead of ${scopes.length}`);
+    const names = ['comms_update', 'a_scope_name_too_long_t', 'never_ran'];
+    decoded.forEach((scope, i) => {
+      const sent = scopes[i];
+      expect(scope.name === names[i], `scope ${i} is named '${scope.name}'`);
+      expect(scope.count === sent.count && scope.max === sent.max, `${scope.name}: count ${scope.count}, max ${scope.max}`);
+      expect(scope.min === (sent.count ? sent.min : 0), `${scope.name}: min ${scope.min}`);
+      expect(scope.mean === (sent.count ? Number(sent.total) / sent.count : 0), `${scope.name}: mean ${scope.mean}`);
+      expect(scope.histogram.every((samples, bin) => samples === sent.histogram[bin]), `${scope.name}: histogram differs`);
+    });
+
+    await session.resetProfile();
+    const reset = await session.readProfile();
+    expect(reset.every(scope => scope.count === 0 && scope.mean === 0 && scope.histogram.every(samples => samples === 0)),
+      'scopes still hold samples after a reset');
+  } finally {
+    await session.close();
+  }
+
+  // A bootloader built without diagnostics says so, rather than leaving the request to time out
+  const bare = new SimulatedDevice({ baudRate: DEFAULT_BAUD_RATE, deviceId: image[FWINFO_DEVICE_ID_OFFSET], diagnostics: false });
+  const barePort = await Port.openOn('sim', bare);
+  const bareSession = DeviceSession.onPort(barePort, { logger: new QuietLogger() });
+  try {
+    await bareSession.syncWithBootloader();
+    const error = await bareSession.readProfile().then(() => null, (e: Error) => e);
+    expect(error !== null && error.message.includes('DIAGNOSTICS=1'), `reading the profile gave ${error ? error.message : 'no error'}`);
+  } finally {
+    await bareSession.close();
+  }
+};
+
+// Five boards found through globs, flashed two at a time. One has the wrong device ID on its first
+// attempt and comes good on the retry, and one never does, so runs out of retries.
+const checkFleet = async (seed: number) => {
+  const directory = await fs.mkdtemp(path.join(os.tmpdir(), 'sim-check-'));
+  try {
+    for (const name of ['ttyUSB0', 'ttyUSB1', 'ttyUSB2', 'ttyUSB10', 'ttyACM0', 'console']) {
+      await fs.writeFile(path.join(directory, name), '');
+    }
+    const ports = await expandPorts([path.join(directory, 'ttyUSB1'), path.join(directory, 'ttyUSB*'), path.join(directory, 'ttyACM?')]);
+    const names = ports.map(port => path.basename(port)).join(',');
+    expect(names === 'ttyUSB1,ttyUSB0,ttyUSB10,ttyUSB2,ttyACM0', `ports expanded to ${names}`);
+
+    const image = makeImage(8 * 1024, seed);
+    const flaky = path.join(directory, 'ttyUSB10');
+    const broken = path.join(directory, 'ttyACM0');
+    const attempts = new Map<string, number>();
+    let active = 0;
+    let maxActive = 0;
+
+    const openSession = async (port: string, options: SessionOptions) => {
+      const attempt = (attempts.get(port) ?? 0) + 1;
+      attempts.set(port, attempt);
+      const wrongId = (port === broken) || (port === flaky && attempt === 1);
+      const deviceId = image[FWINFO_DEVICE_ID_OFFSET] ^ (wrongId ? 1 : 0);
+      const device = new SimulatedDevice({ baudRate: DEFAULT_BAUD_RATE, deviceId, seed: seed + attempt });
+      const session = DeviceSession.onPort(await Port.openOn(port, device), options);
+
+      maxActive = Math.max(maxActive, ++active);
+      const close = session.close.bind(session);
+      session.close = () => {
+        active--;
+        return close();
+      };
+      return session;
+    };
+
+    const { results, wallTimeMs } = await runFleet(ports, image, {
+      concurrency: 2, retries: 1, retryDelay: 0, full: true, openSession, logger: () => new QuietLogger(),
+    });
+
+    expect(maxActive === 2, `${maxActive} sessions were open at once with a limit of 2`);
+    expect(results.map(r => r.path).join(',') === ports.join(','), 'the results are not in the order of the ports');
+    for (const r of results) {
+      const expected = r.path === broken ? 2 : r.path === flaky ? 2 : 1;
+      expect(r.ok === (r.path !== broken), `${r.path}: ${r.ok ? 'succeeded' : r.error}`);
+      expect(r.attempts === expected && attempts.get(r.path) === expected, `${r.path}: ${r.attempts} attempt(s) instead of ${expected}`);
+    }
+
+    const summary = summarizeFleet(results, wallTimeMs, image.length);
+    expect(summary.succeeded === 4 && summary.failed === 1 && summary.retried === 2,
+      `${summary.succeeded} succeeded, ${summary.failed} failed, ${summary.retried} retried`);
+    expect(summary.serialSeconds > summary.wallSeconds, `${summary.serialSeconds}s serial isn't more than ${summary.wallSeconds}s wall time`);
+    expect(Math.abs(summary.bytesPerSecond - 4 * image.length / summary.wallSeconds) < 1e-6, `${summary.bytesPerSecond} B/s aggregate`);
+  } finally {
+    await fs.rm(directory, { recursive: true, force: true });
+  }
+};
+
+// Capture an update over a lossy wire, then check that the analyzer finds every phase and the
+// recovery that went on, that replay gets the same image back out of it, and that replaying that
+// image over a clean wire needs no recovery at all
+const checkCaptureReplay = async (seed: number) => {
+  const directory = await fs.mkdtemp(path.join(os.tmpdir(), 'sim-check-'));
+  try {
+    const image = makeImage(8 * 1024, seed);
+    const filename = path.join(directory, 'update.cap');
+    const device = await captureUpdate(image, seed, 2e-3, filename);
+    const capture = await readCapture(filename);
+
+    expect(capture.baudRate === DEFAULT_BAUD_RATE, `capture is at ${capture.baudRate} baud`);
+    expect([CaptureDirection.HostToDevice, CaptureDirection.DeviceToHost].every(direction =>
+      capture.records.some(record => record.direction === direction)), 'capture is missing a direction');
+    expect(capture.records.every((record, i) => i === 0 || record.timeUs >= capture.records[i - 1].timeUs), 'capture times go backwards');
+
+    // Anything after the boot response (e.g. the last ACK) is the tail, if there is any
+    const phaseNames = (phases: {name: string}[]) => phases.map(phase => phase.name).filter(name => name !== 'tail').join(',');
+    const report = analyzeCapture(capture);
+    const phases = phaseNames(report.phases);
+    expect(phases === 'sync,handshake,erase,transfer,verify,boot', `phases found were ${phases}`);
+    expect(report.syncAttempts >= 1, 'no sync attempts found');
+    expect(report.imageBytes > 0 && report.imageBytes <= image.length, `${report.imageBytes} image bytes counted`);
+    expect(report.host.frames >= Math.ceil(image.length / PACKET_DATA_BYTES), `only ${report.host.frames} host frames counted`);
+    expect(device.corruptFrames === 0 || report.host.retransmits + report.host.retxRequests > 0,
+      `${device.corruptFrames} frames were corrupted on the way to the device, but no recovery was found`);
+    expect(report.host.rttMs.length > 0 && report.host.rttMs.every(rtt => rtt >= 0), 'no sensible host RTT samples');
+
+    const extracted = extractImage(capture);
+    expect(extracted.equals(image), 'the image extracted from the capture differs from the one sent');
+
+    // A capture cut short mid-record keeps the records before it
+    const file = await fs.readFile(filename);
+    const truncatedFilename = path.join(directory, 'truncated.cap');
+    await fs.writeFile(truncatedFilename, file.subarray(0, file.length - 1));
+    const truncated = await readCapture(truncatedFilename);
+    expect(truncated.records.length === capture.records.length - 1, `${truncated.records.length} of ${capture.records.length} records kept after truncation`);
+
+    const replayFilename = path.join(directory, 'update.cap.replay');
+    const replayDevice = await captureUpdate(extracted, seed, 0, replayFilename);
+    const replay = analyzeCapture(await readCapture(replayFilename));
+    expect(replayDevice.corruptFrames === 0 && replay.host.crcErrors === 0 && replay.device.crcErrors === 0, 'errors on a clean wire');
+    expect(replay.host.retxRequests === 0 && replay.device.retxRequests === 0, 'RETX requests on a clean wire');
+    expect(phaseNames(replay.phases) === phases, 'the replay went through different phases');
+  } finally {
+    await fs.rm(directory, { recursive: true, force: true });
+  }
+};
+
+const checks: Check[] = [
+  { name: 'erase-stream', description: 'no bytes dropped while streaming during an erase', run: checkEraseStream },
+  { name: 'loss', description: 'updates recover from corrupted frames and ACKs', run: checkLossRecovery },
+  { name: 'boot-res', description: 'a lost boot response is sent again before the device boots', run: checkBootResponseLoss },
+  { name: 'bus', description: 'a broadcast update of three nodes on one bus fills in their gaps', run: checkBusGapFill },
+  { name: 'capture', description: 'a captured update analyzes, and replays to the same image', run: checkCaptureReplay },
+  { name: 'profile', description: 'profiling scopes decode to the statistics the device kept, and a build without them says so', run: checkProfileDecode },
+  { name: 'fleet', description: 'a fleet update keeps to its concurrency, retries a failed port, and reports the totals', run: checkFleet },
+];
+
+async function main() {
+  const argv = process.argv.slice(2);
+  const args = { names: [] as string[], seed: 1 };
+
+  for (let i = 0; i < argv.length; i++) {
+    const arg = argv[i];
+    const value = () => {
+      if (i + 1 >= argv.length) usage();
+      return argv[++i];
+    };
+
+    if (arg === '--check') args.names.push(value());
+    else if (arg === '--seed') args.seed = parseInt(value(), 10);
+    else usage();
+  }
+  if (isNaN(args.seed) || args.names.some(name => !checks.find(check => check.name === name))) usage();
+
+  let failures = 0;
+  for (const check of checks.filter(check => args.names.length === 0 || args.names.includes(check.name))) {
+    const start = Date.now();
+    try {
+      await check.run(args.seed);
+      Logger.success(`${check.name}: ${check.description} (${Date.now() - start} ms)`);
+    } catch (e) {
+      Logger.error(`${check.name}: ${(e as Error).message}`);
+      failures++;
+    }
+  }
+
+  if (failures > 0) {
+    Logger.error(`${failures} check(s) failed`);
+    process.exit(1);
+  }
+}
+
+main()
+  .catch((e: Error) => {
+    Logger.error(e.message);
+    process.exit(1);
+  });
@@ -0,0 +1,907 @@
+import {
+  PACKET_ACK_DATA0,
+  PACKET_RETX_DATA0,
+  PACKET_FLAG_LARGE,
+  COMMS_ADDR_FROM_NODE,
+  COMMS_ADDR_ANY,
+  COMMS_ADDR_BROADCAST,
+  COMMS_WINDOW_SIZE,
+  COMMS_ACK_EVERY,
+  COMMS_ACK_DELAY,
+  COMMS_RETX_HOLDOFF,
+  BL_PACKET_SYNC_OBSERVED_DATA0,
+  BL_PACKET_FW_UPDATE_REQ_DATA0,
+  BL_PACKET_FW_UPDATE_RES_DATA0,
+  BL_PACKET_DEVICE_ID_REQ_DATA0,
+  BL_PACKET_DEVICE_ID_RES_DATA0,
+  BL_PACKET_FW_LENGTH_REQ_DATA0,
+  BL_PACKET_FW_LENGTH_RES_DATA0,
+  BL_PACKET_READY_FOR_DATA_DATA0,
+  BL_PACKET_UPDATE_SUCCESSFUL_DATA0,
+  BL_PACKET_NACK_DATA0,
+  BL_PACKET_CRC_REQ_DATA0,
+  BL_PACKET_CRC_RES_DATA0,
+  BL_PACKET_READ_REQ_DATA0,
+  BL_PACKET_READ_RES_DATA0,
+  BL_PACKET_SECTOR_REWRITE_REQ_DATA0,
+  BL_PACKET_BOOT_REQ_DATA0,
+  BL_PACKET_BOOT_RES_DATA0,
+  BL_PACKET_EXTENT_DATA0,
+  BL_PACKET_SECTOR_CRC_REQ_DATA0,
+  BL_PACKET_SECTOR_CRC_RES_DATA0,
+  BL_PACKET_DELTA_UPDATE_REQ_DATA0,
+  BL_PACKET_BUS_JOIN_REQ_DATA0,
+  BL_PACKET_BUS_JOIN_RES_DATA0,
+  BL_PACKET_BUS_DATA_DATA0,
+  BL_PACKET_BUS_GAP_REQ_DATA0,
+  BL_PACKET_BUS_GAP_RES_DATA0,
+  BL_PACKET_DIAG_REQ_DATA0,
+  BL_PACKET_DIAG_RES_DATA0,
+  BL_DIAG_PROFILE,
+  BL_DIAG_PROFILE_NAME_LENGTH,
+  BL_DIAG_PROFILE_RESET,
+  BL_DIAG_UNSUPPORTED,
+  PROFILE_HISTOGRAM_BINS,
+  BL_BUS_CHUNK_SIZE,
+  BL_BUS_GAP_MAX_RANGES,
+  BL_MAX_EXTENTS,
+  BL_READ_MAX_LENGTH,
+  APP_START_OFFSET,
+  FLASH_SECTOR_SIZES,
+  MAX_FW_LENGTH,
+  SYNC_SEQ,
+  SYNC_SEQ_BUS,
+  applicationSectors,
+  crc32,
+  Extent,
+  FlashSector,
+  FrameParser,
+  Packet,
+  RttEstimator,
+} from './protocol';
+import {SerialLike} from './link';
+
+export type SimulatedDeviceOptions = {
+  baudRate: number;
+  deviceId?: number;
+  nodeId?: number;
+  // Chance of each byte on the wire being corrupted, in either direction
+  byteErrorRate?: number;
+  seed?: number;
+  // Flash timings, defaulting to the STM32F401's typical figures at 3.3V
+  eraseMsPerKiB?: number;
+  programUsPerByte?: number;
+  // The application already installed, if there is one
+  installed?: Buffer;
+  // What the bootloader's profiling scopes have recorded, served up as BL_DIAG_PROFILE answers
+  profileScopes?: SimulatedProfileScope[];
+  // False to answer diagnostic requests as a bootloader built without 'make DIAGNOSTICS=1' does
+  diagnostics?: boolean;
+  // Packet types (data[0]) whose first transmission never reaches the host, e.g. the boot response
+  dropFirst?: number[];
+};
+
+export type SimulatedProfileScope = {
+  name: string;
+  count: number;
+  min: number;
+  max: number;
+  total: bigint;
+  histogram: number[];
+};
+
+// The bootloader's UART ring buffer, which is in the RAM image load area during a flash update. It
+// holds more than a sector erase's worth of bytes, and anything arriving while it's full is lost.
+const RX_RING_BYTES = 0x8000;
+// The link layer's packet buffer. Frames that don't fit aren't acknowledged, so the host holds off.
+const PACKET_BUFFER_LENGTH = 8;
+const DEFAULT_DEVICE_ID = 0x42;
+// As the bootloader's LINGER_TIMEOUT: how long the last responses are resent for once it's done
+const LINGER_MS = 2000;
+
+type State = 'sync' | 'waitForUpdateReq' | 'deviceIdRes' | 'fwLengthRes' | 'extents' | 'erase' | 'receive' | 'busReceive' | 'verify' | 'linger' | 'done';
+
+type TxSlot = { packet: Packet, sentAt: number, acked: boolean, retransmitted: boolean };
+
+// Small, seedable PRNG, so that a benchmark sees the same errors every run
+const mulberry32 = (seed: number) => () => {
+  seed = (seed + 0x6D2B79F5) | 0;
+  let t = Math.imul(seed ^ (seed >>> 15), 1 | seed);
+  t = (t + Math.imul(t ^ (t >>> 7), 61 | t)) ^ t;
+  return ((t ^ (t >>> 14)) >>> 0) / 4294967296;
+};
+
+// A bootloader, link layer and all, behind a simulated UART. Bytes take as long as they would at
+// the given baud rate, and flash operations keep the main loop busy for as long as the real thing.
+// It stands in for the serial port underneath a Port, so the updater runs against it unchanged.
+export class SimulatedDevice implements SerialLike {
+  isOpen = false;
+
+  private options: Required<SimulatedDeviceOptions>;
+  private random: () => number;
+  private byteMs: number;
+  private dataListeners: ((data: Buffer) => void)[] = [];
+  private ticker: ReturnType<typeof setInterval> | null = null;
+
+  // The wire, one way each, as the time it's next free
+  private hostToDeviceFreeAt = 0;
+  private deviceToHostFreeAt = 0;
+
+  // Device side
+  private rxRing: number[] = [];
+  private syncWindow: number[] = [];
+  private parser = new FrameParser();
+  private busyUntil = 0;
+  private lingerUntil = 0;
+  private state: State = 'sync';
+  private flash = Buffer.alloc(MAX_FW_LENGTH, 0xff);
+  private fwLength = 0;
+  private bytesWritten = 0;
+  private writeLimit = 0;
+  private extents: Extent[] = [];
+  private extentCount = 0;
+  private extentIndex = 0;
+  private deltaUpdate = false;
+  private eraseQueue: FlashSector[] = [];
+  private busMode = false;
+  private busChunkCount = 0;
+  private busReceived: boolean[] = [];
+  private busChunksReceived = 0;
+
+  private rxNextSeq = 0;
+  private rxWindow = new Map<number, Packet>();
+  private framesSinceAck = 0;
+  private ackDueAt = 0;
+  private delivered: Packet[] = [];
+
+  private txQueue: Packet[] = [];
+  private txWindow = new Map<number, TxSlot>();
+  private txBaseSeq = 0;
+  private txNextSeq = 0;
+  private rtt = new RttEstimator();
+  private dropped = new Set<number>();
+
+  // Bytes lost to a full ring buffer, frames dropped as asked, frames put right by FEC, frames that failed their CRC and
+  // frames that were already delivered, for the curious
+  overrunBytes = 0;
+  droppedFrames = 0;
+  fecCorrections = 0;
+  corruptFrames = 0;
+  duplicateFrames = 0;
+
+  constructor(options: SimulatedDeviceOptions) {
+    this.options = {
+      deviceId: DEFAULT_DEVICE_ID,
+      nodeId: 0x01,
+      byteErrorRate: 0,
+      seed: 1,
+      eraseMsPerKiB: 8,
+      programUsPerByte: 16,
+      installed: Buffer.alloc(0),
+      profileScopes: [],
+      diagnostics: true,
+      dropFirst: [],
+      ...options,
+    };
+    this.options.installed.copy(this.flash);
+    this.random = mulberry32(this.options.seed);
+    // 8N1: ten bit times per byte
+    this.byteMs = 10000 / this.options.baudRate;
+  }
+
+  open(callback: (e: Error | null) => void) {
+    this.isOpen = true;
+    this.ticker = setInterval(() => this.mainLoop(), 1);
+    setImmediate(() => callback(null));
+  }
+
+  close(callback: () => void) {
+    this.isOpen = false;
+    if (this.ticker) {
+      clearInterval(this.ticker);
+      this.ticker = null;
+    }
+    setImmediate(callback);
+  }
+
+  on(event: 'data' | 'error', listener: (arg: any) => void) {
+    if (event === 'data') {
+      this.dataListeners.push(listener);
+    }
+    return this;
+  }
+
+  write(data: Buffer) {
+    this.hostToDeviceFreeAt = this.transmit(data, this.hostToDeviceFreeAt, bytes => this.receive(bytes));
+    return true;
+  }
+
+  drain(callback: () => void) {
+    setTimeout(callback, Math.max(0, this.hostToDeviceFreeAt - Date.now()));
+  }
+
+  // Put bytes on the wire: they arrive once every byte ahead of them and they themselves are sent
+  private transmit(data: Buffer, freeAt: number, arrive: (bytes: Buffer) => void) {
+    const bytes = Buffer.from(data);
+    for (let i = 0; i < bytes.length; i++) {
+      if (this.random() < this.options.byteErrorRate) {
+        bytes[i] ^= 1 << Math.floor(this.random() * 8);
+      }
+    }
+
+    const arrivesAt = Math.max(Date.now(), freeAt) + bytes.length * this.byteMs;
+    setTimeout(() => this.isOpen && arrive(bytes), arrivesAt - Date.now());
+    return arrivesAt;
+  }
+
+  // The UART ISR: always runs, even while the main loop is busy
+  private receive(bytes: Buffer) {
+    for (const byte of bytes) {
+      if (this.rxRing.length >= RX_RING_BYTES) {
+        this.overrunBytes++;
+      } else {
+        this.rxRing.push(byte);
+      }
+    }
+  }
+
+  private sendToHost(data: Buffer) {
+    this.deviceToHostFreeAt = this.transmit(data, this.deviceToHostFreeAt, bytes => {
+      this.dataListeners.forEach(listener => listener(bytes));
+    });
+  }
+
+  private mainLoop() {
+    const now = Date.now();
+    if (now < this.busyUntil || this.state === 'done') {
+      return;
+    }
+
+    const bytes = Buffer.from(this.rxRing);
+    this.rxRing = [];
+
+    if (this.state === 'sync') {
+      this.watchForSync(bytes);
+      return;
+    }
+
+    this.commsUpdate(bytes, now);
+
+    // Like the bootloader's exit: nothing more is handled, but comms runs until the host has
+    // acknowledged everything sent, or the linger runs out
+    if (this.state === 'linger') {
+      const acked = this.txQueue.length === 0 && [...this.txWindow.values()].every(slot => slot.acked);
+      if (acked || now >= this.lingerUntil) {
+        this.state = 'done';
+      }
+      return;
+    }
+
+    if (this.state === 'erase') {
+      this.eraseNextSector();
+      return;
+    }
+
+    // One packet per pass, like the bootloader's state machine. Once it starts erasing, the rest
+    // wait until the erase is done.
+    while (this.delivered.length > 0 && Date.now() >= this.busyUntil && this.state !== 'done' && this.state !== 'erase') {
+      this.handlePacket(this.delivered.shift()!);
+    }
+    this.fillTxWindow();
+  }
+
+  // On a bus, every node sees the sync sequence at once, so none of them answers it
+  private watchForSync(bytes: Buffer) {
+    for (const byte of bytes) {
+      this.syncWindow = [...this.syncWindow, byte].slice(-SYNC_SEQ.length);
+      if (Buffer.from(this.syncWindow).equals(SYNC_SEQ)) {
+        this.state = 'waitForUpdateReq';
+        this.writePacket(Packet.createSingleBytePacket(BL_PACKET_SYNC_OBSERVED_DATA0));
+        return;
+      }
+      if (Buffer.from(this.syncWindow).equals(SYNC_SEQ_BUS)) {
+        this.state = 'waitForUpdateReq';
+        this.busMode = true;
+        return;
+      }
+    }
+  }
+
+  // The device end of the link layer, as in comms.c
+  private commsUpdate(bytes: Buffer, now: number) {
+    this.deliverReceivedFrames(now);
+    for (const frame of this.parser.push(bytes)) {
+      const packet = frame.packet;
+      const forUs = packet.address === COMMS_ADDR_ANY || packet.address === this.options.nodeId;
+      const broadcast = packet.address === COMMS_ADDR_BROADCAST;
+      if (!forUs && !broadcast) {
+        continue;
+      }
+
+      if (frame.corrected) {
+        this.fecCorrections++;
+      }
+
+      if (!frame.crcOk) {
+        this.corruptFrames++;
+        if (forUs) {
+          this.sendAck(PACKET_RETX_DATA0);
+        }
+      } else if (broadcast) {
+        // Straight to the state machine, unacknowledged, and lost if there's no room for it
+        if (!packet.isAck() && !packet.isLarge() && this.delivered.length < PACKET_BUFFER_LENGTH - 1) {
+          this.delivered.push(packet);
+        }
+      } else if (packet.isAck()) {
+        this.handleAck(packet, now);
+      } else {
+        this.handleFrame(packet, now);
+      }
+    }
+
+    if (this.framesSinceAck >= COMMS_ACK_EVERY || (this.framesSinceAck > 0 && now >= this.ackDueAt)) {
+      this.sendAck(PACKET_ACK_DATA0);
+    }
+
+    let timedOut = false;
+    for (const slot of this.txWindow.values()) {
+      if (!slot.acked && now - slot.sentAt >= this.rtt.rto) {
+        this.retransmitSlot(slot, now);
+        timedOut = true;
+      }
+    }
+    if (timedOut) {
+      this.rtt.backOff();
+    }
+  }
+
+  private handleFrame(packet: Packet, now: number) {
+    const offset = (packet.seq - this.rxNextSeq) & 0xff;
+    if (offset >= COMMS_WINDOW_SIZE) {
+      this.duplicateFrames++;
+      this.sendAck(PACKET_ACK_DATA0);
+      return;
+    }
+
+    this.rxWindow.set(packet.seq, packet);
+    for (let i = 0; i < offset; i++) {
+      if (!this.rxWindow.has((this.rxNextSeq + i) & 0xff)) {
+        this.sendAck(PACKET_ACK_DATA0);
+        return;
+      }
+    }
+    this.deliverReceivedFrames(now);
+  }
+
+  private deliverReceivedFrames(now: number) {
+    while (this.rxWindow.has(this.rxNextSeq) && this.delivered.length < PACKET_BUFFER_LENGTH - 1) {
+      this.delivered.push(this.rxWindow.get(this.rxNextSeq)!);
+      this.rxWindow.delete(this.rxNextSeq);
+      this.rxNextSeq = (this.rxNextSeq + 1) & 0xff;
+      if (this.framesSinceAck++ === 0) {
+        this.ackDueAt = now + COMMS_ACK_DELAY;
+      }
+    }
+  }
+
+  private handleAck(ack: Packet, now: number) {
+    const cumulativeSeq = ack.data[1];
+    const bitmap = ack.data.readUInt16LE(2);
+    const inFlight = (this.txNextSeq - this.txBaseSeq) & 0xff;
+    if (((cumulativeSeq - this.txBaseSeq) & 0xff) > inFlight) {
+      return;
+    }
+
+    const newest = this.txWindow.get((cumulativeSeq - 1) & 0xff);
+    if (this.txBaseSeq !== cumulativeSeq && newest && !newest.acked && !newest.retransmitted) {
+      this.rtt.sample(now - newest.sentAt);
+    }
+
+    while (this.txBaseSeq !== cumulativeSeq) {
+      this.txWindow.delete(this.txBaseSeq);
+      this.txBaseSeq = (this.txBaseSeq + 1) & 0xff;
+    }
+
+    let highestAcked = 0;
+    for (let i = 0; i < COMMS_WINDOW_SIZE - 1; i++) {
+      const slot = this.txWindow.get((this.txBaseSeq + i + 1) & 0xff);
+      if ((bitmap & (1 << i)) && slot) {
+        slot.acked = true;
+        highestAcked = i + 1;
+      }
+    }
+
+    const resendUpTo = (ack.data[0] === PACKET_RETX_DATA0 && highestAcked === 0) ? 1 : highestAcked;
+    for (let offset = 0; offset < resendUpTo; offset++) {
+      const slot = this.txWindow.get((this.txBaseSeq + offset) & 0xff);
+      if (slot && !slot.acked && now - slot.sentAt >= COMMS_RETX_HOLDOFF) {
+        this.retransmitSlot(slot, now);
+      }
+    }
+
+    this.fillTxWindow();
+  }
+
+  private sendAck(type: number) {
+    let bitmap = 0;
+    for (let i = 1; i < COMMS_WINDOW_SIZE; i++) {
+      if (this.rxWindow.has((this.rxNextSeq + i) & 0xff)) {
+        bitmap |= 1 << (i - 1);
+      }
+    }
+
+    const ack = Packet.createAck(type, this.rxNextSeq, bitmap);
+    ack.address = COMMS_ADDR_FROM_NODE | this.options.nodeId;
+    ack.crc = ack.computeCrc();
+    this.sendToHost(ack.toBuffer());
+    this.framesSinceAck = 0;
+  }
+
+  private writePacket(packet: Packet) {
+    this.txQueue.push(packet);
+    this.fillTxWindow();
+  }
+
+  // Nothing goes out until the flash operation the packet was waiting on is done
+  private fillTxWindow() {
+    while (Date.now() >= this.busyUntil && this.txQueue.length > 0 && ((this.txNextSeq - this.txBaseSeq) & 0xff) < COMMS_WINDOW_SIZE) {
+      const packet = this.txQueue.shift()!;
+      packet.address = COMMS_ADDR_FROM_NODE | this.options.nodeId;
+      packet.seq = this.txNextSeq;
+      packet.crc = packet.computeCrc();
+      this.txNextSeq = (this.txNextSeq + 1) & 0xff;
+
+      const slot = { packet, sentAt: Date.now(), acked: false, retransmitted: false };
+      this.txWindow.set(packet.seq, slot);
+      if (this.options.dropFirst.includes(packet.data[0]) && !this.dropped.has(packet.data[0])) {
+        this.dropped.add(packet.data[0]);
+        this.droppedFrames++;
+        continue;
+      }
+      this.sendToHost(packet.toBuffer());
+    }
+  }
+
+  private retransmitSlot(slot: TxSlot, now: number) {
+    this.sendToHost(slot.packet.toBuffer());
+    slot.sentAt = now;
+    slot.retransmitted = true;
+  }
+
+  private writeLargeFrame(header: Packet, payload: Buffer) {
+    header.address = COMMS_ADDR_FROM_NODE | this.options.nodeId;
+    header.seq = 0;
+    header.flags = PACKET_FLAG_LARGE;
+    header.crc = header.computeCrc();
+
+    const length = Buffer.alloc(2);
+    length.writeUInt16LE(payload.length);
+    const crc = Buffer.alloc(4);
+    crc.writeUInt32LE(crc32(payload, payload.length) >>> 0);
+    this.sendToHost(Buffer.concat([header.toBuffer(), length, payload, crc]));
+  }
+
+  // Before a long flash operation, acknowledge everything so the host doesn't retransmit meanwhile
+  private busyFor(ms: number) {
+    if (this.framesSinceAck > 0) {
+      this.sendAck(PACKET_ACK_DATA0);
+    }
+    this.busyUntil = Date.now() + ms;
+  }
+
+  private fail() {
+    this.writePacket(Packet.createSingleBytePacket(BL_PACKET_NACK_DATA0));
+    this.finish();
+  }
+
+  private finish() {
+    this.state = 'linger';
+    this.lingerUntil = Date.now() + LINGER_MS;
+  }
+
+  // Like the bootloader, data only goes where the extents say, and the write position skips the gaps
+  private seek(offset: number) {
+    this.bytesWritten = offset;
+    this.extentIndex = 0;
+    this.skipToExtent();
+  }
+
+  private skipToExtent() {
+    const extents = this.extents;
+    while (this.extentIndex < extents.length && this.bytesWritten >= extents[this.extentIndex].offset + extents[this.extentIndex].length) {
+      this.extentIndex++;
+    }
+    if (this.extentIndex === extents.length) {
+      this.bytesWritten = this.fwLength;
+    } else {
+      this.bytesWritten = Math.max(this.bytesWritten, extents[this.extentIndex].offset);
+    }
+  }
+
+  private eraseApplication() {
+    if (this.deltaUpdate) {
+      this.state = 'verify';
+      return;
+    }
+
+    this.eraseQueue = applicationSectors(MAX_FW_LENGTH);
+    this.state = 'erase';
+  }
+
+  // One sector per pass of the main loop, with the UART drained in between
+  private eraseNextSector() {
+    const sector = this.eraseQueue.shift();
+    if (sector) {
+      this.busyFor(this.eraseMs(sector.size));
+      this.flash.fill(0xff, sector.offset, sector.offset + sector.size);
+      return;
+    }
+
+    if (this.busMode) {
+      this.state = 'busReceive';
+      return;
+    }
+
+    this.seek(0);
+    this.writePacket(Packet.createSingleBytePacket(BL_PACKET_READY_FOR_DATA_DATA0));
+    this.state = 'receive';
+  }
+
+  private eraseMs(bytes: number) {
+    return (bytes / 1024) * this.options.eraseMsPerKiB;
+  }
+
+  private handleInspection(packet: Packet) {
+    if (packet.isSingleBytePacket(BL_PACKET_SECTOR_CRC_REQ_DATA0)) {
+      const sectors = applicationSectors(MAX_FW_LENGTH);
+      const crcs = Buffer.alloc(sectors.length * 4);
+      sectors.forEach((sector, i) => {
+        crcs.writeUInt32LE(crc32(this.flash.slice(sector.offset, sector.offset + sector.size), sector.size) >>> 0, i * 4);
+      });
+      this.busyUntil = Date.now() + MAX_FW_LENGTH / 84000;
+      this.writeLargeFrame(new Packet(3, Buffer.from([BL_PACKET_SECTOR_CRC_RES_DATA0, sectors[0].index, sectors.length])), crcs);
+      return true;
+    }
+
+    const type = packet.data[0];
+    if (packet.length !== 9 || (type !== BL_PACKET_CRC_REQ_DATA0 && type !== BL_PACKET_READ_REQ_DATA0)) {
+      return false;
+    }
+
+    const offset = packet.data.readUInt32LE(1);
+    const length = packet.data.readUInt32LE(5);
+    if (offset > MAX_FW_LENGTH || length > MAX_FW_LENGTH - offset) {
+      return false;
+    }
+
+    const region = this.flash.slice(offset, offset + length);
+    if (type === BL_PACKET_CRC_REQ_DATA0) {
+      // The real thing reads flash at about a byte per cycle
+      this.busyUntil = Date.now() + length / 84000;
+      const data = Buffer.alloc(5);
+      data[0] = BL_PACKET_CRC_RES_DATA0;
+      data.writeUInt32LE(crc32(region, region.length) >>> 0, 1);
+      this.writePacket(new Packet(5, data));
+      return true;
+    }
+
+    if (length > BL_READ_MAX_LENGTH) {
+      return false;
+    }
+    const data = Buffer.alloc(9);
+    data[0] = BL_PACKET_READ_RES_DATA0;
+    data.writeUInt32LE(offset, 1);
+    data.writeUInt32LE(length, 5);
+    this.writeLargeFrame(new Packet(9, data), region);
+    return true;
+  }
+
+  private handleBoot(packet: Packet) {
+    if (!packet.isSingleBytePacket(BL_PACKET_BOOT_REQ_DATA0)) {
+      return false;
+    }
+    // No signature to check here, so any image with the right device ID boots
+    this.writePacket(new Packet(2, Buffer.from([BL_PACKET_BOOT_RES_DATA0, 1])));
+    this.finish();
+    return true;
+  }
+
+  private handleSectorRewrite(packet: Packet) {
+    if (packet.length !== 2 || packet.data[0] !== BL_PACKET_SECTOR_REWRITE_REQ_DATA0) {
+      return false;
+    }
+
+    const index = packet.data[1];
+    const sectorOffset = FLASH_SECTOR_SIZES.slice(0, index).reduce((a, b) => a + b, 0) - APP_START_OFFSET;
+    const sectorSize = FLASH_SECTOR_SIZES[index];
+    if (sectorOffset < 0 || sectorSize === undefined || sectorOffset >= MAX_FW_LENGTH) {
+      return false;
+    }
+
+    this.busyFor(this.eraseMs(sectorSize));
+    this.flash.fill(0xff, sectorOffset, sectorOffset + sectorSize);
+    this.seek(sectorOffset);
+    this.writeLimit = Math.min(sectorOffset + sectorSize, this.fwLength);
+    this.writePacket(Packet.createSingleBytePacket(BL_PACKET_READY_FOR_DATA_DATA0));
+    if (this.bytesWritten >= this.writeLimit) {
+      this.writePacket(Packet.createSingleBytePacket(BL_PACKET_UPDATE_SUCCESSFUL_DATA0));
+    } else {
+      this.state = 'receive';
+    }
+    return true;
+  }
+
+  private handleBusJoin(packet: Packet) {
+    if (packet.length !== 6 || packet.data[0] !== BL_PACKET_BUS_JOIN_REQ_DATA0) {
+      return false;
+    }
+
+    const length = packet.data.readUInt32LE(2);
+    const accepted = packet.data[1] === this.options.deviceId && length > 0 && length <= MAX_FW_LENGTH;
+    this.writePacket(new Packet(2, Buffer.from([BL_PACKET_BUS_JOIN_RES_DATA0, accepted ? 1 : 0])));
+    if (!accepted) {
+      this.finish();
+      return true;
+    }
+
+    this.fwLength = length;
+    this.busChunkCount = Math.ceil(length / BL_BUS_CHUNK_SIZE);
+    this.busReceived = new Array(this.busChunkCount).fill(false);
+    this.busChunksReceived = 0;
+    this.eraseQueue = applicationSectors(MAX_FW_LENGTH);
+    this.state = 'erase';
+    return true;
+  }
+
+  // Each chunk is only written the first time it's seen, since repairs go to every node
+  private handleBusData(packet: Packet) {
+    if (packet.length < 5 || packet.data[0] !== BL_PACKET_BUS_DATA_DATA0) {
+      return false;
+    }
+
+    const offset = packet.data.readUIntLE(1, 3);
+    const chunk = offset / BL_BUS_CHUNK_SIZE;
+    const length = packet.length - 4;
+    if (this.state !== 'busReceive' || offset % BL_BUS_CHUNK_SIZE !== 0 || chunk >= this.busChunkCount) {
+      return true;
+    }
+    if (length !== Math.min(BL_BUS_CHUNK_SIZE, this.fwLength - offset) || this.busReceived[chunk]) {
+      return true;
+    }
+
+    packet.data.copy(this.flash, offset, 4, 4 + length);
+    this.busReceived[chunk] = true;
+    this.busChunksReceived++;
+    this.busyUntil = Date.now() + (length * this.options.programUsPerByte) / 1000;
+    return true;
+  }
+
+  private handleBusGapRequest(packet: Packet) {
+    if (packet.length !== 3 || packet.data[0] !== BL_PACKET_BUS_GAP_REQ_DATA0) {
+      return false;
+    }
+
+    const ranges = Buffer.alloc(BL_BUS_GAP_MAX_RANGES * 4);
+    let rangeCount = 0;
+    let chunk = packet.data.readUInt16LE(1);
+    while (chunk < this.busChunkCount && rangeCount < BL_BUS_GAP_MAX_RANGES) {
+      if (this.busReceived[chunk]) {
+        chunk++;
+        continue;
+      }
+
+      const first = chunk;
+      while (chunk < this.busChunkCount && !this.busReceived[chunk] && chunk - first < 0xffff) {
+        chunk++;
+      }
+      ranges.writeUInt16LE(first, rangeCount * 4);
+      ranges.writeUInt16LE(chunk - first, rangeCount * 4 + 2);
+      rangeCount++;
+    }
+
+    const header = Buffer.alloc(4);
+    header[0] = BL_PACKET_BUS_GAP_RES_DATA0;
+    header.writeUInt16LE(this.busChunkCount - this.busChunksReceived, 1);
+    header[3] = rangeCount;
+    this.writeLargeFrame(new Packet(4, header), ranges.slice(0, rangeCount * 4));
+    return true;
+  }
+
+  // Only the profiling diagnostics, laid out as handle_diagnostic_request does
+  private handleDiagnostic(packet: Packet) {
+    if (packet.length < 2 || packet.data[0] !== BL_PACKET_DIAG_REQ_DATA0) {
+      return false;
+    }
+
+    if (!this.options.diagnostics) {
+      this.writeLargeFrame(new Packet(3, Buffer.from([BL_PACKET_DIAG_RES_DATA0, BL_DIAG_UNSUPPORTED, packet.data[1]])), Buffer.alloc(0));
+      return true;
+    }
+
+    const scopes = this.options.profileScopes;
+    if (packet.data[1] === BL_DIAG_PROFILE) {
+      const index = packet.data[2];
+      const scope = scopes[index];
+      const payload = Buffer.alloc(scope ? BL_DIAG_PROFILE_NAME_LENGTH + 20 + PROFILE_HISTOGRAM_BINS * 4 : 0);
+      if (scope) {
+        payload.write(scope.name.slice(0, BL_DIAG_PROFILE_NAME_LENGTH - 1), 0, 'latin1');
+        const stats = payload.subarray(BL_DIAG_PROFILE_NAME_LENGTH);
+        stats.writeUInt32LE(scope.count, 0);
+        stats.writeUInt32LE(scope.min, 4);
+        stats.writeUInt32LE(scope.max, 8);
+        stats.writeBigUInt64LE(scope.total, 12);
+        scope.histogram.forEach((samples, bin) => stats.writeUInt32LE(samples, 20 + bin * 4));
+      }
+      this.writeLargeFrame(new Packet(4, Buffer.from([BL_PACKET_DIAG_RES_DATA0, BL_DIAG_PROFILE, index, scopes.length])), payload);
+      return true;
+    }
+
+    if (packet.data[1] === BL_DIAG_PROFILE_RESET) {
+      for (const scope of scopes) {
+        Object.assign(scope, { count: 0, min: 0xffffffff, max: 0, total: 0n, histogram: scope.histogram.map(() => 0) });
+      }
+      this.writeLargeFrame(new Packet(2, Buffer.from([BL_PACKET_DIAG_RES_DATA0, BL_DIAG_PROFILE_RESET])), Buffer.alloc(0));
+      return true;
+    }
+
+    return false;
+  }
+
+  // The bootloader's state machine
+  private handlePacket(packet: Packet) {
+    switch (this.state) {
+      case 'waitForUpdateReq': {
+        const delta = packet.isSingleBytePacket(BL_PACKET_DELTA_UPDATE_REQ_DATA0);
+        if (delta || packet.isSingleBytePacket(BL_PACKET_FW_UPDATE_REQ_DATA0)) {
+          this.deltaUpdate = delta;
+          this.writePacket(Packet.createSingleBytePacket(BL_PACKET_FW_UPDATE_RES_DATA0));
+          this.writePacket(Packet.createSingleBytePacket(BL_PACKET_DEVICE_ID_REQ_DATA0));
+          this.state = 'deviceIdRes';
+        } else if (!this.handleBusJoin(packet) && !this.handleInspection(packet) && !this.handleDiagnostic(packet) && !this.handleBoot(packet)) {
+          this.fail();
+        }
+      } break;
+
+      case 'busReceive': {
+        if (this.handleBusData(packet)) {
+          if (this.busChunksReceived === this.busChunkCount) {
+            this.state = 'verify';
+          }
+        } else if (!this.handleBusGapRequest(packet) && !this.handleInspection(packet) && !this.handleDiagnostic(packet)) {
+          this.fail();
+        }
+      } break;
+
+      case 'deviceIdRes': {
+        if (packet.length === 2 && packet.data[0] === BL_PACKET_DEVICE_ID_RES_DATA0 && packet.data[1] === this.options.deviceId) {
+          this.writePacket(Packet.createSingleBytePacket(BL_PACKET_FW_LENGTH_REQ_DATA0));
+          this.state = 'fwLengthRes';
+        } else {
+          this.fail();
+        }
+      } break;
+
+      case 'fwLengthRes': {
+        const length = packet.data.readUInt32LE(1);
+        const sparse = packet.length === 6;
+        if ((packet.length !== 5 && !sparse) || packet.data[0] !== BL_PACKET_FW_LENGTH_RES_DATA0 || length > MAX_FW_LENGTH) {
+          this.fail();
+          break;
+        }
+
+        this.fwLength = length;
+        this.writeLimit = length;
+        if (!sparse) {
+          this.extents = [{ offset: 0, length }];
+          this.eraseApplication();
+        } else if (packet.data[5] > 0 && packet.data[5] <= BL_MAX_EXTENTS) {
+          this.extents = [];
+          this.extentCount = packet.data[5];
+          this.state = 'extents';
+        } else {
+          this.fail();
+        }
+      } break;
+
+      case 'extents': {
+        const last = this.extents[this.extents.length - 1];
+        const offset = packet.data.readUInt32LE(1);
+        const length = packet.data.readUInt32LE(5);
+        if (packet.length !== 9 || packet.data[0] !== BL_PACKET_EXTENT_DATA0 || length === 0 ||
+            offset < (last ? last.offset + last.length : 0) || offset + length > this.fwLength) {
+          this.fail();
+          break;
+        }
+
+        this.extents.push({ offset, length });
+        if (this.extents.length === this.extentCount) {
+          this.eraseApplication();
+        }
+      } break;
+
+      case 'receive': {
+        let consumed = 0;
+        while (consumed < packet.length && this.bytesWritten < this.writeLimit) {
+          const extent = this.extents[this.extentIndex];
+          const runEnd = Math.min(extent.offset + extent.length, this.writeLimit);
+          const run = Math.min(packet.length - consumed, runEnd - this.bytesWritten);
+          packet.data.copy(this.flash, this.bytesWritten, consumed, consumed + run);
+          consumed += run;
+          this.bytesWritten += run;
+          this.skipToExtent();
+        }
+        this.busyUntil = Date.now() + (packet.length * this.options.programUsPerByte) / 1000;
+
+        if (this.bytesWritten >= this.writeLimit) {
+          this.writePacket(Packet.createSingleBytePacket(BL_PACKET_UPDATE_SUCCESSFUL_DATA0));
+          this.state = 'verify';
+        }
+      } break;
+
+      case 'verify': {
+        // Repairs for other nodes on the bus, or a last gap poll, are fine here too
+        if (!this.handleInspection(packet) && !this.handleDiagnostic(packet) && !this.handleBoot(packet) && !this.handleSectorRewrite(packet) &&
+            !this.handleBusData(packet) && !this.handleBusGapRequest(packet)) {
+          this.fail();
+        }
+      } break;
+    }
+  }
+}
+
+// Several simulated devices on one multi-drop wire. Everything the host sends reaches every node,
+// each with its own errors, and whatever any node sends reaches the host. The nodes only ever
+// answer when addressed, one at a time, so collisions between them aren't modelled.
+export class SimulatedBus implements SerialLike {
+  isOpen = false;
+  readonly nodes: SimulatedDevice[];
+  private dataListeners: ((data: Buffer) => void)[] = [];
+
+  constructor(nodes: SimulatedDevice[]) {
+    this.nodes = nodes;
+    for (const node of nodes) {
+      node.on('data', data => this.dataListeners.forEach(listener => listener(data)));
+    }
+  }
+
+  open(callback: (e: Error | null) => void) {
+    let opened = 0;
+    for (const node of this.nodes) {
+      node.open(() => {
+        if (++opened === this.nodes.length) {
+          this.isOpen = true;
+          callback(null);
+        }
+      });
+    }
+  }
+
+  close(callback: () => void) {
+    let closed = 0;
+    this.isOpen = false;
+    for (const node of this.nodes) {
+      node.close(() => {
+        if (++closed === this.nodes.length) {
+          callback();
+        }
+      });
+    }
+  }
+
+  on(event: 'data' | 'error', listener: (arg: any) => void) {
+    if (event === 'data') {
+      this.dataListeners.push(listener);
+    }
+    return this;
+  }
+
+  write(data: Buffer) {
+    this.nodes.forEach(node => node.write(data));
+    return true;
+  }
+
+  // Every node shares the wire's timing, so they all drain together
+  drain(callback: () => void) {
+    this.nodes[0].drain(callback);
+  }
+}
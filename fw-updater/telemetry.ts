@@ -0,0 +1,274 @@
+import * as fs from 'fs';
+import {SerialPort} from 'serialport';
+import {
+  COMMS_ADDR_ANY,
+  COMMS_ADDR_FROM_NODE,
+  CPU_FREQ,
+  PACKET_FLAG_LARGE,
+  PACKET_TELEMETRY_DATA0,
+  PACKET_TELEMETRY_LENGTH,
+  TELEMETRY_SAMPLE_BYTES,
+  FrameParser,
+  Logger,
+  Packet,
+  crc32,
+} from './protocol';
+
+const usage = () => {
+  console.log("usage: telemetry [options]");
+  console.log("  --port <path>         serial port the app is streaming on (default /dev/ttyUSB0)");
+  console.log("  --baud <rate>         serial baud rate (default 115200)");
+  console.log("  --duration <s>        stop after this long (default: until interrupted)");
+  console.log("  --csv <file>          save every sample to <file> as time (s), channel, value");
+  console.log("  --input <file>        decode a raw recording of the stream instead of a live port");
+  console.log("  --synthetic <n>       no device: time the decoder on <n> batches encoded here");
+  process.exit(1);
+};
+
+// Channel the app streams a count on when built with 'make TELEMETRY_TEST_RATE=n', so that every
+// missing sample can be found
+const TEST_CHANNEL = 0x0100;
+
+export type TelemetrySample = {
+  timeS: number;
+  channel: number;
+  value: number;
+};
+
+export type TelemetryStats = {
+  bytes: number;
+  batches: number;
+  samples: number;
+  // Dropped by the app because the line couldn't keep up
+  droppedOnDevice: number;
+  // Batches that never arrived, and ones that arrived with a bad payload
+  lostBatches: number;
+  corruptBatches: number;
+};
+
+// Turns the app's byte stream back in to samples. Timestamps are 32-bit cycle counts, unwrapped
+// on the assumption that batches are never more than ~25 s apart.
+export class TelemetryDecoder {
+  private parser = new FrameParser();
+  private lastBatch: number | null = null;
+  private lastCycles: number | null = null;
+  private cycles = 0;
+
+  readonly stats: TelemetryStats = {
+    bytes: 0, batches: 0, samples: 0, droppedOnDevice: 0, lostBatches: 0, corruptBatches: 0,
+  };
+
+  push(data: Buffer) {
+    const samples: TelemetrySample[] = [];
+    this.stats.bytes += data.length;
+
+    for (const { packet, crcOk } of this.parser.push(data)) {
+      if (!crcOk || !packet.isLarge() || packet.length !== PACKET_TELEMETRY_LENGTH || packet.data[0] !== PACKET_TELEMETRY_DATA0) {
+        continue;
+      }
+
+      const number = packet.data.readUInt16LE(4);
+      if (this.lastBatch !== null) {
+        this.stats.lostBatches += (number - this.lastBatch - 1) & 0xffff;
+      }
+      this.lastBatch = number;
+      this.stats.droppedOnDevice += packet.data.readUInt16LE(2);
+
+      const payload = packet.payload;
+      if (!payload) {
+        this.stats.corruptBatches++;
+        continue;
+      }
+
+      this.stats.batches++;
+      for (let i = 0; i < packet.data[1] && (i + 1) * TELEMETRY_SAMPLE_BYTES <= payload.length; i++) {
+        const sample = payload.slice(i * TELEMETRY_SAMPLE_BYTES);
+        samples.push({
+          timeS: this.unwrap(sample.readUInt32LE(0)) / CPU_FREQ,
+          channel: sample.readUInt16LE(4),
+          value: sample.readInt32LE(8),
+        });
+      }
+    }
+
+    this.stats.samples += samples.length;
+    return samples;
+  }
+
+  // Producers in interrupts can timestamp a sample just before one from the main loop that gets
+  // in to the batch first, so small steps backwards are allowed
+  private unwrap(cycles: number) {
+    if (this.lastCycles !== null) {
+      const delta = (cycles - this.lastCycles) >>> 0;
+      this.cycles += delta < 0x80000000 ? delta : delta - 0x100000000;
+    }
+    this.lastCycles = cycles;
+    return this.cycles;
+  }
+}
+
+// A batch as the app sends it, for exercising the decoder without a device
+export const encodeTelemetryBatch = (samples: { cycles: number, channel: number, value: number }[], number: number, dropped = 0) => {
+  const data = Buffer.from([PACKET_TELEMETRY_DATA0, samples.length, dropped & 0xff, dropped >> 8, number & 0xff, (number >> 8) & 0xff]);
+  const header = new Packet(PACKET_TELEMETRY_LENGTH, data, PACKET_FLAG_LARGE);
+  header.address = COMMS_ADDR_FROM_NODE | COMMS_ADDR_ANY;
+  header.crc = header.computeCrc();
+
+  const payload = Buffer.alloc(samples.length * TELEMETRY_SAMPLE_BYTES);
+  samples.forEach((sample, i) => {
+    payload.writeUInt32LE(sample.cycles >>> 0, i * TELEMETRY_SAMPLE_BYTES);
+    payload.writeUInt16LE(sample.channel, i * TELEMETRY_SAMPLE_BYTES + 4);
+    payload.writeInt32LE(sample.value, i * TELEMETRY_SAMPLE_BYTES + 8);
+  });
+
+  const length = Buffer.alloc(2);
+  length.writeUInt16LE(payload.length);
+  const crc = Buffer.alloc(4);
+  crc.writeUInt32LE(crc32(payload, payload.length));
+  return Buffer.concat([header.toBuffer(), length, payload, crc]);
+};
+
+// Counts, per channel, and for the test channel, how many values in its count never showed up
+class ChannelSummary {
+  counts = new Map<number, number>();
+  private nextTestValue: number | null = null;
+  testMissing = 0;
+
+  add(sample: TelemetrySample) {
+    this.counts.set(sample.channel, (this.counts.get(sample.channel) ?? 0) + 1);
+    if (sample.channel === TEST_CHANNEL) {
+      if (this.nextTestValue !== null && sample.value > this.nextTestValue) {
+        this.testMissing += sample.value - this.nextTestValue;
+      }
+      this.nextTestValue = sample.value + 1;
+    }
+  }
+}
+
+const printSummary = (decoder: TelemetryDecoder, summary: ChannelSummary, seconds: number, lineBytesPerS: number) => {
+  const stats = decoder.stats;
+  Logger.info(`${stats.samples} samples in ${stats.batches} batches over ${seconds.toFixed(1)} s: ` +
+    `${(stats.samples / seconds).toFixed(0)} samples/s, ${(stats.bytes * 100 / seconds / lineBytesPerS).toFixed(0)}% of the line`);
+  for (const [channel, count] of [...summary.counts].sort((a, b) => a[0] - b[0])) {
+    Logger.info(`  channel 0x${channel.toString(16).padStart(4, '0')}: ${count} samples`);
+  }
+
+  const lost = stats.droppedOnDevice + stats.lostBatches + stats.corruptBatches + summary.testMissing;
+  const log = lost > 0 ? Logger.error : Logger.success;
+  log(`${stats.droppedOnDevice} sample(s) dropped by the app, ${stats.lostBatches} batch(es) lost and ` +
+    `${stats.corruptBatches} corrupted on the line, ${summary.testMissing} missing from the test count`);
+};
+
+const runSynthetic = (batches: number) => {
+  const decoder = new TelemetryDecoder();
+  const frames: Buffer[] = [];
+  let value = 0;
+  for (let number = 0; number < batches; number++) {
+    const samples = [];
+    for (let i = 0; i < 40; i++, value++) {
+      samples.push({ cycles: value * 1000, channel: TEST_CHANNEL, value });
+    }
+    frames.push(encodeTelemetryBatch(samples, number));
+  }
+  const stream = Buffer.concat(frames);
+
+  const start = process.hrtime.bigint();
+  // Split up as a serial port would hand it over
+  let decoded = 0;
+  for (let offset = 0; offset < stream.length; offset += 64) {
+    decoded += decoder.push(stream.slice(offset, offset + 64)).length;
+  }
+  const seconds = Number(process.hrtime.bigint() - start) / 1e9;
+
+  Logger.info(`Decoded ${decoded}/${value} samples (${stream.length} bytes) in ${(seconds * 1000).toFixed(1)} ms`);
+  Logger.info(`${Math.round(decoded / seconds)} samples/s, ${(stream.length / seconds / 1024).toFixed(0)} KiB/s`);
+  if (decoded !== value || decoder.stats.lostBatches > 0) {
+    Logger.error('Decoder lost samples');
+    process.exitCode = 1;
+  }
+};
+
+async function main() {
+  const argv = process.argv.slice(2);
+  const args = { port: '/dev/ttyUSB0', baudRate: 115200, durationS: 0, csvFilename: '', inputFilename: '', synthetic: 0 };
+
+  for (let i = 0; i < argv.length; i++) {
+    const arg = argv[i];
+    const value = () => {
+      if (i + 1 >= argv.length) usage();
+      return argv[++i];
+    };
+
+    if (arg === '--port') args.port = value();
+    else if (arg === '--baud') args.baudRate = parseInt(value(), 10);
+    else if (arg === '--duration') args.durationS = parseFloat(value());
+    else if (arg === '--csv') args.csvFilename = value();
+    else if (arg === '--input') args.inputFilename = value();
+    else if (arg === '--synthetic') args.synthetic = parseInt(value(), 10);
+    else usage();
+  }
+  if (isNaN(args.baudRate) || isNaN(args.durationS) || isNaN(args.synthetic)) usage();
+
+  if (args.synthetic > 0) {
+    runSynthetic(args.synthetic);
+    return;
+  }
+
+  const decoder = new TelemetryDecoder();
+  const summary = new ChannelSummary();
+  const csv = args.csvFilename ? fs.createWriteStream(args.csvFilename) : null;
+  csv?.write('time,channel,value\n');
+  const decode = (data: Buffer) => {
+    let lastTimeS = 0;
+    for (const sample of decoder.push(data)) {
+      summary.add(sample);
+      csv?.write(`${sample.timeS.toFixed(6)},${sample.channel},${sample.value}\n`);
+      lastTimeS = sample.timeS;
+    }
+    return lastTimeS;
+  };
+
+  // 8N1: ten bit times per byte
+  const lineBytesPerS = args.baudRate / 10;
+
+  // A recording has no wall clock, so its length comes from the samples' own timestamps
+  if (args.inputFilename) {
+    const seconds = decode(fs.readFileSync(args.inputFilename));
+    csv?.end();
+    printSummary(decoder, summary, seconds, lineBytesPerS);
+    return;
+  }
+
+  const uart = new SerialPort({ path: args.port, baudRate: args.baudRate, autoOpen: false });
+  await new Promise<void>((resolve, reject) => uart.open(e => e ? reject(e) : resolve()));
+  uart.on('data', (data: Buffer) => decode(data));
+  const start = Date.now();
+  let last = { timeMs: start, samples: 0, bytes: 0 };
+  const report = setInterval(() => {
+    const now = Date.now();
+    const seconds = (now - last.timeMs) / 1000;
+    const samples = (decoder.stats.samples - last.samples) / seconds;
+    const bytes = (decoder.stats.bytes - last.bytes) / seconds;
+    Logger.info(`${((now - start) / 1000).toFixed(0).padStart(4)} s: ${samples.toFixed(0)} samples/s, ` +
+      `${(bytes / 1024).toFixed(2)} KiB/s (${(bytes * 100 / lineBytesPerS).toFixed(0)}% of the line)`);
+    last = { timeMs: now, samples: decoder.stats.samples, bytes: decoder.stats.bytes };
+  }, 1000);
+
+  await new Promise<void>(resolve => {
+    process.once('SIGINT', resolve);
+    if (args.durationS > 0) {
+      setTimeout(resolve, args.durationS * 1000);
+    }
+  });
+  clearInterval(report);
+  await new Promise<void>(resolve => uart.close(() => resolve()));
+  csv?.end();
+
+  printSummary(decoder, summary, (Date.now() - start) / 1000, lineBytesPerS);
+}
+
+main()
+  .catch((e: Error) => {
+    Logger.error(e.message);
+    process.exit(1);
+  });
@@ -0,0 +1,53 @@
+#ifndef INC_BOOT_TIMELINE_H
+#define INC_BOOT_TIMELINE_H
+
+#include "common-defines.h"
+
+#define BOOT_TIMELINE_MAGIC      (0x454D4954) // "TIME"
+#define BOOT_TIMELINE_MAX_EVENTS (24)
+
+// Each phase is marked when it ends, so the time spent in it is the gap to the previous mark
+typedef enum boot_phase_t {
+  BootPhase_BootloaderMain = 0,  // Start of the bootloader's main, where the clock starts
+  BootPhase_BootloaderSystemSetup,
+  BootPhase_BootloaderPeripheralSetup,
+  BootPhase_BootloaderSynced,    // Only when a host synced
+  BootPhase_BootloaderLoopDone,  // Sync window timed out, or the update finished
+  BootPhase_BootloaderTeardown,
+  BootPhase_BootloaderKeySchedule,
+  BootPhase_BootloaderValidate,
+  BootPhase_BootloaderJump,
+  BootPhase_AppMain,
+  BootPhase_AppSystemSetup,
+  BootPhase_AppReady,
+} boot_phase_t;
+
+typedef struct boot_event_t {
+  uint32_t time_us; // Since the bootloader's main
+  uint32_t phase;
+} boot_event_t;
+
+typedef struct boot_timeline_t {
+  uint32_t magic;
+  uint32_t version;     // Firmware version the bootloader validated, or 0
+  uint32_t count;
+  uint32_t clock_mhz;   // Core clock the cycle counter is running at right now
+  uint32_t last_cycles;
+  uint64_t elapsed_ns;
+  boot_event_t events[BOOT_TIMELINE_MAX_EVENTS];
+} boot_timeline_t;
+
+// Lives in no-init RAM at the same address in the bootloader and the app, so the app carries on
+// the timeline the bootloader started. The last complete one is kept for the next boot to report.
+typedef struct boot_timelines_t {
+  boot_timeline_t current;
+  boot_timeline_t previous;
+} boot_timelines_t;
+
+void boot_timeline_begin(void);
+void boot_timeline_mark(const boot_phase_t phase);
+void boot_timeline_set_clock(const uint32_t hz);
+void boot_timeline_set_version(const uint32_t version);
+const boot_timeline_t* boot_timeline_get(const bool previous);
+
+#endif // INC_BOOT_TIMELINE_H
@@ -5,5 +5,7 @@
 
 uint8_t crc8(uint8_t* data, uint32_t length);
 uint32_t crc32(const uint8_t* data, const uint32_t length);
+// Carries on a CRC32 from where a previous call left it, for data that comes in pieces. Start at 0.
+uint32_t crc32_update(const uint32_t previous, const uint8_t* data, const uint32_t length);
 
 #endif // INC_CRC_H
@@ -7,14 +7,34 @@
 
 #define ALIGNED(address, alignment) (((address) - 1U + (alignment)) & -(alignment))
 
-#define BOOTLOADER_SIZE                   (0x8000U)
-#define MAIN_APP_START_ADDRESS            (FLASH_BASE + BOOTLOADER_SIZE)
-#define MAX_FW_LENGTH                     ((1024U * 512U) - BOOTLOADER_SIZE)
+#define FLASH_TOTAL_SIZE                  (512U * 1024U)
+#define BOOTLOADER_SIZE                   (0x4000U)
+#define MAIN_APP_START_ADDRESS            (KV_FLASH_ADDRESS + KV_FLASH_SIZE)
+#define MAX_FW_LENGTH                     (FLASH_TOTAL_SIZE - (MAIN_APP_START_ADDRESS - FLASH_BASE))
 #define DEVICE_ID                         (0x42)
 
+// The two 16K sectors after the bootloader hold the key-value store (see kv.h), and are never
+// part of the image. Small sectors keep each of its erases short. This costs the app sector 1,
+// which the smaller bootloader had freed, and sector 2: 464K rather than 496K (480K before).
+// There's nowhere else on chip for it, with no backup SRAM and OTP only writable once.
+#define KV_FLASH_SECTOR_0                 (1)
+#define KV_FLASH_ADDRESS                  (FLASH_BASE + BOOTLOADER_SIZE)
+#define KV_FLASH_SECTOR_SIZE              (0x4000U)
+#define KV_FLASH_SIZE                     (2U * KV_FLASH_SECTOR_SIZE)
+
+// Development images can be loaded in to RAM and run from there instead (see linkerscript-ram.ld).
+// Below the load area is the bootloader's own RAM, above it the RAM image's data, bss and stack.
+#define RAM_APP_START_ADDRESS             (0x20004000U)
+#define RAM_APP_MAX_LENGTH                (48U * 1024U)
+
 #define FWINFO_SENTINEL                   (0xDEADC0DE)
 #define FWINFO_ADDRESS                    (ALIGNED((MAIN_APP_START_ADDRESS + sizeof(vector_table_t)), 16))
+#define FWINFO_OFFSET                     (FWINFO_ADDRESS - MAIN_APP_START_ADDRESS)
 #define SIGNATURE_ADDRESS                 (FWINFO_ADDRESS + sizeof(firmware_info_t))
+#define SIGNATURE_OFFSET                  (SIGNATURE_ADDRESS - MAIN_APP_START_ADDRESS)
+#define MANIFEST_ADDRESS                  (SIGNATURE_ADDRESS + 16)
+#define MANIFEST_OFFSET                   (MANIFEST_ADDRESS - MAIN_APP_START_ADDRESS)
+#define MANIFEST_CRC_NONE                 (0xffffffff)
 
 typedef struct firmware_info_t {
   uint32_t sentinel;
@@ -23,4 +43,11 @@ typedef struct firmware_info_t {
   uint32_t length;
 } firmware_info_t;
 
+// Filled in by the signer, and covered by the signature. The CRC is of the whole image but the
+// signature and this manifest, so the app can check its own image without the signing key.
+typedef struct firmware_manifest_t {
+  uint32_t image_crc;
+  uint32_t reserved[3];
+} firmware_manifest_t;
+
 #endif // INC_FIRMWARE_INFO_H
@@ -0,0 +1,39 @@
+#ifndef INC_HANDOFF_H
+#define INC_HANDOFF_H
+
+#include "common-defines.h"
+
+#define HANDOFF_MAGIC   (0x464F4448) // "HDOF"
+#define HANDOFF_VERSION (1)
+
+// What the bootloader left the clocks as
+#define HANDOFF_CLOCK_RESET      (0) // 16MHz HSI, as out of reset
+#define HANDOFF_CLOCK_HSI_84MHZ  (1) // rcc_hsi_configs[RCC_CLOCK_3V3_84MHZ]
+#define HANDOFF_CLOCK_HSE_84MHZ  (2) // rcc_hse_8mhz_3v3[RCC_CLOCK_3V3_84MHZ], HSE bypassed
+
+#define HANDOFF_FLAG_SYNCED      (1 << 0) // A host synced with the bootloader this boot
+#define HANDOFF_FLAG_UPDATED     (1 << 1) // ...and wrote a new image
+#define HANDOFF_FLAG_RAM_IMAGE   (1 << 2) // The app was loaded in to RAM, and runs from there
+
+// Left by the bootloader in no-init RAM, at the same address in the bootloader and the app, just
+// before it jumps. The app trusts it only when the magic, layout version and CRC all check out.
+typedef struct handoff_t {
+  uint32_t magic;
+  uint32_t version;       // Layout version, bumped whenever a field changes meaning
+  uint32_t clock_config;
+  uint32_t ahb_hz;
+  uint32_t apb1_hz;
+  uint32_t apb2_hz;
+  uint64_t ticks;         // SysTick count when the bootloader stopped it
+  uint32_t reset_flags;   // RCC_CSR reset flags, as found before the bootloader cleared them
+  uint32_t fw_version;    // Version of the image the bootloader validated
+  uint32_t flags;
+  uint32_t boot_cycles;   // Cycles from the start of the bootloader's main to the jump
+  uint32_t crc;           // CRC32 of everything above
+} handoff_t;
+
+void handoff_begin(void);
+void handoff_publish(const uint32_t clock_config, const uint32_t fw_version, const uint32_t flags);
+const handoff_t* handoff_get(void);
+
+#endif // INC_HANDOFF_H
@@ -0,0 +1,30 @@
+#ifndef INC_KV_H
+#define INC_KV_H
+
+#include "common-defines.h"
+
+#define KV_MAX_KEYS          (64)
+#define KV_MAX_VALUE_LENGTH  (64)
+#define KV_KEY_INVALID       (0xFFFF) // Reads back as erased flash, so can't be stored
+
+// The two sectors the store rotates between. Words are only ever programmed once after an erase,
+// so a host build can run the store over a simulated flash, and cut the power at any point.
+typedef struct kv_flash_t {
+  uint32_t sector_size;
+  uint32_t (*read_word)(const uint8_t sector, const uint32_t offset);
+  void (*program_word)(const uint8_t sector, const uint32_t offset, const uint32_t word);
+  void (*erase)(const uint8_t sector);
+} kv_flash_t;
+
+// Never erases: if a sector has to be, that's left for kv_tick, or the first write before then
+bool kv_init(const kv_flash_t* flash);
+// length is the size of value on the way in, and the length of what was stored on the way out
+bool kv_get(const uint16_t key, void* value, uint8_t* length);
+bool kv_set(const uint16_t key, const void* value, const uint8_t length);
+bool kv_delete(const uint16_t key);
+// Does a little of any compaction or erase that's due. Call it from the main loop when there's time.
+void kv_tick(void);
+
+extern const kv_flash_t kv_internal_flash;
+
+#endif // INC_KV_H
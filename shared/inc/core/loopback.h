@@ -0,0 +1,18 @@
+#ifndef INC_LOOPBACK_H
+#define INC_LOOPBACK_H
+
+#include "common-defines.h"
+#include "core/transport.h"
+
+// An in-memory transport with no hardware behind it, so that comms can run in a host build. The
+// code playing the far end of the link injects what comms should read, and collects what it wrote.
+// If given, far_end is run by flush, as the one place comms waits for the other side.
+typedef void (*loopback_far_end_t)(void);
+
+void loopback_setup(loopback_far_end_t far_end);
+bool loopback_inject(const uint8_t* data, const uint32_t length);
+uint32_t loopback_collect(uint8_t* data, const uint32_t length);
+
+extern const transport_t loopback_transport;
+
+#endif // INC_LOOPBACK_H
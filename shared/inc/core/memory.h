@@ -0,0 +1,32 @@
+#ifndef INC_MEMORY_H
+#define INC_MEMORY_H
+
+#include "common-defines.h"
+
+// Everything from _stack_floor up to the stack pointer is filled with this at startup, so the
+// deepest the stack has been is the lowest word that no longer holds it
+#define MEMORY_STACK_PAINT (0xA5A5A5A5)
+
+typedef struct buffer_usage_t {
+  uint32_t capacity;  // Most it can hold at once
+  uint32_t peak;      // Most it has held at once
+  uint32_t overflows; // Writes turned away because it was full
+} buffer_usage_t;
+
+// Where RAM went, from the symbols the linker script defines
+typedef struct memory_map_t {
+  uint32_t ram_start;
+  uint32_t ram_size;
+  uint32_t noinit_size;
+  uint32_t data_size;   // Including RAM functions
+  uint32_t bss_size;
+  uint32_t stack_size;  // _stack_floor to the top of RAM
+} memory_map_t;
+
+// Call early in main, once the clocks are up. Painting again later restarts the high-water mark.
+void memory_paint_stack(void);
+// The most stack ever used since it was painted, in bytes
+uint32_t memory_stack_peak(void);
+void memory_get_map(memory_map_t* map);
+
+#endif // INC_MEMORY_H
@@ -0,0 +1,51 @@
+#ifndef INC_PACKET_H
+#define INC_PACKET_H
+
+#include "common-defines.h"
+
+// Frames on the wire are: SOF, address, seq, length (+ flags), `length` data bytes, CRC8 over
+// address..data
+#define PACKET_DATA_LENGTH  (16)
+#define PACKET_SOF          (0xA5)
+#define PACKET_HEADER_BYTES (4)
+#define PACKET_CRC_BYTES    (1)
+#define PACKET_MAX_BYTES    (PACKET_HEADER_BYTES + PACKET_DATA_LENGTH + PACKET_CRC_BYTES)
+
+#define PACKET_LENGTH_MASK  (0x1F)
+#define PACKET_FLAG_FEC     (0x20) // Followed by FEC_PARITY_BYTES over address..CRC (host to node only)
+#define PACKET_FLAG_LARGE   (0x40) // Unsequenced header, followed by a raw payload and its CRC32
+#define PACKET_FLAG_ACK     (0x80) // Link control frame, never delivered to the application
+
+// A large frame's header packet is followed by the payload length (16 bit), the payload, and the
+// payload's CRC32
+#define PACKET_LARGE_LENGTH_BYTES (2)
+#define PACKET_LARGE_CRC_BYTES    (4)
+#define PACKET_LARGE_HEADER_BYTES (PACKET_MAX_BYTES + PACKET_LARGE_LENGTH_BYTES)
+
+// Host to node frames carry the destination node ID, node to host frames carry the sender's ID
+// with COMMS_ADDR_FROM_NODE set. On a multi-drop bus, every node hears every frame (including
+// its own echo), so anything from another node is ignored.
+#define COMMS_ADDR_FROM_NODE (0x80)
+#define COMMS_NODE_ID_MIN    (0x01)
+#define COMMS_NODE_ID_MAX    (0x7D)
+#define COMMS_ADDR_ANY       (0x7E) // Point-to-point: whichever node is on the other end
+#define COMMS_ADDR_BROADCAST (0x7F) // Every node. Unsequenced and never acknowledged.
+
+typedef struct comms_packet_t {
+  uint8_t address;
+  uint8_t seq;
+  uint8_t length;
+  uint8_t data[PACKET_DATA_LENGTH];
+  uint8_t crc;
+} comms_packet_t;
+
+uint8_t packet_compute_crc(const comms_packet_t* packet);
+// The frame for a packet, CRC and all, in to `frame` (at least PACKET_MAX_BYTES). Returns its length.
+uint32_t packet_encode(const comms_packet_t* packet, uint8_t* frame);
+// The header of a large frame with a `length` byte payload, in to `frame` (at least
+// PACKET_LARGE_HEADER_BYTES). The header's CRC is filled in. Returns the number of bytes.
+uint32_t packet_encode_large_header(comms_packet_t* header, const uint32_t length, uint8_t* frame);
+// What follows the payload of a large frame, given the CRC32 of the payload
+void packet_encode_large_crc(const uint32_t crc, uint8_t* bytes);
+
+#endif // INC_PACKET_H
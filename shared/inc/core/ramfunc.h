@@ -0,0 +1,14 @@
+#ifndef INC_RAMFUNC_H
+#define INC_RAMFUNC_H
+
+// Places a function in .ramfunc, which the linker scripts put in .data so that the startup code
+// copies it in to SRAM. It then keeps running while the flash is stalled by an erase or program.
+// long_call is needed because SRAM is out of BL range from flash, so use it on prototypes too.
+#if defined(__arm__)
+#define RAMFUNC __attribute__((section(".ramfunc"), long_call, noinline))
+#else
+// A host build (e.g. of the tests) has no flash to stall, and no .ramfunc section to put it in
+#define RAMFUNC
+#endif
+
+#endif // INC_RAMFUNC_H
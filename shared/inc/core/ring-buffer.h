@@ -2,17 +2,25 @@
 #define INC_RING_BUFFER_H
 
 #include "common-defines.h"
+#include "core/memory.h"
+#include "core/ramfunc.h"
 
 typedef struct ring_buffer_t {
   uint8_t* buffer;
   uint32_t mask;
   uint32_t read_index;
   uint32_t write_index;
+  uint32_t peak;      // Most bytes it has held at once
+  uint32_t overflows; // Bytes turned away because it was full
 } ring_buffer_t;
 
 void ring_buffer_setup(ring_buffer_t* rb, uint8_t* buffer, uint32_t size);
-bool ring_buffer_empty(ring_buffer_t* rb);
-bool ring_buffer_write(ring_buffer_t* rb, uint8_t byte);
-bool ring_buffer_read(ring_buffer_t* rb, uint8_t* byte);
+RAMFUNC bool ring_buffer_empty(ring_buffer_t* rb);
+RAMFUNC bool ring_buffer_write(ring_buffer_t* rb, uint8_t byte);
+RAMFUNC bool ring_buffer_read(ring_buffer_t* rb, uint8_t* byte);
+// Bytes that can be written before it's full
+uint32_t ring_buffer_free(ring_buffer_t* rb);
+buffer_usage_t ring_buffer_usage(const ring_buffer_t* rb);
+void ring_buffer_reset_usage(ring_buffer_t* rb);
 
 #endif // INC_RING_BUFFER_H
@@ -2,13 +2,83 @@
 #define INC_SYSTEM_H
 
 #include "common-defines.h"
+#include "core/ramfunc.h"
 
 #define CPU_FREQ      (84000000)
 #define SYSTICK_FREQ  (1000)
 
+// Profiling scopes are compiled out of the app's release builds ('make RELEASE=1'), and out of the
+// bootloader unless it's built with 'make DIAGNOSTICS=1'
+#ifndef PROFILE_ENABLED
+#define PROFILE_ENABLED (1)
+#endif
+
+#define PROFILE_MAX_SCOPES     (16)
+// Bin n counts the samples that took [2^(n-1), 2^n) cycles, bin 0 the ones that took none
+#define PROFILE_HISTOGRAM_BINS (32)
+
+typedef struct profile_scope_t {
+  const char* name;
+  bool registered;
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint64_t total;
+  uint32_t histogram[PROFILE_HISTOGRAM_BINS];
+} profile_scope_t;
+
+// 'make PC_SAMPLING=1' has every SysTick count where it interrupted, for building a profile guided
+// link order (see fw-tools/link-order.py). Off by default, as the histogram takes 2K of RAM.
+#ifndef PC_SAMPLING_ENABLED
+#define PC_SAMPLING_ENABLED (0)
+#endif
+
+// Must be a power of two. Buckets cover the image's code from its vector table to _etext, and are
+// as narrow as that allows, but never less than a 16 byte flash line.
+#define PC_HISTOGRAM_BUCKETS   (1024)
+#define PC_HISTOGRAM_MIN_SHIFT (4)
+#define PC_HISTOGRAM_MAGIC     (0x43505448) // "HTPC"
+
+// Laid out so that a raw dump of it (e.g. from a debugger) is enough for the host tools
+typedef struct pc_histogram_t {
+  uint32_t magic;
+  uint32_t start;   // Address of bucket 0
+  uint32_t shift;   // Bucket n counts samples in [start + (n << shift), start + ((n + 1) << shift))
+  uint32_t outside; // Samples anywhere else, e.g. in RAM functions
+  uint16_t counts[PC_HISTOGRAM_BUCKETS]; // Saturating
+} pc_histogram_t;
+
 void system_setup(void);
 void system_teardown(void);
+void system_relocate_vector_table(void);
 uint64_t system_get_ticks(void);
 void system_delay(uint64_t milleseconds);
+void system_enable_cycle_counter(void);
+bool system_use_hse_clock(void);
+// One of the HANDOFF_CLOCK_ values
+uint32_t system_get_clock_config(void);
+
+RAMFUNC void system_profile_record(profile_scope_t* scope, const uint32_t cycles);
+uint32_t system_profile_scope_count(void);
+const profile_scope_t* system_profile_get_scope(const uint32_t index);
+void system_profile_reset(void);
+// NULL unless built with PC_SAMPLING=1
+const pc_histogram_t* system_pc_histogram_get(void);
+
+#if PROFILE_ENABLED
+#include <libopencm3/cm3/dwt.h>
+
+// Time everything between PROFILE_BEGIN and PROFILE_END in cycles. One scope per function; the
+// cycle count at the start is available as `profile_start` in between. The scope is zeroed rather
+// than initialised with its name, so that it's in .bss and not in .data's 1.5K.
+#define PROFILE_BEGIN(scope_name)                                  \
+  static profile_scope_t profile_scope;                            \
+  profile_scope.name = (scope_name);                               \
+  const uint32_t profile_start = DWT_CYCCNT
+#define PROFILE_END() system_profile_record(&profile_scope, DWT_CYCCNT - profile_start)
+#else
+#define PROFILE_BEGIN(scope_name) do {} while (0)
+#define PROFILE_END() do {} while (0)
+#endif
 
 #endif // INC_SYSTEM_H
@@ -0,0 +1,46 @@
+#ifndef INC_TRACE_H
+#define INC_TRACE_H
+
+#include "common-defines.h"
+#include "core/ramfunc.h"
+
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED (1)
+#endif
+
+// Number of records kept. Must be a power of two.
+#define TRACE_CAPACITY (128)
+#define TRACE_MAGIC    (0x43525454) // "TTRC"
+
+// Event IDs are the offsets of format strings in the .trace_fmt section, which the linker scripts
+// keep in the ELF file but never load in to flash. The host decoder finds the format string there.
+typedef struct trace_record_t {
+  uint32_t timestamp; // DWT cycle count
+  uint32_t event;
+  uint32_t arg0;
+  uint32_t arg1;
+} trace_record_t;
+
+// Laid out so that a raw dump of it (e.g. from a debugger) is enough for the host decoder
+typedef struct trace_buffer_t {
+  uint32_t magic;
+  uint32_t capacity;
+  volatile uint32_t head;
+  trace_record_t records[TRACE_CAPACITY];
+} trace_buffer_t;
+
+void trace_setup(void);
+RAMFUNC void trace_record(const uint32_t event, const uint32_t arg0, const uint32_t arg1);
+uint32_t trace_read(trace_record_t* records, const uint32_t max_records, uint32_t* dropped);
+uint32_t trace_pending(void);
+
+#if TRACE_ENABLED
+#define TRACE(fmt, arg0, arg1) do {                                                  \
+  static const char trace_fmt[] __attribute__((section(".trace_fmt"), used)) = fmt;  \
+  trace_record((uint32_t)trace_fmt, (uint32_t)(arg0), (uint32_t)(arg1));             \
+} while (0)
+#else
+#define TRACE(fmt, arg0, arg1) do { (void)(arg0); (void)(arg1); } while (0)
+#endif
+
+#endif // INC_TRACE_H
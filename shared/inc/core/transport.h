@@ -0,0 +1,15 @@
+#ifndef INC_TRANSPORT_H
+#define INC_TRANSPORT_H
+
+#include "common-defines.h"
+
+// A byte stream that comms can run over. Each physical link provides one of these.
+typedef struct transport_t {
+  bool (*data_available)(void);
+  uint32_t (*read)(uint8_t* data, const uint32_t length);
+  void (*write)(uint8_t* data, const uint32_t length);
+  // Block until everything written so far has left the device
+  void (*flush)(void);
+} transport_t;
+
+#endif // INC_TRANSPORT_H
@@ -2,13 +2,28 @@
 #define INC_UART_H
 
 #include "common-defines.h"
+#include "core/memory.h"
+#include "core/transport.h"
+
+#define UART_BAUD_RATE (115200)
 
 void uart_setup(void);
 void uart_teardown(void);
+bool uart_use_rx_buffer(uint8_t* buffer, const uint32_t size);
 void uart_write(uint8_t* data, const uint32_t length);
 void uart_write_byte(uint8_t data);
+uint32_t uart_write_nonblocking(const uint8_t* data, const uint32_t length);
+uint32_t uart_tx_free(void);
 uint32_t uart_read(uint8_t* data, const uint32_t length);
 uint8_t uart_read_byte(void);
 bool uart_data_available(void);
+void uart_flush(void);
+uint32_t uart_measure_rx_latency(const uint32_t samples, const uint32_t timeout);
+uint32_t uart_measure_loopback(const uint32_t length, const uint32_t timeout, uint32_t* cycles);
+buffer_usage_t uart_rx_usage(void);
+buffer_usage_t uart_tx_usage(void);
+void uart_reset_usage(void);
+
+extern const transport_t uart_transport;
 
 #endif // INC_UART_H
@@ -0,0 +1,19 @@
+#ifndef INC_USB_CDC_H
+#define INC_USB_CDC_H
+
+#include "common-defines.h"
+#include "core/memory.h"
+#include "core/transport.h"
+
+void usb_cdc_setup(void);
+void usb_cdc_teardown(void);
+void usb_cdc_write(uint8_t* data, const uint32_t length);
+uint32_t usb_cdc_read(uint8_t* data, const uint32_t length);
+bool usb_cdc_data_available(void);
+void usb_cdc_flush(void);
+buffer_usage_t usb_cdc_rx_usage(void);
+void usb_cdc_reset_usage(void);
+
+extern const transport_t usb_cdc_transport;
+
+#endif // INC_USB_CDC_H
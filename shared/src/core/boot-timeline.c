@@ -0,0 +1,70 @@
+#include <string.h>
+#include <libopencm3/cm3/dwt.h>
+
+#include "core/boot-timeline.h"
+#include "core/system.h"
+
+// Out of reset the core runs from the 16MHz HSI
+#define RESET_CLOCK_MHZ (16)
+
+// Placed at the very start of RAM by both linker scripts
+boot_timelines_t boot_timelines __attribute__((section(".noinit.boot_timeline")));
+
+static bool timeline_valid(const boot_timeline_t* timeline) {
+  return (timeline->magic == BOOT_TIMELINE_MAGIC) && (timeline->count <= BOOT_TIMELINE_MAX_EVENTS);
+}
+
+// Bring elapsed_ns up to date at the current clock rate
+static void timeline_advance(boot_timeline_t* timeline) {
+  const uint32_t cycles = DWT_CYCCNT;
+  timeline->elapsed_ns += ((uint64_t)(cycles - timeline->last_cycles) * 1000) / timeline->clock_mhz;
+  timeline->last_cycles = cycles;
+}
+
+// Called first thing in the bootloader. Whatever is left from the last boot is kept as the
+// previous timeline (RAM contents are garbage after a power cycle, hence the magic).
+void boot_timeline_begin(void) {
+  system_enable_cycle_counter();
+  DWT_CYCCNT = 0;
+
+  if (timeline_valid(&boot_timelines.current)) {
+    memcpy(&boot_timelines.previous, &boot_timelines.current, sizeof(boot_timeline_t));
+  } else if (!timeline_valid(&boot_timelines.previous)) {
+    memset(&boot_timelines.previous, 0, sizeof(boot_timeline_t));
+  }
+
+  memset(&boot_timelines.current, 0, sizeof(boot_timeline_t));
+  boot_timelines.current.clock_mhz = RESET_CLOCK_MHZ;
+  boot_timelines.current.magic = BOOT_TIMELINE_MAGIC;
+  boot_timeline_mark(BootPhase_BootloaderMain);
+}
+
+void boot_timeline_mark(const boot_phase_t phase) {
+  boot_timeline_t* timeline = &boot_timelines.current;
+  if (!timeline_valid(timeline) || (timeline->count >= BOOT_TIMELINE_MAX_EVENTS)) {
+    return;
+  }
+
+  timeline_advance(timeline);
+  timeline->events[timeline->count].time_us = (uint32_t)(timeline->elapsed_ns / 1000);
+  timeline->events[timeline->count].phase = phase;
+  timeline->count++;
+}
+
+void boot_timeline_set_clock(const uint32_t hz) {
+  boot_timeline_t* timeline = &boot_timelines.current;
+  if (!timeline_valid(timeline)) {
+    return;
+  }
+
+  timeline_advance(timeline);
+  timeline->clock_mhz = hz / 1000000;
+}
+
+void boot_timeline_set_version(const uint32_t version) {
+  boot_timelines.current.version = version;
+}
+
+const boot_timeline_t* boot_timeline_get(const bool previous) {
+  return previous ? &boot_timelines.previous : &boot_timelines.current;
+}
@@ -1,6 +1,8 @@
 #include "core/crc.h"
+#include "core/system.h"
 
 uint8_t crc8(uint8_t* data, uint32_t length) {
+  PROFILE_BEGIN("crc8");
   uint8_t crc = 0;
 
   for (uint32_t i = 0; i < length; i++) {
@@ -14,12 +16,17 @@ uint8_t crc8(uint8_t* data, uint32_t length) {
     }
   }
 
+  PROFILE_END();
   return crc;
 }
 
 uint32_t crc32(const uint8_t* data, const uint32_t length) {
+  return crc32_update(0, data, length);
+}
+
+uint32_t crc32_update(const uint32_t previous, const uint8_t* data, const uint32_t length) {
    uint8_t byte;
-   uint32_t crc = 0xffffffff;
+   uint32_t crc = ~previous;
    uint32_t mask;
 
    for (uint32_t i = 0; i < length; i++) {
@@ -34,4 +41,3 @@ uint32_t crc32(const uint8_t* data, const uint32_t length) {
 
    return ~crc;
 }
-
@@ -0,0 +1,44 @@
+#include <stddef.h>
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/stm32/rcc.h>
+
+#include "core/handoff.h"
+#include "core/system.h"
+#include "core/crc.h"
+
+// Placed at a fixed offset in to RAM, straight after the boot timelines, by both linker scripts
+handoff_t handoff __attribute__((section(".noinit.handoff")));
+
+static uint32_t handoff_crc(void) {
+  return crc32((const uint8_t*)&handoff, offsetof(handoff_t, crc));
+}
+
+// Called first thing in the bootloader. Nothing from a previous boot can be trusted by this one's
+// app, so the block is invalidated until the bootloader publishes it again.
+void handoff_begin(void) {
+  handoff.magic = 0;
+  handoff.reset_flags = RCC_CSR & RCC_CSR_RESET_FLAGS;
+  RCC_CSR |= RCC_CSR_RMVF;
+}
+
+// Called by the bootloader once it has torn everything down but the clocks, right before the jump
+void handoff_publish(const uint32_t clock_config, const uint32_t fw_version, const uint32_t flags) {
+  handoff.magic = HANDOFF_MAGIC;
+  handoff.version = HANDOFF_VERSION;
+  handoff.clock_config = clock_config;
+  handoff.ahb_hz = rcc_ahb_frequency;
+  handoff.apb1_hz = rcc_apb1_frequency;
+  handoff.apb2_hz = rcc_apb2_frequency;
+  handoff.ticks = system_get_ticks();
+  handoff.fw_version = fw_version;
+  handoff.flags = flags;
+  handoff.boot_cycles = DWT_CYCCNT;
+  handoff.crc = handoff_crc();
+}
+
+const handoff_t* handoff_get(void) {
+  if ((handoff.magic != HANDOFF_MAGIC) || (handoff.version != HANDOFF_VERSION) || (handoff.crc != handoff_crc())) {
+    return NULL;
+  }
+  return &handoff;
+}
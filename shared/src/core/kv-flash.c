@@ -0,0 +1,69 @@
+#include <libopencm3/stm32/flash.h>
+#include "core/kv.h"
+#include "core/ramfunc.h"
+#include "core/firmware-info.h"
+
+// The store's two sectors, at the top of the internal flash. Like bl-flash.c, the registers are
+// driven from RAM so that the code doing it isn't stalled by its own erase or program.
+
+#define KV_SECTOR_ADDRESS(sector) (KV_FLASH_ADDRESS + ((uint32_t)(sector) * KV_FLASH_SECTOR_SIZE))
+
+static RAMFUNC void kv_flash_wait_for_last_operation(void) {
+  while ((FLASH_SR & FLASH_SR_BSY) == FLASH_SR_BSY) {
+    // Spin
+  }
+}
+
+static RAMFUNC void kv_flash_program(uint32_t address, uint32_t word) {
+  kv_flash_wait_for_last_operation();
+  FLASH_CR &= ~(FLASH_CR_PROGRAM_MASK << FLASH_CR_PROGRAM_SHIFT);
+  FLASH_CR |= FLASH_CR_PROGRAM_X32 << FLASH_CR_PROGRAM_SHIFT;
+
+  FLASH_CR |= FLASH_CR_PG;
+  MMIO32(address) = word;
+  kv_flash_wait_for_last_operation();
+  FLASH_CR &= ~FLASH_CR_PG;
+}
+
+static RAMFUNC void kv_flash_erase(uint8_t sector) {
+  kv_flash_wait_for_last_operation();
+  FLASH_CR &= ~(FLASH_CR_PROGRAM_MASK << FLASH_CR_PROGRAM_SHIFT);
+  FLASH_CR |= FLASH_CR_PROGRAM_X32 << FLASH_CR_PROGRAM_SHIFT;
+
+  FLASH_CR &= ~(FLASH_CR_SNB_MASK << FLASH_CR_SNB_SHIFT);
+  FLASH_CR |= (sector & FLASH_CR_SNB_MASK) << FLASH_CR_SNB_SHIFT;
+  FLASH_CR |= FLASH_CR_SER;
+  FLASH_CR |= FLASH_CR_STRT;
+
+  kv_flash_wait_for_last_operation();
+  FLASH_CR &= ~FLASH_CR_SER;
+  FLASH_CR &= ~(FLASH_CR_SNB_MASK << FLASH_CR_SNB_SHIFT);
+}
+
+static uint32_t internal_read_word(const uint8_t sector, const uint32_t offset) {
+  return MMIO32(KV_SECTOR_ADDRESS(sector) + offset);
+}
+
+static void internal_program_word(const uint8_t sector, const uint32_t offset, const uint32_t word) {
+  flash_unlock();
+  kv_flash_program(KV_SECTOR_ADDRESS(sector) + offset, word);
+  flash_lock();
+}
+
+static void internal_erase(const uint8_t sector) {
+  flash_unlock();
+  kv_flash_erase(KV_FLASH_SECTOR_0 + sector);
+  flash_lock();
+
+  // The data cache may still hold what was there before the erase
+  flash_dcache_disable();
+  flash_dcache_reset();
+  flash_dcache_enable();
+}
+
+const kv_flash_t kv_internal_flash = {
+  .sector_size = KV_FLASH_SECTOR_SIZE,
+  .read_word = internal_read_word,
+  .program_word = internal_program_word,
+  .erase = internal_erase,
+};
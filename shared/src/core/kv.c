@@ -0,0 +1,519 @@
+#include <string.h>
+#include "core/kv.h"
+#include "core/crc.h"
+
+// Each sector starts with a magic word and a generation, and then a log of records:
+//
+//   [header: key16 | length8 << 16 | crc8 << 24] [value, padded to words with 0xff] [commit]
+//
+// The commit word is a CRC32 of the header and value. It's programmed last, so a record cut short
+// by a power loss is skipped on the next boot. A length of KV_TOMBSTONE marks a deleted key.
+//
+// Records are only ever appended. When the active sector fills up, the live records are copied a
+// few at a time to the other sector, which is committed by programming its magic last, and then
+// the old sector is erased. Until then the old sector stays active, so it's what recovery uses.
+
+#define KV_SECTOR_MAGIC       (0x3153564B) // "KVS1"
+#define KV_SECTOR_HEADER      (8)
+#define KV_ERASED             (0xFFFFFFFF)
+#define KV_TOMBSTONE          (0xFF)
+#define KV_VALUE_WORDS_MAX    ((KV_MAX_VALUE_LENGTH + 3) / 4)
+#define KV_RECORD_SIZE_MAX    ((KV_VALUE_WORDS_MAX + 2) * 4)
+// Enough for a fully compacted store, and as much again before it has to be compacted
+#define KV_MIN_SECTOR_SIZE    (KV_SECTOR_HEADER + (2 * KV_MAX_KEYS * KV_RECORD_SIZE_MAX))
+
+// Twice the number of keys, so probe sequences stay short and there's always an empty slot
+#define KV_INDEX_BITS         (7)
+#define KV_INDEX_SIZE         (1 << KV_INDEX_BITS)
+#define KV_INDEX_MASK         (KV_INDEX_SIZE - 1)
+
+#define KV_COPIES_PER_TICK    (4)
+
+typedef enum kv_state_t {
+  KvState_Idle,
+  KvState_Format,   // Neither sector held a store, and the active one has to be erased first
+  KvState_Copy,     // Copying live records in to the other sector
+  KvState_Commit,   // Everything copied, switch over to the other sector
+  KvState_EraseOld, // The old sector still needs to be erased
+} kv_state_t;
+
+typedef enum kv_record_t {
+  KvRecord_Ok,
+  KvRecord_End,     // Erased flash, or the end of the sector
+  KvRecord_Torn,    // Never committed, skip it
+  KvRecord_Corrupt, // The header can't be trusted, so neither can anything after it
+} kv_record_t;
+
+typedef struct kv_entry_t {
+  uint16_t key;
+  uint8_t sector;
+  bool deleted;     // Points at a tombstone, which has to be copied if compaction is under way
+  uint32_t offset;  // Of the record's header
+} kv_entry_t;
+
+static const kv_flash_t* flash = NULL;
+static kv_entry_t entries[KV_INDEX_SIZE];
+static uint32_t entry_count = 0;
+
+static uint8_t active = 0;
+static uint32_t generation = 0;
+static uint32_t write_offset = 0;
+static bool sealed = false;
+
+static kv_state_t state = KvState_Idle;
+static uint32_t copy_cursor = 0;
+static uint32_t copy_offset = 0;
+
+static uint32_t make_header(const uint16_t key, const uint8_t length) {
+  uint8_t bytes[3] = { key & 0xff, key >> 8, length };
+  return key | ((uint32_t)length << 16) | ((uint32_t)crc8(bytes, sizeof(bytes)) << 24);
+}
+
+static uint16_t header_key(const uint32_t header) {
+  return header & 0xffff;
+}
+
+static uint8_t header_length(const uint32_t header) {
+  return (header >> 16) & 0xff;
+}
+
+static uint32_t value_words(const uint8_t length) {
+  return (length == KV_TOMBSTONE) ? 0 : ((length + 3U) / 4U);
+}
+
+static uint32_t record_size(const uint8_t length) {
+  return (value_words(length) + 2) * 4;
+}
+
+static uint32_t record_crc(const uint32_t* words, const uint32_t count) {
+  const uint32_t crc = crc32((const uint8_t*)words, count * 4);
+  // Never the same as an erased commit word
+  return (crc == KV_ERASED) ? 0x7FFFFFFF : crc;
+}
+
+// words receives the header and the value, up to 1 + KV_VALUE_WORDS_MAX words
+static kv_record_t read_record(const uint8_t sector, const uint32_t offset, uint32_t* words) {
+  if ((offset + 4) > flash->sector_size) {
+    return KvRecord_End;
+  }
+
+  words[0] = flash->read_word(sector, offset);
+  if (words[0] == KV_ERASED) {
+    return KvRecord_End;
+  }
+
+  const uint16_t key = header_key(words[0]);
+  const uint8_t length = header_length(words[0]);
+  if ((words[0] != make_header(key, length)) || (key == KV_KEY_INVALID) ||
+      ((length != KV_TOMBSTONE) && (length > KV_MAX_VALUE_LENGTH)) ||
+      ((offset + record_size(length)) > flash->sector_size)) {
+    return KvRecord_Corrupt;
+  }
+
+  const uint32_t count = value_words(length) + 1;
+  for (uint32_t i = 1; i < count; i++) {
+    words[i] = flash->read_word(sector, offset + (i * 4));
+  }
+  if (flash->read_word(sector, offset + (count * 4)) != record_crc(words, count)) {
+    return KvRecord_Torn;
+  }
+  return KvRecord_Ok;
+}
+
+static void write_record(const uint8_t sector, const uint32_t offset, const uint32_t* words) {
+  const uint32_t count = value_words(header_length(words[0])) + 1;
+  for (uint32_t i = 0; i < count; i++) {
+    flash->program_word(sector, offset + (i * 4), words[i]);
+  }
+  flash->program_word(sector, offset + (count * 4), record_crc(words, count));
+}
+
+static bool sector_blank(const uint8_t sector) {
+  for (uint32_t offset = 0; offset < flash->sector_size; offset += 4) {
+    if (flash->read_word(sector, offset) != KV_ERASED) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static uint32_t index_home(const uint16_t key) {
+  return ((uint32_t)key * 0x9E3779B1U) >> (32 - KV_INDEX_BITS);
+}
+
+static kv_entry_t* index_find(const uint16_t key) {
+  for (uint32_t i = index_home(key); ; i = (i + 1) & KV_INDEX_MASK) {
+    if (entries[i].key == key) {
+      return &entries[i];
+    }
+    if (entries[i].key == KV_KEY_INVALID) {
+      return NULL;
+    }
+  }
+}
+
+static kv_entry_t* index_insert(const uint16_t key) {
+  uint32_t i = index_home(key);
+  for (; entries[i].key != KV_KEY_INVALID; i = (i + 1) & KV_INDEX_MASK) {
+    if (entries[i].key == key) {
+      return &entries[i];
+    }
+  }
+
+  if (entry_count >= KV_MAX_KEYS) {
+    return NULL;
+  }
+  entries[i].key = key;
+  entries[i].deleted = false;
+  entry_count++;
+  return &entries[i];
+}
+
+// Backward shift deletion: anything further along the probe sequence that could live in the hole
+// is moved in to it, so lookups never need to step over removed entries
+static void index_remove(kv_entry_t* entry) {
+  uint32_t hole = (uint32_t)(entry - entries);
+  for (uint32_t i = (hole + 1) & KV_INDEX_MASK; entries[i].key != KV_KEY_INVALID; i = (i + 1) & KV_INDEX_MASK) {
+    const uint32_t home = index_home(entries[i].key);
+    if (((i - home) & KV_INDEX_MASK) >= ((i - hole) & KV_INDEX_MASK)) {
+      entries[hole] = entries[i];
+      hole = i;
+    }
+  }
+  entries[hole].key = KV_KEY_INVALID;
+  entry_count--;
+}
+
+static void index_clear(void) {
+  for (uint32_t i = 0; i < KV_INDEX_SIZE; i++) {
+    entries[i].key = KV_KEY_INVALID;
+  }
+  entry_count = 0;
+}
+
+static void scan(const uint8_t sector) {
+  uint32_t words[1 + KV_VALUE_WORDS_MAX];
+  uint32_t offset = KV_SECTOR_HEADER;
+
+  sealed = false;
+  while (true) {
+    const kv_record_t result = read_record(sector, offset, words);
+    if (result == KvRecord_End) {
+      break;
+    }
+    if (result == KvRecord_Corrupt) {
+      // Nothing more can go in this sector, so the next tick compacts it
+      sealed = true;
+      break;
+    }
+
+    const uint16_t key = header_key(words[0]);
+    const uint8_t length = header_length(words[0]);
+    if (result == KvRecord_Ok) {
+      if (length == KV_TOMBSTONE) {
+        kv_entry_t* entry = index_find(key);
+        if (entry != NULL) {
+          index_remove(entry);
+        }
+      } else {
+        kv_entry_t* entry = index_insert(key);
+        if (entry != NULL) {
+          entry->sector = sector;
+          entry->offset = offset;
+        }
+      }
+    }
+    offset += record_size(length);
+  }
+
+  write_offset = offset;
+}
+
+static void start_compaction(void) {
+  copy_cursor = 0;
+  copy_offset = KV_SECTOR_HEADER;
+  state = KvState_Copy;
+}
+
+static bool copy_pending(void) {
+  for (uint32_t i = 0; i < KV_INDEX_SIZE; i++) {
+    if ((entries[i].key != KV_KEY_INVALID) && (entries[i].sector == active)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void purge_deleted(void) {
+  for (uint32_t i = 0; i < KV_INDEX_SIZE; ) {
+    if ((entries[i].key != KV_KEY_INVALID) && entries[i].deleted) {
+      index_remove(&entries[i]);
+    } else {
+      i++;
+    }
+  }
+}
+
+static void compact_step(void) {
+  const uint8_t other = active ^ 1;
+
+  switch (state) {
+    case KvState_Copy: {
+      uint32_t words[1 + KV_VALUE_WORDS_MAX];
+      uint32_t copied = 0;
+
+      while ((copied < KV_COPIES_PER_TICK) && (copy_cursor < KV_INDEX_SIZE)) {
+        kv_entry_t* entry = &entries[copy_cursor];
+        if ((entry->key == KV_KEY_INVALID) || (entry->sector != active)) {
+          copy_cursor++;
+          continue;
+        }
+
+        if (read_record(active, entry->offset, words) != KvRecord_Ok) {
+          // Gone bad since it was written, and there's nothing to copy. Another entry may be
+          // shifted in to this slot, so look at it again.
+          index_remove(entry);
+          continue;
+        }
+
+        write_record(other, copy_offset, words);
+        entry->sector = other;
+        entry->offset = copy_offset;
+        copy_offset += record_size(header_length(words[0]));
+        copied++;
+        copy_cursor++;
+      }
+
+      // Records written while copying went in to the old sector, so go round again for them
+      if (copy_cursor == KV_INDEX_SIZE) {
+        if (copy_pending()) {
+          copy_cursor = 0;
+        } else {
+          state = KvState_Commit;
+        }
+      }
+    } break;
+
+    case KvState_Commit: {
+      if (copy_pending()) {
+        copy_cursor = 0;
+        state = KvState_Copy;
+        break;
+      }
+
+      flash->program_word(other, 4, generation + 1);
+      flash->program_word(other, 0, KV_SECTOR_MAGIC);
+
+      active = other;
+      generation++;
+      write_offset = copy_offset;
+      sealed = false;
+      purge_deleted();
+      state = KvState_EraseOld;
+    } break;
+
+    case KvState_EraseOld: {
+      flash->erase(other);
+      state = KvState_Idle;
+    } break;
+
+    case KvState_Format: {
+      flash->erase(active);
+      flash->program_word(active, 4, generation);
+      flash->program_word(active, 0, KV_SECTOR_MAGIC);
+      state = sector_blank(other) ? KvState_Idle : KvState_EraseOld;
+    } break;
+
+    default: break;
+  }
+}
+
+// Something has to be written now, and there's no room for it. Finish any compaction that's under
+// way, or do a whole one, but leave erasing the old sector for later.
+static bool compact_now(const uint32_t size) {
+  if (state == KvState_EraseOld) {
+    compact_step();
+  }
+  if (state == KvState_Idle) {
+    start_compaction();
+  }
+  while (state != KvState_EraseOld) {
+    compact_step();
+  }
+  return !sealed && ((write_offset + size) <= flash->sector_size);
+}
+
+static bool append(const uint32_t* words) {
+  const uint16_t key = header_key(words[0]);
+  const uint8_t length = header_length(words[0]);
+  const uint32_t size = record_size(length);
+
+  // Written before kv_tick got round to formatting the store, so it has to be done now
+  if (state == KvState_Format) {
+    compact_step();
+  }
+
+  // A new key needs an index entry. Ones for deleted keys are dropped once compaction finishes.
+  if ((index_find(key) == NULL) && (entry_count >= KV_MAX_KEYS)) {
+    if (((state != KvState_Copy) && (state != KvState_Commit)) || !compact_now(size) || (entry_count >= KV_MAX_KEYS)) {
+      return false;
+    }
+  }
+
+  if (sealed || ((write_offset + size) > flash->sector_size)) {
+    if (!compact_now(size)) {
+      return false;
+    }
+  }
+
+  const uint32_t offset = write_offset;
+  write_record(active, offset, words);
+  write_offset += size;
+
+  kv_entry_t* entry = index_find(key);
+  if (length == KV_TOMBSTONE) {
+    if (entry == NULL) {
+      return true;
+    }
+    if (state == KvState_Idle || state == KvState_EraseOld) {
+      index_remove(entry);
+      return true;
+    }
+    // The key might have been copied already, so the tombstone has to follow it
+    entry->deleted = true;
+  } else {
+    entry = index_insert(key);
+    entry->deleted = false;
+  }
+  entry->sector = active;
+  entry->offset = offset;
+  return true;
+}
+
+bool kv_init(const kv_flash_t* kv_flash) {
+  if (kv_flash->sector_size < KV_MIN_SECTOR_SIZE) {
+    return false;
+  }
+
+  flash = kv_flash;
+  index_clear();
+  state = KvState_Idle;
+
+  bool valid[2];
+  uint32_t generations[2];
+  for (uint8_t sector = 0; sector < 2; sector++) {
+    valid[sector] = flash->read_word(sector, 0) == KV_SECTOR_MAGIC;
+    generations[sector] = flash->read_word(sector, 4);
+  }
+
+  if (!valid[0] && !valid[1]) {
+    // First boot, or the flash held something else. A blank sector is formatted straight away, but
+    // an erase is left for kv_tick or the first write, so that it never holds up start up.
+    const bool blank[2] = { sector_blank(0), sector_blank(1) };
+    active = (!blank[0] && blank[1]) ? 1 : 0;
+    generation = 1;
+    if (!blank[active]) {
+      write_offset = KV_SECTOR_HEADER;
+      sealed = false;
+      state = KvState_Format;
+      return true;
+    }
+    flash->program_word(active, 4, generation);
+    flash->program_word(active, 0, KV_SECTOR_MAGIC);
+  } else if (valid[0] && valid[1]) {
+    // Power was lost between committing a compaction and erasing the old sector
+    active = ((int32_t)(generations[1] - generations[0]) > 0) ? 1 : 0;
+    generation = generations[active];
+  } else {
+    active = valid[0] ? 0 : 1;
+    generation = generations[active];
+  }
+
+  scan(active);
+
+  // Anything in the other sector is left over from a compaction that didn't finish
+  if (!sector_blank(active ^ 1)) {
+    state = KvState_EraseOld;
+  }
+  return true;
+}
+
+bool kv_get(const uint16_t key, void* value, uint8_t* length) {
+  if ((flash == NULL) || (key == KV_KEY_INVALID)) {
+    return false;
+  }
+
+  const kv_entry_t* entry = index_find(key);
+  if ((entry == NULL) || entry->deleted) {
+    return false;
+  }
+
+  uint32_t words[1 + KV_VALUE_WORDS_MAX];
+  if (read_record(entry->sector, entry->offset, words) != KvRecord_Ok) {
+    return false;
+  }
+
+  const uint8_t stored = header_length(words[0]);
+  if (stored > *length) {
+    *length = stored;
+    return false;
+  }
+  memcpy(value, &words[1], stored);
+  *length = stored;
+  return true;
+}
+
+bool kv_set(const uint16_t key, const void* value, const uint8_t length) {
+  if ((flash == NULL) || (key == KV_KEY_INVALID) || (length > KV_MAX_VALUE_LENGTH)) {
+    return false;
+  }
+
+  uint32_t words[1 + KV_VALUE_WORDS_MAX];
+  const uint32_t count = value_words(length) + 1;
+  words[0] = make_header(key, length);
+  if (count > 1) {
+    words[count - 1] = KV_ERASED;
+  }
+  memcpy(&words[1], value, length);
+
+  // Rewriting the same value would only use up flash
+  const kv_entry_t* entry = index_find(key);
+  if ((entry != NULL) && !entry->deleted) {
+    bool same = true;
+    for (uint32_t i = 0; same && (i < count); i++) {
+      same = flash->read_word(entry->sector, entry->offset + (i * 4)) == words[i];
+    }
+    if (same) {
+      return true;
+    }
+  }
+
+  return append(words);
+}
+
+bool kv_delete(const uint16_t key) {
+  if ((flash == NULL) || (key == KV_KEY_INVALID)) {
+    return false;
+  }
+
+  const kv_entry_t* entry = index_find(key);
+  if ((entry == NULL) || entry->deleted) {
+    return true;
+  }
+
+  const uint32_t words[1] = { make_header(key, KV_TOMBSTONE) };
+  return append(words);
+}
+
+void kv_tick(void) {
+  if (flash == NULL) {
+    return;
+  }
+
+  if ((state == KvState_Idle) && (sealed || (write_offset >= ((flash->sector_size / 4) * 3)))) {
+    start_compaction();
+  }
+  if (state != KvState_Idle) {
+    compact_step();
+  }
+}
@@ -0,0 +1,73 @@
+#include <stddef.h>
+
+#include "core/loopback.h"
+#include "core/ring-buffer.h"
+
+#define RING_BUFFER_SIZE (2048)
+
+static ring_buffer_t rx_rb = {0U};
+static ring_buffer_t tx_rb = {0U};
+static uint8_t rx_buffer[RING_BUFFER_SIZE] = {0U};
+static uint8_t tx_buffer[RING_BUFFER_SIZE] = {0U};
+static loopback_far_end_t far_end = NULL;
+
+static uint32_t read_from(ring_buffer_t* rb, uint8_t* data, const uint32_t length) {
+  uint32_t bytes_read = 0;
+  while ((bytes_read < length) && ring_buffer_read(rb, &data[bytes_read])) {
+    bytes_read++;
+  }
+  return bytes_read;
+}
+
+void loopback_setup(loopback_far_end_t far_end_handler) {
+  far_end = far_end_handler;
+  ring_buffer_setup(&rx_rb, rx_buffer, RING_BUFFER_SIZE);
+  ring_buffer_setup(&tx_rb, tx_buffer, RING_BUFFER_SIZE);
+}
+
+bool loopback_inject(const uint8_t* data, const uint32_t length) {
+  for (uint32_t i = 0; i < length; i++) {
+    if (!ring_buffer_write(&rx_rb, data[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+uint32_t loopback_collect(uint8_t* data, const uint32_t length) {
+  return read_from(&tx_rb, data, length);
+}
+
+static bool loopback_data_available(void) {
+  return !ring_buffer_empty(&rx_rb);
+}
+
+static uint32_t loopback_read(uint8_t* data, const uint32_t length) {
+  return read_from(&rx_rb, data, length);
+}
+
+// Like a wire with nobody listening, anything that doesn't fit is simply lost
+static void loopback_write(uint8_t* data, const uint32_t length) {
+  for (uint32_t i = 0; i < length; i++) {
+    ring_buffer_write(&tx_rb, data[i]);
+  }
+}
+
+// Written bytes have left once the far end has collected them. Keep running it while it does, and
+// give up once it stops, as it would otherwise never return.
+static void loopback_flush(void) {
+  while ((far_end != NULL) && !ring_buffer_empty(&tx_rb)) {
+    const uint32_t free_before = ring_buffer_free(&tx_rb);
+    far_end();
+    if (ring_buffer_free(&tx_rb) <= free_before) {
+      break;
+    }
+  }
+}
+
+const transport_t loopback_transport = {
+  .data_available = loopback_data_available,
+  .read = loopback_read,
+  .write = loopback_write,
+  .flush = loopback_flush,
+};
@@ -0,0 +1,40 @@
+#include "core/memory.h"
+
+// Defined by the linker scripts
+extern uint32_t __ram_start;
+extern uint32_t __ram_end;
+extern uint32_t __noinit_start;
+extern uint32_t __noinit_end;
+extern uint32_t _data;
+extern uint32_t _edata;
+extern uint32_t _ebss;
+extern uint32_t _stack_floor;
+extern uint32_t _stack;
+
+// Everything below the stack pointer is free, so this never touches a live frame, including its
+// own. An interrupt's frame can land in the painted area, but it's gone by the time it returns.
+void memory_paint_stack(void) {
+  uint32_t sp;
+  __asm__ volatile("mov %0, sp" : "=r"(sp));
+
+  for (uint32_t* word = &_stack_floor; word < (uint32_t*)sp; word++) {
+    *word = MEMORY_STACK_PAINT;
+  }
+}
+
+uint32_t memory_stack_peak(void) {
+  const uint32_t* word = &_stack_floor;
+  while ((word < &_stack) && (*word == MEMORY_STACK_PAINT)) {
+    word++;
+  }
+  return (uint32_t)&_stack - (uint32_t)word;
+}
+
+void memory_get_map(memory_map_t* map) {
+  map->ram_start = (uint32_t)&__ram_start;
+  map->ram_size = (uint32_t)&__ram_end - (uint32_t)&__ram_start;
+  map->noinit_size = (uint32_t)&__noinit_end - (uint32_t)&__noinit_start;
+  map->data_size = (uint32_t)&_edata - (uint32_t)&_data;
+  map->bss_size = (uint32_t)&_ebss - (uint32_t)&_edata;
+  map->stack_size = (uint32_t)&_stack - (uint32_t)&_stack_floor;
+}
@@ -0,0 +1,45 @@
+#include <string.h>
+#include "core/packet.h"
+#include "core/crc.h"
+
+uint8_t packet_compute_crc(const comms_packet_t* packet) {
+  uint8_t frame[3 + PACKET_DATA_LENGTH];
+  const uint8_t data_length = packet->length & PACKET_LENGTH_MASK;
+
+  frame[0] = packet->address;
+  frame[1] = packet->seq;
+  frame[2] = packet->length;
+  memcpy(&frame[3], packet->data, data_length);
+
+  return crc8(frame, 3 + data_length);
+}
+
+uint32_t packet_encode(const comms_packet_t* packet, uint8_t* frame) {
+  const uint8_t data_length = packet->length & PACKET_LENGTH_MASK;
+
+  frame[0] = PACKET_SOF;
+  frame[1] = packet->address;
+  frame[2] = packet->seq;
+  frame[3] = packet->length;
+  memcpy(&frame[PACKET_HEADER_BYTES], packet->data, data_length);
+  frame[PACKET_HEADER_BYTES + data_length] = packet->crc;
+
+  return PACKET_HEADER_BYTES + data_length + PACKET_CRC_BYTES;
+}
+
+uint32_t packet_encode_large_header(comms_packet_t* header, const uint32_t length, uint8_t* frame) {
+  header->length |= PACKET_FLAG_LARGE;
+  header->crc = packet_compute_crc(header);
+
+  const uint32_t frame_length = packet_encode(header, frame);
+  frame[frame_length] = length & 0xff;
+  frame[frame_length + 1] = (length >> 8) & 0xff;
+  return frame_length + PACKET_LARGE_LENGTH_BYTES;
+}
+
+void packet_encode_large_crc(const uint32_t crc, uint8_t* bytes) {
+  bytes[0] = crc & 0xff;
+  bytes[1] = (crc >> 8) & 0xff;
+  bytes[2] = (crc >> 16) & 0xff;
+  bytes[3] = (crc >> 24) & 0xff;
+}
@@ -5,13 +5,15 @@ void ring_buffer_setup(ring_buffer_t* rb, uint8_t* buffer, uint32_t size) {
   rb->read_index = 0;
   rb->write_index = 0;
   rb->mask = size - 1;
+  rb->peak = 0;
+  rb->overflows = 0;
 }
 
-bool ring_buffer_empty(ring_buffer_t* rb) {
+RAMFUNC bool ring_buffer_empty(ring_buffer_t* rb) {
   return rb->read_index == rb->write_index;
 }
 
-bool ring_buffer_read(ring_buffer_t* rb, uint8_t* byte) {
+RAMFUNC bool ring_buffer_read(ring_buffer_t* rb, uint8_t* byte) {
   uint32_t local_read_index = rb->read_index;
   uint32_t local_write_index = rb->write_index;
 
@@ -26,18 +28,37 @@ bool ring_buffer_read(ring_buffer_t* rb, uint8_t* byte) {
   return true;
 }
 
-bool ring_buffer_write(ring_buffer_t* rb, uint8_t byte) {
+RAMFUNC bool ring_buffer_write(ring_buffer_t* rb, uint8_t byte) {
   uint32_t local_write_index = rb->write_index;
   uint32_t local_read_index = rb->read_index;
 
   uint32_t next_write_index = (local_write_index + 1) & rb->mask;
 
   if (next_write_index == local_read_index) {
+    rb->overflows++;
     return false;
   }
 
   rb->buffer[local_write_index] = byte;
   rb->write_index = next_write_index;
+
+  const uint32_t used = (next_write_index - local_read_index) & rb->mask;
+  if (used > rb->peak) {
+    rb->peak = used;
+  }
   return true;
 }
 
+uint32_t ring_buffer_free(ring_buffer_t* rb) {
+  return rb->mask - ((rb->write_index - rb->read_index) & rb->mask);
+}
+
+buffer_usage_t ring_buffer_usage(const ring_buffer_t* rb) {
+  const buffer_usage_t usage = { .capacity = rb->mask, .peak = rb->peak, .overflows = rb->overflows };
+  return usage;
+}
+
+void ring_buffer_reset_usage(ring_buffer_t* rb) {
+  rb->peak = 0;
+  rb->overflows = 0;
+}
@@ -1,17 +1,128 @@
+#include <string.h>
+
 #include "core/system.h"
+#include "core/ramfunc.h"
+#include "core/boot-timeline.h"
+#include "core/handoff.h"
 
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/cm3/scb.h>
+#include <libopencm3/cm3/scs.h>
 #include <libopencm3/cm3/systick.h>
 #include <libopencm3/cm3/vector.h>
 #include <libopencm3/stm32/rcc.h>
 
+// How long to wait for an external clock on HSE before carrying on without it, ms
+#define HSE_READY_TIMEOUT (5)
+
 static volatile uint64_t ticks = 0;
+static uint32_t clock_config = HANDOFF_CLOCK_RESET;
+
+// VTOR requires the table to be aligned to the next power of two above its size
+static vector_table_t ram_vector_table __attribute__((aligned(512)));
+static uint32_t flash_vector_table_address = 0;
+
+// Scopes register themselves the first time they record anything
+static profile_scope_t* profile_scopes[PROFILE_MAX_SCOPES];
+static uint32_t profile_scope_count = 0;
+
+#if PC_SAMPLING_ENABLED
+extern uint8_t _etext;
+static pc_histogram_t pc_histogram = { .magic = PC_HISTOGRAM_MAGIC };
+
+static void pc_histogram_setup(void) {
+  const uint32_t length = (uint32_t)&_etext - (uint32_t)&vector_table;
+  uint32_t shift = PC_HISTOGRAM_MIN_SHIFT;
+  while (((length - 1) >> shift) >= PC_HISTOGRAM_BUCKETS) {
+    shift++;
+  }
 
-void sys_tick_handler(void) {
+  pc_histogram.start = (uint32_t)&vector_table;
+  pc_histogram.shift = shift;
+}
+
+// Only ever called from the handler below, by name
+__attribute__((used)) RAMFUNC static void sys_tick_sample(const uint32_t* frame) {
   ticks++;
+
+  const uint32_t offset = frame[6] - pc_histogram.start;
+  if (offset < ((uint32_t)&_etext - pc_histogram.start)) {
+    uint16_t* count = &pc_histogram.counts[offset >> pc_histogram.shift];
+    if (*count != UINT16_MAX) {
+      (*count)++;
+    }
+  } else {
+    pc_histogram.outside++;
+  }
 }
 
+// The interrupted PC is word 6 of the exception frame the core stacked on entry. Naked, so that
+// nothing is pushed on top of the frame before it's found, and LR still holds EXC_RETURN when
+// sys_tick_sample returns.
+RAMFUNC __attribute__((naked)) void sys_tick_handler(void) {
+  __asm__ volatile(
+    "mov r0, sp\n"
+    "ldr r1, =sys_tick_sample\n"
+    "bx r1\n"
+  );
+}
+#else
+RAMFUNC void sys_tick_handler(void) {
+  ticks++;
+}
+#endif
+
 static void rcc_setup(void) {
   rcc_clock_setup_pll(&rcc_hsi_configs[RCC_CLOCK_3V3_84MHZ]);
+  clock_config = HANDOFF_CLOCK_HSI_84MHZ;
+}
+
+// When the bootloader says it left the PLL running as rcc_setup (or system_use_hse_clock) would
+// have, and it really is the system clock, there's no need to wait for it to lock again. The tick
+// count carries on too.
+static bool rcc_resume(void) {
+  const handoff_t* handoff = handoff_get();
+  const bool pll_running = ((RCC_CFGR >> RCC_CFGR_SWS_SHIFT) & RCC_CFGR_SWS_MASK) == RCC_CFGR_SWS_PLL;
+  if ((handoff == NULL) || !pll_running ||
+      ((handoff->clock_config != HANDOFF_CLOCK_HSI_84MHZ) && (handoff->clock_config != HANDOFF_CLOCK_HSE_84MHZ))) {
+    return false;
+  }
+
+  rcc_ahb_frequency = handoff->ahb_hz;
+  rcc_apb1_frequency = handoff->apb1_hz;
+  rcc_apb2_frequency = handoff->apb2_hz;
+  ticks = handoff->ticks;
+  clock_config = handoff->clock_config;
+  return true;
+}
+
+// USB full speed needs its 48MHz within 0.25%, which the HSI isn't trimmed to over temperature.
+// Moves the PLL on to the 8MHz the ST-Link drives in to OSC_IN from its MCO (HSE bypass), at the
+// same frequencies, so nothing set up from them needs to change. Returns false and stays on the
+// HSI when there's no clock there, e.g. on a board without an ST-Link.
+bool system_use_hse_clock(void) {
+  if (clock_config == HANDOFF_CLOCK_HSE_84MHZ) {
+    return true;
+  }
+
+  rcc_osc_bypass_enable(RCC_HSE);
+  rcc_osc_on(RCC_HSE);
+  const uint64_t give_up_time = ticks + HSE_READY_TIMEOUT;
+  while (!rcc_is_osc_ready(RCC_HSE)) {
+    if (ticks >= give_up_time) {
+      rcc_osc_off(RCC_HSE);
+      rcc_osc_bypass_disable(RCC_HSE);
+      return false;
+    }
+  }
+
+  rcc_clock_setup_pll(&rcc_hse_8mhz_3v3[RCC_CLOCK_3V3_84MHZ]);
+  clock_config = HANDOFF_CLOCK_HSE_84MHZ;
+  return true;
+}
+
+uint32_t system_get_clock_config(void) {
+  return clock_config;
 }
 
 static void systick_setup(void) {
@@ -25,14 +136,42 @@ uint64_t system_get_ticks(void) {
 }
 
 void system_setup(void) {
-  rcc_setup();
+  if (!rcc_resume()) {
+    rcc_setup();
+  }
+  boot_timeline_set_clock(rcc_ahb_frequency);
+#if PC_SAMPLING_ENABLED
+  pc_histogram_setup();
+#endif
   systick_setup();
+  system_enable_cycle_counter();
+}
+
+// Unlike dwt_enable_cycle_counter, leaves the count alone when it's already running, so that it
+// keeps counting across the jump from the bootloader to the app
+void system_enable_cycle_counter(void) {
+  if ((DWT_CTRL & DWT_CTRL_CYCCNTENA) == 0) {
+    SCS_DEMCR |= SCS_DEMCR_TRCENA;
+    DWT_CYCCNT = 0;
+    DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+  }
 }
 
 void system_teardown(void) {
   systick_interrupt_disable();
   systick_counter_disable();
   systick_clear();
+
+  if (SCB_VTOR == (uint32_t)&ram_vector_table) {
+    SCB_VTOR = flash_vector_table_address;
+  }
+}
+
+void system_relocate_vector_table(void) {
+  flash_vector_table_address = SCB_VTOR;
+  memcpy(&ram_vector_table, (const void*)flash_vector_table_address, sizeof(vector_table_t));
+  SCB_VTOR = (uint32_t)&ram_vector_table;
+  __asm__("DSB");
 }
 
 void system_delay(uint64_t milleseconds) {
@@ -41,3 +180,62 @@ void system_delay(uint64_t milleseconds) {
     // Spin
   }
 }
+
+// Called from ISRs as well as the main loop, so it runs from RAM. A scope is only ever recorded
+// from one context, so the statistics themselves need no locking.
+RAMFUNC void system_profile_record(profile_scope_t* scope, const uint32_t cycles) {
+  if (!scope->registered) {
+    scope->registered = true;
+    scope->min = UINT32_MAX;
+
+    // Scopes beyond the table still keep their statistics, they just can't be read out
+    const uint32_t index = __atomic_fetch_add(&profile_scope_count, 1, __ATOMIC_RELAXED);
+    if (index < PROFILE_MAX_SCOPES) {
+      profile_scopes[index] = scope;
+    }
+  }
+
+  scope->count++;
+  scope->total += cycles;
+  if (cycles < scope->min) {
+    scope->min = cycles;
+  }
+  if (cycles > scope->max) {
+    scope->max = cycles;
+  }
+
+  const uint32_t bin = (cycles == 0) ? 0 : (32 - __builtin_clz(cycles));
+  scope->histogram[bin < PROFILE_HISTOGRAM_BINS ? bin : PROFILE_HISTOGRAM_BINS - 1]++;
+}
+
+uint32_t system_profile_scope_count(void) {
+  return profile_scope_count < PROFILE_MAX_SCOPES ? profile_scope_count : PROFILE_MAX_SCOPES;
+}
+
+const profile_scope_t* system_profile_get_scope(const uint32_t index) {
+  return (index < system_profile_scope_count()) ? profile_scopes[index] : NULL;
+}
+
+void system_profile_reset(void) {
+  for (uint32_t i = 0; i < system_profile_scope_count(); i++) {
+    profile_scope_t* scope = profile_scopes[i];
+    scope->count = 0;
+    scope->min = UINT32_MAX;
+    scope->max = 0;
+    scope->total = 0;
+    memset(scope->histogram, 0, sizeof(scope->histogram));
+  }
+
+#if PC_SAMPLING_ENABLED
+  pc_histogram.outside = 0;
+  memset(pc_histogram.counts, 0, sizeof(pc_histogram.counts));
+#endif
+}
+
+const pc_histogram_t* system_pc_histogram_get(void) {
+#if PC_SAMPLING_ENABLED
+  return &pc_histogram;
+#else
+  return NULL;
+#endif
+}
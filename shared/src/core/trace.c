@@ -0,0 +1,86 @@
+#include <string.h>
+#include <libopencm3/cm3/dwt.h>
+
+#include "core/trace.h"
+#include "core/system.h"
+
+#define CAPACITY_MASK (TRACE_CAPACITY - 1)
+
+#if TRACE_ENABLED
+// Zeroed rather than initialised, so that it's in .bss and not copied out of flash at startup
+static trace_buffer_t trace_buffer;
+
+// Index of the next record trace_read will hand out
+static uint32_t tail = 0;
+
+void trace_setup(void) {
+  trace_buffer.magic = TRACE_MAGIC;
+  trace_buffer.capacity = TRACE_CAPACITY;
+  system_enable_cycle_counter();
+}
+
+// Writers claim a slot with an atomic increment (LDREX/STREX), so any mix of ISRs and the main
+// loop can trace without locks. The oldest records are overwritten once the buffer is full.
+RAMFUNC void trace_record(const uint32_t event, const uint32_t arg0, const uint32_t arg1) {
+  const uint32_t index = __atomic_fetch_add(&trace_buffer.head, 1, __ATOMIC_RELAXED);
+  trace_record_t* record = &trace_buffer.records[index & CAPACITY_MASK];
+
+  record->timestamp = DWT_CYCCNT;
+  record->event = event;
+  record->arg0 = arg0;
+  record->arg1 = arg1;
+}
+
+uint32_t trace_pending(void) {
+  const uint32_t pending = trace_buffer.head - tail;
+  return pending > TRACE_CAPACITY ? TRACE_CAPACITY : pending;
+}
+
+// Copy out the records written since the last read, oldest first. Records that were overwritten
+// before they could be read are counted in `dropped`.
+uint32_t trace_read(trace_record_t* records, const uint32_t max_records, uint32_t* dropped) {
+  uint32_t count = 0;
+  *dropped = 0;
+
+  while (count < max_records) {
+    const uint32_t head = trace_buffer.head;
+    if (tail == head) {
+      break;
+    }
+
+    if ((head - tail) > TRACE_CAPACITY) {
+      *dropped += (head - tail) - TRACE_CAPACITY;
+      tail = head - TRACE_CAPACITY;
+    }
+
+    memcpy(&records[count], &trace_buffer.records[tail & CAPACITY_MASK], sizeof(trace_record_t));
+
+    // An interrupt may have lapped us and rewritten the record while it was being copied
+    if ((trace_buffer.head - tail) > TRACE_CAPACITY) {
+      continue;
+    }
+
+    tail++;
+    count++;
+  }
+
+  return count;
+}
+
+#else
+// Nothing is traced, but the cycle counter is still there for anything else that times with it
+void trace_setup(void) {
+  system_enable_cycle_counter();
+}
+
+uint32_t trace_pending(void) {
+  return 0;
+}
+
+uint32_t trace_read(trace_record_t* records, const uint32_t max_records, uint32_t* dropped) {
+  (void)records;
+  (void)max_records;
+  *dropped = 0;
+  return 0;
+}
+#endif
@@ -1,36 +1,82 @@
+#include <stddef.h>
+
+#include <libopencm3/cm3/dwt.h>
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/usart.h>
 
 #include "core/uart.h"
 #include "core/ring-buffer.h"
+#include "core/ramfunc.h"
+#include "core/system.h"
+#include "core/trace.h"
 
-#define BAUD_RATE (115200)
 #define RING_BUFFER_SIZE (128) // For maximum of ~10ms of latency
+#define TX_RING_BUFFER_SIZE (512) // ~45ms of line time, for writers that can't wait on the line
 
 static ring_buffer_t rb = {0U};
 static uint8_t data_buffer[RING_BUFFER_SIZE] = {0U};
+static ring_buffer_t tx_rb = {0U};
+static uint8_t tx_data_buffer[TX_RING_BUFFER_SIZE] = {0U};
+
+#if PROFILE_ENABLED
+// Interrupt latency measurement: the cycle count when a pending RXNE was unmasked, and whether the
+// ISR has yet to record how long it took to get there
+static profile_scope_t rx_latency_scope;
+static volatile uint32_t rx_latency_mark = 0;
+static volatile bool rx_latency_armed = false;
+#endif
+
+// Runs from RAM so that reception continues while the flash is busy. That means no calls in to
+// libopencm3 (which lives in flash), so the status and data registers are accessed directly.
+RAMFUNC void usart2_isr(void) {
+  PROFILE_BEGIN("usart2_isr");
+
+#if PROFILE_ENABLED
+  if (rx_latency_armed) {
+    system_profile_record(&rx_latency_scope, profile_start - rx_latency_mark);
+    rx_latency_armed = false;
+  }
+#endif
 
-void usart2_isr(void) {
-  const bool overrun_occurred = usart_get_flag(USART2, USART_FLAG_ORE) == 1;
-  const bool received_data = usart_get_flag(USART2, USART_FLAG_RXNE) == 1;
+  const uint32_t status = USART_SR(USART2);
+  const bool overrun_occurred = (status & USART_SR_ORE) != 0;
+  const bool received_data = (status & USART_SR_RXNE) != 0;
+
+  if (overrun_occurred) {
+    TRACE("uart: overrun, sr %08x", status, 0);
+  }
 
   if (received_data || overrun_occurred) {
-    if (!ring_buffer_write(&rb, (uint8_t)usart_recv(USART2))) {
-      // Handle failure?
+    const uint8_t byte = (uint8_t)USART_DR(USART2);
+    if (!ring_buffer_write(&rb, byte)) {
+      TRACE("uart: rx ring full, dropped %02x", byte, 0);
     }
   }
+
+  // TXE is set whenever the data register is empty, so its interrupt is only on while bytes are queued
+  if ((status & USART_SR_TXE) && (USART_CR1(USART2) & USART_CR1_TXEIE)) {
+    uint8_t byte = 0;
+    if (ring_buffer_read(&tx_rb, &byte)) {
+      USART_DR(USART2) = byte;
+    } else {
+      USART_CR1(USART2) &= ~USART_CR1_TXEIE;
+    }
+  }
+
+  PROFILE_END();
 }
 
 void uart_setup(void) {
   ring_buffer_setup(&rb, data_buffer, RING_BUFFER_SIZE);
+  ring_buffer_setup(&tx_rb, tx_data_buffer, TX_RING_BUFFER_SIZE);
 
   rcc_periph_clock_enable(RCC_USART2);
 
   usart_set_mode(USART2, USART_MODE_TX_RX);
   usart_set_flow_control(USART2, USART_FLOWCONTROL_NONE);
   usart_set_databits(USART2, 8);
-  usart_set_baudrate(USART2, BAUD_RATE);
+  usart_set_baudrate(USART2, UART_BAUD_RATE);
   usart_set_parity(USART2, 0);
   usart_set_stopbits(USART2, 1);
 
@@ -40,8 +86,39 @@ void uart_setup(void) {
   usart_enable(USART2);
 }
 
+// Receive in to `buffer` (a power of two in size) instead of the built-in ring, e.g. to ride out a
+// long flash erase, or go back to the built-in ring with NULL. Unread bytes are carried across, and
+// so are the usage counts. If the unread bytes won't all fit, nothing changes and it returns false,
+// so the caller can read some of them first and try again.
+bool uart_use_rx_buffer(uint8_t* buffer, const uint32_t size) {
+  ring_buffer_t next;
+  if (buffer == NULL) {
+    ring_buffer_setup(&next, data_buffer, RING_BUFFER_SIZE);
+  } else {
+    ring_buffer_setup(&next, buffer, size);
+  }
+
+  usart_disable_rx_interrupt(USART2);
+  if ((rb.mask - ring_buffer_free(&rb)) > next.mask) {
+    usart_enable_rx_interrupt(USART2);
+    return false;
+  }
+
+  uint8_t byte = 0;
+  while (ring_buffer_read(&rb, &byte)) {
+    (void)ring_buffer_write(&next, byte);
+  }
+  next.peak = rb.peak;
+  next.overflows += rb.overflows;
+  rb = next;
+  usart_enable_rx_interrupt(USART2);
+  return true;
+}
+
 void uart_teardown(void) {
+  uart_flush();
   usart_disable_rx_interrupt(USART2);
+  usart_disable_tx_interrupt(USART2);
   usart_disable(USART2);
   nvic_disable_irq(NVIC_USART2_IRQ);
   rcc_periph_clock_disable(RCC_USART2);
@@ -53,10 +130,32 @@ void uart_write(uint8_t* data, const uint32_t length) {
   }
 }
 
+// Anything still queued by uart_write_nonblocking goes first, so bytes leave in the order written
 void uart_write_byte(uint8_t data) {
+  while (!ring_buffer_empty(&tx_rb)) {
+    // Wait for the ISR to send the queue
+  }
   usart_send_blocking(USART2, (uint16_t)data);
 }
 
+// Queue as much of `data` as there's room for, to be sent from the interrupt, and return how much
+// that was. Never waits on the line.
+uint32_t uart_write_nonblocking(const uint8_t* data, const uint32_t length) {
+  uint32_t queued = 0;
+  while ((queued < length) && ring_buffer_write(&tx_rb, data[queued])) {
+    queued++;
+  }
+
+  if (queued > 0) {
+    usart_enable_tx_interrupt(USART2);
+  }
+  return queued;
+}
+
+uint32_t uart_tx_free(void) {
+  return ring_buffer_free(&tx_rb);
+}
+
 uint32_t uart_read(uint8_t* data, const uint32_t length) {
   if (length == 0) {
     return 0;
@@ -80,3 +179,119 @@ uint8_t uart_read_byte(void) {
 bool uart_data_available(void) {
   return !ring_buffer_empty(&rb);
 }
+
+void uart_flush(void) {
+  while (!ring_buffer_empty(&tx_rb)) {
+    // Wait for the ISR to send the queue
+  }
+  while ((USART_SR(USART2) & USART_SR_TC) == 0) {
+    // Wait for the last byte to leave the shift register
+  }
+}
+
+// Measure interrupt entry latency on the next `samples` received bytes (or until `timeout` ms pass).
+// Each byte is waited for with the RX interrupt masked, then the interrupt is unmasked with RXNE
+// already set, so the time to the first instruction of the ISR is the NVIC's entry latency (plus
+// the fetch from RAM). The results go in to the "usart2 rxne->isr" profiling scope. Blocks the
+// caller, and returns the number of samples taken.
+uint32_t uart_measure_rx_latency(const uint32_t samples, const uint32_t timeout) {
+#if PROFILE_ENABLED
+  const uint64_t end_time = system_get_ticks() + timeout;
+  uint32_t taken = 0;
+  rx_latency_scope.name = "usart2 rxne->isr";
+
+  while (taken < samples) {
+    usart_disable_rx_interrupt(USART2);
+    while ((USART_SR(USART2) & USART_SR_RXNE) == 0) {
+      if (system_get_ticks() >= end_time) {
+        usart_enable_rx_interrupt(USART2);
+        return taken;
+      }
+    }
+
+    rx_latency_armed = true;
+    rx_latency_mark = DWT_CYCCNT;
+    usart_enable_rx_interrupt(USART2);
+    while (rx_latency_armed) {
+      // The ISR clears this on entry
+    }
+    taken++;
+  }
+
+  return taken;
+#else
+  (void)samples;
+  (void)timeout;
+  return 0;
+#endif
+}
+
+// Send `length` bytes with the receiver joined to the transmitter inside the USART (half-duplex
+// mode), and time how long they take to come back through both rings and the interrupt. Nothing
+// from the other end gets in meanwhile, though it does see the bytes go out, so they're all below
+// 0x80 and never look like the start of a frame. Blocks the caller, and returns how many bytes
+// came back as they were sent, with the cycles it took in `cycles`.
+uint32_t uart_measure_loopback(const uint32_t length, const uint32_t timeout, uint32_t* cycles) {
+  // Whatever the other end had already sent is put back afterwards, for the comms layer
+  uint8_t pending[RING_BUFFER_SIZE];
+  uart_flush();
+  const uint32_t pending_length = uart_read(pending, sizeof(pending));
+
+  usart_disable(USART2);
+  USART_CR3(USART2) |= USART_CR3_HDSEL;
+  usart_enable(USART2);
+
+  const uint64_t end_time = system_get_ticks() + timeout;
+  const uint32_t start = DWT_CYCCNT;
+  uint32_t sent = 0;
+  uint32_t received = 0;
+  uint32_t matched = 0;
+
+  while ((received < length) && (system_get_ticks() < end_time)) {
+    while ((sent < length) && (uart_tx_free() > 0)) {
+      const uint8_t byte = sent & 0x7f;
+      sent += uart_write_nonblocking(&byte, 1);
+    }
+
+    uint8_t byte = 0;
+    while (ring_buffer_read(&rb, &byte)) {
+      matched += (byte == (received & 0x7f)) ? 1 : 0;
+      received++;
+    }
+  }
+  *cycles = DWT_CYCCNT - start;
+
+  uart_flush();
+  usart_disable(USART2);
+  USART_CR3(USART2) &= ~USART_CR3_HDSEL;
+  uint8_t late = 0;
+  while (ring_buffer_read(&rb, &late)) {
+    // Anything that came back after the timeout
+  }
+  for (uint32_t i = 0; i < pending_length; i++) {
+    (void)ring_buffer_write(&rb, pending[i]);
+  }
+  usart_enable(USART2);
+
+  return matched;
+}
+
+const transport_t uart_transport = {
+  .data_available = uart_data_available,
+  .read = uart_read,
+  .write = uart_write,
+  .flush = uart_flush,
+};
+
+buffer_usage_t uart_rx_usage(void) {
+  return ring_buffer_usage(&rb);
+}
+
+buffer_usage_t uart_tx_usage(void) {
+  return ring_buffer_usage(&tx_rb);
+}
+
+void uart_reset_usage(void) {
+  ring_buffer_reset_usage(&rb);
+  ring_buffer_reset_usage(&tx_rb);
+}
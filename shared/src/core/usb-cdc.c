@@ -0,0 +1,317 @@
+#include <stddef.h>
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/cdc.h>
+#include <libopencm3/usb/dwc/otg_fs.h>
+
+#include "core/usb-cdc.h"
+#include "core/ring-buffer.h"
+#include "core/system.h"
+
+#define DATA_OUT_EP       (0x01)
+#define DATA_IN_EP        (0x82)
+#define COMM_EP           (0x83)
+#define MAX_PACKET_SIZE   (64)
+#define RING_BUFFER_SIZE  (1024)
+
+// A host that has stopped reading shouldn't be able to hang the device forever
+#define WRITE_TIMEOUT     (50)
+
+static usbd_device* usbd_dev = NULL;
+static uint8_t usbd_control_buffer[128];
+static volatile bool configured = false;
+static volatile bool out_nak = false;
+
+static ring_buffer_t rb = {0U};
+static uint8_t data_buffer[RING_BUFFER_SIZE] = {0U};
+
+static const struct usb_device_descriptor device_descriptor = {
+  .bLength = USB_DT_DEVICE_SIZE,
+  .bDescriptorType = USB_DT_DEVICE,
+  .bcdUSB = 0x0200,
+  .bDeviceClass = USB_CLASS_CDC,
+  .bDeviceSubClass = 0,
+  .bDeviceProtocol = 0,
+  .bMaxPacketSize0 = MAX_PACKET_SIZE,
+  .idVendor = 0x0483,
+  .idProduct = 0x5740,
+  .bcdDevice = 0x0200,
+  .iManufacturer = 1,
+  .iProduct = 2,
+  .iSerialNumber = 3,
+  .bNumConfigurations = 1,
+};
+
+static const struct usb_endpoint_descriptor comm_endpoint[] = {{
+  .bLength = USB_DT_ENDPOINT_SIZE,
+  .bDescriptorType = USB_DT_ENDPOINT,
+  .bEndpointAddress = COMM_EP,
+  .bmAttributes = USB_ENDPOINT_ATTR_INTERRUPT,
+  .wMaxPacketSize = 16,
+  .bInterval = 255,
+}};
+
+static const struct usb_endpoint_descriptor data_endpoints[] = {{
+  .bLength = USB_DT_ENDPOINT_SIZE,
+  .bDescriptorType = USB_DT_ENDPOINT,
+  .bEndpointAddress = DATA_OUT_EP,
+  .bmAttributes = USB_ENDPOINT_ATTR_BULK,
+  .wMaxPacketSize = MAX_PACKET_SIZE,
+  .bInterval = 1,
+}, {
+  .bLength = USB_DT_ENDPOINT_SIZE,
+  .bDescriptorType = USB_DT_ENDPOINT,
+  .bEndpointAddress = DATA_IN_EP,
+  .bmAttributes = USB_ENDPOINT_ATTR_BULK,
+  .wMaxPacketSize = MAX_PACKET_SIZE,
+  .bInterval = 1,
+}};
+
+static const struct {
+  struct usb_cdc_header_descriptor header;
+  struct usb_cdc_call_management_descriptor call_mgmt;
+  struct usb_cdc_acm_descriptor acm;
+  struct usb_cdc_union_descriptor cdc_union;
+} __attribute__((packed)) cdcacm_functional_descriptors = {
+  .header = {
+    .bFunctionLength = sizeof(struct usb_cdc_header_descriptor),
+    .bDescriptorType = CS_INTERFACE,
+    .bDescriptorSubtype = USB_CDC_TYPE_HEADER,
+    .bcdCDC = 0x0110,
+  },
+  .call_mgmt = {
+    .bFunctionLength = sizeof(struct usb_cdc_call_management_descriptor),
+    .bDescriptorType = CS_INTERFACE,
+    .bDescriptorSubtype = USB_CDC_TYPE_CALL_MANAGEMENT,
+    .bmCapabilities = 0,
+    .bDataInterface = 1,
+  },
+  .acm = {
+    .bFunctionLength = sizeof(struct usb_cdc_acm_descriptor),
+    .bDescriptorType = CS_INTERFACE,
+    .bDescriptorSubtype = USB_CDC_TYPE_ACM,
+    .bmCapabilities = 0,
+  },
+  .cdc_union = {
+    .bFunctionLength = sizeof(struct usb_cdc_union_descriptor),
+    .bDescriptorType = CS_INTERFACE,
+    .bDescriptorSubtype = USB_CDC_TYPE_UNION,
+    .bControlInterface = 0,
+    .bSubordinateInterface0 = 1,
+  },
+};
+
+static const struct usb_interface_descriptor comm_interface[] = {{
+  .bLength = USB_DT_INTERFACE_SIZE,
+  .bDescriptorType = USB_DT_INTERFACE,
+  .bInterfaceNumber = 0,
+  .bAlternateSetting = 0,
+  .bNumEndpoints = 1,
+  .bInterfaceClass = USB_CLASS_CDC,
+  .bInterfaceSubClass = USB_CDC_SUBCLASS_ACM,
+  .bInterfaceProtocol = USB_CDC_PROTOCOL_AT,
+  .iInterface = 0,
+  .endpoint = comm_endpoint,
+  .extra = &cdcacm_functional_descriptors,
+  .extralen = sizeof(cdcacm_functional_descriptors),
+}};
+
+static const struct usb_interface_descriptor data_interface[] = {{
+  .bLength = USB_DT_INTERFACE_SIZE,
+  .bDescriptorType = USB_DT_INTERFACE,
+  .bInterfaceNumber = 1,
+  .bAlternateSetting = 0,
+  .bNumEndpoints = 2,
+  .bInterfaceClass = USB_CLASS_DATA,
+  .bInterfaceSubClass = 0,
+  .bInterfaceProtocol = 0,
+  .iInterface = 0,
+  .endpoint = data_endpoints,
+}};
+
+static const struct usb_interface interfaces[] = {{
+  .num_altsetting = 1,
+  .altsetting = comm_interface,
+}, {
+  .num_altsetting = 1,
+  .altsetting = data_interface,
+}};
+
+static const struct usb_config_descriptor config_descriptor = {
+  .bLength = USB_DT_CONFIGURATION_SIZE,
+  .bDescriptorType = USB_DT_CONFIGURATION,
+  .wTotalLength = 0,
+  .bNumInterfaces = 2,
+  .bConfigurationValue = 1,
+  .iConfiguration = 0,
+  .bmAttributes = 0x80,
+  .bMaxPower = 0x32,
+  .interface = interfaces,
+};
+
+static const char* usb_strings[] = {
+  "Bare Metal Series",
+  "Bootloader",
+  "0001",
+};
+
+static uint32_t ring_buffer_free_space(void) {
+  return (rb.read_index - rb.write_index - 1) & rb.mask;
+}
+
+static enum usbd_request_return_codes control_request_cb(
+  usbd_device* dev,
+  struct usb_setup_data* req,
+  uint8_t** buf,
+  uint16_t* len,
+  void (**complete)(usbd_device* dev, struct usb_setup_data* req)
+) {
+  (void)dev;
+  (void)buf;
+  (void)complete;
+
+  switch (req->bRequest) {
+    case USB_CDC_REQ_SET_CONTROL_LINE_STATE: {
+      return USBD_REQ_HANDLED;
+    }
+
+    case USB_CDC_REQ_SET_LINE_CODING: {
+      // The baud rate means nothing here, but the host expects it to be accepted
+      return (*len < sizeof(struct usb_cdc_line_coding)) ? USBD_REQ_NOTSUPP : USBD_REQ_HANDLED;
+    }
+  }
+
+  return USBD_REQ_NOTSUPP;
+}
+
+static void data_rx_cb(usbd_device* dev, uint8_t ep) {
+  (void)ep;
+
+  uint8_t buffer[MAX_PACKET_SIZE];
+  const uint16_t length = usbd_ep_read_packet(dev, DATA_OUT_EP, buffer, MAX_PACKET_SIZE);
+
+  for (uint16_t i = 0; i < length; i++) {
+    ring_buffer_write(&rb, buffer[i]);
+  }
+
+  // Hold the host off until there is room for another whole packet. It just keeps retrying,
+  // so unlike the UART, nothing is ever lost to a full buffer.
+  if (ring_buffer_free_space() < MAX_PACKET_SIZE) {
+    usbd_ep_nak_set(dev, DATA_OUT_EP, 1);
+    out_nak = true;
+  }
+}
+
+static void set_config_cb(usbd_device* dev, uint16_t value) {
+  (void)value;
+
+  usbd_ep_setup(dev, DATA_OUT_EP, USB_ENDPOINT_ATTR_BULK, MAX_PACKET_SIZE, data_rx_cb);
+  usbd_ep_setup(dev, DATA_IN_EP, USB_ENDPOINT_ATTR_BULK, MAX_PACKET_SIZE, NULL);
+  usbd_ep_setup(dev, COMM_EP, USB_ENDPOINT_ATTR_INTERRUPT, 16, NULL);
+
+  usbd_register_control_callback(
+    dev,
+    USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+    USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+    control_request_cb
+  );
+
+  configured = true;
+}
+
+void otg_fs_isr(void) {
+  usbd_poll(usbd_dev);
+}
+
+void usb_cdc_setup(void) {
+  // Without it the HSI's error is well outside what the host's USB tolerates, but it may still
+  // work at room temperature, so carry on either way
+  system_use_hse_clock();
+  ring_buffer_setup(&rb, data_buffer, RING_BUFFER_SIZE);
+
+  rcc_periph_clock_enable(RCC_OTGFS);
+
+  usbd_dev = usbd_init(
+    &otgfs_usb_driver,
+    &device_descriptor,
+    &config_descriptor,
+    usb_strings,
+    3,
+    usbd_control_buffer,
+    sizeof(usbd_control_buffer)
+  );
+  usbd_register_set_config_callback(usbd_dev, set_config_cb);
+
+  // VBUS isn't wired to PA9 on every board, so don't wait to see it before connecting
+  OTG_FS_GCCFG |= OTG_GCCFG_NOVBUSSENS;
+  OTG_FS_GCCFG &= ~(OTG_GCCFG_VBUSBSEN | OTG_GCCFG_VBUSASEN);
+
+  nvic_enable_irq(NVIC_OTG_FS_IRQ);
+}
+
+void usb_cdc_teardown(void) {
+  nvic_disable_irq(NVIC_OTG_FS_IRQ);
+  usbd_disconnect(usbd_dev, true);
+  rcc_periph_clock_disable(RCC_OTGFS);
+  configured = false;
+}
+
+// Each packet is handed to the endpoint with the interrupt masked, as the USB stack isn't
+// reentrant. The endpoint is free again once the hardware has sent it, without any help.
+void usb_cdc_write(uint8_t* data, const uint32_t length) {
+  const uint64_t give_up_time = system_get_ticks() + WRITE_TIMEOUT;
+  uint32_t offset = 0;
+
+  while (configured && (offset < length) && (system_get_ticks() < give_up_time)) {
+    const uint32_t remaining = length - offset;
+    const uint16_t packet_length = remaining < MAX_PACKET_SIZE ? remaining : MAX_PACKET_SIZE;
+
+    nvic_disable_irq(NVIC_OTG_FS_IRQ);
+    offset += usbd_ep_write_packet(usbd_dev, DATA_IN_EP, &data[offset], packet_length);
+    nvic_enable_irq(NVIC_OTG_FS_IRQ);
+  }
+}
+
+uint32_t usb_cdc_read(uint8_t* data, const uint32_t length) {
+  uint32_t bytes_read = 0;
+  while ((bytes_read < length) && ring_buffer_read(&rb, &data[bytes_read])) {
+    bytes_read++;
+  }
+
+  if (out_nak && (ring_buffer_free_space() >= MAX_PACKET_SIZE)) {
+    nvic_disable_irq(NVIC_OTG_FS_IRQ);
+    out_nak = false;
+    usbd_ep_nak_set(usbd_dev, DATA_OUT_EP, 0);
+    nvic_enable_irq(NVIC_OTG_FS_IRQ);
+  }
+
+  return bytes_read;
+}
+
+bool usb_cdc_data_available(void) {
+  return !ring_buffer_empty(&rb);
+}
+
+void usb_cdc_flush(void) {
+  const uint64_t give_up_time = system_get_ticks() + WRITE_TIMEOUT;
+  while (configured && (OTG_FS_DIEPTSIZ(DATA_IN_EP & 0x7f) & OTG_DIEPSIZ0_PKTCNT) && (system_get_ticks() < give_up_time)) {
+    // Wait for the last packet to be collected by the host
+  }
+}
+
+const transport_t usb_cdc_transport = {
+  .data_available = usb_cdc_data_available,
+  .read = usb_cdc_read,
+  .write = usb_cdc_write,
+  .flush = usb_cdc_flush,
+};
+
+buffer_usage_t usb_cdc_rx_usage(void) {
+  return ring_buffer_usage(&rb);
+}
+
+void usb_cdc_reset_usage(void) {
+  ring_buffer_reset_usage(&rb);
+}
@@ -0,0 +1,355 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "comms.h"
+#include "core/loopback.h"
+#include "core/system.h"
+#include "core/trace.h"
+
+#define NODE_ID        (0x01)
+#define MAX_FRAMES     (32)
+#define COLLECT_BYTES  (2048)
+
+#define CHECK(condition) check((condition), #condition, __LINE__)
+
+typedef struct sent_frames_t {
+  comms_packet_t frames[MAX_FRAMES];
+  uint32_t count;
+} sent_frames_t;
+
+static uint64_t now = 0;
+static uint32_t failures = 0;
+static uint32_t far_end_runs = 0;
+
+// comms only needs the time and (when draining) the trace, which the host provides here
+uint64_t system_get_ticks(void) {
+  return now;
+}
+
+uint32_t trace_pending(void) {
+  return 0;
+}
+
+uint32_t trace_read(trace_record_t* records, const uint32_t max_records, uint32_t* dropped) {
+  (void)records;
+  (void)max_records;
+  *dropped = 0;
+  return 0;
+}
+
+static void check(const bool condition, const char* text, const int line) {
+  if (!condition) {
+    printf("    line %d: %s\n", line, text);
+    failures++;
+  }
+}
+
+static void reset(void) {
+  now = 1000;
+  loopback_setup(NULL);
+  comms_setup(&loopback_transport);
+  comms_set_node_id(NODE_ID);
+
+  comms_packet_t packet;
+  while (comms_packets_available()) {
+    comms_read(&packet);
+  }
+}
+
+// What the host would send: a sequenced frame for the node, with `length` bytes from `fill`
+static void send_frame(const uint8_t address, const uint8_t seq, const uint8_t length, const uint8_t fill) {
+  comms_packet_t packet;
+  uint8_t frame[PACKET_MAX_BYTES];
+
+  memset(&packet, 0xff, sizeof(packet));
+  packet.address = address;
+  packet.seq = seq;
+  packet.length = length;
+  memset(packet.data, fill, length);
+  packet.crc = packet_compute_crc(&packet);
+  loopback_inject(frame, packet_encode(&packet, frame));
+}
+
+static void send_ack(const uint8_t next_seq, const uint16_t bitmap) {
+  comms_packet_t ack;
+  uint8_t frame[PACKET_MAX_BYTES];
+
+  memset(&ack, 0xff, sizeof(ack));
+  ack.address = COMMS_ADDR_ANY;
+  ack.seq = 0;
+  ack.length = PACKET_FLAG_ACK | PACKET_ACK_LENGTH;
+  ack.data[0] = PACKET_ACK_DATA0;
+  ack.data[1] = next_seq;
+  ack.data[2] = bitmap & 0xff;
+  ack.data[3] = (bitmap >> 8) & 0xff;
+  ack.crc = packet_compute_crc(&ack);
+  loopback_inject(frame, packet_encode(&ack, frame));
+}
+
+// Everything the node has written since the last call, split back in to frames
+static sent_frames_t collect_frames(void) {
+  static uint8_t bytes[COLLECT_BYTES];
+  sent_frames_t sent = { .count = 0 };
+  const uint32_t length = loopback_collect(bytes, sizeof(bytes));
+
+  uint32_t i = 0;
+  while ((i + PACKET_HEADER_BYTES + PACKET_CRC_BYTES <= length) && (sent.count < MAX_FRAMES)) {
+    if (bytes[i] != PACKET_SOF) {
+      i++;
+      continue;
+    }
+
+    comms_packet_t* packet = &sent.frames[sent.count];
+    memset(packet, 0xff, sizeof(*packet));
+    packet->address = bytes[i + 1];
+    packet->seq = bytes[i + 2];
+    packet->length = bytes[i + 3];
+    const uint8_t data_length = packet->length & PACKET_LENGTH_MASK;
+    if (i + PACKET_HEADER_BYTES + data_length + PACKET_CRC_BYTES > length) {
+      break;
+    }
+    memcpy(packet->data, &bytes[i + PACKET_HEADER_BYTES], data_length);
+    packet->crc = bytes[i + PACKET_HEADER_BYTES + data_length];
+    CHECK(packet->crc == packet_compute_crc(packet));
+
+    sent.count++;
+    i += PACKET_HEADER_BYTES + data_length + PACKET_CRC_BYTES;
+  }
+  return sent;
+}
+
+static bool is_ack(const comms_packet_t* packet, const uint8_t type, const uint8_t next_seq, const uint16_t bitmap) {
+  return (packet->length == (PACKET_FLAG_ACK | PACKET_ACK_LENGTH)) &&
+    (packet->address == (COMMS_ADDR_FROM_NODE | NODE_ID)) &&
+    (packet->data[0] == type) &&
+    (packet->data[1] == next_seq) &&
+    ((packet->data[2] | (packet->data[3] << 8)) == bitmap);
+}
+
+static void write_response(const uint8_t byte) {
+  comms_packet_t packet;
+  comms_create_single_byte_packet(&packet, byte);
+  comms_write(&packet);
+}
+
+static void test_in_order_delivery(void) {
+  reset();
+  send_frame(COMMS_ADDR_ANY, 0, 3, 0x11);
+  send_frame(NODE_ID, 1, 16, 0x22);
+  send_frame(NODE_ID + 1, 2, 1, 0x33); // Another node's
+  comms_update();
+
+  comms_packet_t packet;
+  CHECK(comms_packets_available());
+  comms_read(&packet);
+  CHECK((packet.seq == 0) && (packet.length == 3) && (packet.data[2] == 0x11));
+  CHECK(comms_packets_available());
+  comms_read(&packet);
+  CHECK((packet.seq == 1) && (packet.length == 16) && (packet.data[15] == 0x22));
+  CHECK(!comms_packets_available());
+
+  // Two frames is fewer than COMMS_ACK_EVERY, so the ACK waits for COMMS_ACK_DELAY
+  sent_frames_t sent = collect_frames();
+  CHECK(sent.count == 0);
+  now += COMMS_ACK_DELAY;
+  comms_update();
+  sent = collect_frames();
+  CHECK((sent.count == 1) && is_ack(&sent.frames[0], PACKET_ACK_DATA0, 2, 0));
+}
+
+static void test_ack_every(void) {
+  reset();
+  for (uint8_t seq = 0; seq < COMMS_ACK_EVERY; seq++) {
+    send_frame(COMMS_ADDR_ANY, seq, 1, seq);
+  }
+  comms_update();
+
+  const sent_frames_t sent = collect_frames();
+  CHECK((sent.count == 1) && is_ack(&sent.frames[0], PACKET_ACK_DATA0, COMMS_ACK_EVERY, 0));
+}
+
+// A frame whose ACK was lost comes again, and is acknowledged again rather than delivered twice
+static void test_duplicate(void) {
+  reset();
+  send_frame(COMMS_ADDR_ANY, 0, 1, 0x44);
+  comms_update();
+  now += COMMS_ACK_DELAY;
+  comms_update();
+  collect_frames();
+
+  comms_packet_t packet;
+  comms_read(&packet);
+  send_frame(COMMS_ADDR_ANY, 0, 1, 0x44);
+  comms_update();
+
+  CHECK(!comms_packets_available());
+  const sent_frames_t sent = collect_frames();
+  CHECK((sent.count == 1) && is_ack(&sent.frames[0], PACKET_ACK_DATA0, 1, 0));
+}
+
+// Early frames are held back until the gap is filled, and the ACK's bitmap says which are held
+static void test_out_of_order(void) {
+  reset();
+  send_frame(COMMS_ADDR_ANY, 2, 1, 0x02);
+  comms_update();
+  CHECK(!comms_packets_available());
+  sent_frames_t sent = collect_frames();
+  CHECK((sent.count == 1) && is_ack(&sent.frames[0], PACKET_ACK_DATA0, 0, 0x0002));
+
+  send_frame(COMMS_ADDR_ANY, 0, 1, 0x00);
+  comms_update();
+  sent = collect_frames();
+  CHECK(sent.count == 0);
+
+  comms_packet_t packet;
+  comms_read(&packet);
+  CHECK(packet.seq == 0);
+  CHECK(!comms_packets_available());
+
+  send_frame(COMMS_ADDR_ANY, 1, 1, 0x01);
+  comms_update();
+  for (uint8_t seq = 1; seq <= 2; seq++) {
+    CHECK(comms_packets_available());
+    comms_read(&packet);
+    CHECK((packet.seq == seq) && (packet.data[0] == seq));
+  }
+}
+
+// A corrupted frame addressed to us is asked for again straight away, and dropped
+static void test_corrupt_frame(void) {
+  reset();
+  comms_packet_t packet;
+  uint8_t frame[PACKET_MAX_BYTES];
+
+  memset(&packet, 0xff, sizeof(packet));
+  packet.address = COMMS_ADDR_ANY;
+  packet.seq = 0;
+  packet.length = 1;
+  packet.data[0] = 0x55;
+  packet.crc = packet_compute_crc(&packet);
+  const uint32_t length = packet_encode(&packet, frame);
+  frame[4] ^= 0x01;
+  loopback_inject(frame, length);
+  comms_update();
+
+  CHECK(!comms_packets_available());
+  CHECK(comms_get_link_stats()->crc_errors > 0);
+  const sent_frames_t sent = collect_frames();
+  CHECK((sent.count == 1) && is_ack(&sent.frames[0], PACKET_RETX_DATA0, 0, 0));
+}
+
+// Broadcasts go straight up, unacknowledged
+static void test_broadcast(void) {
+  reset();
+  send_frame(COMMS_ADDR_BROADCAST, 0, 2, 0x66);
+  comms_update();
+  now += COMMS_ACK_DELAY;
+  comms_update();
+
+  comms_packet_t packet;
+  CHECK(comms_packets_available());
+  comms_read(&packet);
+  CHECK((packet.address == COMMS_ADDR_BROADCAST) && (packet.data[1] == 0x66));
+  CHECK(collect_frames().count == 0);
+}
+
+// An unacknowledged frame is resent after the RTO, and not again once it's acknowledged
+static void test_retransmit_timeout(void) {
+  reset();
+  write_response(BL_PACKET_FW_UPDATE_RES_DATA0);
+  sent_frames_t sent = collect_frames();
+  CHECK((sent.count == 1) && (sent.frames[0].seq == 0) && (sent.frames[0].data[0] == BL_PACKET_FW_UPDATE_RES_DATA0));
+
+  now += COMMS_RTO_INITIAL - 1;
+  comms_update();
+  CHECK(collect_frames().count == 0);
+
+  now += 1;
+  comms_update();
+  sent = collect_frames();
+  CHECK((sent.count == 1) && (sent.frames[0].seq == 0));
+  CHECK(comms_get_link_stats()->retransmits > 0);
+
+  send_ack(1, 0);
+  comms_update();
+  now += COMMS_RTO_MAX;
+  comms_update();
+  CHECK(collect_frames().count == 0);
+}
+
+// Only the frames an ACK reports missing are resent, and only once the holdoff has passed
+static void test_selective_retransmit(void) {
+  reset();
+  for (uint8_t i = 0; i < 4; i++) {
+    write_response(BL_PACKET_READY_FOR_DATA_DATA0);
+  }
+  CHECK(collect_frames().count == 4);
+
+  // 0 and 2 lost, 1 and 3 held
+  send_ack(0, 0x0005);
+  comms_update();
+  CHECK(collect_frames().count == 0);
+
+  now += COMMS_RETX_HOLDOFF;
+  send_ack(0, 0x0005);
+  comms_update();
+  const sent_frames_t sent = collect_frames();
+  CHECK((sent.count == 2) && (sent.frames[0].seq == 0) && (sent.frames[1].seq == 2));
+  CHECK(comms_tx_pending());
+
+  send_ack(4, 0);
+  comms_update();
+  CHECK(!comms_tx_pending());
+  now += COMMS_RTO_MAX;
+  comms_update();
+  CHECK(collect_frames().count == 0);
+}
+
+static void far_end(void) {
+  uint8_t byte = 0;
+  far_end_runs++;
+  loopback_collect(&byte, 1);
+}
+
+// Flushing runs the far end until it has taken everything
+static void test_flush(void) {
+  reset();
+  loopback_setup(far_end);
+  far_end_runs = 0;
+  write_response(BL_PACKET_BOOT_RES_DATA0);
+  loopback_transport.flush();
+
+  CHECK(far_end_runs == PACKET_HEADER_BYTES + 1 + PACKET_CRC_BYTES);
+  CHECK(collect_frames().count == 0);
+}
+
+typedef struct test_t {
+  const char* name;
+  void (*run)(void);
+} test_t;
+
+static const test_t tests[] = {
+  { "in order delivery", test_in_order_delivery },
+  { "ack every", test_ack_every },
+  { "duplicate", test_duplicate },
+  { "out of order", test_out_of_order },
+  { "corrupt frame", test_corrupt_frame },
+  { "broadcast", test_broadcast },
+  { "retransmit timeout", test_retransmit_timeout },
+  { "selective retransmit", test_selective_retransmit },
+  { "flush", test_flush },
+};
+
+int main(void) {
+  uint32_t failed_tests = 0;
+
+  for (uint32_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+    const uint32_t failures_before = failures;
+    tests[i].run();
+    const bool passed = failures == failures_before;
+    printf("  %s %s\n", passed ? "ok  " : "FAIL", tests[i].name);
+    failed_tests += passed ? 0 : 1;
+  }
+
+  return failed_tests == 0 ? 0 : 1;
+}
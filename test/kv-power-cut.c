@@ -0,0 +1,309 @@
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "core/kv.h"
+
+// Same as the internal flash's: two 16K sectors
+#define SECTOR_SIZE     (0x4000)
+#define SECTOR_WORDS    (SECTOR_SIZE / 4)
+#define ERASED          (0xFFFFFFFF)
+#define KEYS            (24)
+#define WORKLOAD_STEPS  (800)
+#define RECOVERY_STEPS  (200)
+
+#define CHECK(condition) check((condition), #condition, __LINE__)
+
+typedef struct step_t {
+  uint16_t key;
+  bool delete;
+  uint8_t length;
+  uint8_t value[KV_MAX_VALUE_LENGTH];
+} step_t;
+
+typedef struct model_entry_t {
+  bool present;
+  uint8_t length;
+  uint8_t value[KV_MAX_VALUE_LENGTH];
+} model_entry_t;
+
+static uint32_t flash_words[2][SECTOR_WORDS];
+static uint32_t operations = 0; // Programs and erases so far
+static uint32_t erases = 0;
+static uint32_t cut_at = 0;     // The power goes during this operation, or never if 0
+static jmp_buf power_cut;
+
+static uint32_t workload_seed = 0;
+static uint32_t tear_seed = 0;
+static model_entry_t model[KEYS];
+static step_t step;
+// Set while a step's write is under way, so its key may have either value after a power cut
+static volatile bool writing = false;
+
+static uint32_t failures = 0;
+
+static void check(const bool condition, const char* text, const int line) {
+  if (!condition) {
+    printf("    line %d: %s\n", line, text);
+    failures++;
+  }
+}
+
+static uint32_t next_random(uint32_t* seed) {
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 17;
+  *seed ^= *seed << 5;
+  return *seed;
+}
+
+// A cut program leaves some of the bits that should have been cleared still set, and a cut erase
+// leaves some of the words still as they were
+static uint32_t sim_read_word(const uint8_t sector, const uint32_t offset) {
+  return flash_words[sector][offset / 4];
+}
+
+static void sim_program_word(const uint8_t sector, const uint32_t offset, const uint32_t word) {
+  uint32_t* target = &flash_words[sector][offset / 4];
+  operations++;
+  if (operations == cut_at) {
+    *target &= word | next_random(&tear_seed);
+    longjmp(power_cut, 1);
+  }
+
+  // Flash can only clear bits, and the store never programs the same word twice
+  CHECK(*target == ERASED);
+  *target &= word;
+}
+
+static void sim_erase(const uint8_t sector) {
+  operations++;
+  erases++;
+  for (uint32_t i = 0; i < SECTOR_WORDS; i++) {
+    if ((operations != cut_at) || (next_random(&tear_seed) & 1)) {
+      flash_words[sector][i] = ERASED;
+    }
+  }
+  if (operations == cut_at) {
+    longjmp(power_cut, 1);
+  }
+}
+
+static const kv_flash_t sim_flash = {
+  .sector_size = SECTOR_SIZE,
+  .read_word = sim_read_word,
+  .program_word = sim_program_word,
+  .erase = sim_erase,
+};
+
+// What was there before the store: blank flash, or the code that used to live in these sectors
+static void reset_flash(const bool blank) {
+  for (uint8_t sector = 0; sector < 2; sector++) {
+    for (uint32_t i = 0; i < SECTOR_WORDS; i++) {
+      flash_words[sector][i] = blank ? ERASED : ((i * 0x9E3779B1U) ^ sector);
+    }
+  }
+  operations = 0;
+  erases = 0;
+  cut_at = 0;
+  memset(model, 0, sizeof(model));
+}
+
+// Half of them as long as a value can be, so the workload goes through a few compactions
+static void next_step(void) {
+  step.key = next_random(&workload_seed) % KEYS;
+  step.delete = (next_random(&workload_seed) % 8) == 0;
+  step.length = (next_random(&workload_seed) % 2 == 0) ? KV_MAX_VALUE_LENGTH : (next_random(&workload_seed) % 12);
+  for (uint8_t i = 0; i < step.length; i++) {
+    step.value[i] = (uint8_t)next_random(&workload_seed);
+  }
+}
+
+static void apply_step(void) {
+  writing = true;
+  if (step.delete) {
+    CHECK(kv_delete(step.key));
+    model[step.key].present = false;
+  } else {
+    CHECK(kv_set(step.key, step.value, step.length));
+    model[step.key].present = true;
+    model[step.key].length = step.length;
+    memcpy(model[step.key].value, step.value, step.length);
+  }
+  writing = false;
+}
+
+static void run_steps(const uint32_t steps) {
+  for (uint32_t i = 0; i < steps; i++) {
+    next_step();
+    apply_step();
+    if (i & 1) {
+      kv_tick();
+    }
+  }
+}
+
+static bool matches(const uint16_t key, const bool present, const uint8_t length, const uint8_t* value) {
+  uint8_t stored[KV_MAX_VALUE_LENGTH];
+  uint8_t stored_length = sizeof(stored);
+  const bool found = kv_get(key, stored, &stored_length);
+  if (!present) {
+    return !found;
+  }
+  return found && (stored_length == length) && (memcmp(stored, value, length) == 0);
+}
+
+// Every key has what was last written to it, but the one being written when the power went, which
+// can have either its old value or its new one
+static void verify(void) {
+  for (uint16_t key = 0; key < KEYS; key++) {
+    model_entry_t* entry = &model[key];
+    const bool expected = matches(key, entry->present, entry->length, entry->value);
+
+    if (writing && (key == step.key) && !expected) {
+      CHECK(matches(key, !step.delete, step.length, step.value));
+      entry->present = !step.delete;
+      entry->length = step.length;
+      memcpy(entry->value, step.value, step.length);
+    } else {
+      CHECK(expected);
+    }
+  }
+  writing = false;
+}
+
+// Runs the workload with the power cut during operation `cut`, then checks what comes back and
+// that the store carries on working. Returns false if the workload finished before the cut.
+static bool run_with_cut(const bool blank, const uint32_t cut, const uint32_t seed) {
+  reset_flash(blank);
+  workload_seed = seed;
+  tear_seed = seed ^ cut;
+  writing = false;
+  cut_at = cut;
+
+  if (setjmp(power_cut) == 0) {
+    CHECK(kv_init(&sim_flash));
+    run_steps(WORKLOAD_STEPS);
+    cut_at = 0;
+    return false;
+  }
+
+  cut_at = 0;
+  CHECK(kv_init(&sim_flash));
+  verify();
+
+  run_steps(RECOVERY_STEPS);
+  CHECK(kv_init(&sim_flash));
+  verify();
+  return true;
+}
+
+static uint32_t workload_operations(const bool blank, const uint32_t seed) {
+  reset_flash(blank);
+  workload_seed = seed;
+  CHECK(kv_init(&sim_flash));
+  run_steps(WORKLOAD_STEPS);
+  return operations;
+}
+
+static void test_first_boot_blank(void) {
+  reset_flash(true);
+  CHECK(kv_init(&sim_flash));
+  CHECK(erases == 0);
+  CHECK(flash_words[1][0] == ERASED);
+
+  const uint32_t value = 42;
+  CHECK(kv_set(1, &value, sizeof(value)));
+  CHECK(kv_init(&sim_flash));
+  CHECK(matches(1, true, sizeof(value), (const uint8_t*)&value));
+}
+
+// The sectors held something else, and the erase waits for kv_tick rather than holding up kv_init
+static void test_first_boot_deferred_erase(void) {
+  reset_flash(false);
+  CHECK(kv_init(&sim_flash));
+  CHECK(operations == 0);
+  CHECK(matches(1, false, 0, NULL));
+
+  kv_tick();
+  CHECK(erases == 1);
+  kv_tick();
+  CHECK(erases == 2);
+  CHECK(flash_words[1][0] == ERASED);
+
+  const uint32_t value = 42;
+  CHECK(kv_set(1, &value, sizeof(value)));
+  CHECK(kv_init(&sim_flash));
+  CHECK(matches(1, true, sizeof(value), (const uint8_t*)&value));
+}
+
+// Or for a write that comes first
+static void test_first_boot_write_before_tick(void) {
+  reset_flash(false);
+  CHECK(kv_init(&sim_flash));
+
+  const uint32_t value = 42;
+  CHECK(kv_set(1, &value, sizeof(value)));
+  CHECK(erases == 1);
+  CHECK(kv_init(&sim_flash));
+  CHECK(matches(1, true, sizeof(value), (const uint8_t*)&value));
+}
+
+static void test_compaction(void) {
+  const uint32_t seed = 0x1234567;
+  workload_operations(true, seed);
+  CHECK(erases >= 2);
+
+  CHECK(kv_init(&sim_flash));
+  verify();
+}
+
+static void power_cut_every_operation(const bool blank, const uint32_t seed) {
+  const uint32_t total = workload_operations(blank, seed);
+  uint32_t runs = 0;
+
+  for (uint32_t cut = 1; cut <= total; cut++) {
+    const uint32_t failures_before = failures;
+    runs += run_with_cut(blank, cut, seed) ? 1 : 0;
+    if (failures != failures_before) {
+      printf("    power cut at operation %u of %u\n", (unsigned)cut, (unsigned)total);
+      return;
+    }
+  }
+  CHECK(runs == total);
+}
+
+static void test_power_cut_blank(void) {
+  power_cut_every_operation(true, 0x1234567);
+}
+
+static void test_power_cut_first_boot(void) {
+  power_cut_every_operation(false, 0x89abcdef);
+}
+
+typedef struct test_t {
+  const char* name;
+  void (*run)(void);
+} test_t;
+
+static const test_t tests[] = {
+  { "first boot blank", test_first_boot_blank },
+  { "first boot deferred erase", test_first_boot_deferred_erase },
+  { "first boot write before tick", test_first_boot_write_before_tick },
+  { "compaction", test_compaction },
+  { "power cut blank", test_power_cut_blank },
+  { "power cut first boot", test_power_cut_first_boot },
+};
+
+int main(void) {
+  uint32_t failed_tests = 0;
+
+  for (uint32_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+    const uint32_t failures_before = failures;
+    tests[i].run();
+    const bool passed = failures == failures_before;
+    printf("  %s %s\n", passed ? "ok  " : "FAIL", tests[i].name);
+    failed_tests += passed ? 0 : 1;
+  }
+
+  return failed_tests == 0 ? 0 : 1;
+}